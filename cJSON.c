@@ -249,6 +249,89 @@ static cJSON *cJSON_New_Item(const internal_hooks * const hooks)
     return node;
 }
 
+/* A block of nodes handed out by an arena. */
+typedef struct arena_block
+{
+    struct arena_block *next;
+    size_t used;
+    size_t capacity;
+    cJSON nodes[1];
+} arena_block;
+
+struct cJSON_Arena
+{
+    internal_hooks hooks;
+    arena_block *blocks;
+};
+
+#define ARENA_MIN_BLOCK_NODES 256
+#define ARENA_MAX_BLOCK_NODES 65536
+
+/* Take a zeroed node from the arena, starting a new (bigger) block when the current one is full. */
+static cJSON *arena_new_item(cJSON_Arena * const arena)
+{
+    arena_block *block = arena->blocks;
+    cJSON *node = NULL;
+
+    if ((block == NULL) || (block->used == block->capacity))
+    {
+        size_t capacity = ARENA_MIN_BLOCK_NODES;
+        if ((block != NULL) && (block->capacity < ARENA_MAX_BLOCK_NODES))
+        {
+            capacity = block->capacity * 2;
+        }
+        else if (block != NULL)
+        {
+            capacity = ARENA_MAX_BLOCK_NODES;
+        }
+
+        block = (arena_block*)arena->hooks.allocate(sizeof(arena_block) + ((capacity - 1) * sizeof(cJSON)));
+        if (block == NULL)
+        {
+            return NULL;
+        }
+        block->next = arena->blocks;
+        block->used = 0;
+        block->capacity = capacity;
+        arena->blocks = block;
+    }
+
+    node = &block->nodes[block->used++];
+    memset(node, '\0', sizeof(cJSON));
+
+    return node;
+}
+
+/* Allocate a node for the parser, from the arena if there is one. */
+static cJSON *parse_new_item(const internal_hooks * const hooks, cJSON_Arena * const arena)
+{
+    if (arena != NULL)
+    {
+        return arena_new_item(arena);
+    }
+
+    return cJSON_New_Item(hooks);
+}
+
+CJSON_PUBLIC(void) cJSON_DeleteArena(cJSON_Arena *arena)
+{
+    arena_block *block = NULL;
+
+    if (arena == NULL)
+    {
+        return;
+    }
+
+    block = arena->blocks;
+    while (block != NULL)
+    {
+        arena_block *next = block->next;
+        arena->hooks.deallocate(block);
+        block = next;
+    }
+    arena->hooks.deallocate(arena);
+}
+
 /* Delete a cJSON structure. */
 CJSON_PUBLIC(void) cJSON_Delete(cJSON *item)
 {
@@ -293,6 +376,7 @@ typedef struct
     size_t offset;
     size_t depth; /* How deeply nested (in arrays/objects) is the input at the current offset. */
     internal_hooks hooks;
+    cJSON_Arena *arena; /* if set, nodes come from the arena and strings are decoded in place */
 } parse_buffer;
 
 /* check if the given size is left to read in a given parse buffer (starting with 1) */
@@ -479,8 +563,31 @@ typedef struct
     cJSON_bool noalloc;
     cJSON_bool format; /* is this print a formatted print */
     internal_hooks hooks;
+    cJSON_PrintSink sink; /* if set, completed output is flushed here instead of growing the buffer */
+    void *sink_context;
 } printbuffer;
 
+#define cjson_min(a, b) (((a) < (b)) ? (a) : (b))
+
+/* size of the intermediate buffer used by cJSON_PrintToSink */
+#define CJSON_SINK_CHUNK_SIZE 16384
+
+/* hand everything before the offset to the sink and rewind the buffer */
+static cJSON_bool flush_to_sink(printbuffer * const p)
+{
+    if (p->offset > 0)
+    {
+        if (!p->sink((const char*)p->buffer, p->offset, p->sink_context))
+        {
+            return false;
+        }
+        p->offset = 0;
+    }
+    p->buffer[0] = '\0';
+
+    return true;
+}
+
 /* realloc printbuffer if necessary to have at least "needed" bytes more */
 static unsigned char* ensure(printbuffer * const p, size_t needed)
 {
@@ -504,6 +611,15 @@ static unsigned char* ensure(printbuffer * const p, size_t needed)
         return NULL;
     }
 
+    if ((p->sink != NULL) && ((needed + p->offset + 1) > p->length))
+    {
+        /* everything before the offset is final, so it can leave the buffer */
+        if (!flush_to_sink(p))
+        {
+            return NULL;
+        }
+    }
+
     needed += p->offset + 1;
     if (needed <= p->length)
     {
@@ -815,6 +931,143 @@ fail:
     return 0;
 }
 
+/* Vectorized scanning for string printing and parsing.
+ * Both print_string_ptr and parse_string spend almost all of their time on
+ * long runs of bytes that need no special handling (base64 attachments, long
+ * text parts). These helpers find the next byte that does: '"', '\\' and,
+ * when printing, control characters below 0x20. SSE2 is used on x86-64
+ * (it is part of the baseline), AVX2 is selected at runtime when the CPU
+ * supports it, and NEON is used on AArch64. Everything else, and every tail
+ * shorter than a vector, goes through the scalar loop, so the results are
+ * identical on all paths. */
+#if defined(__GNUC__) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#define CJSON_SCAN_SSE2
+#include <emmintrin.h>
+#if defined(__clang__) || (__GNUC__ >= 5)
+#define CJSON_SCAN_AVX2
+#include <immintrin.h>
+#endif
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define CJSON_SCAN_NEON
+#include <arm_neon.h>
+#endif
+
+static const unsigned char *scan_special_scalar(const unsigned char *pointer, const unsigned char *end, cJSON_bool control)
+{
+    for (; pointer < end; pointer++)
+    {
+        if ((*pointer == '\"') || (*pointer == '\\') || (control && (*pointer < 32)))
+        {
+            break;
+        }
+    }
+    return pointer;
+}
+
+#ifdef CJSON_SCAN_SSE2
+static const unsigned char *scan_special_sse2(const unsigned char *pointer, const unsigned char *end, cJSON_bool control)
+{
+    const __m128i quote = _mm_set1_epi8('\"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control_max = _mm_set1_epi8(31);
+    while ((end - pointer) >= 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(const void *)pointer);
+        __m128i special = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash));
+        int mask;
+        if (control)
+        {
+            /* unsigned chunk <= 31  <=>  max(chunk, 31) == 31 */
+            special = _mm_or_si128(special, _mm_cmpeq_epi8(_mm_max_epu8(chunk, control_max), control_max));
+        }
+        mask = _mm_movemask_epi8(special);
+        if (mask != 0)
+        {
+            return pointer + __builtin_ctz((unsigned int)mask);
+        }
+        pointer += 16;
+    }
+    return scan_special_scalar(pointer, end, control);
+}
+#endif
+
+#ifdef CJSON_SCAN_AVX2
+__attribute__((target("avx2")))
+static const unsigned char *scan_special_avx2(const unsigned char *pointer, const unsigned char *end, cJSON_bool control)
+{
+    const __m256i quote = _mm256_set1_epi8('\"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control_max = _mm256_set1_epi8(31);
+    while ((end - pointer) >= 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(const void *)pointer);
+        __m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote), _mm256_cmpeq_epi8(chunk, backslash));
+        unsigned int mask;
+        if (control)
+        {
+            special = _mm256_or_si256(special, _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, control_max), control_max));
+        }
+        mask = (unsigned int)_mm256_movemask_epi8(special);
+        if (mask != 0)
+        {
+            return pointer + __builtin_ctz(mask);
+        }
+        pointer += 32;
+    }
+    return scan_special_sse2(pointer, end, control);
+}
+#endif
+
+#ifdef CJSON_SCAN_NEON
+static const unsigned char *scan_special_neon(const unsigned char *pointer, const unsigned char *end, cJSON_bool control)
+{
+    const uint8x16_t quote = vdupq_n_u8('\"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t space = vdupq_n_u8(32);
+    while ((end - pointer) >= 16)
+    {
+        uint8x16_t chunk = vld1q_u8(pointer);
+        uint8x16_t special = vorrq_u8(vceqq_u8(chunk, quote), vceqq_u8(chunk, backslash));
+        if (control)
+        {
+            special = vorrq_u8(special, vcltq_u8(chunk, space));
+        }
+        if (vmaxvq_u8(special) != 0)
+        {
+            /* locate the byte inside this block */
+            return scan_special_scalar(pointer, pointer + 16, control);
+        }
+        pointer += 16;
+    }
+    return scan_special_scalar(pointer, end, control);
+}
+#endif
+
+/* Returns a pointer to the first byte in [pointer, end) that is '"' or '\\'
+ * (or, if control is true, below 32), or end if there is none. */
+static const unsigned char *scan_special(const unsigned char *pointer, const unsigned char *end, cJSON_bool control)
+{
+#if defined(CJSON_SCAN_AVX2)
+    static int use_avx2 = -1;
+    if (use_avx2 < 0)
+    {
+        __builtin_cpu_init();
+        use_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    if (use_avx2)
+    {
+        return scan_special_avx2(pointer, end, control);
+    }
+    return scan_special_sse2(pointer, end, control);
+#elif defined(CJSON_SCAN_SSE2)
+    return scan_special_sse2(pointer, end, control);
+#elif defined(CJSON_SCAN_NEON)
+    return scan_special_neon(pointer, end, control);
+#else
+    return scan_special_scalar(pointer, end, control);
+#endif
+}
+
 /* Parse the input text into an unescaped cinput, and populate item. */
 static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_buffer)
 {
@@ -833,32 +1086,43 @@ static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_bu
         /* calculate approximate size of the output (overestimate) */
         size_t allocation_length = 0;
         size_t skipped_bytes = 0;
-        while (((size_t)(input_end - input_buffer->content) < input_buffer->length) && (*input_end != '\"'))
+        const unsigned char *buffer_end = input_buffer->content + input_buffer->length;
+        for (;;)
         {
+            /* skip to the next quote or escape sequence */
+            input_end = scan_special(input_end, buffer_end, false);
+            if ((input_end >= buffer_end) || (*input_end == '\"'))
+            {
+                break;
+            }
             /* is escape sequence */
-            if (input_end[0] == '\\')
+            if ((size_t)(input_end + 1 - input_buffer->content) >= input_buffer->length)
             {
-                if ((size_t)(input_end + 1 - input_buffer->content) >= input_buffer->length)
-                {
-                    /* prevent buffer overflow when last input character is a backslash */
-                    goto fail;
-                }
-                skipped_bytes++;
-                input_end++;
+                /* prevent buffer overflow when last input character is a backslash */
+                goto fail;
             }
-            input_end++;
+            skipped_bytes++;
+            input_end += 2;
         }
         if (((size_t)(input_end - input_buffer->content) >= input_buffer->length) || (*input_end != '\"'))
         {
             goto fail; /* string ended unexpectedly */
         }
 
-        /* This is at most how much we need for the output */
-        allocation_length = (size_t) (input_end - buffer_at_offset(input_buffer)) - skipped_bytes;
-        output = (unsigned char*)input_buffer->hooks.allocate(allocation_length + sizeof(""));
-        if (output == NULL)
+        if (input_buffer->arena != NULL)
         {
-            goto fail; /* allocation failure */
+            /* decode in place: the output never gets ahead of the input and the closing quote makes room for the terminator */
+            output = (unsigned char*)input_pointer;
+        }
+        else
+        {
+            /* This is at most how much we need for the output */
+            allocation_length = (size_t) (input_end - buffer_at_offset(input_buffer)) - skipped_bytes;
+            output = (unsigned char*)input_buffer->hooks.allocate(allocation_length + sizeof(""));
+            if (output == NULL)
+            {
+                goto fail; /* allocation failure */
+            }
         }
     }
 
@@ -868,7 +1132,16 @@ static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_bu
     {
         if (*input_pointer != '\\')
         {
-            *output_pointer++ = *input_pointer++;
+            /* copy the whole run up to the next escape sequence at once */
+            const unsigned char *run_end = scan_special(input_pointer, input_end, false);
+            size_t run_length = (run_end > input_pointer) ? (size_t)(run_end - input_pointer) : 1;
+            if (output_pointer != input_pointer)
+            {
+                /* may overlap when decoding in place */
+                memmove(output_pointer, input_pointer, run_length);
+            }
+            output_pointer += run_length;
+            input_pointer += run_length;
         }
         /* escape sequence */
         else
@@ -931,7 +1204,7 @@ static cJSON_bool parse_string(cJSON * const item, parse_buffer * const input_bu
     return true;
 
 fail:
-    if (output != NULL)
+    if ((output != NULL) && (input_buffer->arena == NULL))
     {
         input_buffer->hooks.deallocate(output);
         output = NULL;
@@ -945,10 +1218,96 @@ fail:
     return false;
 }
 
+/* Render a string that does not fit into a sink chunk, a bounded piece at a time. */
+static cJSON_bool print_string_to_sink(const unsigned char * const input, const unsigned char * const input_end, printbuffer * const output_buffer)
+{
+    const unsigned char *input_pointer = input;
+    unsigned char *output = NULL;
+
+    output = ensure(output_buffer, 1);
+    if (output == NULL)
+    {
+        return false;
+    }
+    *output = '\"';
+    output_buffer->offset++;
+
+    while (input_pointer < input_end)
+    {
+        const unsigned char *run_end = scan_special(input_pointer, input_end, true);
+        while (input_pointer < run_end)
+        {
+            size_t piece = cjson_min((size_t)(run_end - input_pointer), CJSON_SINK_CHUNK_SIZE - 1);
+            output = ensure(output_buffer, piece);
+            if (output == NULL)
+            {
+                return false;
+            }
+            memcpy(output, input_pointer, piece);
+            output_buffer->offset += piece;
+            input_pointer += piece;
+        }
+        if (input_pointer == input_end)
+        {
+            break;
+        }
+
+        /* character needs to be escaped */
+        output = ensure(output_buffer, 6);
+        if (output == NULL)
+        {
+            return false;
+        }
+        output[0] = '\\';
+        switch (*input_pointer)
+        {
+            case '\\':
+                output[1] = '\\';
+                break;
+            case '\"':
+                output[1] = '\"';
+                break;
+            case '\b':
+                output[1] = 'b';
+                break;
+            case '\f':
+                output[1] = 'f';
+                break;
+            case '\n':
+                output[1] = 'n';
+                break;
+            case '\r':
+                output[1] = 'r';
+                break;
+            case '\t':
+                output[1] = 't';
+                break;
+            default:
+                /* escape and print as unicode codepoint */
+                sprintf((char*)output + 1, "u%04x", *input_pointer);
+                output_buffer->offset += 4;
+                break;
+        }
+        output_buffer->offset += 2;
+        input_pointer++;
+    }
+
+    output = ensure(output_buffer, 2);
+    if (output == NULL)
+    {
+        return false;
+    }
+    output[0] = '\"';
+    output[1] = '\0';
+
+    return true;
+}
+
 /* Render the cstring provided to an escaped version that can be printed. */
 static cJSON_bool print_string_ptr(const unsigned char * const input, printbuffer * const output_buffer)
 {
     const unsigned char *input_pointer = NULL;
+    const unsigned char *input_end = NULL;
     unsigned char *output = NULL;
     unsigned char *output_pointer = NULL;
     size_t output_length = 0;
@@ -973,8 +1332,9 @@ static cJSON_bool print_string_ptr(const unsigned char * const input, printbuffe
         return true;
     }
 
-    /* set "flag" to 1 if something needs to be escaped */
-    for (input_pointer = input; *input_pointer; input_pointer++)
+    /* count the additional characters needed for escaping */
+    input_end = input + strlen((const char*)input);
+    for (input_pointer = scan_special(input, input_end, true); input_pointer < input_end; input_pointer = scan_special(input_pointer + 1, input_end, true))
     {
         switch (*input_pointer)
         {
@@ -989,16 +1349,19 @@ static cJSON_bool print_string_ptr(const unsigned char * const input, printbuffe
                 escape_characters++;
                 break;
             default:
-                if (*input_pointer < 32)
-                {
-                    /* UTF-16 escape sequence uXXXX */
-                    escape_characters += 5;
-                }
+                /* UTF-16 escape sequence uXXXX */
+                escape_characters += 5;
                 break;
         }
     }
     output_length = (size_t)(input_pointer - input) + escape_characters;
 
+    if ((output_buffer->sink != NULL) && ((output_length + sizeof("\"\"")) > output_buffer->length))
+    {
+        /* too long for the sink's chunk, emit it piecewise */
+        return print_string_to_sink(input, input_end, output_buffer);
+    }
+
     output = ensure(output_buffer, output_length + sizeof("\"\""));
     if (output == NULL)
     {
@@ -1018,48 +1381,52 @@ static cJSON_bool print_string_ptr(const unsigned char * const input, printbuffe
 
     output[0] = '\"';
     output_pointer = output + 1;
-    /* copy the string */
-    for (input_pointer = input; *input_pointer != '\0'; (void)input_pointer++, output_pointer++)
+    /* copy the string, moving runs of normal characters in bulk */
+    input_pointer = input;
+    while (input_pointer < input_end)
     {
-        if ((*input_pointer > 31) && (*input_pointer != '\"') && (*input_pointer != '\\'))
+        const unsigned char *run_end = scan_special(input_pointer, input_end, true);
+        memcpy(output_pointer, input_pointer, (size_t)(run_end - input_pointer));
+        output_pointer += run_end - input_pointer;
+        input_pointer = run_end;
+        if (input_pointer == input_end)
         {
-            /* normal character, copy */
-            *output_pointer = *input_pointer;
+            break;
         }
-        else
+
+        /* character needs to be escaped */
+        *output_pointer++ = '\\';
+        switch (*input_pointer)
         {
-            /* character needs to be escaped */
-            *output_pointer++ = '\\';
-            switch (*input_pointer)
-            {
-                case '\\':
-                    *output_pointer = '\\';
-                    break;
-                case '\"':
-                    *output_pointer = '\"';
-                    break;
-                case '\b':
-                    *output_pointer = 'b';
-                    break;
-                case '\f':
-                    *output_pointer = 'f';
-                    break;
-                case '\n':
-                    *output_pointer = 'n';
-                    break;
-                case '\r':
-                    *output_pointer = 'r';
-                    break;
-                case '\t':
-                    *output_pointer = 't';
-                    break;
-                default:
-                    /* escape and print as unicode codepoint */
-                    sprintf((char*)output_pointer, "u%04x", *input_pointer);
-                    output_pointer += 4;
-                    break;
-            }
+            case '\\':
+                *output_pointer = '\\';
+                break;
+            case '\"':
+                *output_pointer = '\"';
+                break;
+            case '\b':
+                *output_pointer = 'b';
+                break;
+            case '\f':
+                *output_pointer = 'f';
+                break;
+            case '\n':
+                *output_pointer = 'n';
+                break;
+            case '\r':
+                *output_pointer = 'r';
+                break;
+            case '\t':
+                *output_pointer = 't';
+                break;
+            default:
+                /* escape and print as unicode codepoint */
+                sprintf((char*)output_pointer, "u%04x", *input_pointer);
+                output_pointer += 4;
+                break;
         }
+        output_pointer++;
+        input_pointer++;
     }
     output[output_length + 1] = '\"';
     output[output_length + 2] = '\0';
@@ -1138,10 +1505,10 @@ CJSON_PUBLIC(cJSON *) cJSON_ParseWithOpts(const char *value, const char **return
     return cJSON_ParseWithLengthOpts(value, buffer_length, return_parse_end, require_null_terminated);
 }
 
-/* Parse an object - create a new root, and populate. */
-CJSON_PUBLIC(cJSON *) cJSON_ParseWithLengthOpts(const char *value, size_t buffer_length, const char **return_parse_end, cJSON_bool require_null_terminated)
+/* Parse an object - create a new root, and populate. Nodes come from arena if one is given. */
+static cJSON *parse_document(const char *value, size_t buffer_length, const char **return_parse_end, cJSON_bool require_null_terminated, cJSON_Arena * const arena)
 {
-    parse_buffer buffer = { 0, 0, 0, 0, { 0, 0, 0 } };
+    parse_buffer buffer = { 0, 0, 0, 0, { 0, 0, 0 }, 0 };
     cJSON *item = NULL;
 
     /* reset error position */
@@ -1157,8 +1524,9 @@ CJSON_PUBLIC(cJSON *) cJSON_ParseWithLengthOpts(const char *value, size_t buffer
     buffer.length = buffer_length;
     buffer.offset = 0;
     buffer.hooks = global_hooks;
+    buffer.arena = arena;
 
-    item = cJSON_New_Item(&global_hooks);
+    item = parse_new_item(&global_hooks, arena);
     if (item == NULL) /* memory fail */
     {
         goto fail;
@@ -1187,7 +1555,7 @@ CJSON_PUBLIC(cJSON *) cJSON_ParseWithLengthOpts(const char *value, size_t buffer
     return item;
 
 fail:
-    if (item != NULL)
+    if ((item != NULL) && (arena == NULL))
     {
         cJSON_Delete(item);
     }
@@ -1218,6 +1586,38 @@ fail:
     return NULL;
 }
 
+CJSON_PUBLIC(cJSON *) cJSON_ParseWithLengthOpts(const char *value, size_t buffer_length, const char **return_parse_end, cJSON_bool require_null_terminated)
+{
+    return parse_document(value, buffer_length, return_parse_end, require_null_terminated, NULL);
+}
+
+CJSON_PUBLIC(cJSON *) cJSON_ParseInSitu(char *value, size_t buffer_length, cJSON_Arena **arena)
+{
+    cJSON *item = NULL;
+
+    if (arena == NULL)
+    {
+        return NULL;
+    }
+
+    *arena = (cJSON_Arena*)global_hooks.allocate(sizeof(cJSON_Arena));
+    if (*arena == NULL)
+    {
+        return NULL;
+    }
+    (*arena)->hooks = global_hooks;
+    (*arena)->blocks = NULL;
+
+    item = parse_document(value, buffer_length, NULL, false, *arena);
+    if (item == NULL)
+    {
+        cJSON_DeleteArena(*arena);
+        *arena = NULL;
+    }
+
+    return item;
+}
+
 /* Default options for cJSON_Parse */
 CJSON_PUBLIC(cJSON *) cJSON_Parse(const char *value)
 {
@@ -1229,8 +1629,6 @@ CJSON_PUBLIC(cJSON *) cJSON_ParseWithLength(const char *value, size_t buffer_len
     return cJSON_ParseWithLengthOpts(value, buffer_length, 0, 0);
 }
 
-#define cjson_min(a, b) (((a) < (b)) ? (a) : (b))
-
 static unsigned char *print(const cJSON * const item, cJSON_bool format, const internal_hooks * const hooks)
 {
     static const size_t default_buffer_size = 256;
@@ -1311,7 +1709,7 @@ CJSON_PUBLIC(char *) cJSON_PrintUnformatted(const cJSON *item)
 
 CJSON_PUBLIC(char *) cJSON_PrintBuffered(const cJSON *item, int prebuffer, cJSON_bool fmt)
 {
-    printbuffer p = { 0, 0, 0, 0, 0, 0, { 0, 0, 0 } };
+    printbuffer p = { 0, 0, 0, 0, 0, 0, { 0, 0, 0 }, 0, 0 };
 
     if (prebuffer < 0)
     {
@@ -1342,7 +1740,7 @@ CJSON_PUBLIC(char *) cJSON_PrintBuffered(const cJSON *item, int prebuffer, cJSON
 
 CJSON_PUBLIC(cJSON_bool) cJSON_PrintPreallocated(cJSON *item, char *buffer, const int length, const cJSON_bool format)
 {
-    printbuffer p = { 0, 0, 0, 0, 0, 0, { 0, 0, 0 } };
+    printbuffer p = { 0, 0, 0, 0, 0, 0, { 0, 0, 0 }, 0, 0 };
 
     if ((length < 0) || (buffer == NULL))
     {
@@ -1359,6 +1757,43 @@ CJSON_PUBLIC(cJSON_bool) cJSON_PrintPreallocated(cJSON *item, char *buffer, cons
     return print_value(item, &p);
 }
 
+CJSON_PUBLIC(cJSON_bool) cJSON_PrintToSink(const cJSON *item, cJSON_bool format, cJSON_PrintSink sink, void *context)
+{
+    printbuffer p = { 0, 0, 0, 0, 0, 0, { 0, 0, 0 }, 0, 0 };
+    cJSON_bool success = false;
+
+    if ((item == NULL) || (sink == NULL))
+    {
+        return false;
+    }
+
+    p.buffer = (unsigned char*)global_hooks.allocate(CJSON_SINK_CHUNK_SIZE);
+    if (p.buffer == NULL)
+    {
+        return false;
+    }
+    p.length = CJSON_SINK_CHUNK_SIZE;
+    p.format = format;
+    p.hooks = global_hooks;
+    p.sink = sink;
+    p.sink_context = context;
+
+    success = print_value(item, &p);
+    if (success)
+    {
+        update_offset(&p);
+        success = flush_to_sink(&p);
+    }
+
+    /* ensure() may have swapped the buffer when a single token outgrew the chunk */
+    if (p.buffer != NULL)
+    {
+        global_hooks.deallocate(p.buffer);
+    }
+
+    return success;
+}
+
 /* Parser core - when encountering text, process appropriately. */
 static cJSON_bool parse_value(cJSON * const item, parse_buffer * const input_buffer)
 {
@@ -1527,7 +1962,7 @@ static cJSON_bool parse_array(cJSON * const item, parse_buffer * const input_buf
     do
     {
         /* allocate next item */
-        cJSON *new_item = cJSON_New_Item(&(input_buffer->hooks));
+        cJSON *new_item = parse_new_item(&(input_buffer->hooks), input_buffer->arena);
         if (new_item == NULL)
         {
             goto fail; /* allocation failure */
@@ -1578,7 +2013,7 @@ success:
     return true;
 
 fail:
-    if (head != NULL)
+    if ((head != NULL) && (input_buffer->arena == NULL))
     {
         cJSON_Delete(head);
     }
@@ -1685,7 +2120,7 @@ static cJSON_bool parse_object(cJSON * const item, parse_buffer * const input_bu
     do
     {
         /* allocate next item */
-        cJSON *new_item = cJSON_New_Item(&(input_buffer->hooks));
+        cJSON *new_item = parse_new_item(&(input_buffer->hooks), input_buffer->arena);
         if (new_item == NULL)
         {
             goto fail; /* allocation failure */
@@ -1758,7 +2193,7 @@ success:
     return true;
 
 fail:
-    if (head != NULL)
+    if ((head != NULL) && (input_buffer->arena == NULL))
     {
         cJSON_Delete(head);
     }
@@ -131,6 +131,12 @@ typedef struct cJSON_Hooks
 
 typedef int cJSON_bool;
 
+/* Node storage for cJSON_ParseInSitu, freed in one shot. */
+typedef struct cJSON_Arena cJSON_Arena;
+
+/* Receives successive pieces of printed JSON from cJSON_PrintToSink. Return false to abort printing. */
+typedef cJSON_bool (*cJSON_PrintSink)(const char *data, size_t length, void *context);
+
 /* Limits how deeply nested arrays/objects can be before cJSON rejects to parse them.
  * This is to prevent stack overflows. */
 #ifndef CJSON_NESTING_LIMIT
@@ -157,6 +163,10 @@ CJSON_PUBLIC(cJSON *) cJSON_ParseWithLength(const char *value, size_t buffer_len
 /* If you supply a ptr in return_parse_end and parsing fails, then return_parse_end will contain a pointer to the error so will match cJSON_GetErrorPtr(). */
 CJSON_PUBLIC(cJSON *) cJSON_ParseWithOpts(const char *value, const char **return_parse_end, cJSON_bool require_null_terminated);
 CJSON_PUBLIC(cJSON *) cJSON_ParseWithLengthOpts(const char *value, size_t buffer_length, const char **return_parse_end, cJSON_bool require_null_terminated);
+/* ParseInSitu is for large read-only documents: nodes are carved from an arena and strings are decoded in place, so value is modified and every valuestring/string points into it. */
+/* The tree stays valid while both value and *arena live. Release it with cJSON_DeleteArena (never cJSON_Delete) and do not attach, detach or replace its items. */
+CJSON_PUBLIC(cJSON *) cJSON_ParseInSitu(char *value, size_t buffer_length, cJSON_Arena **arena);
+CJSON_PUBLIC(void) cJSON_DeleteArena(cJSON_Arena *arena);
 
 /* Render a cJSON entity to text for transfer/storage. */
 CJSON_PUBLIC(char *) cJSON_Print(const cJSON *item);
@@ -167,6 +177,8 @@ CJSON_PUBLIC(char *) cJSON_PrintBuffered(const cJSON *item, int prebuffer, cJSON
 /* Render a cJSON entity to text using a buffer already allocated in memory with given length. Returns 1 on success and 0 on failure. */
 /* NOTE: cJSON is not always 100% accurate in estimating how much memory it will use, so to be safe allocate 5 bytes more than you actually need */
 CJSON_PUBLIC(cJSON_bool) cJSON_PrintPreallocated(cJSON *item, char *buffer, const int length, const cJSON_bool format);
+/* Render a cJSON entity to text without building the whole string: output is handed to sink in chunks of bounded size (only a single number or raw value may exceed it). Returns 1 on success and 0 if printing failed or the sink aborted. */
+CJSON_PUBLIC(cJSON_bool) cJSON_PrintToSink(const cJSON *item, cJSON_bool format, cJSON_PrintSink sink, void *context);
 /* Delete a cJSON entity and all subentities. */
 CJSON_PUBLIC(void) cJSON_Delete(cJSON *item);
 
@@ -0,0 +1,281 @@
+/* Differential test for the vectorized string scans in cJSON.c.
+ *
+ * Every vector implementation of scan_special that this machine can run is
+ * compared with the scalar loop for every start offset and length within a
+ * few vectors, on random bytes and on buffers built around the special bytes
+ * ('"', '\\', 0x1F/0x20, 0x7F/0x80, 0xFF) placed at chunk edges. Then
+ * cJSON_PrintUnformatted and cJSON_Parse are checked end to end against a
+ * byte-at-a-time reference escaper on random strings, and cJSON_ParseInSitu
+ * is checked to decode the same strings in place and to build the same tree.
+ *
+ * Built and run by `make test-cjson`. An optional argument sets the seed.
+ */
+
+#include "cJSON.c"
+
+#include <stdio.h>
+
+#define SCAN_BUFFER_SIZE 160
+#define STRING_ROUNDS 20000
+
+static unsigned long long rng_state = 0x9E3779B97F4A7C15ULL;
+static int failures = 0;
+
+static unsigned int next_random(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (unsigned int)(rng_state >> 32);
+}
+
+typedef const unsigned char *(*scan_function)(const unsigned char *pointer, const unsigned char *end, cJSON_bool control);
+
+static void check_scans(const char *name, scan_function scan, const unsigned char *buffer, const char *what)
+{
+    size_t start;
+    size_t length;
+    int control;
+    for (control = 0; control <= 1; control++)
+    {
+        for (start = 0; start < 48; start++)
+        {
+            for (length = 0; start + length <= SCAN_BUFFER_SIZE; length++)
+            {
+                const unsigned char *expected = scan_special_scalar(buffer + start, buffer + start + length, (cJSON_bool)control);
+                const unsigned char *actual = scan(buffer + start, buffer + start + length, (cJSON_bool)control);
+                if (actual != expected)
+                {
+                    if (failures++ < 10)
+                    {
+                        fprintf(stderr, "FAIL: %s (%s, control=%d) start %lu length %lu: got %ld, expected %ld\n",
+                                name, what, control, (unsigned long)start, (unsigned long)length,
+                                (long)(actual - buffer), (long)(expected - buffer));
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void check_all_scans(const unsigned char *buffer, const char *what)
+{
+#ifdef CJSON_SCAN_SSE2
+    check_scans("sse2", scan_special_sse2, buffer, what);
+#endif
+#ifdef CJSON_SCAN_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        check_scans("avx2", scan_special_avx2, buffer, what);
+    }
+#endif
+#ifdef CJSON_SCAN_NEON
+    check_scans("neon", scan_special_neon, buffer, what);
+#endif
+    check_scans("dispatch", scan_special, buffer, what);
+}
+
+static void test_scans(void)
+{
+    static const unsigned char specials[] = { '\"', '\\', 0x00, 0x1F, 0x20, 0x7F, 0x80, 0xFF };
+    unsigned char buffer[SCAN_BUFFER_SIZE];
+    size_t i;
+    size_t position;
+    int round;
+
+    /* one special byte at every offset, in a run of plain bytes */
+    for (i = 0; i < sizeof(specials); i++)
+    {
+        for (position = 0; position < SCAN_BUFFER_SIZE; position += 7)
+        {
+            memset(buffer, 'a', sizeof(buffer));
+            buffer[position] = specials[i];
+            check_all_scans(buffer, "single special byte");
+        }
+    }
+
+    /* specials at both sides of every 16- and 32-byte boundary */
+    memset(buffer, 'a', sizeof(buffer));
+    for (position = 16; position < SCAN_BUFFER_SIZE; position += 16)
+    {
+        buffer[position - 1] = '\\';
+        buffer[position] = 0x1F;
+    }
+    check_all_scans(buffer, "chunk edges");
+
+    /* random bytes, dense and sparse in specials */
+    for (round = 0; round < 200; round++)
+    {
+        for (i = 0; i < sizeof(buffer); i++)
+        {
+            unsigned int r = next_random();
+            buffer[i] = (round & 1) ? (unsigned char)r : (((r >> 8) % 64) == 0 ? specials[r % sizeof(specials)] : (unsigned char)(0x20 + (r % 0x60)));
+        }
+        check_all_scans(buffer, "random bytes");
+    }
+}
+
+/* Escapes like print_string_ptr, one byte at a time. */
+static size_t reference_escape(const unsigned char *input, size_t length, char *output)
+{
+    size_t i;
+    char *out = output;
+    *out++ = '\"';
+    for (i = 0; i < length; i++)
+    {
+        switch (input[i])
+        {
+            case '\"': out += sprintf(out, "\\\""); break;
+            case '\\': out += sprintf(out, "\\\\"); break;
+            case '\b': out += sprintf(out, "\\b"); break;
+            case '\f': out += sprintf(out, "\\f"); break;
+            case '\n': out += sprintf(out, "\\n"); break;
+            case '\r': out += sprintf(out, "\\r"); break;
+            case '\t': out += sprintf(out, "\\t"); break;
+            default:
+                if (input[i] < 32)
+                {
+                    out += sprintf(out, "\\u%04x", input[i]);
+                }
+                else
+                {
+                    *out++ = (char)input[i];
+                }
+                break;
+        }
+    }
+    *out++ = '\"';
+    *out = '\0';
+    return (size_t)(out - output);
+}
+
+static void test_strings(void)
+{
+    unsigned char input[200];
+    char expected[200 * 6 + 3];
+    int round;
+    for (round = 0; round < STRING_ROUNDS && failures < 10; round++)
+    {
+        size_t length = next_random() % (sizeof(input) - 1);
+        size_t i;
+        int sparse = round & 1;
+        cJSON *item;
+        cJSON *parsed;
+        char *printed;
+        for (i = 0; i < length; i++)
+        {
+            unsigned int r = next_random();
+            /* no NUL: the strings are C strings */
+            input[i] = (sparse && (r % 40) != 0) ? (unsigned char)('a' + (r >> 8) % 26) : (unsigned char)(1 + (r >> 8) % 255);
+        }
+        input[length] = '\0';
+
+        reference_escape(input, length, expected);
+        item = cJSON_CreateString((const char *)input);
+        printed = cJSON_PrintUnformatted(item);
+        if ((printed == NULL) || (strcmp(printed, expected) != 0))
+        {
+            failures++;
+            fprintf(stderr, "FAIL: print of a %lu-byte string differs from the reference\n", (unsigned long)length);
+        }
+        else
+        {
+            parsed = cJSON_Parse(printed);
+            if (!cJSON_IsString(parsed) || (strcmp(parsed->valuestring, (const char *)input) != 0))
+            {
+                failures++;
+                fprintf(stderr, "FAIL: parse of a %lu-byte string does not round-trip\n", (unsigned long)length);
+            }
+            cJSON_Delete(parsed);
+
+            /* the same text parsed in place decodes to the same string inside the buffer */
+            {
+                size_t printed_length = strlen(printed);
+                cJSON_Arena *arena = NULL;
+                parsed = cJSON_ParseInSitu(printed, printed_length, &arena);
+                if (!cJSON_IsString(parsed) || (strcmp(parsed->valuestring, (const char *)input) != 0) ||
+                    (parsed->valuestring < printed) || (parsed->valuestring >= printed + printed_length))
+                {
+                    failures++;
+                    fprintf(stderr, "FAIL: in-situ parse of a %lu-byte string does not round-trip in place\n", (unsigned long)length);
+                }
+                cJSON_DeleteArena(arena);
+            }
+        }
+        cJSON_free(printed);
+        cJSON_Delete(item);
+    }
+}
+
+static void check_in_situ(const char *json, const char *what)
+{
+    size_t length = strlen(json);
+    char *buffer = (char *)malloc(length + 1);
+    cJSON_Arena *arena = NULL;
+    cJSON *expected = cJSON_Parse(json);
+    cJSON *actual;
+    memcpy(buffer, json, length + 1);
+    actual = cJSON_ParseInSitu(buffer, length, &arena);
+    if ((expected == NULL) != (actual == NULL))
+    {
+        failures++;
+        fprintf(stderr, "FAIL: in-situ parse (%s) %s where cJSON_Parse %s\n", what,
+                actual ? "succeeded" : "failed", expected ? "succeeded" : "failed");
+    }
+    else if ((expected != NULL) && !cJSON_Compare(expected, actual, 1))
+    {
+        failures++;
+        fprintf(stderr, "FAIL: in-situ parse (%s) builds a different tree\n", what);
+    }
+    if ((actual == NULL) && (arena != NULL))
+    {
+        failures++;
+        fprintf(stderr, "FAIL: failed in-situ parse (%s) leaves an arena behind\n", what);
+    }
+    cJSON_DeleteArena(arena);
+    cJSON_Delete(expected);
+    free(buffer);
+}
+
+static void test_in_situ(void)
+{
+    static char big[128 * 1024];
+    size_t offset;
+    int i;
+
+    check_in_situ("{\"a\":[1,2.5,-3e2,true,false,null],\"b\":{\"c\":\"d\"},\"\":\"\"}", "nested values");
+    check_in_situ("{\"k\\\"ey\":\"line\\nbreak\\t\\u00e9\\ud83d\\ude00\\/\"}", "escapes in keys and values");
+    check_in_situ("[\"\\u0000 cut\"]", "escaped NUL");
+    check_in_situ("  \"x\"  ", "surrounding whitespace");
+    check_in_situ("{\"a\":[1,2,}", "truncated document");
+    check_in_situ("[\"\\ud800\"]", "lone surrogate");
+    check_in_situ("", "empty input");
+
+    /* enough nodes to need several arena blocks */
+    offset = (size_t)sprintf(big, "[");
+    for (i = 0; i < 4000; i++)
+    {
+        offset += (size_t)sprintf(big + offset, "%s{\"n\":%d,\"s\":\"v\\\"%d\"}", i ? "," : "", i, i);
+    }
+    sprintf(big + offset, "]");
+    check_in_situ(big, "many nodes");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+    {
+        rng_state = strtoull(argv[1], NULL, 0) | 1;
+    }
+    test_scans();
+    test_strings();
+    test_in_situ();
+    if (failures > 0)
+    {
+        fprintf(stderr, "cjson_scan_test: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("cjson_scan_test: OK\n");
+    return 0;
+}
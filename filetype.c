@@ -0,0 +1,412 @@
+/**
+ * @file filetype.c
+ * @brief Content-based type detection for attachments.
+ *
+ * The extension of an attachment says little about what it holds: logs are
+ * named `.txt` or nothing at all, images arrive without an extension through
+ * stdin, and a "text" file may be UTF-16 or contain binary data. Sending the
+ * wrong thing costs a failed round trip, or silently truncated text in free
+ * mode. This module answers three questions about the bytes themselves:
+ *   - Is it text? A streaming UTF-8 validator runs over each chunk as it is
+ *     read. Runs of printable ASCII are checked eight bytes per step with
+ *     word-sized (SWAR) arithmetic, which needs no platform-specific SIMD;
+ *     multi-byte sequences go through an exact validator that rejects
+ *     overlong forms, surrogates and code points beyond U+10FFFF, also
+ *     across chunk boundaries.
+ *   - If not UTF-8, is it UTF-16 (with or without BOM) or 8-bit legacy text
+ *     that can be converted? NUL and control byte counts decide. UTF-8 with
+ *     a few damaged sequences (a cut-off log line, one stray Latin-1 byte)
+ *     stays UTF-8 with those sequences replaced; only content whose
+ *     multi-byte sequences are mostly invalid is read as Windows-1252.
+ *   - Which binary format is it? Magic-byte signatures cover the image,
+ *     audio, video and document types the API accepts and the common
+ *     archive and executable formats it does not. Short signatures that
+ *     also occur at the start of text (such as "BM" or "MZ") only count
+ *     for content that is not valid text.
+ */
+
+#include "filetype.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UTF16_PROBE_BYTES 512
+
+void content_scan_init(ContentScan* scan) {
+    memset(scan, 0, sizeof(*scan));
+    scan->lower = 0x80;
+    scan->upper = 0xBF;
+}
+
+static void mark_invalid(ContentScan* scan, size_t offset) {
+    if (scan->invalid_utf8 == 0) scan->first_invalid = offset;
+    scan->invalid_utf8++;
+}
+
+/**
+ * Validates the next chunk of the content. Chunks may split multi-byte
+ * sequences anywhere; the decoder state carries over.
+ */
+void content_scan_update(ContentScan* scan, const unsigned char* data, size_t size) {
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t highs = 0x8080808080808080ull;
+    size_t i = 0;
+    while (i < size) {
+        if (scan->pending == 0) {
+            // Printable ASCII fast path: no byte has the high bit set and none is below 0x20.
+            // With all bytes below 0x80 the borrow test is exact.
+            while (size - i >= 8) {
+                uint64_t word;
+                memcpy(&word, data + i, sizeof(word));
+                if ((word & highs) || ((word - ones * 0x20) & ~word & highs)) break;
+                i += 8;
+            }
+            if (i == size) break;
+        }
+
+        unsigned char c = data[i];
+        if (scan->pending > 0) {
+            if (c >= scan->lower && c <= scan->upper) {
+                if (--scan->pending == 0) scan->valid_multibyte++;
+                scan->lower = 0x80;
+                scan->upper = 0xBF;
+                i++;
+            } else {
+                // The sequence ends early; `c` is examined again as a lead byte.
+                mark_invalid(scan, scan->bytes + i);
+                scan->pending = 0;
+                scan->lower = 0x80;
+                scan->upper = 0xBF;
+            }
+            continue;
+        }
+
+        if (c < 0x80) {
+            if (c == 0) {
+                scan->nul_bytes++;
+            } else if (c < 0x20 && c != '\t' && c != '\n' && c != '\r' && c != '\f' && c != '\v' && c != '\b' && c != 0x1B) {
+                if (scan->control_bytes == 0) scan->first_control = scan->bytes + i;
+                scan->control_bytes++;
+            }
+        } else if (c >= 0xC2 && c <= 0xDF) {
+            scan->pending = 1;
+        } else if (c == 0xE0) {
+            scan->pending = 2;
+            scan->lower = 0xA0;             // No overlong three-byte forms.
+        } else if ((c >= 0xE1 && c <= 0xEC) || c == 0xEE || c == 0xEF) {
+            scan->pending = 2;
+        } else if (c == 0xED) {
+            scan->pending = 2;
+            scan->upper = 0x9F;             // No UTF-16 surrogates.
+        } else if (c == 0xF0) {
+            scan->pending = 3;
+            scan->lower = 0x90;             // No overlong four-byte forms.
+        } else if (c >= 0xF1 && c <= 0xF3) {
+            scan->pending = 3;
+        } else if (c == 0xF4) {
+            scan->pending = 3;
+            scan->upper = 0x8F;             // Nothing beyond U+10FFFF.
+        } else {
+            mark_invalid(scan, scan->bytes + i);
+        }
+        i++;
+    }
+    scan->bytes += size;
+}
+
+// A sequence still open at the end of the content is truncated.
+void content_scan_finish(ContentScan* scan) {
+    if (scan->pending > 0) {
+        mark_invalid(scan, scan->bytes);
+        scan->pending = 0;
+    }
+}
+
+/**
+ * Decides how the scanned content should be read. `data` is the start of the
+ * content, used for byte order marks and the UTF-16 probe.
+ */
+ContentEncoding content_classify(const ContentScan* scan, const unsigned char* data, size_t size) {
+    if (size >= 2 && data[0] == 0xFF && data[1] == 0xFE && !(size >= 4 && data[2] == 0 && data[3] == 0)) {
+        return CONTENT_UTF16LE;
+    }
+    if (size >= 2 && data[0] == 0xFE && data[1] == 0xFF) return CONTENT_UTF16BE;
+
+    if (scan->nul_bytes > 0) {
+        // UTF-16 without a BOM: mostly-ASCII text has a NUL in every other byte.
+        size_t probe = (size < UTF16_PROBE_BYTES ? size : UTF16_PROBE_BYTES) & ~(size_t)1;
+        size_t even_nuls = 0, odd_nuls = 0;
+        for (size_t i = 0; i < probe; i += 2) {
+            if (data[i] == 0) even_nuls++;
+            if (data[i + 1] == 0) odd_nuls++;
+        }
+        size_t units = probe / 2;
+        if (units >= 4 && even_nuls == 0 && odd_nuls * 10 >= units * 8) return CONTENT_UTF16LE;
+        if (units >= 4 && odd_nuls == 0 && even_nuls * 10 >= units * 8) return CONTENT_UTF16BE;
+        return CONTENT_BINARY;
+    }
+    // Text has line breaks and tabs but hardly any other control characters.
+    if (scan->control_bytes * 100 > scan->bytes) return CONTENT_BINARY;
+    if (scan->invalid_utf8 == 0) return CONTENT_UTF8;
+    // Legacy 8-bit text hardly ever forms valid sequences by accident.
+    return scan->valid_multibyte > scan->invalid_utf8 ? CONTENT_UTF8_REPAIRED : CONTENT_LEGACY_TEXT;
+}
+
+const char* content_encoding_name(ContentEncoding encoding) {
+    switch (encoding) {
+        case CONTENT_UTF8: return "UTF-8";
+        case CONTENT_UTF8_REPAIRED: return "malformed UTF-8";
+        case CONTENT_UTF16LE: return "UTF-16LE";
+        case CONTENT_UTF16BE: return "UTF-16BE";
+        case CONTENT_LEGACY_TEXT: return "Windows-1252";
+        default: return "binary";
+    }
+}
+
+typedef struct {
+    size_t offset;
+    const char* magic;
+    size_t len;
+    const char* mime_type;
+    bool weak;                      // Plausible at the start of text; only trusted for non-text.
+} Signature;
+
+#define SIGNATURE(offset, magic, mime_type, weak) { offset, magic, sizeof(magic) - 1, mime_type, weak }
+
+static const Signature SIGNATURES[] = {
+    SIGNATURE(0, "\x89PNG\r\n\x1A\n", "image/png", false),
+    SIGNATURE(0, "\xFF\xD8\xFF", "image/jpeg", false),
+    SIGNATURE(0, "GIF87a", "image/gif", false),
+    SIGNATURE(0, "GIF89a", "image/gif", false),
+    SIGNATURE(0, "BM", "image/bmp", true),
+    SIGNATURE(0, "II*\0", "image/tiff", false),
+    SIGNATURE(0, "MM\0*", "image/tiff", false),
+    SIGNATURE(0, "\0\0\1\0", "image/x-icon", false),
+    SIGNATURE(0, "ID3", "audio/mp3", false),
+    SIGNATURE(0, "OggS", "audio/ogg", false),
+    SIGNATURE(0, "fLaC", "audio/flac", false),
+    SIGNATURE(0, "\x1A\x45\xDF\xA3", "video/webm", false),
+    SIGNATURE(0, "\0\0\1\xBA", "video/mpeg", false),
+    SIGNATURE(0, "\0\0\1\xB3", "video/mpeg", false),
+    SIGNATURE(0, "FLV\1", "video/x-flv", false),
+    SIGNATURE(0, "\x30\x26\xB2\x75\x8E\x66\xCF\x11", "video/wmv", false),
+    SIGNATURE(0, "PK\3\4", "application/zip", false),
+    SIGNATURE(0, "PK\5\6", "application/zip", false),
+    SIGNATURE(0, "\x1F\x8B", "application/gzip", false),
+    SIGNATURE(0, "BZh", "application/x-bzip2", true),
+    SIGNATURE(0, "\xFD" "7zXZ\0", "application/x-xz", false),
+    SIGNATURE(0, "\x28\xB5\x2F\xFD", "application/zstd", false),
+    SIGNATURE(0, "7z\xBC\xAF\x27\x1C", "application/x-7z-compressed", false),
+    SIGNATURE(0, "Rar!\x1A\x07", "application/vnd.rar", false),
+    SIGNATURE(257, "ustar", "application/x-tar", false),
+    SIGNATURE(0, "\x7F" "ELF", "application/x-executable", false),
+    SIGNATURE(0, "MZ", "application/x-msdownload", true),
+    SIGNATURE(0, "\xCA\xFE\xBA\xBE", "application/x-mach-binary", false),
+    SIGNATURE(0, "\xCF\xFA\xED\xFE", "application/x-mach-binary", false),
+    SIGNATURE(0, "\xCE\xFA\xED\xFE", "application/x-mach-binary", false),
+    SIGNATURE(0, "\0asm", "application/wasm", false),
+    SIGNATURE(0, "\xD0\xCF\x11\xE0\xA1\xB1\x1A\xE1", "application/x-ole-storage", false),
+    SIGNATURE(0, "SQLite format 3", "application/vnd.sqlite3", false),
+    SIGNATURE(0, "\xED\xAB\xEE\xDB", "application/x-rpm", false),
+    SIGNATURE(0, "!<arch>\n", "application/x-archive", false),
+};
+
+static bool starts_with(const unsigned char* data, size_t size, size_t offset, const char* magic, size_t len) {
+    return size >= offset + len && memcmp(data + offset, magic, len) == 0;
+}
+
+/**
+ * Identifies the format of binary content from its signature. `text` says
+ * whether the content validated as text, which disables weak signatures.
+ * Returns a MIME type, or NULL if no signature matches.
+ */
+const char* content_sniff_mime(const unsigned char* data, size_t size, bool text) {
+    // PDF allows leading garbage before the header. Text that merely mentions
+    // the header (source code, for one) must not match, so that needs binary content.
+    if (starts_with(data, size, 0, "%PDF-", 5)) return "application/pdf";
+    size_t head = size < 1024 ? size : 1024;
+    for (size_t i = 1; !text && i + 5 <= head; i++) {
+        if (data[i] == '%' && memcmp(data + i, "%PDF-", 5) == 0) return "application/pdf";
+    }
+
+    if (starts_with(data, size, 0, "RIFF", 4) && size >= 12) {
+        if (memcmp(data + 8, "WEBP", 4) == 0) return "image/webp";
+        if (memcmp(data + 8, "WAVE", 4) == 0) return "audio/wav";
+        if (memcmp(data + 8, "AVI ", 4) == 0) return "video/avi";
+    }
+    if (starts_with(data, size, 0, "FORM", 4) && size >= 12 &&
+        (memcmp(data + 8, "AIFF", 4) == 0 || memcmp(data + 8, "AIFC", 4) == 0)) {
+        return "audio/aiff";
+    }
+    // ISO base media files: the brand after "ftyp" tells image, audio and video apart.
+    if (starts_with(data, size, 4, "ftyp", 4) && size >= 12) {
+        const unsigned char* brand = data + 8;
+        if (memcmp(brand, "heic", 4) == 0 || memcmp(brand, "heix", 4) == 0 || memcmp(brand, "hevc", 4) == 0 ||
+            memcmp(brand, "heim", 4) == 0 || memcmp(brand, "heis", 4) == 0) {
+            return "image/heic";
+        }
+        if (memcmp(brand, "mif1", 4) == 0 || memcmp(brand, "msf1", 4) == 0) return "image/heif";
+        if (memcmp(brand, "avif", 4) == 0) return "image/avif";
+        if (memcmp(brand, "qt  ", 4) == 0) return "video/mov";
+        if (memcmp(brand, "3gp", 3) == 0) return "video/3gpp";
+        if (memcmp(brand, "M4A ", 4) == 0) return "audio/aac";
+        return "video/mp4";
+    }
+
+    for (size_t i = 0; i < sizeof(SIGNATURES) / sizeof(SIGNATURES[0]); i++) {
+        const Signature* sig = &SIGNATURES[i];
+        if (sig->weak && text) continue;
+        if (starts_with(data, size, sig->offset, sig->magic, sig->len)) return sig->mime_type;
+    }
+    // MPEG audio frame sync; layer bits of zero mean AAC in ADTS framing.
+    if (!text && size >= 2 && data[0] == 0xFF && (data[1] & 0xE0) == 0xE0) {
+        return (data[1] & 0x06) == 0 ? "audio/aac" : "audio/mp3";
+    }
+    return NULL;
+}
+
+// Inline data types the API accepts, besides text.
+static const char* const SUPPORTED_TYPES[] = {
+    "application/pdf",
+    "image/png", "image/jpeg", "image/webp", "image/heic", "image/heif", "image/gif",
+    "audio/wav", "audio/mp3", "audio/aiff", "audio/aac", "audio/ogg", "audio/flac",
+    "video/mp4", "video/mpeg", "video/mov", "video/avi", "video/x-flv", "video/mpg",
+    "video/webm", "video/wmv", "video/3gpp",
+};
+
+bool content_mime_is_text(const char* mime_type) {
+    return strncmp(mime_type, "text/", 5) == 0 || strcmp(mime_type, "application/json") == 0 ||
+           strcmp(mime_type, "application/xml") == 0;
+}
+
+bool content_mime_supported(const char* mime_type) {
+    if (content_mime_is_text(mime_type)) return true;
+    for (size_t i = 0; i < sizeof(SUPPORTED_TYPES) / sizeof(SUPPORTED_TYPES[0]); i++) {
+        if (strcmp(mime_type, SUPPORTED_TYPES[i]) == 0) return true;
+    }
+    return false;
+}
+
+static const uint16_t WINDOWS_1252_80[32] = {
+    0x20AC, 0xFFFD, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021, 0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0xFFFD, 0x017D, 0xFFFD,
+    0xFFFD, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014, 0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0xFFFD, 0x017E, 0x0178,
+};
+
+static size_t put_utf8(char* out, uint32_t u) {
+    if (u < 0x80) {
+        out[0] = (char)u;
+        return 1;
+    }
+    if (u < 0x800) {
+        out[0] = (char)(0xC0 | u >> 6);
+        out[1] = (char)(0x80 | (u & 0x3F));
+        return 2;
+    }
+    if (u < 0x10000) {
+        out[0] = (char)(0xE0 | u >> 12);
+        out[1] = (char)(0x80 | (u >> 6 & 0x3F));
+        out[2] = (char)(0x80 | (u & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | u >> 18);
+    out[1] = (char)(0x80 | (u >> 12 & 0x3F));
+    out[2] = (char)(0x80 | (u >> 6 & 0x3F));
+    out[3] = (char)(0x80 | (u & 0x3F));
+    return 4;
+}
+
+/**
+ * Returns the length of the well-formed UTF-8 sequence at `data`, or 0 if it
+ * is malformed. `*prefix` is then the number of bytes that belong to the bad
+ * sequence (at least 1), so decoding resumes where the scanner would.
+ */
+static size_t utf8_sequence(const unsigned char* data, size_t size, size_t* prefix) {
+    unsigned char c = data[0];
+    unsigned char lower = 0x80, upper = 0xBF;
+    size_t need;
+    *prefix = 1;
+    if (c < 0x80) return 1;
+    if (c >= 0xC2 && c <= 0xDF) {
+        need = 1;
+    } else if (c >= 0xE0 && c <= 0xEF) {
+        need = 2;
+        if (c == 0xE0) lower = 0xA0;
+        if (c == 0xED) upper = 0x9F;
+    } else if (c >= 0xF0 && c <= 0xF4) {
+        need = 3;
+        if (c == 0xF0) lower = 0x90;
+        if (c == 0xF4) upper = 0x8F;
+    } else {
+        return 0;
+    }
+    size_t i = 1;
+    while (i <= need && i < size && data[i] >= lower && data[i] <= upper) {
+        lower = 0x80;
+        upper = 0xBF;
+        i++;
+    }
+    *prefix = i;
+    return i == need + 1 ? i : 0;
+}
+
+/**
+ * Converts UTF-16 or Windows-1252 text to NUL-terminated UTF-8, dropping a
+ * byte order mark. Unpaired surrogates and, for repaired UTF-8, malformed
+ * sequences become U+FFFD. Returns NULL for other encodings or on
+ * allocation failure.
+ */
+char* content_to_utf8(const unsigned char* data, size_t size, ContentEncoding encoding, size_t* out_size) {
+    if (encoding != CONTENT_UTF16LE && encoding != CONTENT_UTF16BE && encoding != CONTENT_LEGACY_TEXT &&
+        encoding != CONTENT_UTF8_REPAIRED) {
+        return NULL;
+    }
+    // Each input byte becomes at most three output bytes (a UTF-16 unit, two bytes, at most three).
+    char* out = malloc(size * 3 + 1);
+    if (!out) return NULL;
+    size_t len = 0;
+    if (encoding == CONTENT_UTF8_REPAIRED) {
+        size_t i = 0;
+        while (i < size) {
+            size_t prefix;
+            size_t valid = utf8_sequence(data + i, size - i, &prefix);
+            if (valid > 0) {
+                memcpy(out + len, data + i, valid);
+                len += valid;
+                i += valid;
+            } else {
+                len += put_utf8(out + len, 0xFFFD);
+                i += prefix;
+            }
+        }
+    } else if (encoding == CONTENT_LEGACY_TEXT) {
+        for (size_t i = 0; i < size; i++) {
+            unsigned char c = data[i];
+            uint32_t u = (c >= 0x80 && c < 0xA0) ? WINDOWS_1252_80[c - 0x80] : c;
+            len += put_utf8(out + len, u);
+        }
+    } else {
+        bool little = encoding == CONTENT_UTF16LE;
+        size_t i = 0;
+        if (size >= 2 && ((little && data[0] == 0xFF && data[1] == 0xFE) || (!little && data[0] == 0xFE && data[1] == 0xFF))) {
+            i = 2;
+        }
+        for (; i + 1 < size; i += 2) {
+            uint32_t unit = little ? (uint32_t)(data[i] | data[i + 1] << 8) : (uint32_t)(data[i] << 8 | data[i + 1]);
+            if (unit >= 0xD800 && unit <= 0xDBFF && i + 3 < size) {
+                uint32_t next = little ? (uint32_t)(data[i + 2] | data[i + 3] << 8) : (uint32_t)(data[i + 2] << 8 | data[i + 3]);
+                if (next >= 0xDC00 && next <= 0xDFFF) {
+                    len += put_utf8(out + len, 0x10000 + ((unit - 0xD800) << 10) + (next - 0xDC00));
+                    i += 2;
+                    continue;
+                }
+            }
+            if (unit >= 0xD800 && unit <= 0xDFFF) unit = 0xFFFD;
+            if (unit == 0) continue;
+            len += put_utf8(out + len, unit);
+        }
+    }
+    out[len] = '\0';
+    *out_size = len;
+    return out;
+}
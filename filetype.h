@@ -0,0 +1,50 @@
+/**
+ * @file filetype.h
+ * @brief Content-based type detection for attachments.
+ *
+ * Attachments are classified by what they contain, not by their extension:
+ * a streaming scanner validates UTF-8 and counts NUL and control bytes while
+ * the file is read, magic-byte signatures identify binary formats, and text
+ * in UTF-16 or a legacy 8-bit encoding is converted to UTF-8. gcli uses the
+ * result to send text as text, supported binaries as inline data, and to
+ * reject everything else before any bytes go over the network.
+ */
+
+#ifndef GCLI_FILETYPE_H
+#define GCLI_FILETYPE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    size_t bytes;
+    size_t nul_bytes;
+    size_t control_bytes;   // C0 controls other than tab, line breaks, form feed, backspace and escape.
+    size_t invalid_utf8;    // Malformed or truncated sequences.
+    size_t valid_multibyte; // Well-formed sequences of two or more bytes.
+    size_t first_invalid;   // Offset of the first malformed sequence, if any.
+    size_t first_control;   // Offset of the first counted control byte, if any.
+    int pending;            // Continuation bytes still expected.
+    unsigned char lower, upper; // Allowed range of the next continuation byte.
+} ContentScan;
+
+typedef enum {
+    CONTENT_UTF8,
+    CONTENT_UTF8_REPAIRED,  // UTF-8 with a few malformed sequences, read as U+FFFD.
+    CONTENT_UTF16LE,
+    CONTENT_UTF16BE,
+    CONTENT_LEGACY_TEXT,    // 8-bit text, read as Windows-1252.
+    CONTENT_BINARY
+} ContentEncoding;
+
+void content_scan_init(ContentScan* scan);
+void content_scan_update(ContentScan* scan, const unsigned char* data, size_t size);
+void content_scan_finish(ContentScan* scan);
+ContentEncoding content_classify(const ContentScan* scan, const unsigned char* data, size_t size);
+const char* content_sniff_mime(const unsigned char* data, size_t size, bool text);
+bool content_mime_supported(const char* mime_type);
+bool content_mime_is_text(const char* mime_type);
+char* content_to_utf8(const unsigned char* data, size_t size, ContentEncoding encoding, size_t* out_size);
+const char* content_encoding_name(ContentEncoding encoding);
+
+#endif // GCLI_FILETYPE_H
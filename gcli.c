@@ -33,8 +33,18 @@
 #include <curl/curl.h>
 #include <zlib.h>
 #include "cJSON.h"
+#include "image.h"
+#include "logcompact.h"
+#include "srcview.h"
+#include "tabular.h"
+#include "pdftext.h"
+#include "filetype.h"
+#include "jsonschema.h"
+#include "toolexec.h"
+#include "routes.h"
 
 #include <limits.h>
+#include <time.h>
 
 // --- Portability Layer ---
 #ifdef _WIN32
@@ -42,6 +52,8 @@
   #include <direct.h>
   #include "linenoise.h"
   #include <conio.h>
+  #include <malloc.h>
+  #include <psapi.h>
   #define MKDIR(path) _mkdir(path)
   #define STRCASECMP _stricmp
   #define PATH_MAX MAX_PATH
@@ -54,25 +66,215 @@
   #include <readline/readline.h>
   #include <readline/history.h>
   #include <dirent.h>
+  #include <poll.h>
+  #include <pthread.h>
+  #include <sys/resource.h>
+  #include <sys/socket.h>
+  #include <regex.h>
   #define MKDIR(path) mkdir(path, 0755)
   #define STRCASECMP strcasecmp
 #endif
 
+#ifdef __linux__
+  #include <sys/inotify.h>
+#endif
+
+// Usable size of a heap block, for memory accounting (0 where unknown).
+#if defined(_WIN32)
+  #define MEM_BLOCK_SIZE(ptr) _msize((void*)(ptr))
+#elif defined(__APPLE__)
+  #include <malloc/malloc.h>
+  #define MEM_BLOCK_SIZE(ptr) malloc_size(ptr)
+#elif defined(__linux__)
+  #include <malloc.h>
+  #define MEM_BLOCK_SIZE(ptr) malloc_usable_size((void*)(ptr))
+#else
+  #define MEM_BLOCK_SIZE(ptr) ((size_t)0)
+  #define MEM_NO_BLOCK_SIZE
+#endif
+
+// Memory counters are also updated from Gzip worker threads.
+#if defined(__GNUC__) || defined(__clang__)
+  #define MEM_COUNTER_ADD(var, n) __atomic_add_fetch(&(var), (n), __ATOMIC_RELAXED)
+  #define MEM_COUNTER_SUB(var, n) __atomic_sub_fetch(&(var), (n), __ATOMIC_RELAXED)
+#else
+  #define MEM_COUNTER_ADD(var, n) ((var) += (n))
+  #define MEM_COUNTER_SUB(var, n) ((var) -= (n))
+#endif
+
 // --- Configuration Constants ---
 #define DEFAULT_MODEL_NAME "gemini-2.5-pro"
-#define API_URL_FORMAT "https://generativelanguage.googleapis.com/v1beta/models/%s:%s"
+#define API_BASE_URL "https://generativelanguage.googleapis.com"
+#define API_MODEL_PATH_FORMAT "/v1beta/models/%s:%s"
+#define API_MODELS_PATH "/v1beta/models"
 #define FREE_API_URL "https://gemini.google.com/_/BardChatUi/data/assistant.lamda.BardFrontendService/StreamGenerate?bl=&f.sid=&hl=en&_reqid=&rt=c"
 #define GZIP_CHUNK_SIZE 16384
+#define GZIP_BLOCK_SIZE (128 * 1024)
+#define GZIP_DICT_SIZE 32768
+#define GZIP_MAX_THREADS 8
+#define COMPRESSION_LEVEL_AUTO -1
+#define DEFAULT_COMPRESSION_MIN_BYTES 1024
+#define COMPRESSION_PROBE_SIZE (2 * GZIP_BLOCK_SIZE)
+#define UPLOAD_SAMPLE_MIN_BYTES 16384
+#define UPLOAD_SAMPLE_WINDOW 8
+#define DEFAULT_ROUTE_PROBE_INTERVAL 60
 #define ATTACHMENT_LIMIT 1024
+#define ATTACHMENT_READ_CHUNK (256 * 1024)
+#define DEFAULT_TABLE_PROFILE_MIN_BYTES (8 * 1024 * 1024)
 #define MAX_FREE_MODE_CONTEXT_SIZE 102400
+#define MAX_STREAM_CONTINUATIONS 3
+#define STOP_NONE ((size_t)-1)
+#define STREAM_OVERLAP_MIN 8
+#define STREAM_CONTINUE_PROMPT "Your previous answer was cut off by a network error. Continue it exactly where it stopped, without repeating any of it and without any preamble."
+#define WATCH_DEBOUNCE_MS 300
+#define MAX_FUNCTION_ROUNDS 8
+#define DEFAULT_FUNCTION_TIMEOUT_MS 30000
+#define DEFAULT_FUNCTION_OUTPUT_LIMIT (32 * 1024)
+#define DEFAULT_FUNCTION_WORKERS 4
+#define DEFAULT_HTTP2_MAX_STREAMS 32
+#define MAX_SAMPLES 8
+#define DEFAULT_IMAGE_MAX_DIMENSION 2048
+#define IMAGE_OPTIMIZE_TIMEOUT_MS 10000
+#define PDF_EXTRACT_TIMEOUT_MS 10000
+#define DIFF_CONTEXT_LINES 3
+#define DEFAULT_COLD_HISTORY_TURNS 10
+#define COLD_PART_MIN_BYTES 1024
+#define USAGE_LEDGER_FILE "usage.ledger"
+#define USAGE_RECORD_VERSION 1
+#define USAGE_RECORD_FIXED_SIZE 74
+#define USAGE_TOOL_URL_CONTEXT 0x01
+#define USAGE_TOOL_GROUNDING 0x02
+#define USAGE_TOOL_AUTO 0x04     // At least one tool was decided per turn (auto mode).
+#define USAGE_TOOL_RECORDED 0x08 // Unset in records written before tools were recorded.
+#define USAGE_HTTP_1 1
+#define USAGE_HTTP_2 2
+#define USAGE_HTTP_3 3
+#define USAGE_HTTP_VERSION_MASK 0x0F
+#define USAGE_HTTP_NEW_CONNECTION 0x10 // The last transfer opened a connection instead of reusing one.
+#define SOURCE_TREE_MAX_FILES 4096
+#define SOURCE_TREE_MAX_THREADS 8
 
 // --- Data Structures ---
 typedef struct { unsigned char* data; size_t size; } GzipResult;
-typedef enum { PART_TYPE_TEXT, PART_TYPE_FILE } PartType;
-typedef struct { PartType type; char* text; char* mime_type; char* base64_data; char* filename; } Part;
+typedef struct {
+    unsigned char* data;
+    size_t size;            // Bytes sent on the wire.
+    size_t raw_size;        // Size of the JSON before compression.
+    bool gzipped;
+    double deflate_seconds; // Deflate time summed over all threads.
+    int threads;            // Threads the deflate work was spread over.
+} RequestBody;
+typedef struct {
+    double upload_samples[UPLOAD_SAMPLE_WINDOW]; // Recent upload throughputs (bytes/s).
+    int num_upload_samples, next_upload_sample;
+    double speed_scale, ratio_scale; // Measured vs. profiled deflate speed (machine) and ratio (data).
+    long requests, compressed_requests;
+    double bytes_in, bytes_out;
+    double cpu_seconds;
+    double seconds_saved;
+} CompressionStats;
+typedef enum { USAGE_OP_GENERATE, USAGE_OP_FREE, USAGE_OP_COUNT_TOKENS, USAGE_OP_LIST_MODELS } UsageOp;
+typedef enum { TOOL_OFF, TOOL_ON, TOOL_AUTO } ToolMode;
+typedef struct {
+    int64_t timestamp;          // Unix time the request started.
+    uint8_t op;                 // UsageOp.
+    uint8_t attempts;           // Transfers made, i.e. 1 + retries.
+    uint8_t tools;              // USAGE_TOOL_* bits: the server-side tools the request carried.
+    uint8_t http;               // USAGE_HTTP_* of the last transfer; 0 in older records.
+    bool ok, cancelled;
+    int32_t status;             // Last HTTP status, or -CURLcode on a transport error.
+    uint32_t input_tokens, output_tokens, cached_tokens, thought_tokens;
+    uint32_t dns_us, connect_us, tls_us, ttfb_us, total_us; // Last transfer, from its start.
+    uint32_t elapsed_ms;        // Wall time including retries and back-off.
+    uint64_t bytes_sent, bytes_received;
+    char model[128];            // Sized like AppState.model_name.
+    char tool[16];              // gcli, or the wrapper named by GCLI_TOOL.
+    char session[128];          // Sized like AppState.current_session_name.
+    double started;             // monotonic_seconds() at the start; not stored.
+} UsageRecord;
+typedef struct {
+    CURLM* multi;               // Shared by all requests, so their connections are reused.
+    long h1_requests, h1_connections; // HTTP/1.x transfers and the connections they opened.
+    long h2_streams, h2_connections;  // HTTP/2 streams and the connections they opened.
+    int peak_transfers;         // Most transfers in flight at once.
+} HttpTransport;
+typedef struct {
+    CURL* curl;
+    CURLcode result;
+    double started;             // monotonic_seconds() when the transfer was started.
+    double responded;           // When the first final (non-1xx) response header arrived, or 0.
+    double uploaded;            // When libcurl had handed the last byte of the body to the socket, or 0.
+    long send_buffer;           // The socket's send buffer (SO_SNDBUF) at that point, or 0 if unknown.
+    curl_xferinfo_callback progress; // The caller's progress callback, or NULL.
+    void* progress_data;
+} HttpTransfer;
+typedef enum { MEM_HISTORY, MEM_ATTACHMENTS, MEM_REQUEST, MEM_JSON, MEM_CURL, MEM_CATEGORY_COUNT } MemCategory;
+typedef struct {
+    size_t live_bytes, peak_bytes; // Usable heap bytes held now / at most.
+    size_t allocs, frees;
+} MemCounters;
+// Function calls and responses keep the part's JSON object in `text`.
+typedef enum { PART_TYPE_TEXT, PART_TYPE_FILE, PART_TYPE_FUNCTION_CALL, PART_TYPE_FUNCTION_RESPONSE } PartType;
+typedef struct {
+    unsigned char* data;
+    size_t size;        // Stored size.
+    size_t raw_size;    // Size after inflating (decoded bytes for attachments).
+    bool deflated;      // false if deflate did not pay off and `data` is stored as-is.
+    bool base64;        // true if `data` holds decoded Base64 bytes.
+} ColdPayload;
+typedef struct { PartType type; char* text; char* mime_type; char* base64_data; char* filename; ColdPayload* cold; } Part;
 typedef struct { char* role; Part* parts; int num_parts; } Content;
-typedef struct { Content* contents; int num_contents; } History;
-typedef struct { char* buffer; size_t size; char* full_response; size_t full_response_size; } MemoryStruct;
+typedef struct { Content* contents; int num_contents; int cold_after; } History;
+typedef struct {
+    // Set from the command line.
+    bool use_regex;
+#ifndef _WIN32
+    regex_t regex;          // --stop-regex: cut the answer where this matches.
+#endif
+    bool after_block;       // --stop-after-block: cut after the first fenced code block.
+    int max_lines;          // --max-lines: cut after this many lines (0 = no limit).
+    // Progress through the response being streamed.
+    size_t line_start;      // Start of the first line not yet complete.
+    int lines;              // Complete lines seen.
+    bool in_block;          // Inside a fenced code block.
+    bool triggered;         // A condition matched; the transfer is being aborted.
+    const char* reason;     // Which one (static string).
+} StopConditions;
+typedef struct {
+    char* buffer;
+    size_t size;
+    char* full_response;
+    size_t full_response_size;
+    UsageRecord* usage; // If set, receives the token counts of a streamed response.
+    bool finished;      // A candidate carried a finishReason; the stream is complete.
+    bool resuming;      // The next text continues `full_response`; drop any repeated overlap.
+    StopConditions* stop; // If set, evaluated on the response as it streams.
+    JsonValidator* schema; // If set, the response is validated instead of printed as it streams.
+    cJSON* function_calls; // If set, collects the functionCall parts of the response.
+} MemoryStruct;
+typedef struct {
+    CURL* curl;
+    size_t (*callback)(void*, size_t, size_t, void*); // The caller's write callback.
+    void* callback_data;
+    bool delivered;             // The callback has received part of the response.
+    MemoryStruct held;          // The body of a proxy or gateway error, held back from the callback.
+} RouteResponse;
+typedef struct {
+    char* path;      // As given on the command line.
+    char* base;      // File name matched against directory events.
+    int wd;          // inotify watch descriptor of the containing directory.
+    char* snapshot;  // Content the model last replied to (NULL before the first reply).
+    char* pending;   // Content of the run in progress.
+    bool dirty;
+} WatchedFile;
+typedef struct {
+    char* path;
+    uint64_t hash;
+    char* content;          // The version the model has answered.
+    uint64_t pending_hash;
+    char* pending;          // A newer version attached to the turn in progress, or NULL.
+} AttachmentRecord;
+typedef struct WatchContext { int fd; WatchedFile* files; int num_files; bool change_pending; } WatchContext;
 typedef struct AppState {
     char api_key[128];
     char origin[128];
@@ -81,8 +283,8 @@ typedef struct AppState {
     float temperature;
     int max_output_tokens;
     int thinking_budget;
-    bool google_grounding;
-    bool url_context;
+    ToolMode google_grounding;  // Google Search grounding; in auto mode only for prompts asking for fresh information.
+    ToolMode url_context;       // URL context; in auto mode only when the turn contains URLs.
     History history;
     char* last_model_response;
     char* system_prompt;
@@ -98,6 +300,40 @@ typedef struct AppState {
     bool loc_gathered;
     char* save_session_path;
     char* final_code;
+    bool watch_mode;
+    bool watch_send_diff;
+    WatchContext* watch;
+    bool request_cancelled;
+    AttachmentRecord* attachment_records;
+    int num_attachment_records;
+    int image_max_dimension;
+    int compression_level;      // COMPRESSION_LEVEL_AUTO, 0 (off) or a fixed 1-9.
+    int compression_min_bytes;  // Bodies smaller than this are sent uncompressed.
+    CompressionStats compression;
+    bool mem_report;            // Print the memory report on exit (--mem-report).
+    bool usage_ledger;          // Append every request to the usage ledger.
+    bool compact_logs;          // Collapse repeated log lines in stdin and log attachments.
+    bool pdf_text;              // Send text-based PDFs as their extracted text (--pdf-text).
+    SourceViewMode attach_view; // Outline or minify attached source files (--outline, --minify).
+    bool attach_table;          // Attach CSV/TSV files as profiles (--table).
+    const char* table_where;    // Row filter for table profiles (--where), not owned.
+    int table_profile_min_bytes; // CSV/TSV files this large are always profiled (0 = only with --table).
+    UsageRecord usage;          // The request in progress.
+    StopConditions stop;        // Client-side stop conditions (--stop-regex, --stop-after-block, --max-lines).
+    cJSON* response_schema;     // Structured output schema (--schema), or NULL.
+    JsonValidator* schema_validator; // Validates streamed output against `response_schema`.
+    cJSON* functions;           // Local functions the model may call (config "functions"), or NULL.
+    bool use_functions;         // Declare `functions` in requests (off with --no-functions).
+    int function_timeout_ms;    // Default time limit of a function call.
+    int function_output_limit;  // Bytes of a call's output sent back to the model.
+    int function_workers;       // Function calls run at once.
+    bool http2;                 // Negotiate HTTP/2 and multiplex concurrent requests (off with --http1.1).
+    int http2_max_streams;      // Concurrent streams per HTTP/2 connection before another is opened.
+    int samples;                // Answers to generate concurrently for the initial prompt (--samples).
+    HttpTransport transport;
+    RouteTable* routes;         // Routes to the API (config "routes"); NULL until the first request without them.
+    bool routes_configured;     // `routes` came from the configuration rather than being the default route.
+    int route_probe_interval;   // Seconds between latency probes of the routes (0 = off).
 } AppState;
 
 typedef struct {
@@ -114,7 +350,8 @@ void free_content(Content* content);
 int get_token_count(AppState* state);
 char* base64_encode(const unsigned char* data, size_t input_length);
 const char* get_mime_type(const char* filename);
-GzipResult gzip_compress(const unsigned char* input_data, size_t input_size);
+GzipResult gzip_compress(const unsigned char* input_data, size_t input_size, int level);
+bool encode_request_body(AppState* state, const cJSON* root, RequestBody* body);
 cJSON* build_request_json(AppState* state);
 bool is_path_safe(const char* path);
 void get_api_key_securely(AppState* state);
@@ -128,17 +365,44 @@ void list_sessions();
 void clear_session_state(AppState* state);
 static size_t write_to_memory_struct_callback(void* contents, size_t size, size_t nmemb, void* userp);
 void free_pending_attachments(AppState* state);
+void free_attachment_records(AppState* state);
+static void settle_attachment_revisions(AppState* state, bool answered);
 void initialize_default_state(AppState* state);
 void print_usage(const char* prog_name);
 int parse_common_options(int argc, char* argv[], AppState* state);
 static void json_read_string(const cJSON* obj, const char* key, char* buffer, size_t buffer_size);
 static void json_read_float(const cJSON* obj, const char* key, float* target);
 static void json_read_int(const cJSON* obj, const char* key, int* target);
+static const char* part_payload(const Part* part, char** scratch);
+static void free_cold_payload(Part* part);
+static void history_memory_usage(const History* history, size_t* expanded, size_t* stored, int* cold_parts);
+static void print_compression_stats(const AppState* state);
+static void* mem_alloc(MemCategory category, size_t size);
+static void* mem_calloc(MemCategory category, size_t count, size_t size);
+static void* mem_realloc(MemCategory category, void* ptr, size_t size);
+static char* mem_strdup(MemCategory category, const char* str);
+static void mem_free(MemCategory category, void* ptr);
+static void mem_track(MemCategory category, void* ptr);
+static void mem_untrack(MemCategory category, void* ptr);
+static void track_part(MemCategory category, const Part* part);
+static void release_part(MemCategory category, Part* part);
+static void mem_accounting_init(void);
+static void print_memory_report(void);
+static void usage_begin(AppState* state, UsageOp op);
+static void usage_note_transfer(UsageRecord* usage, const HttpTransfer* transfer, long http_code);
+static void usage_finish(AppState* state, bool ok);
+static void usage_read_metadata(UsageRecord* usage, const cJSON* metadata);
+static bool print_usage_report(const char* group_by);
 static void json_read_bool(const cJSON* obj, const char* key, bool* target);
+static void json_read_tool_mode(const cJSON* obj, const char* key, ToolMode* target);
+static void json_write_tool_mode(cJSON* obj, const char* key, ToolMode mode);
+static const char* tool_mode_name(ToolMode mode);
+static bool parse_tool_mode(const char* text, ToolMode* mode);
+static uint8_t choose_tools(const AppState* state);
 static void json_read_strdup(const cJSON* obj, const char* key, char** target);
 bool send_api_request(AppState* state, char** full_response_out);
 bool build_session_path(const char* session_name, char* path_buffer, size_t buffer_size);
-long perform_api_curl_request(AppState* state, const char* endpoint, const char* compressed_payload, size_t payload_size, size_t (*callback)(void*, size_t, size_t, void*), void* callback_data);
+long perform_api_curl_request(AppState* state, const char* endpoint, const RequestBody* body, size_t (*callback)(void*, size_t, size_t, void*), void* callback_data);
 void export_history_to_markdown(AppState* state, const char* filepath);
 void list_available_models(AppState* state);
 void save_configuration(AppState* state);
@@ -149,13 +413,153 @@ bool send_free_api_request(AppState* state, const char* prompt);
 static void process_free_line(char* line, AppState* state);
 static size_t write_free_memory_callback(void* contents, size_t size, size_t nmemb, void* userp);
 char* build_free_request_payload(AppState* state, const char* current_prompt, bool is_pro_model);
+void run_watch_mode(AppState* state, char** paths, int num_paths, const char* prompt, bool interactive);
+static bool append_unified_diff(MemoryStruct* out, const char* path, const char* old_text, const char* new_text);
+static void watch_install_progress(HttpTransfer* transfer, AppState* state);
+static void transport_prepare(AppState* state, CURL* curl, const char* url);
+static CURLcode transport_perform(AppState* state, HttpTransfer* transfer);
+static void transport_perform_all(AppState* state, HttpTransfer* transfers, int count);
+static curl_off_t transfer_response_us(const HttpTransfer* transfer);
+static void print_transport_stats(const AppState* state);
+static CURL* create_api_curl_handle(AppState* state, int route, const char* endpoint, const RequestBody* body,
+                                    size_t (*callback)(void*, size_t, size_t, void*), void* callback_data,
+                                    struct curl_slist** headers_out);
+static int route_pick(AppState* state, unsigned tried);
+static bool route_finish(AppState* state, int route, const HttpTransfer* transfer, long http_code);
+static int route_failover(AppState* state, int failed, unsigned tried);
+static void route_response_init(RouteResponse* response, CURL* curl, size_t (*callback)(void*, size_t, size_t, void*),
+                                void* callback_data);
+static void route_response_finish(RouteResponse* response, bool resent);
+static void route_apply(AppState* state, CURL* curl, int route, const char* path, char* url, size_t url_size);
+static void start_route_prober(AppState* state);
+static void print_route_stats(AppState* state);
+static long finish_api_curl_request(AppState* state, UsageRecord* usage, const HttpTransfer* transfer, const RequestBody* body);
+static bool generate_samples(AppState* state, int count);
+static void attach_source_tree(AppState* state, const char* dir, SourceViewMode mode);
+
+/**
+ * @brief Compiles the pattern given with --stop-regex.
+ * @details The pattern is a POSIX extended regular expression; `^` and `$`
+ *          match at line boundaries.
+ * @return false (after printing the reason) if the pattern is invalid.
+ */
+static bool stop_conditions_set_regex(StopConditions* stop, const char* pattern) {
+#ifndef _WIN32
+    if (stop->use_regex) regfree(&stop->regex);
+    int rc = regcomp(&stop->regex, pattern, REG_EXTENDED | REG_NEWLINE);
+    stop->use_regex = rc == 0;
+    if (rc != 0) {
+        char message[256];
+        regerror(rc, &stop->regex, message, sizeof(message));
+        fprintf(stderr, "Error: Invalid --stop-regex '%s': %s\n", pattern, message);
+        return false;
+    }
+    return true;
+#else
+    (void)stop;
+    (void)pattern;
+    fprintf(stderr, "Error: --stop-regex is not supported on this platform.\n");
+    return false;
+#endif
+}
+
+static void stop_conditions_free(StopConditions* stop) {
+#ifndef _WIN32
+    if (stop->use_regex) regfree(&stop->regex);
+#endif
+    stop->use_regex = false;
+}
+
+// Forgets the progress through a response, for a new attempt or a rewritten stream.
+static void stop_conditions_reset(StopConditions* stop) {
+    stop->line_start = 0;
+    stop->lines = 0;
+    stop->in_block = false;
+    stop->triggered = false;
+    stop->reason = NULL;
+}
+
+// A Markdown code fence: up to three spaces of indentation, then ``` or ~~~.
+static bool is_code_fence(const char* line, size_t len) {
+    size_t i = 0;
+    while (i < len && i < 3 && line[i] == ' ') i++;
+    return len - i >= 3 && (memcmp(line + i, "```", 3) == 0 || memcmp(line + i, "~~~", 3) == 0);
+}
+
+/**
+ * @brief Evaluates the stop conditions on a response as it grows.
+ * @details Only lines that were not complete at the previous call are
+ *          examined, so the work over a whole response stays linear. Line
+ *          conditions act on complete lines; the regex is searched from the
+ *          start of the first incomplete line, with `$` not matching at the
+ *          end of the text received so far.
+ * @param stop The conditions, or NULL.
+ * @param text The whole response so far, NUL-terminated at `len`.
+ * @param len Its length.
+ * @return The length to cut the response to, or STOP_NONE.
+ */
+static size_t stop_conditions_check(StopConditions* stop, const char* text, size_t len) {
+    if (!stop || stop->triggered || (!stop->use_regex && !stop->after_block && stop->max_lines <= 0)) {
+        return STOP_NONE;
+    }
+    size_t cut = STOP_NONE;
+    size_t search_from = stop->line_start;
+
+    // --max-lines keeps the Nth line; --stop-after-block keeps the closing fence.
+    const char* newline;
+    while (cut == STOP_NONE && (newline = memchr(text + stop->line_start, '\n', len - stop->line_start)) != NULL) {
+        size_t end = (size_t)(newline - text);
+        stop->lines++;
+        if (stop->after_block && is_code_fence(text + stop->line_start, end - stop->line_start)) {
+            if (stop->in_block) {
+                cut = end;
+                stop->reason = "end of the first code block";
+            }
+            stop->in_block = !stop->in_block;
+        }
+        if (cut == STOP_NONE && stop->max_lines > 0 && stop->lines >= stop->max_lines) {
+            cut = end;
+            stop->reason = "line limit reached";
+        }
+        stop->line_start = end + 1;
+    }
+
+#ifndef _WIN32
+    // The match itself is not kept.
+    regmatch_t match;
+    int flags = (len > 0 && text[len - 1] != '\n') ? REG_NOTEOL : 0;
+    if (stop->use_regex && regexec(&stop->regex, text + search_from, 1, &match, flags) == 0 &&
+        search_from + (size_t)match.rm_so < cut) {
+        cut = search_from + (size_t)match.rm_so;
+        stop->reason = "stop pattern matched";
+    }
+#endif
+
+    if (cut != STOP_NONE) stop->triggered = true;
+    return cut;
+}
+
+/**
+ * @brief Measures how much of a continuation's first chunk repeats the received text.
+ * @details Returns the length of the longest prefix of `chunk` that is also a
+ *          suffix of `received`, if it is at least STREAM_OVERLAP_MIN bytes;
+ *          shorter matches are too likely to be coincidence.
+ */
+static size_t stream_overlap(const char* received, size_t received_len, const char* chunk, size_t chunk_len) {
+    size_t max = received_len < chunk_len ? received_len : chunk_len;
+    for (size_t len = max; len >= STREAM_OVERLAP_MIN; len--) {
+        if (memcmp(received + received_len - len, chunk, len) == 0) return len;
+    }
+    return 0;
+}
 
 /**
  * @brief Parses a single line from the API's streaming response.
  * @details This function is designed to handle a Server-Sent Event (SSE)
  *          line from the Gemini API. It looks for lines starting with "data: ",
  *          parses the following JSON, extracts the text content, prints it to
- *          stdout, and appends it to the full response buffer.
+ *          stdout, and appends it to the full response buffer. Function calls
+ *          are collected in `mem->function_calls` for the caller to run.
  * @param line The null-terminated string containing the line to process.
  * @param mem A pointer to the MemoryStruct which holds the buffer for the
  *            complete model response. The `full_response` field will be updated.
@@ -169,6 +573,12 @@ static void process_line(char* line, MemoryStruct* mem) {
     cJSON* json_root = cJSON_Parse(line + 6);
     if (!json_root) return;
 
+    // Token counts arrive with the chunks; the last one carries the totals.
+    cJSON* usage_metadata = cJSON_GetObjectItem(json_root, "usageMetadata");
+    if (mem->usage && cJSON_IsObject(usage_metadata)) {
+        usage_read_metadata(mem->usage, usage_metadata);
+    }
+
     cJSON* candidates = cJSON_GetObjectItem(json_root, "candidates");
     if (!cJSON_IsArray(candidates)) {
         cJSON_Delete(json_root);
@@ -180,6 +590,10 @@ static void process_line(char* line, MemoryStruct* mem) {
         cJSON_Delete(json_root);
         return;
     }
+    // Only the last chunk of a complete stream names a finish reason.
+    if (cJSON_IsString(cJSON_GetObjectItem(candidate, "finishReason"))) {
+        mem->finished = true;
+    }
 
     cJSON* content = cJSON_GetObjectItem(candidate, "content");
     if (!content) {
@@ -193,35 +607,71 @@ static void process_line(char* line, MemoryStruct* mem) {
         return;
     }
 
-    cJSON* part = cJSON_GetArrayItem(parts, 0);
-    if (!part) {
-        cJSON_Delete(json_root);
-        return;
-    }
-
-    cJSON* text = cJSON_GetObjectItem(part, "text");
-    if (cJSON_IsString(text) && text->valuestring) {
-        // Print the incoming text chunk to the user in real-time.
-        printf("%s", text->valuestring);
-        fflush(stdout);
+    // A chunk usually holds one text part. Calls to local functions arrive as
+    // functionCall parts, several at once if the model wants them in parallel.
+    cJSON* part;
+    cJSON_ArrayForEach(part, parts) {
+        if (cJSON_GetObjectItem(part, "functionCall")) {
+            if (mem->function_calls) cJSON_AddItemToArray(mem->function_calls, cJSON_Duplicate(part, true));
+            continue;
+        }
+        if (mem->stop && mem->stop->triggered) break;
+
+        cJSON* text = cJSON_GetObjectItem(part, "text");
+        if (cJSON_IsString(text) && text->valuestring) {
+            const char* chunk_text = text->valuestring;
+            size_t text_len = strlen(chunk_text);
+
+            // A continuation may restate the end of what was already received.
+            if (mem->resuming) {
+                size_t overlap = stream_overlap(mem->full_response, mem->full_response_size, chunk_text, text_len);
+                chunk_text += overlap;
+                text_len -= overlap;
+                mem->resuming = false;
+            }
 
-        // Append the chunk to the complete response buffer.
-        size_t text_len = strlen(text->valuestring);
-        char* new_full_response = realloc(mem->full_response, mem->full_response_size + text_len + 1);
+            // Append the chunk to the complete response buffer.
+            size_t shown = mem->full_response_size;
+            char* new_full_response = mem_realloc(MEM_CURL, mem->full_response, mem->full_response_size + text_len + 1);
+
+            if (new_full_response) {
+                mem->full_response = new_full_response;
+                memcpy(mem->full_response + mem->full_response_size, chunk_text, text_len);
+                mem->full_response_size += text_len;
+                mem->full_response[mem->full_response_size] = '\0';
+
+                // A stop condition cuts the answer short; nothing past the cut is shown or kept.
+                size_t cut = stop_conditions_check(mem->stop, mem->full_response, mem->full_response_size);
+                if (cut < mem->full_response_size) {
+                    mem->full_response_size = cut;
+                    mem->full_response[cut] = '\0';
+                }
 
-        if (new_full_response) {
-            mem->full_response = new_full_response;
-            memcpy(mem->full_response + mem->full_response_size, text->valuestring, text_len);
-            mem->full_response_size += text_len;
-            mem->full_response[mem->full_response_size] = '\0';
-        } else {
-            fprintf(stderr, "\nError: realloc failed while building full response.\n");
+                // Structured output is only shown once the whole document has been validated.
+                if (mem->schema) {
+                    json_validator_feed(mem->schema, chunk_text, text_len);
+                }
+                // Print the incoming text chunk to the user in real-time.
+                else if (mem->full_response_size > shown) {
+                    fwrite(mem->full_response + shown, 1, mem->full_response_size - shown, stdout);
+                    fflush(stdout);
+                }
+            } else {
+                printf("%s", chunk_text);
+                fflush(stdout);
+                fprintf(stderr, "\nError: realloc failed while building full response.\n");
+            }
         }
     }
 
     cJSON_Delete(json_root);
 }
 
+// True once the rest of the response is not wanted.
+static bool stream_should_abort(const MemoryStruct* mem) {
+    return (mem->stop && mem->stop->triggered) || (mem->schema && json_validator_failed(mem->schema));
+}
+
 /**
  * @brief A libcurl write callback function for handling streaming API data.
  * @details This function is called by libcurl whenever new data is received from
@@ -242,7 +692,7 @@ static size_t write_memory_callback(void* contents, size_t size, size_t nmemb, v
     MemoryStruct* mem = (MemoryStruct*)userp;
 
     // Expand the buffer to hold the new data.
-    char* ptr = realloc(mem->buffer, mem->size + realsize + 1);
+    char* ptr = mem_realloc(MEM_CURL, mem->buffer, mem->size + realsize + 1);
     if (!ptr) {
         fprintf(stderr, "Error: realloc failed in stream callback.\n");
         return 0; // Returning 0 signals an error to libcurl.
@@ -256,7 +706,7 @@ static size_t write_memory_callback(void* contents, size_t size, size_t nmemb, v
 
     // Process the buffer line by line, as SSE sends data in chunks separated by newlines.
     char* line_end;
-    while ((line_end = strchr(mem->buffer, '\n')) != NULL) {
+    while (!stream_should_abort(mem) && (line_end = strchr(mem->buffer, '\n')) != NULL) {
         // Temporarily terminate the line at the newline character to treat it as a single string.
         *line_end = '\0';
 
@@ -273,6 +723,11 @@ static size_t write_memory_callback(void* contents, size_t size, size_t nmemb, v
         mem->buffer[mem->size] = '\0';
     }
 
+    // Once a stop condition has matched or the output broke the schema, abort
+    // the transfer so generation stops.
+    if (stream_should_abort(mem)) {
+        return 0;
+    }
     return realsize;
 }
 
@@ -324,6 +779,10 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
     char initial_prompt_buffer[16384] = {0};
     size_t initial_prompt_len = 0;
 
+    // In watch mode, file arguments are re-read on every change instead of attached once.
+    char** watch_paths = malloc(sizeof(char*) * argc);
+    int num_watch_paths = 0;
+
     // Process all remaining arguments. They can be file paths to attach,
     // .json history files to load, or plain text to form an initial prompt.
     for (int i = first_arg_index; i < argc; i++) {
@@ -336,10 +795,16 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
         // Try to open the argument as a file to attach it.
         FILE* file_arg = fopen(argv[i], "rb");
         if (file_arg) {
-            struct stat st;
+            struct stat st = { 0 };
             // Check if it's a regular file.
             if (fstat(fileno(file_arg), &st) == 0 && S_ISREG(st.st_mode)) {
-                handle_attachment_from_stream(file_arg, argv[i], get_mime_type(argv[i]), &state);
+                if (state.watch_mode && watch_paths) {
+                    watch_paths[num_watch_paths++] = argv[i];
+                } else {
+                    handle_attachment_from_stream(file_arg, argv[i], get_mime_type(argv[i]), &state);
+                }
+            } else if (state.attach_view != SOURCE_VIEW_NONE && S_ISDIR(st.st_mode)) {
+                attach_source_tree(&state, argv[i], state.attach_view);
             } else {
                 // If it's not a regular file (e.g., a directory), treat it as prompt text.
                 size_t arg_len = strlen(argv[i]);
@@ -440,6 +905,17 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
         }
     }
 
+    // The key-free endpoint has no structured output.
+    if (state.response_schema && state.free_mode) {
+        fprintf(stderr, "Error: --schema requires the official API (--api and an API key).\n");
+        exit(1);
+    }
+    // A stop condition cuts the document short, so it could never be validated.
+    if (state.response_schema && (state.stop.use_regex || state.stop.after_block || state.stop.max_lines > 0)) {
+        fprintf(stderr, "Error: --schema cannot be combined with --stop-regex, --max-lines or --stop-after-block.\n");
+        exit(1);
+    }
+
     // Print a startup banner with session settings in interactive mode.
     if (interactive) {
         if (state.free_mode) {
@@ -449,8 +925,8 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
             if (state.max_output_tokens > 0) fprintf(stderr,"Max Output Tokens: %d\n", state.max_output_tokens);
             if (state.thinking_budget > 0) fprintf(stderr,"Thinking Budget: %d tokens\n", state.thinking_budget);
             else fprintf(stderr,"Thinking Budget: automatic\n");
-            fprintf(stderr,"Google grounding: %s\n", state.google_grounding?"ON":"OFF");
-            fprintf(stderr,"URL Context: %s\n", state.url_context?"ON":"OFF");
+            fprintf(stderr,"Google grounding: %s\n", tool_mode_name(state.google_grounding));
+            fprintf(stderr,"URL Context: %s\n", tool_mode_name(state.url_context));
 
             if (key_from_env) fprintf(stderr,"API Key loaded from environment variable.\n");
             else if (state.api_key[0] != '\0') fprintf(stderr,"API Key loaded from configuration file.\n");
@@ -461,9 +937,18 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
         fprintf(stderr, "--- Session: %s\n\n", state.current_session_name);
     }
 
+    // Measure the configured routes to the API while the session runs.
+    start_route_prober(&state);
+
+    // In watch mode the prompt is re-run on every file change until interrupted.
+    if (state.watch_mode) {
+        run_watch_mode(&state, watch_paths, num_watch_paths, initial_prompt_buffer, interactive);
+    }
+    free(watch_paths);
+
     // --- 6. Initial Prompt Execution ---
     // If a prompt was constructed from command-line args, send it to the API immediately.
-    if (initial_prompt_len > 0) {
+    if (initial_prompt_len > 0 && !state.watch_mode) {
         if (interactive) fprintf(stderr, "Initial prompt provided. Sending request...\n");
 
         int total_parts = state.num_attached_parts + 1;
@@ -493,11 +978,15 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
 
             if (state.free_mode) {
                 // Handle initial prompt in free mode
+                if (state.samples > 1) {
+                    fprintf(stderr, "Warning: --samples needs the official API; sending the prompt once.\n");
+                }
                 if(state.last_free_response_part) {
                     free(state.last_free_response_part);
                     state.last_free_response_part = NULL;
                 }
                 bool success = send_free_api_request(&state, initial_prompt_buffer);
+                settle_attachment_revisions(&state, success);
                 
                 // End AI response formatting
                 if (interactive) {
@@ -517,10 +1006,20 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                         free_content(&state.history.contents[state.history.num_contents]);
                     }
                 }
+            } else if (state.samples > 1) {
+                // The samples are alternatives; none of them continues the conversation.
+                generate_samples(&state, state.samples);
+                settle_attachment_revisions(&state, false);
+                if (state.history.num_contents > 0) {
+                    state.history.num_contents--;
+                    free_content(&state.history.contents[state.history.num_contents]);
+                }
             } else {
                 // Original logic for the official API
                 char* model_response_text = NULL;
-                if (send_api_request(&state, &model_response_text)) {
+                bool answered = send_api_request(&state, &model_response_text);
+                settle_attachment_revisions(&state, answered);
+                if (answered) {
                     if (interactive) printf("\n\n");
                     if (state.last_model_response) free(state.last_model_response);
                     state.last_model_response = model_response_text;
@@ -547,7 +1046,7 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
         linenoiseHistoryLoad(history_path);
     #endif
 
-    if (interactive) {
+    if (interactive && !state.watch_mode) {
         char* line;
 
         while (1) {
@@ -606,6 +1105,7 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                        "  /exit, /quit               - Exit the program.\n"
                        "  /clear                     - Clear history and attachments for a new chat.\n"
                        "  /stats                     - Show session statistics (tokens, model, etc.).\n"
+                       "  /mem                       - Show memory usage by category and peak RSS.\n"
                        "  /config <save|load>        - Save or load settings to the config file.\n"
                        "  /system [prompt]           - Set/show the system prompt for the conversation.\n"
                        "  /clear_system              - Remove the system prompt.\n"
@@ -614,9 +1114,14 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                        "  /temp [temperature]        - Set/show the temperature for the response.\n"
                        "  /topp [float]              - Set/show the topK for the response.\n"
                        "  /topk [integer]            - Set/show the topP for the response.\n"
-                       "  /grounding [on|off]        - Set/show Google Search grounding.\n"
-                       "  /urlcontext [on|off]       - Set/show URL context fetching.\n"
+                       "  /grounding [on|off|auto]   - Set/show Google Search grounding.\n"
+                       "  /urlcontext [on|off|auto]  - Set/show URL context fetching.\n"
+                       "  /compactlogs [on|off]      - Set/show compaction of piped and attached logs.\n"
+                       "  /pdftext [on|off]          - Set/show sending text-based PDFs as extracted text.\n"
                        "  /attach <file> [prompt]    - Attach a file. Optionally add prompt on same line.\n"
+                       "  /attach --outline <path>   - Attach declarations only, of a source file or a whole directory.\n"
+                       "  /attach --minify <path>    - Attach source without comments and redundant whitespace.\n"
+                       "  /attach --table <csv> [where <conditions>] - Attach a CSV/TSV profile, optionally of matching rows.\n"
                        "  /paste                     - Paste text from stdin as an attachment.\n"
                        "  /savelast <file.txt>       - Save the last model response to a text file.\n"
                        "  /save <file.json>          - (Export) Save history to a specific file path.\n"
@@ -699,12 +1204,15 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                         save_configuration(&state);
                     } else if (strcmp(sub_command, "load") == 0) {
                         load_configuration(&state);
+                        start_route_prober(&state);
                         fprintf(stderr, "Configuration reloaded from file.\n");
                     } else {
                         fprintf(stderr, "Usage: /config <save|load>\n");
                     }
                 } else if (strcmp(command_buffer, "/models") == 0) {
                     list_available_models(&state);
+                } else if (strcmp(command_buffer, "/mem") == 0) {
+                    print_memory_report();
                 } else if (strcmp(command_buffer, "/stats") == 0) {
                     fprintf(stderr,"--- Session Stats ---\n");
                     fprintf(stderr,"Model: %s\n", state.model_name);
@@ -713,6 +1221,14 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                     fprintf(stderr,"System Prompt: %s\n", state.system_prompt ? state.system_prompt : "Not set");
                     fprintf(stderr,"Messages in history: %d\n", state.history.num_contents);
                     fprintf(stderr,"Pending attachments: %d\n", state.num_attached_parts);
+                    size_t history_expanded, history_stored;
+                    int cold_parts;
+                    history_memory_usage(&state.history, &history_expanded, &history_stored, &cold_parts);
+                    fprintf(stderr,"History memory: %zu bytes held for %zu bytes of content (%d parts compressed, turns older than %d)\n",
+                            history_stored, history_expanded, cold_parts, state.history.cold_after);
+                    print_compression_stats(&state);
+                    print_transport_stats(&state);
+                    print_route_stats(&state);
 
                     if (state.history.num_contents == 0 && state.num_attached_parts == 0) {
                         fprintf(stderr,"---------------------\n");
@@ -840,27 +1356,43 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                     }
                 } else if (strcmp(command_buffer, "/grounding") == 0) {
                     if (*arg_start == '\0') {
-                        fprintf(stderr, "Google grounding is %s.\n", state.google_grounding ? "ON" : "OFF");
+                        fprintf(stderr, "Google grounding is %s.\n", tool_mode_name(state.google_grounding));
+                    } else if (parse_tool_mode(arg_start, &state.google_grounding)) {
+                        fprintf(stderr, "Google grounding turned %s.\n", tool_mode_name(state.google_grounding));
+                    } else {
+                        fprintf(stderr, "Usage: /grounding [on|off|auto]\n");
+                    }
+                } else if (strcmp(command_buffer, "/urlcontext") == 0) {
+                    if (*arg_start == '\0') {
+                        fprintf(stderr, "URL context is %s.\n", tool_mode_name(state.url_context));
+                    } else if (parse_tool_mode(arg_start, &state.url_context)) {
+                        fprintf(stderr, "URL context turned %s.\n", tool_mode_name(state.url_context));
+                    } else {
+                        fprintf(stderr, "Usage: /urlcontext [on|off|auto]\n");
+                    }
+                } else if (strcmp(command_buffer, "/compactlogs") == 0) {
+                    if (*arg_start == '\0') {
+                        fprintf(stderr, "Log compaction is %s.\n", state.compact_logs ? "ON" : "OFF");
                     } else if (STRCASECMP(arg_start, "on") == 0) {
-                        state.google_grounding = true;
-                        fprintf(stderr, "Google grounding turned ON.\n");
+                        state.compact_logs = true;
+                        fprintf(stderr, "Log compaction turned ON.\n");
                     } else if (STRCASECMP(arg_start, "off") == 0) {
-                        state.google_grounding = false;
-                        fprintf(stderr, "Google grounding turned OFF.\n");
+                        state.compact_logs = false;
+                        fprintf(stderr, "Log compaction turned OFF.\n");
                     } else {
-                        fprintf(stderr, "Usage: /grounding [on|off]\n");
+                        fprintf(stderr, "Usage: /compactlogs [on|off]\n");
                     }
-                } else if (strcmp(command_buffer, "/urlcontext") == 0) {
+                } else if (strcmp(command_buffer, "/pdftext") == 0) {
                     if (*arg_start == '\0') {
-                        fprintf(stderr, "URL context is %s.\n", state.url_context ? "ON" : "OFF");
+                        fprintf(stderr, "PDF text extraction is %s.\n", state.pdf_text ? "ON" : "OFF");
                     } else if (STRCASECMP(arg_start, "on") == 0) {
-                        state.url_context = true;
-                        fprintf(stderr, "URL context turned ON.\n");
+                        state.pdf_text = true;
+                        fprintf(stderr, "PDF text extraction turned ON.\n");
                     } else if (STRCASECMP(arg_start, "off") == 0) {
-                        state.url_context = false;
-                        fprintf(stderr, "URL context turned OFF.\n");
+                        state.pdf_text = false;
+                        fprintf(stderr, "PDF text extraction turned OFF.\n");
                     } else {
-                        fprintf(stderr, "Usage: /urlcontext [on|off]\n");
+                        fprintf(stderr, "Usage: /pdftext [on|off]\n");
                     }
                 } else if (strcmp(command_buffer, "/save") == 0) {
                     if (!is_path_safe(arg_start)) {
@@ -892,10 +1424,44 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                         fprintf(stderr,"No last response to save.\n");
                     }
                 } else if (strcmp(command_buffer, "/attach") == 0) {
+                    SourceViewMode view = state.attach_view;
+                    bool table = state.attach_table;
+                    const char* where = state.table_where;
+                    if (strncmp(arg_start, "--outline ", 10) == 0 || strncmp(arg_start, "--minify ", 9) == 0) {
+                        view = arg_start[2] == 'o' ? SOURCE_VIEW_OUTLINE : SOURCE_VIEW_MINIFY;
+                        arg_start += view == SOURCE_VIEW_OUTLINE ? 10 : 9;
+                        while (*arg_start == ' ') arg_start++;
+                    } else if (strncmp(arg_start, "--table ", 8) == 0) {
+                        table = true;
+                        arg_start += 8;
+                        while (*arg_start == ' ') arg_start++;
+                        char* clause = strstr(arg_start, " where ");
+                        if (clause) {
+                            *clause = '\0';
+                            where = clause + 7;
+                        }
+                    }
+                    struct stat st;
                     if (*arg_start == '\0') {
-                        fprintf(stderr,"Usage: /attach <filename>\n");
+                        fprintf(stderr,"Usage: /attach [--outline|--minify] <filename|directory>\n"
+                                       "       /attach --table <file.csv> [where <conditions>]\n");
+                    } else if (view != SOURCE_VIEW_NONE && stat(arg_start, &st) == 0 && S_ISDIR(st.st_mode)) {
+                        if (!is_path_safe(arg_start)) {
+                            fprintf(stderr, "Error: Unsafe or absolute file path specified: %s\n", arg_start);
+                        } else {
+                            attach_source_tree(&state, arg_start, view);
+                        }
                     } else {
+                        SourceViewMode saved_view = state.attach_view;
+                        bool saved_table = state.attach_table;
+                        const char* saved_where = state.table_where;
+                        state.attach_view = view;
+                        state.attach_table = table;
+                        state.table_where = where;
                         handle_attachment_from_stream(NULL, arg_start, get_mime_type(arg_start), &state);
+                        state.attach_view = saved_view;
+                        state.attach_table = saved_table;
+                        state.table_where = saved_where;
                     }
                 } else if (strcmp(command_buffer, "/attachments") == 0) {
                     char sub_command[64] = {0};
@@ -924,9 +1490,7 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                                 fprintf(stderr,"Error: Invalid attachment index.\n");
                             } else {
                                 fprintf(stderr,"Removing attachment: %s\n", state.attached_parts[index_to_remove].filename);
-                                free(state.attached_parts[index_to_remove].filename);
-                                free(state.attached_parts[index_to_remove].mime_type);
-                                free(state.attached_parts[index_to_remove].base64_data);
+                                release_part(MEM_ATTACHMENTS, &state.attached_parts[index_to_remove]);
 
                                 if (index_to_remove < state.num_attached_parts - 1) {
                                     memmove(&state.attached_parts[index_to_remove],
@@ -991,10 +1555,7 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                                     } else {
                                         fprintf(stderr,"Removing attachment [%d:%d]: %s\n", msg_idx, part_idx, part_to_remove->filename ? part_to_remove->filename : "Pasted Data");
 
-                                        if (part_to_remove->filename) free(part_to_remove->filename);
-                                        if (part_to_remove->mime_type) free(part_to_remove->mime_type);
-                                        if (part_to_remove->base64_data) free(part_to_remove->base64_data);
-                                        if (part_to_remove->text) free(part_to_remove->text);
+                                        release_part(MEM_HISTORY, part_to_remove);
 
                                         if (part_idx < content->num_parts - 1) {
                                             memmove(&content->parts[part_idx], &content->parts[part_idx + 1], (content->num_parts - part_idx - 1) * sizeof(Part));
@@ -1053,8 +1614,12 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
 
                 size_t history_len = 0;
                 for (int i = 0; i < state.history.num_contents; i++) {
-                    if (state.history.contents[i].num_parts > 0 && state.history.contents[i].parts[0].text) {
-                        history_len += strlen(state.history.contents[i].parts[0].text);
+                    const Part* first = &state.history.contents[i].parts[0];
+                    if (state.history.contents[i].num_parts > 0 && first->type == PART_TYPE_TEXT) {
+                        char* scratch = NULL;
+                        const char* text = part_payload(first, &scratch);
+                        if (text) history_len += strlen(text);
+                        free(scratch);
                     }
                 }
 
@@ -1084,6 +1649,7 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                     state.last_free_response_part = NULL;
                 }
                 bool success = send_free_api_request(&state, current_turn_prompt);
+                settle_attachment_revisions(&state, success);
                 printf("\n\n");
                 if (success) {
                     Part user_part = { .type = PART_TYPE_TEXT, .text = current_turn_prompt };
@@ -1121,7 +1687,9 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
                 free(current_turn_parts);
 
                 char* model_response_text = NULL;
-                if (send_api_request(&state, &model_response_text)) {
+                bool answered = send_api_request(&state, &model_response_text);
+                settle_attachment_revisions(&state, answered);
+                if (answered) {
                     printf("\n\n");
                     if (state.last_model_response) free(state.last_model_response);
                     state.last_model_response = model_response_text;
@@ -1149,6 +1717,8 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
         }
     }
 
+    if (state.mem_report) print_memory_report();
+
     // --- 8. Cleanup ---
     // Free all dynamically allocated memory before exiting.
     if(state.last_model_response) free(state.last_model_response);
@@ -1157,12 +1727,489 @@ void generate_session(int argc, char* argv[], bool interactive, bool is_stdin_a_
     if(state.final_code) free(state.final_code);
     free_history(&state.history);
     free_pending_attachments(&state);
+    free_attachment_records(&state);
+    stop_conditions_free(&state.stop);
+    json_validator_free(state.schema_validator);
+    cJSON_Delete(state.response_schema);
+    cJSON_Delete(state.functions);
+    route_table_free(state.routes);
+    if (state.transport.multi) curl_multi_cleanup(state.transport.multi);
 
     if (interactive) fprintf(stderr,"\nExiting session.\n");
 }
 
+// --- Watch Mode ---
+
+#ifdef __linux__
+/**
+ * @brief Drains pending inotify events and marks the watched files they touch.
+ * @details Files are watched through their parent directory so that editors
+ *          which save by writing a new file and renaming it over the old one
+ *          are still detected. Events for unrelated files in the same
+ *          directory are ignored.
+ * @param ctx The active watch context.
+ * @param timeout_ms How long to wait for an event (-1 blocks, 0 only peeks).
+ * @return 1 if at least one watched file changed during this call, 0 if not,
+ *         and -1 if the inotify descriptor was closed or failed.
+ */
+static int watch_read_events(WatchContext* ctx, int timeout_ms) {
+    struct pollfd pfd = { .fd = ctx->fd, .events = POLLIN };
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready < 0) return errno == EINTR ? 0 : -1;
+    if (ready == 0) return 0;
+    if (pfd.revents & (POLLNVAL | POLLERR)) return -1;
+
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len = read(ctx->fd, buffer, sizeof(buffer));
+    if (len < 0 && errno != EAGAIN && errno != EINTR) return -1;
+    bool relevant = false;
+
+    for (char* ptr = buffer; len > 0 && ptr < buffer + len; ) {
+        const struct inotify_event* event = (const struct inotify_event*)ptr;
+        for (int i = 0; event->len > 0 && i < ctx->num_files; i++) {
+            if (event->wd == ctx->files[i].wd && strcmp(event->name, ctx->files[i].base) == 0) {
+                ctx->files[i].dirty = true;
+                relevant = true;
+            }
+        }
+        ptr += sizeof(struct inotify_event) + event->len;
+    }
+
+    if (relevant) ctx->change_pending = true;
+    return relevant ? 1 : 0;
+}
+
+/**
+ * @brief cURL transfer-info callback that aborts requests for stale input.
+ * @details Peeks at the inotify queue without blocking. If a watched file was
+ *          rewritten while the reply is still streaming, the reply is for
+ *          content that no longer exists, so the transfer is aborted and the
+ *          watch loop re-issues the request for the new version.
+ * @return Non-zero to make libcurl abort the transfer, zero to continue.
+ */
+static int watch_progress_callback(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    (void)dltotal; (void)dlnow; (void)ultotal; (void)ulnow;
+    AppState* state = (AppState*)clientp;
+
+    watch_read_events(state->watch, 0);
+    if (state->watch->change_pending) {
+        state->request_cancelled = true;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Reads an entire file into a newly allocated, null-terminated buffer.
+ * @param path The file to read.
+ * @return The file content, or NULL on failure. The caller must free it.
+ */
+static char* watch_read_file(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return NULL;
+
+    size_t capacity = 4096, size = 0, n;
+    char* content = malloc(capacity);
+    while (content && (n = fread(content + size, 1, capacity - size - 1, file)) > 0) {
+        size += n;
+        if (capacity - size - 1 == 0) {
+            char* grown = realloc(content, capacity * 2);
+            if (!grown) { free(content); content = NULL; break; }
+            content = grown;
+            capacity *= 2;
+        }
+    }
+    fclose(file);
+    if (content) content[size] = '\0';
+    return content;
+}
+
+/**
+ * @brief Sends one watch-mode turn and records it in the history.
+ * @details Mirrors the interactive prompt handling: pending attachments are
+ *          combined with the prompt text, and the user turn is only kept in the
+ *          history if the model replied.
+ * @param state The application state.
+ * @param prompt The text for this turn.
+ * @param interactive Whether to print the compact AI header.
+ * @return true if the model replied, false on error or cancellation.
+ */
+static bool watch_send_turn(AppState* state, const char* prompt, bool interactive) {
+    bool success = false;
+
+    if (interactive) {
+        printf("\033[1;36m◆  AI\033[0m\n");
+        printf("└  ");
+        fflush(stdout);
+    }
+
+    if (state->free_mode) {
+        size_t turn_len = strlen(prompt) + 1;
+        for (int i = 0; i < state->num_attached_parts; i++) {
+            if (state->attached_parts[i].text) turn_len += strlen(state->attached_parts[i].text);
+        }
+        char* turn_prompt = malloc(turn_len);
+        if (!turn_prompt) {
+            fprintf(stderr, "Error: Failed to allocate memory for prompt.\n");
+            free_pending_attachments(state);
+            return false;
+        }
+        turn_prompt[0] = '\0';
+        for (int i = 0; i < state->num_attached_parts; i++) {
+            if (state->attached_parts[i].text) strcat(turn_prompt, state->attached_parts[i].text);
+        }
+        free_pending_attachments(state);
+        strcat(turn_prompt, prompt);
+
+        if (state->last_free_response_part) {
+            free(state->last_free_response_part);
+            state->last_free_response_part = NULL;
+        }
+        success = send_free_api_request(state, turn_prompt);
+        settle_attachment_revisions(state, success);
+        if (success) {
+            Part user_part = { .type = PART_TYPE_TEXT, .text = turn_prompt };
+            add_content_to_history(&state->history, "user", &user_part, 1);
+            if (state->last_free_response_part) {
+                Part model_part = { .type = PART_TYPE_TEXT, .text = state->last_free_response_part };
+                add_content_to_history(&state->history, "model", &model_part, 1);
+            }
+        }
+        free(turn_prompt);
+    } else {
+        int total_parts = state->num_attached_parts + 1;
+        Part* parts = malloc(sizeof(Part) * total_parts);
+        if (!parts) {
+            fprintf(stderr, "Error: Failed to allocate memory for current turn parts.\n");
+            free_pending_attachments(state);
+            return false;
+        }
+        for (int i = 0; i < state->num_attached_parts; i++) parts[i] = state->attached_parts[i];
+        parts[state->num_attached_parts] = (Part){ .type = PART_TYPE_TEXT, .text = (char*)prompt };
+        add_content_to_history(&state->history, "user", parts, total_parts);
+        free_pending_attachments(state);
+        free(parts);
+
+        char* model_response_text = NULL;
+        success = send_api_request(state, &model_response_text);
+        settle_attachment_revisions(state, success);
+        if (success) {
+            if (state->last_model_response) free(state->last_model_response);
+            state->last_model_response = model_response_text;
+            Part model_part = { .type = PART_TYPE_TEXT, .text = strdup(state->last_model_response) };
+            add_content_to_history(&state->history, "model", &model_part, 1);
+            free(model_part.text);
+        } else if (state->history.num_contents > 0) {
+            state->history.num_contents--;
+            free_content(&state->history.contents[state->history.num_contents]);
+        }
+    }
+
+    printf("\n\n");
+    fflush(stdout);
+    return success;
+}
+#endif
+
+/**
+ * @brief Enables stale-request cancellation on a transfer when watching files.
+ * @details Resets the cancellation flag for the new attempt and, when a watch is
+ *          active, has the transport call `watch_progress_callback` so that the
+ *          transfer is aborted as soon as one of the watched files is rewritten.
+ * @param transfer The transfer about to be performed.
+ * @param state The application state; nothing is installed unless a watch is active.
+ */
+static void watch_install_progress(HttpTransfer* transfer, AppState* state) {
+    state->request_cancelled = false;
+#ifdef __linux__
+    if (!state->watch) return;
+    transfer->progress = watch_progress_callback;
+    transfer->progress_data = state;
+#else
+    (void)transfer;
+#endif
+}
+
+/**
+ * @brief Re-runs a prompt every time one of the given files changes.
+ * @details The files are attached and the prompt is sent once up front. The
+ *          loop then blocks on inotify, waits until writes have been quiet for
+ *          WATCH_DEBOUNCE_MS, and sends the prompt again. A request that is
+ *          still streaming when a file changes is cancelled. By default each
+ *          run replaces the previous one in the history and carries the full
+ *          files; with --watch-diff, follow-up runs instead append a turn with
+ *          a unified diff against the version the model last answered for,
+ *          falling back to the full files when the diff would not be smaller.
+ *          Runs until interrupted.
+ * @param state The application state.
+ * @param paths The files to watch and attach.
+ * @param num_paths The number of files.
+ * @param prompt The prompt to send on every run.
+ * @param interactive Whether to print the compact AI header for each run.
+ */
+void run_watch_mode(AppState* state, char** paths, int num_paths, const char* prompt, bool interactive) {
+#ifdef __linux__
+    if (num_paths == 0 || prompt[0] == '\0') {
+        fprintf(stderr, "Error: --watch requires at least one file and a prompt.\n");
+        return;
+    }
+
+    WatchContext ctx = { .fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK), .num_files = 0 };
+    if (ctx.fd < 0) {
+        perror("Error initializing inotify");
+        return;
+    }
+    ctx.files = calloc(num_paths, sizeof(WatchedFile));
+    if (!ctx.files) {
+        fprintf(stderr, "Error: Failed to allocate memory for watch list.\n");
+        close(ctx.fd);
+        return;
+    }
+
+    for (int i = 0; i < num_paths; i++) {
+        WatchedFile* file = &ctx.files[ctx.num_files];
+        const char* slash = strrchr(paths[i], '/');
+        char dir[PATH_MAX];
+        if (slash) {
+            snprintf(dir, sizeof(dir), "%.*s", (int)(slash - paths[i] + (slash == paths[i])), paths[i]);
+        } else {
+            strcpy(dir, ".");
+        }
+        file->wd = inotify_add_watch(ctx.fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (file->wd < 0) {
+            fprintf(stderr, "Error: Cannot watch '%s': %s\n", paths[i], strerror(errno));
+            continue;
+        }
+        file->path = paths[i];
+        file->base = (char*)(slash ? slash + 1 : paths[i]);
+        ctx.num_files++;
+    }
+    if (ctx.num_files == 0) goto cleanup;
+
+    state->watch = &ctx;
+    int base_history = state->history.num_contents;
+    bool first_run = true;
+
+    fprintf(stderr, "Watching %d file(s). Press Ctrl+C to stop.\n", ctx.num_files);
+
+    while (1) {
+        // Clear the change markers before reading, so that writes racing with
+        // this run are picked up as a new change rather than lost.
+        ctx.change_pending = false;
+        bool changed = first_run;
+        bool acknowledged = !first_run;
+        size_t total_size = 0;
+        for (int i = 0; i < ctx.num_files; i++) {
+            WatchedFile* file = &ctx.files[i];
+            file->dirty = false;
+            free(file->pending);
+            file->pending = watch_read_file(file->path);
+            if (!file->pending) file->pending = strdup("");
+            total_size += strlen(file->pending);
+            if (!file->snapshot) acknowledged = false;
+            if (!file->snapshot || strcmp(file->snapshot, file->pending) != 0) changed = true;
+        }
+
+        if (changed && !first_run) {
+            fprintf(stderr, "\033[1;36m◇  Changed:\033[0m");
+            for (int i = 0; i < ctx.num_files; i++) {
+                const char* snapshot = ctx.files[i].snapshot;
+                if (!snapshot || strcmp(snapshot, ctx.files[i].pending) != 0) fprintf(stderr, " %s", ctx.files[i].path);
+            }
+            fprintf(stderr, "\n");
+        }
+
+        if (changed) {
+            MemoryStruct diff = { .buffer = NULL, .size = 0 };
+            bool use_diff = state->watch_send_diff && acknowledged;
+            for (int i = 0; use_diff && i < ctx.num_files; i++) {
+                WatchedFile* file = &ctx.files[i];
+                if (strcmp(file->snapshot, file->pending) != 0) {
+                    use_diff = append_unified_diff(&diff, file->path, file->snapshot, file->pending);
+                }
+            }
+            // A diff bigger than the files themselves saves nothing.
+            if (use_diff && diff.size >= total_size) use_diff = false;
+
+            bool success;
+            if (use_diff) {
+                const char* intro = "The watched files changed. Unified diff against the version you last saw:\n\n```diff\n";
+                size_t turn_len = strlen(intro) + diff.size + strlen(prompt) + 16;
+                char* turn_prompt = malloc(turn_len);
+                success = false;
+                if (turn_prompt) {
+                    snprintf(turn_prompt, turn_len, "%s%s```\n\n%s", intro, diff.buffer, prompt);
+                    success = watch_send_turn(state, turn_prompt, interactive);
+                    free(turn_prompt);
+                }
+            } else {
+                // Replace the previous run with a fresh request carrying the full files.
+                while (state->history.num_contents > base_history) {
+                    state->history.num_contents--;
+                    free_content(&state->history.contents[state->history.num_contents]);
+                }
+                for (int i = 0; i < ctx.num_files; i++) {
+                    FILE* stream = fopen(ctx.files[i].path, "rb");
+                    if (stream) {
+                        handle_attachment_from_stream(stream, ctx.files[i].path, get_mime_type(ctx.files[i].path), state);
+                        fclose(stream);
+                    }
+                }
+                success = watch_send_turn(state, prompt, interactive);
+            }
+            free(diff.buffer);
+
+            if (success) {
+                for (int i = 0; i < ctx.num_files; i++) {
+                    free(ctx.files[i].snapshot);
+                    ctx.files[i].snapshot = ctx.files[i].pending;
+                    ctx.files[i].pending = NULL;
+                }
+            } else if (state->request_cancelled) {
+                fprintf(stderr, "[Cancelled: input changed]\n");
+            }
+            first_run = false;
+        }
+
+        // Block until a watched file changes, then let the burst of writes settle.
+        while (!ctx.change_pending) {
+            if (watch_read_events(&ctx, -1) < 0) goto cleanup;
+        }
+        while (watch_read_events(&ctx, WATCH_DEBOUNCE_MS) > 0) {}
+    }
+
+cleanup:
+    state->watch = NULL;
+    for (int i = 0; i < ctx.num_files; i++) {
+        free(ctx.files[i].snapshot);
+        free(ctx.files[i].pending);
+    }
+    free(ctx.files);
+    close(ctx.fd);
+#else
+    (void)state; (void)paths; (void)num_paths; (void)prompt; (void)interactive;
+    fprintf(stderr, "Error: --watch requires inotify and is only available on Linux.\n");
+#endif
+}
+
+
 // --- Helper and Utility Functions ---
 
+/**
+ * @brief Returns a monotonic timestamp in seconds, for measuring durations.
+ */
+static double monotonic_seconds(void) {
+#ifdef _WIN32
+    return (double)GetTickCount64() / 1000.0;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+/**
+ * @brief Appends bytes to a growable string buffer.
+ * @return false if memory could not be allocated.
+ */
+static bool text_buffer_append(MemoryStruct* buf, const char* data, size_t len) {
+    char* grown = realloc(buf->buffer, buf->size + len + 1);
+    if (!grown) return false;
+    buf->buffer = grown;
+    memcpy(buf->buffer + buf->size, data, len);
+    buf->size += len;
+    buf->buffer[buf->size] = '\0';
+    return true;
+}
+
+typedef struct { const char* start; size_t len; } LineRef;
+
+/**
+ * @brief Splits text into lines (each including its trailing newline, if any).
+ * @return The number of lines; `*lines_out` must be freed by the caller.
+ */
+static int split_lines(const char* text, LineRef** lines_out) {
+    int count = 0, capacity = 64;
+    LineRef* lines = malloc(sizeof(LineRef) * capacity);
+    const char* p = text;
+
+    while (lines && *p) {
+        const char* nl = strchr(p, '\n');
+        size_t len = nl ? (size_t)(nl - p + 1) : strlen(p);
+        if (count == capacity) {
+            LineRef* grown = realloc(lines, sizeof(LineRef) * capacity * 2);
+            if (!grown) { free(lines); lines = NULL; count = 0; break; }
+            lines = grown;
+            capacity *= 2;
+        }
+        lines[count++] = (LineRef){ p, len };
+        p += len;
+    }
+    *lines_out = lines;
+    return count;
+}
+
+static bool lines_equal(const LineRef* a, const LineRef* b) {
+    return a->len == b->len && memcmp(a->start, b->start, a->len) == 0;
+}
+
+static bool append_diff_line(MemoryStruct* out, char marker, const LineRef* line) {
+    bool ok = text_buffer_append(out, &marker, 1) && text_buffer_append(out, line->start, line->len);
+    if (ok && (line->len == 0 || line->start[line->len - 1] != '\n')) {
+        ok = text_buffer_append(out, "\n", 1);
+    }
+    return ok;
+}
+
+/**
+ * @brief Appends a single-hunk unified diff between two versions of a file.
+ * @details The common leading and trailing lines are trimmed and everything in
+ *          between is reported as one replaced block with a few lines of
+ *          context. This is far cheaper than a minimal LCS diff and, for the
+ *          edit-and-resend cycles it is used for (watch mode, re-attached
+ *          files), produces a patch that is nearly as small.
+ * @param out The buffer receiving the diff text.
+ * @param path The file name used in the diff header.
+ * @param old_text The version the model last saw.
+ * @param new_text The current version on disk.
+ * @return false on allocation failure.
+ */
+static bool append_unified_diff(MemoryStruct* out, const char* path, const char* old_text, const char* new_text) {
+    LineRef *old_lines = NULL, *new_lines = NULL;
+    int n_old = split_lines(old_text, &old_lines);
+    int n_new = split_lines(new_text, &new_lines);
+    bool ok = (old_lines || n_old == 0) && (new_lines || n_new == 0);
+
+    int prefix = 0;
+    while (ok && prefix < n_old && prefix < n_new && lines_equal(&old_lines[prefix], &new_lines[prefix])) prefix++;
+    int suffix = 0;
+    while (ok && suffix < n_old - prefix && suffix < n_new - prefix &&
+           lines_equal(&old_lines[n_old - 1 - suffix], &new_lines[n_new - 1 - suffix])) suffix++;
+
+    int context_start = prefix > DIFF_CONTEXT_LINES ? prefix - DIFF_CONTEXT_LINES : 0;
+    int trailing = suffix < DIFF_CONTEXT_LINES ? suffix : DIFF_CONTEXT_LINES;
+    int old_end = n_old - suffix;
+    int new_end = n_new - suffix;
+
+    if (ok) {
+        char header[PATH_MAX * 2 + 128];
+        int len = snprintf(header, sizeof(header), "--- a/%s\n+++ b/%s\n@@ -%d,%d +%d,%d @@\n",
+                           path, path,
+                           context_start + 1, old_end + trailing - context_start,
+                           context_start + 1, new_end + trailing - context_start);
+        ok = text_buffer_append(out, header, (size_t)len < sizeof(header) ? (size_t)len : sizeof(header) - 1);
+    }
+    for (int i = context_start; ok && i < prefix; i++) ok = append_diff_line(out, ' ', &old_lines[i]);
+    for (int i = prefix; ok && i < old_end; i++) ok = append_diff_line(out, '-', &old_lines[i]);
+    for (int i = prefix; ok && i < new_end; i++) ok = append_diff_line(out, '+', &new_lines[i]);
+    for (int i = old_end; ok && i < old_end + trailing; i++) ok = append_diff_line(out, ' ', &old_lines[i]);
+
+    free(old_lines);
+    free(new_lines);
+    return ok;
+}
+
+
 // Helper function to remove a substring from a string.
 // Returns a new dynamically allocated string.
 static char* str_replace(const char* orig, const char* rep, const char* with) {
@@ -1302,23 +2349,32 @@ static void process_free_line(char* line, AppState* state) {
                     const char* current_text = text_item->valuestring;
                     size_t last_len = state->last_free_response_part ? strlen(state->last_free_response_part) : 0;
                     size_t current_len = strlen(current_text);
+                    bool extends = current_len >= last_len &&
+                                   strncmp(current_text, state->last_free_response_part ? state->last_free_response_part : "", last_len) == 0;
+
+                    // Each chunk carries the whole text so far. Stop conditions scan it
+                    // incrementally, from scratch if the text was rewritten.
+                    if (!extends) stop_conditions_reset(&state->stop);
+                    size_t cut = stop_conditions_check(&state->stop, current_text, current_len);
+                    if (cut < current_len) current_len = cut;
 
                     // If the new text is an extension of the old one, print the difference.
-                    if (current_len > last_len && strncmp(current_text, state->last_free_response_part ? state->last_free_response_part : "", last_len) == 0) {
+                    if (extends && current_len > last_len) {
                         const char* diff = current_text + last_len;
-                        printf("%s", diff);
+                        printf("%.*s", (int)(current_len - last_len), diff);
                         fflush(stdout);
                     }
                     // Handle cases where the stream resets or provides a shorter, corrected version.
                     else if (last_len > 0 && current_len < last_len) {
                         // Use carriage return to overwrite the previous line with the new, shorter text.
-                        printf("\r%*s\r%s", (int)last_len, "", current_text);
+                        printf("\r%*s\r%.*s", (int)last_len, "", (int)current_len, current_text);
                         fflush(stdout);
                     }
 
                     // Update the buffer with the latest full response text.
                     free(state->last_free_response_part);
                     state->last_free_response_part = strdup(current_text);
+                    if (state->last_free_response_part) state->last_free_response_part[current_len] = '\0';
                 }
             }
 
@@ -1380,7 +2436,7 @@ static size_t write_free_memory_callback(void* contents, size_t size, size_t nme
     }
 
     // Append the new, potentially stripped, data to the buffer.
-    char* ptr = realloc(mem->buffer, mem->size + realsize + 1);
+    char* ptr = mem_realloc(MEM_CURL, mem->buffer, mem->size + realsize + 1);
     if (!ptr) {
         fprintf(stderr, "Error: realloc failed in stream callback.\n");
         return 0; // Signal error to libcurl.
@@ -1400,6 +2456,8 @@ static size_t write_free_memory_callback(void* contents, size_t size, size_t nme
             process_free_line(line_start, data->state);
         }
         line_start = line_end + 1;
+        // A matched stop condition aborts the transfer; the rest is not needed.
+        if (data->state->stop.triggered) return 0;
     }
 
     // If there's a partial line left at the end of the buffer, move it
@@ -1504,32 +2562,48 @@ const char* get_system_language(void) {
  * @param current_prompt The user's latest prompt for this turn.
  * @param is_pro_model A boolean flag to select the correct structure.
  * @return A dynamically allocated, null-terminated string containing the final
- *         JSON payload. The caller is responsible for freeing this memory.
+ *         JSON payload. The caller frees it with `cJSON_free`.
  */
 char* build_free_request_payload(AppState* state, const char* current_prompt, bool is_pro_model) {
     // --- 1. Build the full conversation transcript string ---
+    // Cold turns are expanded once up front; `texts[i]` is NULL for turns without text.
+    const char** texts = calloc(state->history.num_contents + 1, sizeof(char*));
+    char** scratch = calloc(state->history.num_contents + 1, sizeof(char*));
+    if (!texts || !scratch) {
+        free(texts);
+        free(scratch);
+        return NULL;
+    }
     size_t transcript_len = 0;
     for (int i = 0; i < state->history.num_contents; i++) {
         Content* c = &state->history.contents[i];
-        if (c->num_parts > 0 && c->parts[0].text) {
-            transcript_len += strlen(c->role) + strlen(c->parts[0].text) + 5;
+        if (c->num_parts > 0 && c->parts[0].type == PART_TYPE_TEXT) {
+            texts[i] = part_payload(&c->parts[0], &scratch[i]);
+        }
+        if (texts[i]) {
+            transcript_len += strlen(c->role) + strlen(texts[i]) + 5;
         }
     }
     transcript_len += strlen("User: ") + strlen(current_prompt) + 1;
 
     char* full_transcript = malloc(transcript_len);
-    if (!full_transcript) return NULL;
-    full_transcript[0] = '\0';
-
-    for (int i = 0; i < state->history.num_contents; i++) {
-        Content* c = &state->history.contents[i];
-        if (c->num_parts > 0 && c->parts[0].text) {
-            char role_cap[32];
-            strncpy(role_cap, c->role, sizeof(role_cap) - 1);
-            role_cap[0] = toupper((unsigned char)role_cap[0]);
-            sprintf(full_transcript + strlen(full_transcript), "%s: %s\n\n", role_cap, c->parts[0].text);
+    if (full_transcript) {
+        full_transcript[0] = '\0';
+        for (int i = 0; i < state->history.num_contents; i++) {
+            Content* c = &state->history.contents[i];
+            if (texts[i]) {
+                char role_cap[32];
+                strncpy(role_cap, c->role, sizeof(role_cap) - 1);
+                role_cap[sizeof(role_cap) - 1] = '\0';
+                role_cap[0] = toupper((unsigned char)role_cap[0]);
+                sprintf(full_transcript + strlen(full_transcript), "%s: %s\n\n", role_cap, texts[i]);
+            }
         }
     }
+    for (int i = 0; i < state->history.num_contents; i++) free(scratch[i]);
+    free(scratch);
+    free(texts);
+    if (!full_transcript) return NULL;
     sprintf(full_transcript + strlen(full_transcript), "User: %s", current_prompt);
 
     // --- 2. Programmatically build the inner JSON array ---
@@ -1588,7 +2662,7 @@ char* build_free_request_payload(AppState* state, const char* current_prompt, bo
     cJSON* outer_array = cJSON_CreateArray();
     cJSON_AddItemToArray(outer_array, cJSON_CreateNull());
     cJSON_AddItemToArray(outer_array, cJSON_CreateString(inner_json_str));
-    free(inner_json_str);
+    cJSON_free(inner_json_str);
 
     char* final_json_str = cJSON_PrintUnformatted(outer_array);
     cJSON_Delete(outer_array);
@@ -1608,6 +2682,8 @@ char* build_free_request_payload(AppState* state, const char* current_prompt, bo
  * @return Returns true if the API call was successful, and false otherwise.
  */
 bool send_free_api_request(AppState* state, const char* prompt) {
+    usage_begin(state, USAGE_OP_FREE);
+
     // Determine which payload format to use.
     bool is_pro_model = (strstr(state->model_name, "pro") != NULL);
 
@@ -1643,9 +2719,10 @@ bool send_free_api_request(AppState* state, const char* prompt) {
         snprintf(post_fields, post_fields_len, "f.req=%s", escaped_payload);
         curl_free(escaped_payload);
 
-        MemoryStruct chunk = { .buffer = malloc(1), .size = 0 };
+        MemoryStruct chunk = { .buffer = mem_alloc(MEM_CURL, 1), .size = 0 };
         chunk.buffer[0] = '\0';
         FreeCallbackData callback_data = { .mem = &chunk, .state = state };
+        stop_conditions_reset(&state->stop);
 
         struct curl_slist* headers = NULL;
         headers = curl_slist_append(headers, "Content-Type: application/x-www-form-urlencoded;charset=UTF-8");
@@ -1660,21 +2737,31 @@ bool send_free_api_request(AppState* state, const char* prompt) {
         curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post_fields);
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_free_memory_callback);
         curl_easy_setopt(curl, CURLOPT_WRITEDATA, &callback_data);
+        HttpTransfer transfer = { .curl = curl };
+        watch_install_progress(&transfer, state);
+        transport_prepare(state, curl, FREE_API_URL);
 
         http_code = 0;
-        res = curl_easy_perform(curl);
+        res = transport_perform(state, &transfer);
         curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+        usage_note_transfer(&state->usage, &transfer, (res != CURLE_OK && http_code == 0) ? -(long)res : http_code);
 
         // Clean up all resources allocated for THIS specific attempt.
         free(post_fields);
-        free(chunk.buffer);
+        mem_free(MEM_CURL, chunk.buffer);
         curl_slist_free_all(headers);
         curl_easy_cleanup(curl);
 
         // --- Decision Logic for the current attempt ---
 
-        // Case 1: Success (normal completion OR purposeful abort for --loc/--map)
-        if ((res == CURLE_OK && http_code == 200) || (res == CURLE_WRITE_ERROR && state->loc_gathered)) {
+        // A watched file changed mid-request; the reply is stale, so don't retry.
+        if (state->request_cancelled) {
+            break;
+        }
+
+        // Case 1: Success (normal completion OR purposeful abort for --loc/--map or a stop condition)
+        if ((res == CURLE_OK && http_code == 200) ||
+            (res == CURLE_WRITE_ERROR && (state->loc_gathered || state->stop.triggered))) {
             break; // Success, exit the retry loop.
         }
 
@@ -1695,13 +2782,22 @@ bool send_free_api_request(AppState* state, const char* prompt) {
     }
 
     // This payload was allocated outside the loop, so it's freed once, here.
-    free(freq_payload);
+    cJSON_free(freq_payload);
 
     // --- Final Return Logic ---
     // Check the final status from the last attempt.
-    if ((res == CURLE_OK && http_code == 200) || (res == CURLE_WRITE_ERROR && state->loc_gathered)) {
+    bool success = (res == CURLE_OK && http_code == 200) ||
+                   (res == CURLE_WRITE_ERROR && (state->loc_gathered || state->stop.triggered));
+    usage_finish(state, success);
+    if (success && state->stop.triggered) {
+        fprintf(stderr, "\n[Stopped early: %s]\n", state->stop.reason);
+    }
+    if (success) {
         return true;
     }
+    if (state->request_cancelled) {
+        return false;
+    }
 
     // If we're here, all retries failed.
     fprintf(stderr, "\nFree API call failed after retries (Last HTTP code: %ld, Curl error: %s)\n", http_code, curl_easy_strerror(res));
@@ -1751,8 +2847,37 @@ void save_configuration(AppState* state) {
     }
     cJSON_AddNumberToObject(root, "max_output_tokens", state->max_output_tokens);
     cJSON_AddNumberToObject(root, "thinking_budget", state->thinking_budget);
-    cJSON_AddBoolToObject(root, "google_grounding", state->google_grounding);
-    cJSON_AddBoolToObject(root, "url_context", state->url_context);
+    cJSON_AddNumberToObject(root, "image_max_dimension", state->image_max_dimension);
+    cJSON_AddNumberToObject(root, "compression_level", state->compression_level);
+    cJSON_AddNumberToObject(root, "compression_min_bytes", state->compression_min_bytes);
+    cJSON_AddNumberToObject(root, "cold_history_turns", state->history.cold_after);
+    cJSON_AddBoolToObject(root, "usage_ledger", state->usage_ledger);
+    cJSON_AddBoolToObject(root, "compact_logs", state->compact_logs);
+    cJSON_AddBoolToObject(root, "pdf_text", state->pdf_text);
+    cJSON_AddNumberToObject(root, "table_profile_min_bytes", state->table_profile_min_bytes);
+    json_write_tool_mode(root, "google_grounding", state->google_grounding);
+    json_write_tool_mode(root, "url_context", state->url_context);
+    cJSON_AddNumberToObject(root, "function_timeout_ms", state->function_timeout_ms);
+    cJSON_AddNumberToObject(root, "function_output_limit", state->function_output_limit);
+    cJSON_AddNumberToObject(root, "function_workers", state->function_workers);
+    cJSON_AddBoolToObject(root, "http2", state->http2);
+    cJSON_AddNumberToObject(root, "http2_max_streams", state->http2_max_streams);
+    if (state->functions) {
+        cJSON_AddItemToObject(root, "functions", cJSON_Duplicate(state->functions, true));
+    }
+    if (state->routes_configured) {
+        cJSON* routes = cJSON_AddArrayToObject(root, "routes");
+        for (int i = 0; i < route_table_count(state->routes); i++) {
+            Route route;
+            route_table_get(state->routes, i, &route);
+            cJSON* entry = cJSON_CreateObject();
+            cJSON_AddStringToObject(entry, "name", route.name);
+            cJSON_AddStringToObject(entry, "base_url", route.base_url);
+            if (route.has_proxy) cJSON_AddStringToObject(entry, "proxy", route.proxy);
+            cJSON_AddItemToArray(routes, entry);
+        }
+    }
+    cJSON_AddNumberToObject(root, "route_probe_interval", state->route_probe_interval);
     // Only save topK and topP if they have been explicitly set.
     if (state->topK > 0) {
         cJSON_AddNumberToObject(root, "top_k", state->topK);
@@ -1774,14 +2899,14 @@ void save_configuration(AppState* state) {
     FILE* file = fopen(config_path, "w");
     if (!file) {
         perror("Failed to open configuration file for writing");
-        free(json_string);
+        cJSON_free(json_string);
         return;
     }
 
     // Write the JSON string to the file and clean up.
     fputs(json_string, file);
     fclose(file);
-    free(json_string);
+    cJSON_free(json_string);
 
     fprintf(stderr, "Configuration saved to %s\n", config_path);
 }
@@ -1791,20 +2916,16 @@ void save_configuration(AppState* state) {
  * @details This is a helper function that configures and executes a standard
  *          HTTP GET request using libcurl. It is used for API calls that do not
  *          require a POST body, such as listing available models. It includes
- *          the necessary API key and origin headers.
- * @param url The full URL to request.
+ *          the necessary API key and origin headers, and fails over between
+ *          routes like `perform_api_curl_request`.
+ * @param path The API path to request, including the query string.
  * @param state The current application state, used for the API key and origin.
  * @param callback The libcurl write callback function to handle the response data.
  * @param callback_data A pointer to the data structure for the callback (e.g., MemoryStruct).
  * @return The HTTP status code of the response. On a transport-level error (e.g.,
  *         DNS failure), it returns a negative CURLcode.
  */
-long perform_api_get_request(const char* url, AppState* state, size_t (*callback)(void*, size_t, size_t, void*), void* callback_data) {
-    CURL* curl = curl_easy_init();
-    if (!curl) {
-        return -CURLE_FAILED_INIT;
-    }
-
+long perform_api_get_request(const char* path, AppState* state, size_t (*callback)(void*, size_t, size_t, void*), void* callback_data) {
     // Prepare the required HTTP headers for authentication.
     char auth_header[256];
     snprintf(auth_header, sizeof(auth_header), "x-goog-api-key: %s", state->api_key);
@@ -1819,28 +2940,46 @@ long perform_api_get_request(const char* url, AppState* state, size_t (*callback
         headers = curl_slist_append(headers, origin_header);
     }
 
-    // Configure the cURL handle for a GET request.
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    if (state->proxy[0] != '\0') {
-        curl_easy_setopt(curl, CURLOPT_PROXY, state->proxy);
-    }
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, callback_data);
+    long http_code = -CURLE_FAILED_INIT;
+    unsigned tried = 0;
+    int route = route_pick(state, tried);
+    while (route >= 0) {
+        CURL* curl = curl_easy_init();
+        if (!curl) {
+            http_code = -CURLE_FAILED_INIT;
+            break;
+        }
 
-    // Execute the request and retrieve the HTTP response code.
-    long http_code = 0;
-    CURLcode res = curl_easy_perform(curl);
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+        // Configure the cURL handle for a GET request.
+        char url[1024];
+        route_apply(state, curl, route, path, url, sizeof(url));
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        RouteResponse response;
+        route_response_init(&response, curl, callback, callback_data);
+        HttpTransfer transfer = { .curl = curl };
+        watch_install_progress(&transfer, state);
+        transport_prepare(state, curl, url);
+
+        // Execute the request and retrieve the HTTP response code.
+        http_code = 0;
+        CURLcode res = transport_perform(state, &transfer);
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
 
-    // If the request failed at the transport layer (e.g., could not connect),
-    // http_code will be 0. In this case, we return the negative cURL error code.
-    if (res != CURLE_OK && http_code == 0) {
-        http_code = -res;
+        // If the request failed at the transport layer (e.g., could not connect),
+        // http_code will be 0. In this case, we return the negative cURL error code.
+        if (res != CURLE_OK && http_code == 0) {
+            http_code = -(long)res;
+        }
+        usage_note_transfer(&state->usage, &transfer, http_code);
+        curl_easy_cleanup(curl);
+
+        tried |= 1u << route;
+        bool failed = route_finish(state, route, &transfer, http_code);
+        route = failed && !response.delivered ? route_failover(state, route, tried) : -1;
+        route_response_finish(&response, route >= 0);
     }
 
     // Clean up allocated resources.
-    curl_easy_cleanup(curl);
     curl_slist_free_all(headers);
 
     return http_code;
@@ -1860,9 +2999,10 @@ void list_available_models(AppState* state) {
     char next_page_token[256] = {0};
     bool first_page = true;
     int model_count = 0;
+    usage_begin(state, USAGE_OP_LIST_MODELS);
 
     // Allocate a memory buffer to store the API's JSON response.
-    MemoryStruct chunk = { .buffer = malloc(1), .size = 0 };
+    MemoryStruct chunk = { .buffer = mem_alloc(MEM_CURL, 1), .size = 0 };
     if (!chunk.buffer) {
         fprintf(stderr, "Error: Failed to allocate memory for API response.\n");
         return;
@@ -1873,14 +3013,14 @@ void list_available_models(AppState* state) {
 
     // Loop to handle paginated results.
     do {
-        char full_url[1024];
+        char path[1024];
 
-        // Construct the appropriate URL for the request.
+        // Construct the appropriate API path for the request.
         if (first_page) {
-            snprintf(full_url, sizeof(full_url), "https://generativelanguage.googleapis.com/v1beta/models?pageSize=50");
+            snprintf(path, sizeof(path), API_MODELS_PATH "?pageSize=50");
             first_page = false;
         } else {
-            snprintf(full_url, sizeof(full_url), "https://generativelanguage.googleapis.com/v1beta/models?pageSize=50&pageToken=%s", next_page_token);
+            snprintf(path, sizeof(path), API_MODELS_PATH "?pageSize=50&pageToken=%s", next_page_token);
         }
 
         // --- START OF MODIFICATION ---
@@ -1894,7 +3034,7 @@ void list_available_models(AppState* state) {
             chunk.buffer[0] = '\0';
 
             // Perform the GET request.
-            http_code = perform_api_get_request(full_url, state, write_to_memory_struct_callback, &chunk);
+            http_code = perform_api_get_request(path, state, write_to_memory_struct_callback, &chunk);
 
             if (http_code == 200) {
                 break; // Success, exit the retry loop.
@@ -1925,8 +3065,9 @@ void list_available_models(AppState* state) {
             break; // Exit the pagination loop on failure.
         }
 
-        // Parse the JSON response from the buffer.
-        cJSON* root = cJSON_Parse(chunk.buffer);
+        // Parse the JSON response in place; the buffer is reset before the next page.
+        cJSON_Arena* arena = NULL;
+        cJSON* root = cJSON_ParseInSitu(chunk.buffer, chunk.size, &arena);
         if (!root) {
             fprintf(stderr, "Error: Failed to parse JSON response for models list.\n");
             break;
@@ -1960,7 +3101,7 @@ void list_available_models(AppState* state) {
             next_page_token[0] = '\0'; // No more pages.
         }
 
-        cJSON_Delete(root);
+        cJSON_DeleteArena(arena);
 
     } while (next_page_token[0] != '\0');
 
@@ -1970,7 +3111,8 @@ void list_available_models(AppState* state) {
         fprintf(stderr, "No models were found or an error occurred.\n");
     }
 
-    free(chunk.buffer);
+    mem_free(MEM_CURL, chunk.buffer);
+    usage_finish(state, model_count > 0);
 }
 
 /**
@@ -2013,10 +3155,19 @@ void export_history_to_markdown(AppState* state, const char* filepath) {
         // Iterate through each part within the content block.
         for (int j = 0; j < content->num_parts; j++) {
             Part* part = &content->parts[j];
-            if (part->type == PART_TYPE_TEXT && part->text) {
+            char* scratch = NULL;
+            const char* text = part->type == PART_TYPE_TEXT ? part_payload(part, &scratch) : NULL;
+            if (text) {
                 // Write the text content directly.
-                fprintf(file, "%s\n", part->text);
+                fprintf(file, "%s\n", text);
+                free(scratch);
                 has_text = true;
+            } else if (part->type != PART_TYPE_FILE) {
+                // Function calls and their results are shown as the JSON exchanged.
+                const char* json = part_payload(part, &scratch);
+                fprintf(file, "\n**%s:**\n\n```json\n%s\n```\n", part->type == PART_TYPE_FUNCTION_CALL ? "Function Call" : "Function Result",
+                        json ? json : "");
+                free(scratch);
             } else if (part->type == PART_TYPE_FILE) {
                 // For file attachments, write a placeholder indicating the file's name and type.
                 const char* filename = part->filename ? part->filename : "Pasted Data";
@@ -2129,23 +3280,315 @@ bool build_session_path(const char* session_name, char* path_buffer, size_t buff
     return true;
 }
 
+// --- Local Functions ---
+
 /**
- * @brief Sends a request to the official Gemini API and handles the response.
- * @details This is the primary function for interacting with the official Gemini
- *          API. It builds the JSON request payload, Gzip-compresses it for
+ * @brief Checks a function name against what the API accepts:
+ *        a letter or underscore, then up to 63 letters, digits, '_', '.' or '-'.
+ */
+static bool is_function_name_valid(const char* name) {
+    if (!isalpha((unsigned char)name[0]) && name[0] != '_') return false;
+    size_t length = 1;
+    for (const char* p = name + 1; *p; p++, length++) {
+        if (!isalnum((unsigned char)*p) && *p != '_' && *p != '.' && *p != '-') return false;
+    }
+    return length <= 64;
+}
+
+/**
+ * @brief Loads the "functions" array of a configuration file.
+ * @details Each entry needs a `name` and a shell `command`; `description`,
+ *          `parameters` (a JSON schema for the arguments) and `timeout_ms` are
+ *          optional. Invalid entries are reported and skipped.
+ * @param state The application state; replaces `state->functions`.
+ * @param config The parsed configuration.
+ * @param filepath The configuration file, for messages.
+ */
+static void load_functions(AppState* state, const cJSON* config, const char* filepath) {
+    const cJSON* entries = cJSON_GetObjectItem(config, "functions");
+    if (!entries) return;
+    if (!cJSON_IsArray(entries)) {
+        fprintf(stderr, "Warning: \"functions\" in %s is not an array; ignored.\n", filepath);
+        return;
+    }
+    cJSON* functions = cJSON_CreateArray();
+    if (!functions) return;
+    int index = 0;
+    const cJSON* entry;
+    cJSON_ArrayForEach(entry, entries) {
+        index++;
+        const cJSON* name = cJSON_GetObjectItem(entry, "name");
+        const cJSON* command = cJSON_GetObjectItem(entry, "command");
+        const cJSON* parameters = cJSON_GetObjectItem(entry, "parameters");
+        const char* problem = NULL;
+        if (!cJSON_IsString(name) || !is_function_name_valid(name->valuestring)) {
+            problem = "it needs a name of letters, digits, '_', '.' or '-'";
+        } else if (!cJSON_IsString(command) || command->valuestring[0] == '\0') {
+            problem = "it needs a command";
+        } else if (parameters && !cJSON_IsObject(parameters)) {
+            problem = "its parameters must be a JSON schema object";
+        } else {
+            for (const cJSON* other = functions->child; other && !problem; other = other->next) {
+                if (strcmp(cJSON_GetObjectItem(other, "name")->valuestring, name->valuestring) == 0) {
+                    problem = "its name is already taken";
+                }
+            }
+        }
+        if (problem) {
+            fprintf(stderr, "Warning: Function #%d in %s is ignored: %s.\n", index, filepath, problem);
+            continue;
+        }
+        cJSON_AddItemToArray(functions, cJSON_Duplicate(entry, true));
+    }
+    cJSON_Delete(state->functions);
+    state->functions = functions;
+}
+
+/**
+ * @brief Loads the "routes" array of a configuration file.
+ * @details Each entry needs a `base_url` (scheme and host, and a path prefix
+ *          if the gateway adds one); `name` and `proxy` are optional. A route
+ *          without `proxy` uses the global proxy setting, and `"proxy": ""`
+ *          goes direct. Invalid entries are reported and skipped.
+ * @param state The application state; replaces `state->routes`.
+ * @param config The parsed configuration.
+ * @param filepath The configuration file, for messages.
+ */
+static void load_routes(AppState* state, const cJSON* config, const char* filepath) {
+    const cJSON* entries = cJSON_GetObjectItem(config, "routes");
+    if (!entries) return;
+    if (!cJSON_IsArray(entries)) {
+        fprintf(stderr, "Warning: \"routes\" in %s is not an array; ignored.\n", filepath);
+        return;
+    }
+    RouteTable* routes = route_table_new();
+    if (!routes) return;
+    int index = 0;
+    const cJSON* entry;
+    cJSON_ArrayForEach(entry, entries) {
+        index++;
+        const cJSON* name = cJSON_GetObjectItem(entry, "name");
+        const cJSON* base_url = cJSON_GetObjectItem(entry, "base_url");
+        const cJSON* proxy = cJSON_GetObjectItem(entry, "proxy");
+        char default_name[24];
+        snprintf(default_name, sizeof(default_name), "route %d", index);
+        const char* problem = NULL;
+        if (!cJSON_IsString(base_url)) {
+            problem = "it needs a base_url";
+        } else if ((name && !cJSON_IsString(name)) || (proxy && !cJSON_IsString(proxy))) {
+            problem = "its name and proxy must be strings";
+        } else if (route_table_count(routes) >= ROUTE_MAX) {
+            problem = "there are too many routes";
+        } else if (!route_table_add(routes, name ? name->valuestring : default_name, base_url->valuestring,
+                                    proxy ? proxy->valuestring : NULL)) {
+            problem = "its base_url must be an http:// or https:// URL, and its values of reasonable length";
+        }
+        if (problem) {
+            fprintf(stderr, "Warning: Route #%d in %s is ignored: %s.\n", index, filepath, problem);
+        }
+    }
+    route_table_free(state->routes);
+    state->routes = routes;
+    state->routes_configured = route_table_count(routes) > 0;
+}
+
+/**
+ * @brief Builds the `functionDeclarations` of a request from the configured functions.
+ */
+static cJSON* build_function_declarations(const cJSON* functions) {
+    cJSON* declarations = cJSON_CreateArray();
+    const cJSON* function;
+    cJSON_ArrayForEach(function, functions) {
+        cJSON* declaration = cJSON_CreateObject();
+        cJSON_AddStringToObject(declaration, "name", cJSON_GetObjectItem(function, "name")->valuestring);
+        const cJSON* description = cJSON_GetObjectItem(function, "description");
+        if (cJSON_IsString(description)) cJSON_AddStringToObject(declaration, "description", description->valuestring);
+        const cJSON* parameters = cJSON_GetObjectItem(function, "parameters");
+        if (parameters) cJSON_AddItemToObject(declaration, "parameters", cJSON_Duplicate(parameters, true));
+        cJSON_AddItemToArray(declarations, declaration);
+    }
+    return declarations;
+}
+
+static const cJSON* find_function(const cJSON* functions, const char* name) {
+    const cJSON* function;
+    cJSON_ArrayForEach(function, functions) {
+        if (name && strcmp(cJSON_GetObjectItem(function, "name")->valuestring, name) == 0) return function;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Runs the function calls of a response and records the round trip.
+ * @details The calls run concurrently (see toolexec.c), each with its own time
+ *          limit and output cap. The model turn that made them (with any text
+ *          that came before) and a user turn with one `functionResponse` per
+ *          call, in the order of the calls, are appended to the history, so
+ *          the next request carries all results at once.
+ * @param state The application state.
+ * @param text Text the model sent along with the calls (may be empty).
+ * @param calls The functionCall parts as received.
+ * @return false if the history could not be updated.
+ */
+static bool run_function_calls(AppState* state, const char* text, const cJSON* calls) {
+    int num_calls = cJSON_GetArraySize(calls);
+    ToolJob* jobs = calloc((size_t)num_calls, sizeof(ToolJob));
+    Part* call_parts = calloc((size_t)num_calls + 1, sizeof(Part));
+    Part* response_parts = calloc((size_t)num_calls, sizeof(Part));
+    int num_call_parts = 0;
+    bool ok = jobs && call_parts && response_parts;
+
+    // The model turn is stored exactly as received; thought signatures must go back unchanged.
+    if (ok && text && text[0] != '\0') {
+        call_parts[num_call_parts++] = (Part){ .type = PART_TYPE_TEXT, .text = (char*)text };
+    }
+    for (int i = 0; ok && i < num_calls; i++) {
+        const cJSON* part = cJSON_GetArrayItem(calls, i);
+        const cJSON* call = cJSON_GetObjectItem(part, "functionCall");
+        const cJSON* name = cJSON_GetObjectItem(call, "name");
+        const cJSON* function = find_function(state->functions, cJSON_IsString(name) ? name->valuestring : NULL);
+        jobs[i].function = cJSON_IsString(name) ? name->valuestring : "";
+        jobs[i].args = cJSON_GetObjectItem(call, "args");
+        if (function) {
+            jobs[i].command = cJSON_GetObjectItem(function, "command")->valuestring;
+            const cJSON* timeout = cJSON_GetObjectItem(function, "timeout_ms");
+            jobs[i].timeout_ms = cJSON_IsNumber(timeout) && timeout->valueint > 0 ? timeout->valueint : state->function_timeout_ms;
+        }
+        call_parts[num_call_parts].type = PART_TYPE_FUNCTION_CALL;
+        ok = (call_parts[num_call_parts++].text = cJSON_PrintUnformatted(part)) != NULL;
+    }
+
+    if (ok) {
+        // Calls to unknown functions are answered with an error; the others run together.
+        ToolJob* runnable = malloc(sizeof(ToolJob) * (size_t)num_calls);
+        int num_runnable = 0;
+        for (int i = 0; runnable && i < num_calls; i++) {
+            if (jobs[i].command) runnable[num_runnable++] = jobs[i];
+        }
+        fprintf(stderr, "\n[Running %d function call%s, up to %d at a time]\n", num_runnable, num_runnable == 1 ? "" : "s",
+                state->function_workers);
+        if (runnable) {
+            tool_jobs_run(runnable, num_runnable, state->function_workers, (size_t)state->function_output_limit);
+            for (int i = 0, j = 0; i < num_calls; i++) {
+                if (jobs[i].command) jobs[i] = runnable[j++];
+            }
+            free(runnable);
+        }
+    }
+
+    for (int i = 0; ok && i < num_calls; i++) {
+        ToolJob* job = &jobs[i];
+        const cJSON* call = cJSON_GetObjectItem(cJSON_GetArrayItem(calls, i), "functionCall");
+        cJSON* response = cJSON_CreateObject();
+        if (!job->command) {
+            cJSON_AddStringToObject(response, "error", "unknown function");
+            fprintf(stderr, "[%s: unknown function]\n", job->function);
+        } else if (job->error || !job->output) {
+            cJSON_AddStringToObject(response, "error", job->error ? job->error : "out of memory");
+            fprintf(stderr, "[%s: %s]\n", job->function, job->error ? job->error : "out of memory");
+        } else {
+            cJSON_AddStringToObject(response, "output", job->output);
+            if (job->timed_out) {
+                cJSON_AddBoolToObject(response, "timed_out", true);
+                cJSON_AddStringToObject(response, "error", "the command was killed at its time limit");
+            } else {
+                cJSON_AddNumberToObject(response, "exit_code", job->exit_code);
+            }
+            if (job->output_total > job->output_size) {
+                cJSON_AddBoolToObject(response, "truncated", true);
+                cJSON_AddNumberToObject(response, "total_bytes", (double)job->output_total);
+            }
+            if (job->timed_out) {
+                fprintf(stderr, "[%s: timed out after %.1fs, %zu bytes]\n", job->function, job->seconds, job->output_total);
+            } else {
+                fprintf(stderr, "[%s: exit %d, %zu bytes%s, %.2fs]\n", job->function, job->exit_code, job->output_total,
+                        job->output_total > job->output_size ? " (truncated)" : "", job->seconds);
+            }
+        }
+
+        cJSON* part = cJSON_CreateObject();
+        cJSON* function_response = cJSON_AddObjectToObject(part, "functionResponse");
+        const cJSON* id = cJSON_GetObjectItem(call, "id");
+        if (cJSON_IsString(id)) cJSON_AddStringToObject(function_response, "id", id->valuestring);
+        cJSON_AddStringToObject(function_response, "name", job->function);
+        cJSON_AddItemToObject(function_response, "response", response);
+        response_parts[i].type = PART_TYPE_FUNCTION_RESPONSE;
+        ok = (response_parts[i].text = cJSON_PrintUnformatted(part)) != NULL;
+        cJSON_Delete(part);
+    }
+
+    if (ok) {
+        add_content_to_history(&state->history, "model", call_parts, num_call_parts);
+        add_content_to_history(&state->history, "user", response_parts, num_calls);
+    } else {
+        fprintf(stderr, "Error: Failed to allocate memory for function calls.\n");
+    }
+
+    for (int i = 0; i < num_calls && jobs; i++) tool_job_free(&jobs[i]);
+    for (int i = 0; i < num_call_parts; i++) {
+        if (call_parts[i].type == PART_TYPE_FUNCTION_CALL) cJSON_free(call_parts[i].text);
+    }
+    for (int i = 0; i < num_calls && response_parts; i++) cJSON_free(response_parts[i].text);
+    free(jobs);
+    free(call_parts);
+    free(response_parts);
+    return ok;
+}
+
+/**
+ * @brief Encodes a request that asks the model to continue an interrupted answer.
+ * @details The request is the regular one with the text received so far as a
+ *          model turn, followed by a user turn asking to continue. The history
+ *          itself is not touched; the caller stitches the pieces into one turn.
+ * @param state The application state.
+ * @param partial The answer received before the stream broke off.
+ * @param body Receives the encoded body, freed with `mem_free(MEM_REQUEST, ...)`.
+ * @return true on success.
+ */
+static bool build_continuation_body(AppState* state, const char* partial, RequestBody* body) {
+    cJSON* root = build_request_json(state);
+    if (!root) return false;
+    cJSON* contents = cJSON_GetObjectItem(root, "contents");
+    const char* roles[] = { "model", "user" };
+    const char* texts[] = { partial, STREAM_CONTINUE_PROMPT };
+    for (int i = 0; i < 2; i++) {
+        cJSON* content = cJSON_CreateObject();
+        cJSON* parts = cJSON_CreateArray();
+        cJSON* part = cJSON_CreateObject();
+        cJSON_AddStringToObject(content, "role", roles[i]);
+        cJSON_AddStringToObject(part, "text", texts[i]);
+        cJSON_AddItemToArray(parts, part);
+        cJSON_AddItemToObject(content, "parts", parts);
+        cJSON_AddItemToArray(contents, content);
+    }
+    bool ok = encode_request_body(state, root, body);
+    cJSON_Delete(root);
+    return ok;
+}
+
+/**
+ * @brief Streams one generateContent request and handles the response.
+ * @details It builds the JSON request payload, Gzip-compresses it for
  *          efficiency, sends it via a POST request, and processes the streaming
  *          SSE response. The full, concatenated response from the model is
- *          returned upon success.
+ *          returned upon success. A stream that breaks off before the model
+ *          finished (no `finishReason`) is not restarted: the received text is
+ *          sent back as a model turn with a request to continue, and the
+ *          continuation is appended to it, up to MAX_STREAM_CONTINUATIONS times.
+ *          If a continuation request fails, the text received so far is
+ *          returned with a warning that it is incomplete.
+ *          With a response schema the output is validated while it streams;
+ *          the first violation aborts the transfer and the request is retried.
  * @param state The current application state, containing the history, configuration,
  *              and API key needed for the request.
- * @param[out] full_response_out A pointer to a character pointer. On success, this
- *             will be updated to point to a newly allocated string containing the
- *             complete model response. The caller is responsible for freeing this
- *             memory.
+ * @param[out] full_response_out On success, the complete text of the response,
+ *             which the caller frees.
+ * @param function_calls If not NULL, receives the functionCall parts of the response.
  * @return Returns true if the API call was successful (HTTP 200), and false otherwise.
  */
-bool send_api_request(AppState* state, char** full_response_out) {
+static bool stream_generate_content(AppState* state, char** full_response_out, cJSON* function_calls) {
     *full_response_out = NULL;
+    usage_begin(state, USAGE_OP_GENERATE);
 
     // 1. Build and compress the payload once. It's the same for all retries.
     cJSON* root = build_request_json(state);
@@ -2153,51 +3596,109 @@ bool send_api_request(AppState* state, char** full_response_out) {
         fprintf(stderr, "Error: Failed to build JSON request.\n");
         return false;
     }
-    char* json_string = cJSON_PrintUnformatted(root);
+    RequestBody body;
+    bool encoded = encode_request_body(state, root, &body);
     cJSON_Delete(root);
-    if (!json_string) {
-        fprintf(stderr, "Error: Failed to print JSON to string.\n");
-        return false;
-    }
-    GzipResult compressed_result = gzip_compress((unsigned char*)json_string, strlen(json_string));
-    free(json_string);
-    if (!compressed_result.data) {
-        fprintf(stderr, "Error: Failed to compress request payload.\n");
+    if (!encoded) {
+        fprintf(stderr, "Error: Failed to encode request payload.\n");
         return false;
     }
 
     // 2. Prepare the memory structure. We allocate it once and reuse/reset it.
-    MemoryStruct chunk = { .buffer = malloc(1), .size = 0, .full_response = malloc(1), .full_response_size = 0 };
+    MemoryStruct chunk = { .buffer = mem_alloc(MEM_CURL, 1), .size = 0, .full_response = mem_alloc(MEM_CURL, 1), .full_response_size = 0, .usage = &state->usage, .stop = &state->stop, .schema = state->schema_validator, .function_calls = function_calls };
     if (!chunk.buffer || !chunk.full_response) {
         fprintf(stderr, "Error: Failed to allocate memory for curl response chunk.\n");
-        free(compressed_result.data);
-        if(chunk.buffer) free(chunk.buffer);
-        if(chunk.full_response) free(chunk.full_response);
+        mem_free(MEM_REQUEST, body.data);
+        mem_free(MEM_CURL, chunk.buffer);
+        mem_free(MEM_CURL, chunk.full_response);
         return false;
     }
 
     long http_code = 0;
     bool success = false;
     int max_retries = 3;
+    int continuations = 0;
+    RequestBody resume_body = { 0 };
+    UsageRecord interrupted = { 0 }; // Tokens billed for interrupted streams.
+    bool schema_violation = false;
 
     for (int i = 0; i < max_retries; i++) {
         // 3. Reset buffers for this attempt to clear data from any previous failed attempt.
+        // Text received before an interruption is kept: the continuation builds on it.
         chunk.buffer[0] = '\0';
         chunk.size = 0;
-        chunk.full_response[0] = '\0';
-        chunk.full_response_size = 0;
+        chunk.finished = false;
+        chunk.resuming = continuations > 0;
+        if (continuations == 0) {
+            chunk.full_response[0] = '\0';
+            chunk.full_response_size = 0;
+            while (cJSON_GetArraySize(function_calls) > 0) cJSON_DeleteItemFromArray(function_calls, 0);
+            stop_conditions_reset(&state->stop);
+            if (state->schema_validator) json_validator_reset(state->schema_validator);
+        }
 
         // 4. Perform the API request.
         http_code = perform_api_curl_request(
             state,
             "streamGenerateContent?alt=sse",
-            (const char*)compressed_result.data,
-            compressed_result.size,
+            continuations > 0 ? &resume_body : &body,
             write_memory_callback,
             &chunk
         );
 
         // 5. Decide if this attempt was successful, retryable, or a final failure.
+        // A request cancelled by watch mode is stale and must not be retried.
+        if (state->request_cancelled) {
+            break;
+        }
+
+        // An answer cut short by a stop condition is complete as far as we are concerned.
+        if (state->stop.triggered) {
+            fprintf(stderr, "\n[Stopped early: %s]\n", state->stop.reason);
+            success = true;
+            break;
+        }
+
+        // Structured output that breaks the schema, or ends before the document
+        // does, is generated again from the start.
+        schema_violation = false;
+        if (state->schema_validator && cJSON_GetArraySize(function_calls) == 0 &&
+            (http_code == 200 || chunk.full_response_size > 0)) {
+            if (json_validator_finish(state->schema_validator)) {
+                success = true;
+                break;
+            }
+            schema_violation = true;
+            fprintf(stderr, "\n[Response breaks the schema at byte %zu: %s.%s]\n",
+                    json_validator_offset(state->schema_validator), json_validator_error(state->schema_validator),
+                    i < max_retries - 1 ? " Retrying..." : "");
+            continue;
+        }
+
+        // A stream that delivered text but ended without a finish reason was cut off.
+        // Ask for the rest instead of generating the whole answer again.
+        bool truncated = !chunk.finished && chunk.full_response_size > 0 && (http_code == 200 || http_code < 0);
+        if (truncated && continuations < MAX_STREAM_CONTINUATIONS) {
+            mem_free(MEM_REQUEST, resume_body.data);
+            resume_body.data = NULL;
+            if (build_continuation_body(state, chunk.full_response, &resume_body)) {
+                continuations++;
+                interrupted.input_tokens += state->usage.input_tokens;
+                interrupted.output_tokens += state->usage.output_tokens;
+                interrupted.cached_tokens += state->usage.cached_tokens;
+                interrupted.thought_tokens += state->usage.thought_tokens;
+                state->usage.input_tokens = state->usage.output_tokens = 0;
+                state->usage.cached_tokens = state->usage.thought_tokens = 0;
+                fprintf(stderr, "\n[Stream interrupted after %zu bytes; continuing from there (%d/%d)]\n",
+                        chunk.full_response_size, continuations, MAX_STREAM_CONTINUATIONS);
+                i = -1; // A continuation is a new request with its own retries.
+                continue;
+            }
+            fprintf(stderr, "\nError: Failed to build the continuation request.\n");
+        }
+        if (truncated) {
+            fprintf(stderr, "\nWarning: The response stream was cut off; the answer is incomplete.\n");
+        }
         if (http_code == 200) {
             success = true;
             break; // Success, exit the loop.
@@ -2218,21 +3719,242 @@ bool send_api_request(AppState* state, char** full_response_out) {
         }
     }
 
+    // A continuation that fails outright still leaves the text received so far,
+    // which is worth more than no answer at all.
+    if (!success && !state->request_cancelled && !schema_violation && continuations > 0 && chunk.full_response_size > 0) {
+        fprintf(stderr, "\nWarning: Continuing the interrupted stream failed (HTTP code %ld); the answer is incomplete.\n", http_code);
+        success = true;
+    }
+
     // 6. Handle the final result after the loop is finished.
     if (success) {
+        // Structured output was held back while streaming; print the validated document.
+        if (state->schema_validator && cJSON_GetArraySize(function_calls) == 0) {
+            printf("%s\n", chunk.full_response);
+            fflush(stdout);
+        }
+        mem_untrack(MEM_CURL, chunk.full_response); // Now owned by the caller.
         *full_response_out = chunk.full_response;
+    } else if (state->request_cancelled) {
+        mem_free(MEM_CURL, chunk.full_response);
+    } else if (schema_violation) {
+        fprintf(stderr, "\nError: No response matched the schema in %d attempts.\n", max_retries);
+        mem_free(MEM_CURL, chunk.full_response);
     } else {
         fprintf(stderr, "\nAPI call failed after retries (Last HTTP code: %ld)\n", http_code);
         if(http_code < 0) fprintf(stderr, "Curl error: %s\n", curl_easy_strerror(-http_code));
         parse_and_print_error_json(chunk.buffer);
-        free(chunk.full_response); // Free the unused response buffer on failure.
+        mem_free(MEM_CURL, chunk.full_response); // Free the unused response buffer on failure.
     }
 
     // 7. Clean up all remaining resources.
-    free(chunk.buffer);
-    free(compressed_result.data);
+    mem_free(MEM_CURL, chunk.buffer);
+    mem_free(MEM_REQUEST, body.data);
+    mem_free(MEM_REQUEST, resume_body.data);
+    state->usage.input_tokens += interrupted.input_tokens;
+    state->usage.output_tokens += interrupted.output_tokens;
+    state->usage.cached_tokens += interrupted.cached_tokens;
+    state->usage.thought_tokens += interrupted.thought_tokens;
+    usage_finish(state, success);
+    return success;
+
+}
+
+/**
+ * @brief Sends a request to the official Gemini API and handles the response.
+ * @details This is the primary function for interacting with the official Gemini
+ *          API. When local functions are configured and the model calls them,
+ *          the calls are run, their results are sent back in a follow-up
+ *          request, and so on until the model answers with text only (at most
+ *          MAX_FUNCTION_ROUNDS rounds). The intermediate turns go into the
+ *          history; the final answer is returned like any other. If a round
+ *          fails, the turns it added are removed again.
+ * @param state The current application state, containing the history, configuration,
+ *              and API key needed for the request.
+ * @param[out] full_response_out A pointer to a character pointer. On success, this
+ *             will be updated to point to a newly allocated string containing the
+ *             complete model response. The caller is responsible for freeing this
+ *             memory.
+ * @return Returns true if the API call was successful (HTTP 200), and false otherwise.
+ */
+bool send_api_request(AppState* state, char** full_response_out) {
+    bool functions = state->use_functions && cJSON_GetArraySize(state->functions) > 0;
+    int first_added = state->history.num_contents;
+    bool success = false;
+    for (int round = 0; ; round++) {
+        cJSON* calls = functions ? cJSON_CreateArray() : NULL;
+        success = stream_generate_content(state, full_response_out, calls);
+        bool more = success && cJSON_GetArraySize(calls) > 0 && !state->stop.triggered;
+        if (more && round == MAX_FUNCTION_ROUNDS) {
+            fprintf(stderr, "\nWarning: Stopped after %d rounds of function calls; the last calls were not run.\n",
+                    MAX_FUNCTION_ROUNDS);
+            more = false;
+        }
+        if (more) {
+            success = run_function_calls(state, *full_response_out, calls) && !state->request_cancelled;
+            free(*full_response_out);
+            *full_response_out = NULL;
+        }
+        cJSON_Delete(calls);
+        if (!more || !success) break;
+    }
+
+    // Callers drop the prompt of a failed request; the round trips go with it.
+    while (!success && state->history.num_contents > first_added) {
+        state->history.num_contents--;
+        free_content(&state->history.contents[state->history.num_contents]);
+    }
     return success;
+}
+
+/**
+ * @brief Collects the text parts of a non-streaming generateContent response.
+ * @return The answer (caller frees), or NULL if the response holds no text.
+ */
+static char* response_text(const cJSON* response) {
+    const cJSON* candidate = cJSON_GetArrayItem(cJSON_GetObjectItem(response, "candidates"), 0);
+    const cJSON* parts = cJSON_GetObjectItem(cJSON_GetObjectItem(candidate, "content"), "parts");
+    char* text = NULL;
+    size_t size = 0;
+    const cJSON* part;
+    cJSON_ArrayForEach(part, parts) {
+        const cJSON* value = cJSON_GetObjectItem(part, "text");
+        if (!cJSON_IsString(value) || cJSON_IsTrue(cJSON_GetObjectItem(part, "thought"))) continue;
+        size_t length = strlen(value->valuestring);
+        char* grown = realloc(text, size + length + 1);
+        if (!grown) break;
+        text = grown;
+        memcpy(text + size, value->valuestring, length + 1);
+        size += length;
+    }
+    return text;
+}
+
+/**
+ * @brief Generates several answers to the prompt at the end of the history
+ *        at the same time and prints them one after the other.
+ * @details All samples are sent at once on the shared transport, so over
+ *          HTTP/2 they travel as streams of a single connection instead of
+ *          opening one connection (and TLS handshake) each. They differ only in
+ *          their seed. Each sample is recorded in the usage ledger as a request
+ *          of its own; none of them is added to the history.
+ * @param state The application state; the prompt is the last history entry.
+ * @param count Number of samples (2..MAX_SAMPLES).
+ * @return true if at least one sample was generated.
+ */
+static bool generate_samples(AppState* state, int count) {
+    HttpTransfer transfers[MAX_SAMPLES] = { 0 };
+    struct curl_slist* headers[MAX_SAMPLES] = { 0 };
+    RequestBody bodies[MAX_SAMPLES] = { 0 };
+    MemoryStruct chunks[MAX_SAMPLES] = { 0 };
+    UsageRecord usages[MAX_SAMPLES];
+    int prepared = 0;
+
+    // Samples are plain answers: function calls could not be continued.
+    usage_begin(state, USAGE_OP_GENERATE);
+    bool use_functions = state->use_functions;
+    state->use_functions = false;
+    cJSON* root = build_request_json(state);
+    state->use_functions = use_functions;
+    if (!root) {
+        fprintf(stderr, "Error: Failed to build JSON request.\n");
+        return false;
+    }
+    cJSON* gen_config = cJSON_GetObjectItem(root, "generationConfig");
+    // All samples go over the fastest route; those it fails are resent together over the next.
+    unsigned tried = 0;
+    int route = route_pick(state, tried);
+    for (; route >= 0 && prepared < count; prepared++) {
+        int i = prepared;
+        usages[i] = state->usage;
+        cJSON_DeleteItemFromObject(gen_config, "seed");
+        cJSON_AddNumberToObject(gen_config, "seed", state->seed + i * 7919);
+        chunks[i].buffer = mem_alloc(MEM_CURL, 1);
+        if (!chunks[i].buffer || !encode_request_body(state, root, &bodies[i])) {
+            mem_free(MEM_CURL, chunks[i].buffer);
+            break;
+        }
+        chunks[i].buffer[0] = '\0';
+        transfers[i].curl = create_api_curl_handle(state, route, "generateContent", &bodies[i],
+                                                   write_to_memory_struct_callback, &chunks[i], &headers[i]);
+        if (!transfers[i].curl) {
+            mem_free(MEM_CURL, chunks[i].buffer);
+            mem_free(MEM_REQUEST, bodies[i].data);
+            break;
+        }
+    }
+    cJSON_Delete(root);
+    if (prepared < count) {
+        fprintf(stderr, "Error: Failed to prepare sample %d of %d.\n", prepared + 1, count);
+    }
+
+    transport_perform_all(state, transfers, prepared);
+
+    long http_codes[MAX_SAMPLES];
+    int failed[MAX_SAMPLES];
+    int num_failed = prepared;
+    for (int i = 0; i < prepared; i++) failed[i] = i;
+    while (num_failed > 0) {
+        int retry = 0;
+        for (int k = 0; k < num_failed; k++) {
+            int i = failed[k];
+            http_codes[i] = finish_api_curl_request(state, &usages[i], &transfers[i], &bodies[i]);
+            if (route_finish(state, route, &transfers[i], http_codes[i])) failed[retry++] = i;
+        }
+        tried |= 1u << route;
+        if (retry == 0 || (route = route_failover(state, route, tried)) < 0) break;
+
+        HttpTransfer again[MAX_SAMPLES] = { 0 };
+        num_failed = 0;
+        for (int k = 0; k < retry; k++) {
+            int i = failed[k];
+            struct curl_slist* retry_headers;
+            CURL* curl = create_api_curl_handle(state, route, "generateContent", &bodies[i],
+                                                write_to_memory_struct_callback, &chunks[i], &retry_headers);
+            if (!curl) continue; // Keeps the outcome of the failed attempt.
+            curl_easy_cleanup(transfers[i].curl);
+            curl_slist_free_all(headers[i]);
+            transfers[i].curl = curl;
+            headers[i] = retry_headers;
+            chunks[i].size = 0;
+            chunks[i].buffer[0] = '\0';
+            again[num_failed] = transfers[i];
+            failed[num_failed++] = i;
+        }
+        transport_perform_all(state, again, num_failed);
+        for (int k = 0; k < num_failed; k++) transfers[failed[k]] = again[k];
+    }
+
+    int generated = 0;
+    for (int i = 0; i < prepared; i++) {
+        long http_code = http_codes[i];
+        cJSON* response = http_code == 200 ? cJSON_Parse(chunks[i].buffer) : NULL;
+        char* text = response ? response_text(response) : NULL;
+        if (response) usage_read_metadata(&usages[i], cJSON_GetObjectItem(response, "usageMetadata"));
+
+        printf("--- Sample %d of %d ---\n", i + 1, prepared);
+        fflush(stdout);
+        if (text) {
+            printf("%s\n\n", text);
+            generated++;
+        } else {
+            printf("\n");
+            fprintf(stderr, "Sample %d failed (HTTP code: %ld)\n", i + 1, http_code);
+            if (http_code < 0) fprintf(stderr, "Curl error: %s\n", curl_easy_strerror(-http_code));
+            else if (http_code != 200) parse_and_print_error_json(chunks[i].buffer);
+        }
+        fflush(stdout);
 
+        state->usage = usages[i];
+        usage_finish(state, text != NULL);
+        free(text);
+        cJSON_Delete(response);
+        curl_easy_cleanup(transfers[i].curl);
+        curl_slist_free_all(headers[i]);
+        mem_free(MEM_CURL, chunks[i].buffer);
+        mem_free(MEM_REQUEST, bodies[i].data);
+    }
+    return generated > 0;
 }
 
 /**
@@ -2276,6 +3998,24 @@ static void json_read_int(const cJSON* obj, const char* key, int* target) {
     }
 }
 
+/**
+ * @brief Reads a limit that must be positive; values up to `max` are taken.
+ * @details A value of zero or less keeps the current (default) setting and a
+ *          larger one is capped, each with a warning naming the config file.
+ */
+static void json_read_limit(const cJSON* obj, const char* key, int* target, int max, const char* filepath) {
+    const cJSON* item = cJSON_GetObjectItem(obj, key);
+    if (!cJSON_IsNumber(item)) return;
+    if (item->valuedouble < 1) {
+        fprintf(stderr, "Warning: \"%s\" in %s must be positive; using %d.\n", key, filepath, *target);
+    } else if (item->valuedouble > max) {
+        fprintf(stderr, "Warning: \"%s\" in %s is capped at %d.\n", key, filepath, max);
+        *target = max;
+    } else {
+        *target = item->valueint;
+    }
+}
+
 /**
  * @brief Safely reads a boolean value from a cJSON object.
  * @details It handles both true/false boolean types and numeric 0/1 values
@@ -2293,6 +4033,31 @@ static void json_read_bool(const cJSON* obj, const char* key, bool* target) {
     }
 }
 
+/**
+ * @brief Reads a tool setting: true, false (or 1/0) from older configurations, or "auto".
+ */
+static void json_read_tool_mode(const cJSON* obj, const char* key, ToolMode* target) {
+    const cJSON* item = cJSON_GetObjectItem(obj, key);
+    if (cJSON_IsString(item) && item->valuestring) {
+        parse_tool_mode(item->valuestring, target);
+    } else if (cJSON_IsBool(item) || cJSON_IsNumber(item)) {
+        bool enabled = false;
+        json_read_bool(obj, key, &enabled);
+        *target = enabled ? TOOL_ON : TOOL_OFF;
+    }
+}
+
+/**
+ * @brief Writes a tool setting as a boolean, or as "auto" for per-turn decisions.
+ */
+static void json_write_tool_mode(cJSON* obj, const char* key, ToolMode mode) {
+    if (mode == TOOL_AUTO) {
+        cJSON_AddStringToObject(obj, key, "auto");
+    } else {
+        cJSON_AddBoolToObject(obj, key, mode == TOOL_ON);
+    }
+}
+
 /**
  * @brief Safely reads a string from a cJSON object and allocates new memory for it.
  * @details This is used for fields that can be of variable length, like the
@@ -2314,6 +4079,53 @@ static void json_read_strdup(const cJSON* obj, const char* key, char** target) {
     }
 }
 
+/**
+ * @brief Loads the response schema given with --schema.
+ * @details The schema is sent as `responseSchema` with every request and used
+ *          to validate the streamed output.
+ * @param state The application state that receives the schema and its validator.
+ * @param path The schema file, a JSON object.
+ * @return false (after printing the reason) if the file cannot be used.
+ */
+static bool load_response_schema(AppState* state, const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        fprintf(stderr, "Error: Cannot open schema file '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* buffer = length >= 0 ? malloc((size_t)length + 1) : NULL;
+    bool read_ok = buffer && fread(buffer, 1, (size_t)length, file) == (size_t)length;
+    fclose(file);
+    if (!read_ok) {
+        free(buffer);
+        fprintf(stderr, "Error: Failed to read schema file '%s'.\n", path);
+        return false;
+    }
+    buffer[length] = '\0';
+    cJSON* schema = cJSON_Parse(buffer);
+    free(buffer);
+    if (!cJSON_IsObject(schema)) {
+        cJSON_Delete(schema);
+        fprintf(stderr, "Error: Schema file '%s' is not a JSON object.\n", path);
+        return false;
+    }
+
+    JsonValidator* validator = json_validator_new(schema);
+    if (!validator) {
+        cJSON_Delete(schema);
+        fprintf(stderr, "Error: Failed to allocate the schema validator.\n");
+        return false;
+    }
+    json_validator_free(state->schema_validator);
+    cJSON_Delete(state->response_schema);
+    state->response_schema = schema;
+    state->schema_validator = validator;
+    return true;
+}
+
 /**
  * @brief Parses command-line options and updates the application state.
  * @details This function iterates through the command-line arguments, looking for
@@ -2367,6 +4179,39 @@ int parse_common_options(int argc, char* argv[], AppState* state) {
         } else if ((STRCASECMP(argv[i], "-b") == 0 || STRCASECMP(argv[i], "--budget") == 0) && (i + 1 < argc)) {
             state->thinking_budget = atoi(argv[i + 1]);
             i++;
+        } else if ((STRCASECMP(argv[i], "--image-max") == 0) && (i + 1 < argc)) {
+            state->image_max_dimension = atoi(argv[i + 1]);
+            i++;
+        } else if ((STRCASECMP(argv[i], "--stop-regex") == 0) && (i + 1 < argc)) {
+            if (!stop_conditions_set_regex(&state->stop, argv[i + 1])) exit(1);
+            i++;
+        } else if ((STRCASECMP(argv[i], "--schema") == 0) && (i + 1 < argc)) {
+            if (!load_response_schema(state, argv[i + 1])) exit(1);
+            i++;
+        } else if ((STRCASECMP(argv[i], "--tools") == 0) && (i + 1 < argc)) {
+            if (!parse_tool_mode(argv[i + 1], &state->google_grounding)) {
+                fprintf(stderr, "Error: --tools takes on, off or auto.\n");
+                exit(1);
+            }
+            state->url_context = state->google_grounding;
+            i++;
+        } else if ((STRCASECMP(argv[i], "--max-lines") == 0) && (i + 1 < argc)) {
+            state->stop.max_lines = atoi(argv[i + 1]);
+            i++;
+        } else if ((STRCASECMP(argv[i], "--where") == 0) && (i + 1 < argc)) {
+            state->attach_table = true;
+            state->table_where = argv[i + 1];
+            i++;
+        } else if ((STRCASECMP(argv[i], "--max-streams") == 0) && (i + 1 < argc)) {
+            state->http2_max_streams = atoi(argv[i + 1]);
+            i++;
+        } else if ((STRCASECMP(argv[i], "--samples") == 0) && (i + 1 < argc)) {
+            state->samples = atoi(argv[i + 1]);
+            if (state->samples < 1 || state->samples > MAX_SAMPLES) {
+                fprintf(stderr, "Error: --samples must be between 1 and %d.\n", MAX_SAMPLES);
+                exit(1);
+            }
+            i++;
         }
         // --- Boolean Flags ---
         else if (STRCASECMP(argv[i], "-e") == 0 || STRCASECMP(argv[i], "--execute") == 0) {
@@ -2375,13 +4220,36 @@ int parse_common_options(int argc, char* argv[], AppState* state) {
         } else if (STRCASECMP(argv[i], "-q") == 0 || STRCASECMP(argv[i], "--quiet") == 0) {
             // Handled in main(), just consume the flag.
         } else if (STRCASECMP(argv[i], "-ng") == 0 || STRCASECMP(argv[i], "--no-grounding") == 0) {
-            state->google_grounding = false;
+            state->google_grounding = TOOL_OFF;
         } else if (STRCASECMP(argv[i], "-f") == 0 || STRCASECMP(argv[i], "--free") == 0) {
             state->free_mode = true;
         } else if (STRCASECMP(argv[i], "--api") == 0) {
             state->free_mode = false;
         } else if (STRCASECMP(argv[i], "-nu") == 0 || STRCASECMP(argv[i], "--no-url-context") == 0) {
-            state->url_context = false;
+            state->url_context = TOOL_OFF;
+        } else if (STRCASECMP(argv[i], "--watch") == 0) {
+            state->watch_mode = true;
+        } else if (STRCASECMP(argv[i], "--watch-diff") == 0) {
+            state->watch_mode = true;
+            state->watch_send_diff = true;
+        } else if (STRCASECMP(argv[i], "--mem-report") == 0) {
+            state->mem_report = true;
+        } else if (STRCASECMP(argv[i], "--compact-logs") == 0) {
+            state->compact_logs = true;
+        } else if (STRCASECMP(argv[i], "--pdf-text") == 0) {
+            state->pdf_text = true;
+        } else if (STRCASECMP(argv[i], "--outline") == 0) {
+            state->attach_view = SOURCE_VIEW_OUTLINE;
+        } else if (STRCASECMP(argv[i], "--minify") == 0) {
+            state->attach_view = SOURCE_VIEW_MINIFY;
+        } else if (STRCASECMP(argv[i], "--table") == 0) {
+            state->attach_table = true;
+        } else if (STRCASECMP(argv[i], "--no-functions") == 0) {
+            state->use_functions = false;
+        } else if (STRCASECMP(argv[i], "--http1.1") == 0) {
+            state->http2 = false;
+        } else if (STRCASECMP(argv[i], "--stop-after-block") == 0) {
+            state->stop.after_block = true;
         } else if (STRCASECMP(argv[i], "--loc") == 0) {
             state->loc_tile =  state->loc_tile | 1;
         } else if (STRCASECMP(argv[i], "--map") == 0) {
@@ -2394,6 +4262,14 @@ int parse_common_options(int argc, char* argv[], AppState* state) {
         } else if (STRCASECMP(argv[i], "--list-sessions") == 0) {
             list_sessions();
             exit(0);
+        } else if (STRCASECMP(argv[i], "--report") == 0) {
+            const char* group_by = "day";
+            if (i + 1 < argc && (strcmp(argv[i + 1], "day") == 0 || strcmp(argv[i + 1], "model") == 0 ||
+                                 strcmp(argv[i + 1], "tool") == 0 || strcmp(argv[i + 1], "session") == 0 ||
+                                 strcmp(argv[i + 1], "tools") == 0 || strcmp(argv[i + 1], "protocol") == 0)) {
+                group_by = argv[++i];
+            }
+            exit(print_usage_report(group_by) ? 0 : 1);
         } else if ((STRCASECMP(argv[i], "--save-session") == 0) && (i + 1 < argc)) { // <-- ADD THIS BLOCK
             if (state->save_session_path) free(state->save_session_path);
             state->save_session_path = strdup(argv[i + 1]);
@@ -2443,16 +4319,36 @@ void print_usage(const char* prog_name) {
     fprintf(stderr, "  -p, --proxy <url>         Specify a proxy to use (e.g., 'http://localhost:8080').\n");
     fprintf(stderr, "      --topk <int>          Set the Top-K sampling parameter.\n");
     fprintf(stderr, "      --topp <float>        Set the Top-P (nucleus) sampling parameter.\n");
+    fprintf(stderr, "      --image-max <px>      Downscale attached images to this size (default 2048, 0 = off).\n");
     fprintf(stderr, "  -e, --execute             Execute a single prompt non-interactively and exit.\n");
     fprintf(stderr, "  -q, --quiet               Enable quiet mode; print only the final response to stdout.\n");
     fprintf(stderr, "  -f, --free                Use the unofficial, key-free API endpoint [DEFAULT].\n");
     fprintf(stderr, "      --api                 Use the official API (requires API key).\n");
     fprintf(stderr, "      --loc                 Get location information (requires --free mode).\n");
     fprintf(stderr, "      --map                 Get map URL for location (requires --free mode).\n");
+    fprintf(stderr, "      --watch               Re-run the prompt whenever the given files change (Linux).\n");
+    fprintf(stderr, "      --watch-diff          Like --watch, but send follow-ups as a diff of the changes.\n");
+    fprintf(stderr, "      --mem-report          Print memory usage by category and peak RSS on exit.\n");
+    fprintf(stderr, "      --compact-logs        Collapse repeated log lines in stdin and .log attachments.\n");
+    fprintf(stderr, "      --pdf-text            Send text-based PDFs as extracted text instead of the document.\n");
+    fprintf(stderr, "      --outline             Attach source files and directories as declarations only.\n");
+    fprintf(stderr, "      --minify              Attach source files and directories without comments or extra whitespace.\n");
+    fprintf(stderr, "      --table               Attach CSV/TSV files as a profile: schema, column statistics and a sample.\n");
+    fprintf(stderr, "      --where <conditions>  Profile only matching rows, e.g. \"region = EU and amount > 100\" (implies --table).\n");
+    fprintf(stderr, "      --schema <file>       Request JSON matching this response schema; validated as it streams (--api).\n");
+    fprintf(stderr, "      --stop-regex <re>     Stop the answer where this extended regex matches (the match is dropped).\n");
+    fprintf(stderr, "      --stop-after-block    Stop the answer after its first fenced code block.\n");
+    fprintf(stderr, "      --max-lines <n>       Stop the answer after n lines.\n");
+    fprintf(stderr, "      --tools <mode>        Grounding and URL context: on, off or auto (per turn) [DEFAULT: auto].\n");
     fprintf(stderr, "  -ng, --no-grounding       Disable Google Search grounding for the response.\n");
     fprintf(stderr, "  -nu, --no-url-context     Disable automatic fetching of URL context.\n");
+    fprintf(stderr, "      --no-functions        Do not offer the local functions from the configuration to the model.\n");
+    fprintf(stderr, "      --samples <n>         Generate n answers to the prompt at once, over one connection (--api).\n");
+    fprintf(stderr, "      --http1.1             Do not negotiate HTTP/2; concurrent requests then use a connection each.\n");
+    fprintf(stderr, "      --max-streams <n>     Concurrent requests per HTTP/2 connection [DEFAULT: %d].\n", DEFAULT_HTTP2_MAX_STREAMS);
     fprintf(stderr, "  -l, --list                List all available models and exit.\n");
     fprintf(stderr, "      --list-sessions       List all saved sessions and exit.\n");
+    fprintf(stderr, "      --report [by]         Summarize recorded requests by day, model, tool, session, tools or protocol and exit.\n");
     fprintf(stderr, "      --load-session <name> Load a saved session by name and start chatting.\n");
     fprintf(stderr, "      --save-session <file> Save the conversation to a file after a non-interactive run.\n");
     fprintf(stderr, "  -h, --help                Show this help message and exit.\n\n");
@@ -2482,9 +4378,9 @@ void initialize_default_state(AppState* state) {
     state->seed = 42;
     state->max_output_tokens = 65536; // A high default limit.
 
-    // Default feature toggles.
-    state->google_grounding = true;
-    state->url_context = true;
+    // Default feature toggles. Tools are attached per turn, only when the prompt seems to need them.
+    state->google_grounding = TOOL_AUTO;
+    state->url_context = TOOL_AUTO;
 
     // Default values indicating that these parameters are not set by default.
     // The API will use its own defaults for these.
@@ -2510,6 +4406,38 @@ void initialize_default_state(AppState* state) {
     state->loc_gathered = false;
 
     state->save_session_path = NULL;
+
+    // Attached images are downscaled so their longest side fits this limit.
+    state->image_max_dimension = DEFAULT_IMAGE_MAX_DIMENSION;
+
+    // Turns this far back in the history are kept compressed in memory.
+    state->history.cold_after = DEFAULT_COLD_HISTORY_TURNS;
+
+    // Every request is appended to the usage ledger (see --report).
+    state->usage_ledger = true;
+
+    // Request bodies are compressed adaptively unless configured otherwise.
+    state->compression_level = COMPRESSION_LEVEL_AUTO;
+    state->compression_min_bytes = DEFAULT_COMPRESSION_MIN_BYTES;
+    state->compression.speed_scale = 1.0;
+    state->compression.ratio_scale = 1.0;
+
+    // Very large CSV/TSV attachments are sent as a profile instead of raw text.
+    state->table_profile_min_bytes = DEFAULT_TABLE_PROFILE_MIN_BYTES;
+
+    // Local functions from the configuration are declared to the model.
+    state->use_functions = true;
+    state->function_timeout_ms = DEFAULT_FUNCTION_TIMEOUT_MS;
+    state->function_output_limit = DEFAULT_FUNCTION_OUTPUT_LIMIT;
+    state->function_workers = DEFAULT_FUNCTION_WORKERS;
+
+    // Requests share HTTP/2 connections where the server supports it.
+    state->http2 = true;
+    state->http2_max_streams = DEFAULT_HTTP2_MAX_STREAMS;
+    state->samples = 1;
+
+    // Configured routes to the API are measured in the background this often.
+    state->route_probe_interval = DEFAULT_ROUTE_PROBE_INTERVAL;
 }
 
 /**
@@ -2549,6 +4477,7 @@ void clear_session_state(AppState* state) {
 
     // Clear any files that were attached but not yet sent with a prompt.
     free_pending_attachments(state);
+    free_attachment_records(state);
 
     // Reset the session name to its default.
     strncpy(state->current_session_name, "[unsaved]", sizeof(state->current_session_name) - 1);
@@ -2788,8 +4717,24 @@ void load_configuration_from_path(AppState* state, const char* filepath) {
     json_read_string(root, "origin", state->origin, sizeof(state->origin));
     json_read_int(root, "max_output_tokens", &state->max_output_tokens);
     json_read_int(root, "thinking_budget", &state->thinking_budget);
-    json_read_bool(root, "google_grounding", &state->google_grounding);
-    json_read_bool(root, "url_context", &state->url_context);
+    json_read_int(root, "image_max_dimension", &state->image_max_dimension);
+    json_read_int(root, "compression_level", &state->compression_level);
+    json_read_int(root, "compression_min_bytes", &state->compression_min_bytes);
+    json_read_int(root, "cold_history_turns", &state->history.cold_after);
+    json_read_bool(root, "usage_ledger", &state->usage_ledger);
+    json_read_bool(root, "compact_logs", &state->compact_logs);
+    json_read_bool(root, "pdf_text", &state->pdf_text);
+    json_read_int(root, "table_profile_min_bytes", &state->table_profile_min_bytes);
+    json_read_tool_mode(root, "google_grounding", &state->google_grounding);
+    json_read_tool_mode(root, "url_context", &state->url_context);
+    json_read_limit(root, "function_timeout_ms", &state->function_timeout_ms, INT_MAX, filepath);
+    json_read_limit(root, "function_output_limit", &state->function_output_limit, TOOL_MAX_OUTPUT_LIMIT, filepath);
+    json_read_limit(root, "function_workers", &state->function_workers, TOOL_MAX_WORKERS, filepath);
+    json_read_bool(root, "http2", &state->http2);
+    json_read_int(root, "http2_max_streams", &state->http2_max_streams);
+    json_read_int(root, "route_probe_interval", &state->route_probe_interval);
+    load_functions(state, root, filepath);
+    load_routes(state, root, filepath);
     json_read_int(root, "top_k", &state->topK);
     json_read_float(root, "top_p", &state->topP);
 
@@ -2924,615 +4869,2811 @@ void get_api_key_securely(AppState* state) {
 }
 
 
-/**
- * @brief Constructs the main JSON request object from the application state.
- * @details This function builds the complete cJSON object that serves as the
- *          payload for a `generateContent` API call. It serializes the different
- *          parts of the AppState into the format required by the Gemini API,
- *          including the system prompt, the conversation history, tool
- *          configurations (like grounding), and generation parameters.
- * @param state A pointer to the application's current state.
- * @return A pointer to the root cJSON object of the request. The caller is
- *         responsible for freeing this object with `cJSON_Delete`. Returns
- *         NULL on failure.
+// --- Usage Ledger ---
+
+/*
+ * Every request is appended to ~/.config/gcli/usage.ledger as one binary
+ * record. gcommit and gcmd run gcli, so their requests are recorded too,
+ * tagged with the tool name they pass in GCLI_TOOL. All integers are
+ * little-endian:
+ *
+ *   u16 record length (including this field), u8 version, u8 op,
+ *   u8 attempts, u8 flags (1 = ok, 2 = cancelled), i32 status,
+ *   i64 timestamp, u32 input/output/cached/thought tokens,
+ *   u32 dns/connect/tls/ttfb/total microseconds, u32 elapsed ms,
+ *   u64 bytes sent/received, then model, tool and session as
+ *   u8 length + bytes.
+ *
+ * Readers skip records with an unknown version by their length, so fields
+ * can be added later without breaking old ledgers.
  */
-cJSON* build_request_json(AppState* state) {
-    cJSON* root = cJSON_CreateObject();
-    if (!root) return NULL;
 
-    // --- 1. Add System Instruction (if provided) ---
-    if (state->system_prompt) {
-        cJSON* sys_instruction = cJSON_CreateObject();
-        cJSON* sys_parts_array = cJSON_CreateArray();
-        cJSON* sys_part_item = cJSON_CreateObject();
+static unsigned char* put_le(unsigned char* out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; i++) *out++ = (unsigned char)(value >> (8 * i));
+    return out;
+}
 
-        cJSON_AddStringToObject(sys_part_item, "text", state->system_prompt);
+static uint64_t get_le(const unsigned char** in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) value |= (uint64_t)(*in)[i] << (8 * i);
+    *in += bytes;
+    return value;
+}
+
+static unsigned char* put_short_string(unsigned char* out, const char* str) {
+    size_t length = strlen(str);
+    if (length > 255) length = 255;
+    *out++ = (unsigned char)length;
+    memcpy(out, str, length);
+    return out + length;
+}
+
+static void get_short_string(const unsigned char** in, const unsigned char* end, char* buffer, size_t buffer_size) {
+    size_t length = *in < end ? **in : 0;
+    if (*in < end) (*in)++;
+    if (length > (size_t)(end - *in)) length = (size_t)(end - *in);
+    size_t copy = length < buffer_size - 1 ? length : buffer_size - 1;
+    memcpy(buffer, *in, copy);
+    buffer[copy] = '\0';
+    *in += length;
+}
+
+/**
+ * @brief Builds the path of the usage ledger (empty on failure).
+ */
+static void get_usage_ledger_path(char* buffer, size_t buffer_size) {
+    char base_app_path[PATH_MAX];
+    get_base_app_path(base_app_path, sizeof(base_app_path));
+    if (base_app_path[0] == '\0') {
+        buffer[0] = '\0';
+        return;
+    }
+#ifdef _WIN32
+    int written = snprintf(buffer, buffer_size, "%s\\%s", base_app_path, USAGE_LEDGER_FILE);
+#else
+    int written = snprintf(buffer, buffer_size, "%s/%s", base_app_path, USAGE_LEDGER_FILE);
+#endif
+    // A truncated path would name some other file; record nothing instead.
+    if (written < 0 || (size_t)written >= buffer_size) buffer[0] = '\0';
+}
+
+static uint32_t clamp_u32(curl_off_t value) {
+    if (value < 0) return 0;
+    return value > UINT32_MAX ? UINT32_MAX : (uint32_t)value;
+}
+
+/**
+ * @brief Starts recording a request in `state->usage`.
+ */
+static void usage_begin(AppState* state, UsageOp op) {
+    UsageRecord* usage = &state->usage;
+    memset(usage, 0, sizeof(*usage));
+    usage->timestamp = (int64_t)time(NULL);
+    usage->started = monotonic_seconds();
+    usage->op = (uint8_t)op;
+    snprintf(usage->model, sizeof(usage->model), "%s", state->model_name);
+    const char* tool = getenv("GCLI_TOOL");
+    snprintf(usage->tool, sizeof(usage->tool), "%s", tool && *tool ? tool : "gcli");
+    snprintf(usage->session, sizeof(usage->session), "%s", state->current_session_name);
+}
+
+/**
+ * @brief Adds one finished transfer (attempt) to the request being recorded.
+ * @details Latency phases and the protocol are those of the last attempt;
+ *          byte counts add up.
+ * @param usage The request being recorded (usually `state->usage`).
+ * @param transfer The finished transfer.
+ * @param http_code The result as returned to callers: HTTP status or -CURLcode.
+ */
+static void usage_note_transfer(UsageRecord* usage, const HttpTransfer* transfer, long http_code) {
+    CURL* curl = transfer->curl;
+    curl_off_t dns = 0, connect = 0, tls = 0, ttfb = transfer_response_us(transfer), total = 0, sent = 0, received = 0;
+    long version = 0, connects = 0;
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &sent);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &received);
+    curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &version);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+
+    if (usage->attempts < UINT8_MAX) usage->attempts++;
+    usage->status = (int32_t)http_code;
+    usage->dns_us = clamp_u32(dns);
+    usage->connect_us = clamp_u32(connect);
+    usage->tls_us = clamp_u32(tls);
+    usage->ttfb_us = clamp_u32(ttfb);
+    usage->total_us = clamp_u32(total);
+    usage->bytes_sent += sent > 0 ? (uint64_t)sent : 0;
+    usage->bytes_received += received > 0 ? (uint64_t)received : 0;
+    usage->http = version == CURL_HTTP_VERSION_1_0 || version == CURL_HTTP_VERSION_1_1 ? USAGE_HTTP_1 :
+                  version == CURL_HTTP_VERSION_2_0 ? USAGE_HTTP_2 :
+                  version == CURL_HTTP_VERSION_3 ? USAGE_HTTP_3 : 0;
+    if (usage->http && connects > 0) usage->http |= USAGE_HTTP_NEW_CONNECTION;
+}
+
+/**
+ * @brief Copies the token counts of a response's `usageMetadata`.
+ */
+static void usage_read_metadata(UsageRecord* usage, const cJSON* metadata) {
+    const cJSON* item;
+    if ((item = cJSON_GetObjectItem(metadata, "promptTokenCount")) && cJSON_IsNumber(item)) usage->input_tokens = (uint32_t)item->valuedouble;
+    if ((item = cJSON_GetObjectItem(metadata, "candidatesTokenCount")) && cJSON_IsNumber(item)) usage->output_tokens = (uint32_t)item->valuedouble;
+    if ((item = cJSON_GetObjectItem(metadata, "cachedContentTokenCount")) && cJSON_IsNumber(item)) usage->cached_tokens = (uint32_t)item->valuedouble;
+    if ((item = cJSON_GetObjectItem(metadata, "thoughtsTokenCount")) && cJSON_IsNumber(item)) usage->thought_tokens = (uint32_t)item->valuedouble;
+}
+
+/**
+ * @brief Completes the request being recorded and appends it to the ledger.
+ * @details The record is written with a single fwrite on a file opened for
+ *          appending, so concurrent gcli processes (e.g. `gcommit -j`) do not
+ *          interleave records. Failing to write is silently ignored.
+ */
+static void usage_finish(AppState* state, bool ok) {
+    UsageRecord* usage = &state->usage;
+    if (!state->usage_ledger || usage->attempts == 0) return;
+    usage->ok = ok;
+    usage->cancelled = state->request_cancelled;
+    double elapsed_ms = (monotonic_seconds() - usage->started) * 1000.0;
+    usage->elapsed_ms = elapsed_ms > UINT32_MAX ? UINT32_MAX : (uint32_t)elapsed_ms;
+
+    unsigned char record[USAGE_RECORD_FIXED_SIZE + 3 * 256 + 1];
+    unsigned char* out = record + 2; // Length goes first, once known.
+    out = put_le(out, USAGE_RECORD_VERSION, 1);
+    out = put_le(out, usage->op, 1);
+    out = put_le(out, usage->attempts, 1);
+    out = put_le(out, (usage->ok ? 1 : 0) | (usage->cancelled ? 2 : 0) | (usage->tools << 2), 1);
+    out = put_le(out, (uint32_t)usage->status, 4);
+    out = put_le(out, (uint64_t)usage->timestamp, 8);
+    out = put_le(out, usage->input_tokens, 4);
+    out = put_le(out, usage->output_tokens, 4);
+    out = put_le(out, usage->cached_tokens, 4);
+    out = put_le(out, usage->thought_tokens, 4);
+    out = put_le(out, usage->dns_us, 4);
+    out = put_le(out, usage->connect_us, 4);
+    out = put_le(out, usage->tls_us, 4);
+    out = put_le(out, usage->ttfb_us, 4);
+    out = put_le(out, usage->total_us, 4);
+    out = put_le(out, usage->elapsed_ms, 4);
+    out = put_le(out, usage->bytes_sent, 8);
+    out = put_le(out, usage->bytes_received, 8);
+    out = put_short_string(out, usage->model);
+    out = put_short_string(out, usage->tool);
+    out = put_short_string(out, usage->session);
+    out = put_le(out, usage->http, 1); // Optional trailing field; older readers skip it.
+    size_t length = (size_t)(out - record);
+    put_le(record, length, 2);
+
+    char path[PATH_MAX];
+    get_usage_ledger_path(path, sizeof(path));
+    if (path[0] == '\0') return;
+    FILE* file = fopen(path, "ab");
+    if (!file) return;
+    fwrite(record, 1, length, file);
+    fclose(file);
+}
+
+/**
+ * @brief Decodes one ledger record.
+ * @param in Cursor into the ledger data; advanced past the record.
+ * @param end End of the ledger data.
+ * @param usage Receives the record.
+ * @return 1 for a record, 0 for a record of an unknown version (skipped),
+ *         -1 at the end of the data or on a truncated record.
+ */
+static int usage_decode(const unsigned char** in, const unsigned char* end, UsageRecord* usage) {
+    if (end - *in < 3) return -1;
+    const unsigned char* start = *in;
+    size_t length = (size_t)get_le(&start, 2);
+    if (length < 3 || length > (size_t)(end - *in)) return -1;
+    const unsigned char* record_end = *in + length;
+    unsigned version = (unsigned)get_le(&start, 1);
+    if (version != USAGE_RECORD_VERSION || length < USAGE_RECORD_FIXED_SIZE) {
+        *in = record_end;
+        return 0;
+    }
+
+    memset(usage, 0, sizeof(*usage));
+    usage->op = (uint8_t)get_le(&start, 1);
+    usage->attempts = (uint8_t)get_le(&start, 1);
+    unsigned flags = (unsigned)get_le(&start, 1);
+    usage->ok = (flags & 1) != 0;
+    usage->cancelled = (flags & 2) != 0;
+    usage->tools = (uint8_t)((flags >> 2) & 0x0F);
+    usage->status = (int32_t)(uint32_t)get_le(&start, 4);
+    usage->timestamp = (int64_t)get_le(&start, 8);
+    usage->input_tokens = (uint32_t)get_le(&start, 4);
+    usage->output_tokens = (uint32_t)get_le(&start, 4);
+    usage->cached_tokens = (uint32_t)get_le(&start, 4);
+    usage->thought_tokens = (uint32_t)get_le(&start, 4);
+    usage->dns_us = (uint32_t)get_le(&start, 4);
+    usage->connect_us = (uint32_t)get_le(&start, 4);
+    usage->tls_us = (uint32_t)get_le(&start, 4);
+    usage->ttfb_us = (uint32_t)get_le(&start, 4);
+    usage->total_us = (uint32_t)get_le(&start, 4);
+    usage->elapsed_ms = (uint32_t)get_le(&start, 4);
+    usage->bytes_sent = get_le(&start, 8);
+    usage->bytes_received = get_le(&start, 8);
+    get_short_string(&start, record_end, usage->model, sizeof(usage->model));
+    get_short_string(&start, record_end, usage->tool, sizeof(usage->tool));
+    get_short_string(&start, record_end, usage->session, sizeof(usage->session));
+    if (start < record_end) usage->http = (uint8_t)get_le(&start, 1);
+    *in = record_end;
+    return 1;
+}
+
+/**
+ * @brief Names the tools a recorded request carried and how they were chosen,
+ *        e.g. "search (auto)" or "url+search (fixed)", for `--report tools`.
+ */
+static void usage_tools_key(const UsageRecord* usage, char* key, size_t key_size) {
+    if (usage->op != USAGE_OP_GENERATE || !(usage->tools & USAGE_TOOL_RECORDED)) {
+        snprintf(key, key_size, "(not recorded)");
+        return;
+    }
+    bool url = (usage->tools & USAGE_TOOL_URL_CONTEXT) != 0, search = (usage->tools & USAGE_TOOL_GROUNDING) != 0;
+    snprintf(key, key_size, "%s (%s)", url && search ? "url+search" : url ? "url" : search ? "search" : "none",
+             (usage->tools & USAGE_TOOL_AUTO) ? "auto" : "fixed");
+}
+
+typedef struct {
+    char key[128];
+    long requests, errors, retried, cache_hits;
+    long new_connections;  // Requests whose last transfer opened a connection.
+    uint64_t input_tokens, output_tokens;
+    uint32_t* latencies;   // elapsed_ms of every request.
+    uint32_t* ttfbs;       // Time to first byte (ms) of every completed request.
+    size_t num_ttfbs, capacity;
+} UsageGroup;
+
+static int compare_u32(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int compare_usage_groups(const void* a, const void* b) {
+    return strcmp(((const UsageGroup*)a)->key, ((const UsageGroup*)b)->key);
+}
+
+/**
+ * @brief Nearest-rank percentile of a sorted array (0 if empty).
+ */
+static uint32_t percentile(const uint32_t* sorted, size_t count, int p) {
+    if (count == 0) return 0;
+    size_t rank = (count * (size_t)p + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * @brief Prints the usage ledger aggregated by day, model, tool, session, tools
+ *        or protocol.
+ * @details Reports request, error and retry counts, the share of requests
+ *          served partly from the context cache, token totals, and latency
+ *          percentiles (wall time including retries, and time to first byte).
+ *          Grouped by protocol, it also reports how many connections were
+ *          opened, i.e. HTTP/1.1 connections against HTTP/2 streams.
+ * @param group_by "day", "model", "tool", "session", "tools" (the server-side
+ *                 tools each request carried, to compare latency with and without
+ *                 them) or "protocol" (the HTTP version of the last transfer).
+ * @return false if the ledger could not be read.
+ */
+static bool print_usage_report(const char* group_by) {
+    char path[PATH_MAX];
+    get_usage_ledger_path(path, sizeof(path));
+    FILE* file = path[0] ? fopen(path, "rb") : NULL;
+    if (!file) {
+        if (path[0] && errno == ENOENT) {
+            fprintf(stderr, "No usage recorded yet (%s).\n", path);
+            return true;
+        }
+        fprintf(stderr, "Error: Cannot open usage ledger %s\n", path[0] ? path : USAGE_LEDGER_FILE);
+        return false;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char* data = malloc(length > 0 ? (size_t)length : 1);
+    if (!data || fread(data, 1, (size_t)length, file) != (size_t)length) {
+        fprintf(stderr, "Error: Failed to read %s\n", path);
+        fclose(file);
+        free(data);
+        return false;
+    }
+    fclose(file);
+
+    UsageGroup* groups = NULL;
+    size_t num_groups = 0, total = 0;
+    bool ok = true;
+    const unsigned char* cursor = data;
+    const unsigned char* end = data + length;
+    UsageRecord usage;
+    int status;
+    while ((status = usage_decode(&cursor, end, &usage)) >= 0) {
+        if (status == 0) continue;
+        char key[128];
+        if (strcmp(group_by, "model") == 0) {
+            snprintf(key, sizeof(key), "%s", usage.op == USAGE_OP_FREE ? "(free mode)" : usage.model);
+        } else if (strcmp(group_by, "tool") == 0) {
+            snprintf(key, sizeof(key), "%s", usage.tool);
+        } else if (strcmp(group_by, "session") == 0) {
+            snprintf(key, sizeof(key), "%s", usage.session);
+        } else if (strcmp(group_by, "tools") == 0) {
+            usage_tools_key(&usage, key, sizeof(key));
+        } else if (strcmp(group_by, "protocol") == 0) {
+            unsigned version = usage.http & USAGE_HTTP_VERSION_MASK;
+            snprintf(key, sizeof(key), "%s", version == USAGE_HTTP_1 ? "HTTP/1.1" : version == USAGE_HTTP_2 ? "HTTP/2" :
+                                             version == USAGE_HTTP_3 ? "HTTP/3" : "(not recorded)");
+        } else {
+            time_t when = (time_t)usage.timestamp;
+            struct tm* local = localtime(&when);
+            if (!local || strftime(key, sizeof(key), "%Y-%m-%d", local) == 0) snprintf(key, sizeof(key), "?");
+        }
+
+        UsageGroup* group = NULL;
+        for (size_t i = 0; i < num_groups; i++) {
+            if (strcmp(groups[i].key, key) == 0) {
+                group = &groups[i];
+                break;
+            }
+        }
+        if (!group) {
+            UsageGroup* grown = realloc(groups, (num_groups + 1) * sizeof(UsageGroup));
+            if (!grown) {
+                ok = false;
+                break;
+            }
+            groups = grown;
+            group = &groups[num_groups++];
+            memset(group, 0, sizeof(*group));
+            snprintf(group->key, sizeof(group->key), "%s", key);
+        }
+        if ((size_t)group->requests == group->capacity) {
+            size_t capacity = group->capacity ? group->capacity * 2 : 64;
+            uint32_t* latencies = realloc(group->latencies, capacity * sizeof(uint32_t));
+            if (latencies) group->latencies = latencies;
+            uint32_t* ttfbs = realloc(group->ttfbs, capacity * sizeof(uint32_t));
+            if (ttfbs) group->ttfbs = ttfbs;
+            if (!latencies || !ttfbs) {
+                ok = false;
+                break;
+            }
+            group->capacity = capacity;
+        }
+
+        group->latencies[group->requests++] = usage.elapsed_ms;
+        if (usage.ok) group->ttfbs[group->num_ttfbs++] = usage.ttfb_us / 1000;
+        if (!usage.ok && !usage.cancelled) group->errors++;
+        if (usage.attempts > 1) group->retried++;
+        if (usage.cached_tokens > 0) group->cache_hits++;
+        if (usage.http & USAGE_HTTP_NEW_CONNECTION) group->new_connections++;
+        group->input_tokens += usage.input_tokens;
+        group->output_tokens += usage.output_tokens;
+        total++;
+    }
+    free(data);
+
+    if (ok) {
+        qsort(groups, num_groups, sizeof(UsageGroup), compare_usage_groups);
+        printf("Usage ledger: %s (%zu requests)\n", path, total);
+        printf("%-24s %7s %6s %7s %6s %12s %12s %8s %8s %8s %9s\n", group_by, "reqs", "errors", "retried", "cache",
+               "in_tokens", "out_tokens", "p50_ms", "p90_ms", "p99_ms", "ttfb_p50");
+        for (size_t i = 0; i < num_groups; i++) {
+            UsageGroup* group = &groups[i];
+            qsort(group->latencies, group->requests, sizeof(uint32_t), compare_u32);
+            qsort(group->ttfbs, group->num_ttfbs, sizeof(uint32_t), compare_u32);
+            printf("%-24.24s %7ld %6ld %7ld %5.0f%% %12llu %12llu %8u %8u %8u %9u\n", group->key,
+                   group->requests, group->errors, group->retried, 100.0 * group->cache_hits / group->requests,
+                   (unsigned long long)group->input_tokens, (unsigned long long)group->output_tokens,
+                   percentile(group->latencies, group->requests, 50), percentile(group->latencies, group->requests, 90),
+                   percentile(group->latencies, group->requests, 99), percentile(group->ttfbs, group->num_ttfbs, 50));
+        }
+        for (size_t i = 0; strcmp(group_by, "protocol") == 0 && i < num_groups; i++) {
+            const UsageGroup* group = &groups[i];
+            if (strncmp(group->key, "HTTP/", 5) != 0) continue;
+            printf("%s: %ld %s over %ld new connections (%.1f per connection)\n", group->key, group->requests,
+                   strcmp(group->key, "HTTP/1.1") == 0 ? "requests" : "streams", group->new_connections,
+                   (double)group->requests / (group->new_connections > 0 ? group->new_connections : 1));
+        }
+    } else {
+        fprintf(stderr, "Error: Out of memory while aggregating %s\n", path);
+    }
+    for (size_t i = 0; i < num_groups; i++) {
+        free(groups[i].latencies);
+        free(groups[i].ttfbs);
+    }
+    free(groups);
+    return ok;
+}
+
+
+// --- Memory Accounting ---
+
+// Per-category counters. Global because cJSON's allocation hooks carry no context.
+static MemCounters mem_counters[MEM_CATEGORY_COUNT];
+static const char* const mem_category_names[MEM_CATEGORY_COUNT] = {
+    "History", "Attachments", "Request scratch", "cJSON", "cURL buffers"
+};
+
+/**
+ * @brief Starts accounting for a block allocated elsewhere (e.g. by strdup).
+ * @param category The category to charge.
+ * @param ptr The block; NULL is ignored.
+ */
+static void mem_track(MemCategory category, void* ptr) {
+    if (!ptr) return;
+    MemCounters* counters = &mem_counters[category];
+    size_t live = MEM_COUNTER_ADD(counters->live_bytes, MEM_BLOCK_SIZE(ptr));
+    MEM_COUNTER_ADD(counters->allocs, 1);
+    if (live > counters->peak_bytes) counters->peak_bytes = live; // Racy, but only ever low.
+}
+
+/**
+ * @brief Stops accounting for a block, either because it is about to be
+ *        freed or because its ownership moves out of the category.
+ * @param category The category the block was charged to.
+ * @param ptr The block; NULL is ignored.
+ */
+static void mem_untrack(MemCategory category, void* ptr) {
+    if (!ptr) return;
+    MEM_COUNTER_SUB(mem_counters[category].live_bytes, MEM_BLOCK_SIZE(ptr));
+    MEM_COUNTER_ADD(mem_counters[category].frees, 1);
+}
+
+static void* mem_alloc(MemCategory category, size_t size) {
+    void* ptr = malloc(size);
+    mem_track(category, ptr);
+    return ptr;
+}
+
+static void* mem_calloc(MemCategory category, size_t count, size_t size) {
+    void* ptr = calloc(count, size);
+    mem_track(category, ptr);
+    return ptr;
+}
+
+/**
+ * @brief realloc() for a tracked block. Growing a block is not counted as a
+ *        new allocation; on failure the old block stays tracked.
+ */
+static void* mem_realloc(MemCategory category, void* ptr, size_t size) {
+    if (!ptr) return mem_alloc(category, size);
+    size_t old_size = MEM_BLOCK_SIZE(ptr);
+    void* resized = realloc(ptr, size);
+    if (!resized) return NULL;
+    MemCounters* counters = &mem_counters[category];
+    MEM_COUNTER_SUB(counters->live_bytes, old_size);
+    size_t live = MEM_COUNTER_ADD(counters->live_bytes, MEM_BLOCK_SIZE(resized));
+    if (live > counters->peak_bytes) counters->peak_bytes = live;
+    return resized;
+}
+
+static char* mem_strdup(MemCategory category, const char* str) {
+    char* copy = strdup(str);
+    mem_track(category, copy);
+    return copy;
+}
+
+static void mem_free(MemCategory category, void* ptr) {
+    mem_untrack(category, ptr);
+    free(ptr);
+}
+
+/**
+ * @brief Charges all of a freshly built part's strings to a category.
+ */
+static void track_part(MemCategory category, const Part* part) {
+    mem_track(category, part->text);
+    mem_track(category, part->mime_type);
+    mem_track(category, part->base64_data);
+    mem_track(category, part->filename);
+}
+
+/**
+ * @brief Frees all of a part's strings (and cold payload) and clears them.
+ */
+static void release_part(MemCategory category, Part* part) {
+    mem_free(category, part->text);
+    mem_free(category, part->mime_type);
+    mem_free(category, part->base64_data);
+    mem_free(category, part->filename);
+    free_cold_payload(part);
+    part->text = part->mime_type = part->base64_data = part->filename = NULL;
+}
+
+static void* CJSON_CDECL json_malloc(size_t size) {
+    return mem_alloc(MEM_JSON, size);
+}
+
+static void CJSON_CDECL json_free(void* ptr) {
+    mem_free(MEM_JSON, ptr);
+}
+
+static void* curl_mem_malloc(size_t size) { return mem_alloc(MEM_CURL, size); }
+static void curl_mem_free(void* ptr) { mem_free(MEM_CURL, ptr); }
+static void* curl_mem_realloc(void* ptr, size_t size) { return mem_realloc(MEM_CURL, ptr, size); }
+static char* curl_mem_strdup(const char* str) { return mem_strdup(MEM_CURL, str); }
+static void* curl_mem_calloc(size_t count, size_t size) { return mem_calloc(MEM_CURL, count, size); }
+
+/**
+ * @brief Initializes cURL globally and routes cURL's and cJSON's allocations
+ *        through the accounting wrappers.
+ * @details Must run before any cURL handle or cJSON object is created. cJSON
+ *          falls back from realloc to malloc-and-copy when custom hooks are
+ *          installed; request bodies and saved sessions are printed through
+ *          sinks and do not grow buffers, so this only affects small documents.
+ */
+static void mem_accounting_init(void) {
+    cJSON_Hooks hooks = { json_malloc, json_free };
+    cJSON_InitHooks(&hooks);
+    curl_global_init_mem(CURL_GLOBAL_ALL, curl_mem_malloc, curl_mem_free, curl_mem_realloc, curl_mem_strdup, curl_mem_calloc);
+}
+
+/**
+ * @brief Returns the process's peak resident set size in bytes (0 if unknown).
+ */
+static size_t peak_rss_bytes(void) {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return (size_t)usage.ru_maxrss;        // Bytes on macOS.
+#else
+    return (size_t)usage.ru_maxrss * 1024; // Kilobytes elsewhere.
+#endif
+#endif
+}
+
+/**
+ * @brief Prints live and peak heap usage per category plus peak RSS, for
+ *        `/mem` and `--mem-report`.
+ * @details Sizes are usable block sizes as reported by the allocator, so they
+ *          include allocator rounding. Memory owned by libraries (curl's
+ *          handles, zlib state, image decoders) is only visible in the RSS.
+ */
+static void print_memory_report(void) {
+    size_t live_total = 0, allocs_total = 0, frees_total = 0;
+    fprintf(stderr, "--- Memory ---\n");
+    fprintf(stderr, "%-16s %12s %12s %10s %10s\n", "Category", "Live KB", "Peak KB", "Allocs", "Frees");
+    for (int i = 0; i < MEM_CATEGORY_COUNT; i++) {
+        const MemCounters* counters = &mem_counters[i];
+        fprintf(stderr, "%-16s %12.1f %12.1f %10zu %10zu\n", mem_category_names[i],
+                counters->live_bytes / 1024.0, counters->peak_bytes / 1024.0, counters->allocs, counters->frees);
+        live_total += counters->live_bytes;
+        allocs_total += counters->allocs;
+        frees_total += counters->frees;
+    }
+    fprintf(stderr, "%-16s %12.1f %12s %10zu %10zu\n", "Total", live_total / 1024.0, "", allocs_total, frees_total);
+#ifdef MEM_NO_BLOCK_SIZE
+    fprintf(stderr, "(Block sizes are not available on this platform; only counts are tracked.)\n");
+#endif
+    size_t rss = peak_rss_bytes();
+    if (rss > 0) fprintf(stderr, "Peak RSS: %.1f KB\n", rss / 1024.0);
+    else fprintf(stderr, "Peak RSS: not available\n");
+}
+
+
+// --- Cold History Storage ---
+
+/**
+ * @brief Decodes standard, padded Base64 as produced by `base64_encode`.
+ * @param input The Base64 text.
+ * @param length Its length in bytes.
+ * @param out_length Receives the decoded length.
+ * @return The decoded bytes (caller frees), or NULL on malformed input.
+ */
+static unsigned char* base64_decode(const char* input, size_t length, size_t* out_length) {
+    static signed char table[256];
+    static bool table_ready = false;
+    if (!table_ready) {
+        static const char b64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        memset(table, -1, sizeof(table));
+        for (int i = 0; i < 64; i++) table[(unsigned char)b64_chars[i]] = (signed char)i;
+        table_ready = true;
+    }
+
+    if (length % 4 != 0) return NULL;
+    size_t padding = 0;
+    if (length > 0 && input[length - 1] == '=') padding++;
+    if (length > 1 && input[length - 2] == '=') padding++;
+
+    unsigned char* out = malloc(length / 4 * 3 + 1);
+    if (!out) return NULL;
+
+    size_t o = 0;
+    for (size_t i = 0; i < length; i += 4) {
+        uint32_t triple = 0;
+        for (int k = 0; k < 4; k++) {
+            unsigned char c = (unsigned char)input[i + k];
+            int v = table[c];
+            if (c == '=' && i + k >= length - padding) v = 0;
+            else if (v < 0) {
+                free(out);
+                return NULL;
+            }
+            triple = (triple << 6) | (uint32_t)v;
+        }
+        out[o++] = (unsigned char)(triple >> 16);
+        out[o++] = (unsigned char)(triple >> 8);
+        out[o++] = (unsigned char)triple;
+    }
+    *out_length = o - padding;
+    return out;
+}
+
+/**
+ * @brief Releases a part's compressed representation, if any.
+ */
+static void free_cold_payload(Part* part) {
+    if (part->cold) {
+        mem_free(MEM_HISTORY, part->cold->data);
+        mem_free(MEM_HISTORY, part->cold);
+        part->cold = NULL;
+    }
+}
+
+/**
+ * @brief Compresses a history part in place ("freezes" it).
+ * @details Attachments are stored as their decoded bytes rather than Base64,
+ *          and deflated only when that makes them smaller (images usually are
+ *          compressed already). Text is deflated. The expanded field is freed;
+ *          `part_payload` restores it on demand. Small parts are left alone.
+ * @param part The part to freeze.
+ * @return true if the part is now cold.
+ */
+static bool freeze_part(Part* part) {
+    if (part->cold) return true;
+    char** field = part->type != PART_TYPE_FILE ? &part->text : &part->base64_data;
+    if (!*field) return false;
+    size_t length = strlen(*field);
+    if (length < COLD_PART_MIN_BYTES) return false;
+
+    ColdPayload* cold = mem_calloc(MEM_HISTORY, 1, sizeof(ColdPayload));
+    if (!cold) return false;
+
+    // Store attachments as raw bytes, but only if they round-trip exactly.
+    const unsigned char* raw = (const unsigned char*)*field;
+    unsigned char* decoded = NULL;
+    size_t raw_size = length;
+    if (part->type == PART_TYPE_FILE && (decoded = base64_decode(*field, length, &raw_size)) != NULL) {
+        char* check = base64_encode(decoded, raw_size);
+        if (check && strcmp(check, *field) == 0) {
+            raw = decoded;
+            cold->base64 = true;
+        } else {
+            raw_size = length;
+        }
+        free(check);
+    }
+
+    uLongf packed_size = compressBound(raw_size);
+    cold->data = mem_alloc(MEM_HISTORY, packed_size);
+    if (cold->data && compress2(cold->data, &packed_size, raw, raw_size, Z_DEFAULT_COMPRESSION) == Z_OK && packed_size < raw_size) {
+        cold->deflated = true;
+        cold->size = packed_size;
+        unsigned char* shrunk = mem_realloc(MEM_HISTORY, cold->data, packed_size);
+        if (shrunk) cold->data = shrunk;
+    } else if (cold->data && cold->base64) {
+        // Deflate did not help, but dropping the Base64 still saves a quarter.
+        memcpy(cold->data, raw, raw_size);
+        cold->size = raw_size;
+        unsigned char* shrunk = mem_realloc(MEM_HISTORY, cold->data, raw_size ? raw_size : 1);
+        if (shrunk) cold->data = shrunk;
+    } else {
+        mem_free(MEM_HISTORY, cold->data);
+        mem_free(MEM_HISTORY, cold);
+        free(decoded);
+        return false;
+    }
+    cold->raw_size = raw_size;
+    free(decoded);
+
+    mem_free(MEM_HISTORY, *field);
+    *field = NULL;
+    part->cold = cold;
+    return true;
+}
+
+/**
+ * @brief Returns a part's text (text parts) or Base64 data (file parts).
+ * @details Warm parts return their field directly. Cold parts are expanded
+ *          into a new string that is handed back through `scratch`.
+ * @param part The part to read.
+ * @param scratch Receives the expanded copy, which the caller must free (or
+ *                NULL if the part was warm).
+ * @return The payload, or NULL if the part has none or expansion failed.
+ */
+static const char* part_payload(const Part* part, char** scratch) {
+    *scratch = NULL;
+    if (!part->cold) {
+        return part->type != PART_TYPE_FILE ? part->text : part->base64_data;
+    }
+
+    const ColdPayload* cold = part->cold;
+    unsigned char* raw = malloc(cold->raw_size + 1);
+    if (!raw) return NULL;
+    if (cold->deflated) {
+        uLongf raw_size = cold->raw_size;
+        if (uncompress(raw, &raw_size, cold->data, cold->size) != Z_OK || raw_size != cold->raw_size) {
+            free(raw);
+            return NULL;
+        }
+    } else {
+        memcpy(raw, cold->data, cold->raw_size);
+    }
+
+    if (cold->base64) {
+        *scratch = base64_encode(raw, cold->raw_size);
+        free(raw);
+    } else {
+        raw[cold->raw_size] = '\0';
+        *scratch = (char*)raw;
+    }
+    return *scratch;
+}
+
+/**
+ * @brief Wraps a part payload in a cJSON string node for a request.
+ * @details An expanded copy from `part_payload` is handed to cJSON as the
+ *          node's own string instead of being duplicated once more.
+ * @param payload The payload to wrap.
+ * @param scratch The expanded copy backing `payload`, or NULL if borrowed.
+ */
+static cJSON* json_string_payload(const char* payload, char* scratch) {
+    if (!scratch) return cJSON_CreateString(payload);
+    cJSON* item = cJSON_CreateStringReference(scratch);
+    if (!item) {
+        free(scratch);
+        return NULL;
+    }
+    item->type &= ~cJSON_IsReference; // cJSON_Delete now frees the copy.
+    mem_track(MEM_JSON, scratch);
+    return item;
+}
+
+/**
+ * @brief Sums up how much memory the history's payloads take.
+ * @param history The history to measure.
+ * @param expanded Receives the size of all payloads in expanded form.
+ * @param stored Receives their size as actually held in memory.
+ * @param cold_parts Receives the number of compressed parts.
+ */
+static void history_memory_usage(const History* history, size_t* expanded, size_t* stored, int* cold_parts) {
+    *expanded = *stored = 0;
+    *cold_parts = 0;
+    for (int i = 0; i < history->num_contents; i++) {
+        for (int j = 0; j < history->contents[i].num_parts; j++) {
+            const Part* part = &history->contents[i].parts[j];
+            if (part->cold) {
+                (*cold_parts)++;
+                *stored += part->cold->size;
+                *expanded += part->cold->base64 ? 4 * ((part->cold->raw_size + 2) / 3) : part->cold->raw_size;
+            } else {
+                const char* payload = part->type != PART_TYPE_FILE ? part->text : part->base64_data;
+                size_t length = payload ? strlen(payload) : 0;
+                *stored += length;
+                *expanded += length;
+            }
+        }
+    }
+}
+
+// --- Per-turn Tool Selection ---
+
+// Words suggesting a prompt needs information newer than the model's training.
+// Strong cues decide on their own; weak ones are common in technical prompts
+// ("the current directory", "a release build") and need a second cue.
+static const char* const FRESHNESS_STRONG_WORDS[] = {
+    "latest", "today", "today's", "tonight", "yesterday", "tomorrow", "news", "headline", "headlines",
+    "weather", "forecast", "stock", "stocks", "price", "prices", "election", "elections", "trending",
+    "upcoming", "nowadays", NULL
+};
+static const char* const FRESHNESS_WEAK_WORDS[] = {
+    "current", "currently", "recent", "recently", "newest", "release", "released", "announced", NULL
+};
+#define FRESHNESS_THRESHOLD 2
+
+static const char* tool_mode_name(ToolMode mode) {
+    return mode == TOOL_AUTO ? "AUTO" : mode == TOOL_ON ? "ON" : "OFF";
+}
+
+/**
+ * @brief Parses "on", "off" or "auto" (any case).
+ * @return false, leaving `mode` unchanged, for anything else.
+ */
+static bool parse_tool_mode(const char* text, ToolMode* mode) {
+    if (STRCASECMP(text, "on") == 0) *mode = TOOL_ON;
+    else if (STRCASECMP(text, "off") == 0) *mode = TOOL_OFF;
+    else if (STRCASECMP(text, "auto") == 0) *mode = TOOL_AUTO;
+    else return false;
+    return true;
+}
+
+/**
+ * @return The index of `word` in a NULL-terminated list, or -1.
+ */
+static int find_word(const char* const* list, const char* word) {
+    for (int i = 0; list[i]; i++) {
+        if (strcmp(list[i], word) == 0) return i;
+    }
+    return -1;
+}
+
+/**
+ * @brief Checks text for something URL context could fetch: an http(s)://
+ *        or www. address.
+ */
+static bool text_mentions_url(const char* text, size_t length) {
+    static const char* const prefixes[] = { "https://", "http://", "www." };
+    for (size_t i = 0; i < length; i++) {
+        char c = (char)tolower((unsigned char)text[i]);
+        if ((c != 'h' && c != 'w') || (i > 0 && isalnum((unsigned char)text[i - 1]))) continue;
+        for (size_t p = 0; p < sizeof(prefixes) / sizeof(prefixes[0]); p++) {
+            size_t n = strlen(prefixes[p]), k = 0;
+            if (length - i <= n) continue; // Needs at least one character after the prefix.
+            while (k < n && tolower((unsigned char)text[i + k]) == prefixes[p][k]) k++;
+            if (k == n && !isspace((unsigned char)text[i + n])) return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Checks a prompt part, or a text attachment, for URLs.
+ * @details Binary attachments (images, PDFs) are never scanned.
+ */
+static bool part_mentions_url(const Part* part) {
+    if (part->type != PART_TYPE_TEXT && part->type != PART_TYPE_FILE) return false;
+    if (part->type == PART_TYPE_FILE && !(part->mime_type && content_mime_is_text(part->mime_type))) return false;
+    char* scratch = NULL;
+    const char* payload = part_payload(part, &scratch);
+    bool found = false;
+    if (payload && part->type == PART_TYPE_TEXT) {
+        found = text_mentions_url(payload, strlen(payload));
+    } else if (payload) {
+        size_t size = 0;
+        unsigned char* decoded = base64_decode(payload, strlen(payload), &size);
+        if (decoded) found = text_mentions_url((const char*)decoded, size);
+        free(decoded);
+    }
+    free(scratch);
+    return found;
+}
+
+/**
+ * @brief Scores how strongly a prompt asks for fresh information.
+ * @details A bag-of-words classifier: strong cue words (news, weather, latest)
+ *          count 2, and so do phrases like "this week", "right now" or "who won"
+ *          and years around the present one. Weak ones (current, recent) count
+ *          1, each only once.
+ * @param text The prompt.
+ * @param this_year The current year, or 0 if unknown.
+ */
+static int freshness_score(const char* text, int this_year) {
+    int score = 0;
+    unsigned weak_seen = 0;
+    char word[16], previous[16] = "";
+    const char* p = text;
+    while (*p) {
+        if (!isalnum((unsigned char)*p)) {
+            p++;
+            continue;
+        }
+        size_t n = 0;
+        while (isalnum((unsigned char)*p) || *p == '\'') {
+            if (n < sizeof(word) - 1) word[n++] = (char)tolower((unsigned char)*p);
+            p++;
+        }
+        word[n] = '\0';
+
+        int year = n == 4 && isdigit((unsigned char)word[0]) ? atoi(word) : 0;
+        if ((strcmp(previous, "this") == 0 && (strcmp(word, "week") == 0 || strcmp(word, "month") == 0 ||
+                                               strcmp(word, "year") == 0 || strcmp(word, "season") == 0)) ||
+            (strcmp(previous, "right") == 0 && strcmp(word, "now") == 0) ||
+            (strcmp(previous, "who") == 0 && strcmp(word, "won") == 0) ||
+            (this_year > 0 && year >= this_year - 1 && year <= this_year + 1)) {
+            score += 2;
+        } else if (find_word(FRESHNESS_STRONG_WORDS, word) >= 0) {
+            score += 2;
+        } else {
+            int weak = find_word(FRESHNESS_WEAK_WORDS, word);
+            if (weak >= 0 && !(weak_seen & (1u << weak))) {
+                weak_seen |= 1u << weak;
+                score += 1;
+            }
+        }
+        memcpy(previous, word, n + 1);
+    }
+    return score;
+}
+
+/**
+ * @brief Decides which server-side tools the next request carries.
+ * @details Tools set to on or off are taken as they are. In auto mode they are
+ *          decided from the turn being answered (the last user content that is
+ *          not just function results, so the tools of a prompt stay on for
+ *          its function-call rounds): URL context when its prompt or text
+ *          attachments contain a URL, and
+ *          Google Search grounding when `freshness_score` of the typed prompt
+ *          reaches FRESHNESS_THRESHOLD. Attachments are not classified for
+ *          grounding: they are what the prompt is about, not what it asks.
+ *          Either tool adds server-side latency to every turn it is sent with.
+ * @return USAGE_TOOL_* bits, as recorded in the usage ledger.
+ */
+static uint8_t choose_tools(const AppState* state) {
+    uint8_t tools = USAGE_TOOL_RECORDED;
+    if (state->url_context == TOOL_ON) tools |= USAGE_TOOL_URL_CONTEXT;
+    if (state->google_grounding == TOOL_ON) tools |= USAGE_TOOL_GROUNDING;
+    if (state->url_context != TOOL_AUTO && state->google_grounding != TOOL_AUTO) return tools;
+    tools |= USAGE_TOOL_AUTO;
+
+    const Content* turn = NULL;
+    for (int i = state->history.num_contents - 1; i >= 0 && !turn; i--) {
+        const Content* content = &state->history.contents[i];
+        if (strcmp(content->role, "user") != 0) continue;
+        for (int j = 0; j < content->num_parts && !turn; j++) {
+            if (content->parts[j].type != PART_TYPE_FUNCTION_RESPONSE) turn = content;
+        }
+    }
+    if (!turn) return tools;
+
+    time_t now = time(NULL);
+    struct tm* local = localtime(&now);
+    int this_year = local ? local->tm_year + 1900 : 0;
+    int score = 0;
+    for (int i = 0; i < turn->num_parts; i++) {
+        const Part* part = &turn->parts[i];
+        if (state->url_context == TOOL_AUTO && !(tools & USAGE_TOOL_URL_CONTEXT) && part_mentions_url(part)) {
+            tools |= USAGE_TOOL_URL_CONTEXT;
+        }
+        if (state->google_grounding == TOOL_AUTO && part->type == PART_TYPE_TEXT && !part->filename) {
+            char* scratch = NULL;
+            const char* text = part_payload(part, &scratch);
+            if (text) score += freshness_score(text, this_year);
+            free(scratch);
+        }
+    }
+    if (state->google_grounding == TOOL_AUTO && score >= FRESHNESS_THRESHOLD) tools |= USAGE_TOOL_GROUNDING;
+    return tools;
+}
+
+/**
+ * @brief Constructs the main JSON request object from the application state.
+ * @details This function builds the complete cJSON object that serves as the
+ *          payload for a `generateContent` API call. It serializes the different
+ *          parts of the AppState into the format required by the Gemini API,
+ *          including the system prompt, the conversation history, tool
+ *          configurations (like grounding), and generation parameters.
+ *          The tools chosen for the turn are noted in `state->usage`.
+ * @param state A pointer to the application's current state.
+ * @return A pointer to the root cJSON object of the request. The caller is
+ *         responsible for freeing this object with `cJSON_Delete`. Returns
+ *         NULL on failure.
+ */
+cJSON* build_request_json(AppState* state) {
+    cJSON* root = cJSON_CreateObject();
+    if (!root) return NULL;
+
+    // --- 1. Add System Instruction (if provided) ---
+    if (state->system_prompt) {
+        cJSON* sys_instruction = cJSON_CreateObject();
+        cJSON* sys_parts_array = cJSON_CreateArray();
+        cJSON* sys_part_item = cJSON_CreateObject();
+
+        cJSON_AddStringToObject(sys_part_item, "text", state->system_prompt);
         cJSON_AddItemToArray(sys_parts_array, sys_part_item);
         cJSON_AddItemToObject(sys_instruction, "parts", sys_parts_array);
         cJSON_AddItemToObject(root, "systemInstruction", sys_instruction);
     }
 
-    // --- 2. Add Contents (the conversation history) ---
-    cJSON* contents = cJSON_CreateArray();
-    cJSON_AddItemToObject(root, "contents", contents);
-    for (int i = 0; i < state->history.num_contents; i++) {
-        cJSON* content_item = cJSON_CreateObject();
-        cJSON_AddStringToObject(content_item, "role", state->history.contents[i].role);
+    // --- 2. Add Contents (the conversation history) ---
+    cJSON* contents = cJSON_CreateArray();
+    cJSON_AddItemToObject(root, "contents", contents);
+    for (int i = 0; i < state->history.num_contents; i++) {
+        cJSON* content_item = cJSON_CreateObject();
+        cJSON_AddStringToObject(content_item, "role", state->history.contents[i].role);
+
+        cJSON* parts_array = cJSON_CreateArray();
+        cJSON_AddItemToObject(content_item, "parts", parts_array);
+
+        for (int j = 0; j < state->history.contents[i].num_parts; j++) {
+            Part* current_part = &state->history.contents[i].parts[j];
+            cJSON* part_item = cJSON_CreateObject();
+
+            // Cold parts are expanded here; the expanded copy goes into the tree as-is.
+            char* scratch = NULL;
+            const char* payload = part_payload(current_part, &scratch);
+            if (current_part->type == PART_TYPE_TEXT) {
+                if (payload) {
+                    cJSON_AddItemToObject(part_item, "text", json_string_payload(payload, scratch));
+                }
+            } else if (current_part->type != PART_TYPE_FILE) {
+                // Function calls and responses are stored as the part object itself.
+                cJSON* stored = payload ? cJSON_Parse(payload) : NULL;
+                free(scratch);
+                if (cJSON_IsObject(stored)) {
+                    cJSON_Delete(part_item);
+                    part_item = stored;
+                } else {
+                    cJSON_Delete(stored);
+                }
+            } else { // PART_TYPE_FILE
+                cJSON* inline_data = cJSON_CreateObject();
+                cJSON_AddStringToObject(inline_data, "mimeType", current_part->mime_type);
+                if (payload) {
+                    cJSON_AddItemToObject(inline_data, "data", json_string_payload(payload, scratch));
+                }
+                cJSON_AddItemToObject(part_item, "inlineData", inline_data);
+            }
+            cJSON_AddItemToArray(parts_array, part_item);
+        }
+        cJSON_AddItemToArray(contents, content_item);
+    }
+
+    // --- 3. Add Tools Configuration ---
+    // Only add the "tools" object if at least one tool is enabled for this turn.
+    uint8_t tools = choose_tools(state);
+    state->usage.tools = tools;
+    bool declare_functions = state->use_functions && cJSON_GetArraySize(state->functions) > 0;
+    if ((tools & (USAGE_TOOL_URL_CONTEXT | USAGE_TOOL_GROUNDING)) || declare_functions) {
+        cJSON* tools_array = cJSON_CreateArray();
+        if (declare_functions) {
+            cJSON* tool0 = cJSON_CreateObject();
+            cJSON_AddItemToObject(tool0, "functionDeclarations", build_function_declarations(state->functions));
+            cJSON_AddItemToArray(tools_array, tool0);
+        }
+        if (tools & USAGE_TOOL_URL_CONTEXT) {
+            cJSON* tool1 = cJSON_CreateObject();
+            cJSON_AddItemToObject(tool1, "urlContext", cJSON_CreateObject());
+            cJSON_AddItemToArray(tools_array, tool1);
+        }
+        if (tools & USAGE_TOOL_GROUNDING) {
+            cJSON* tool2 = cJSON_CreateObject();
+            cJSON_AddItemToObject(tool2, "googleSearch", cJSON_CreateObject());
+            cJSON_AddItemToArray(tools_array, tool2);
+        }
+        cJSON_AddItemToObject(root, "tools", tools_array);
+    }
+
+    // --- 4. Add Generation Configuration ---
+    cJSON* gen_config = cJSON_CreateObject();
+    cJSON_AddNumberToObject(gen_config, "temperature", state->temperature);
+    cJSON_AddNumberToObject(gen_config, "maxOutputTokens", state->max_output_tokens);
+    cJSON_AddNumberToObject(gen_config, "seed", state->seed);
+    if (state->topK > 0) {
+        cJSON_AddNumberToObject(gen_config, "topK", state->topK);
+    }
+    if (state->topP > 0.0f) {
+        cJSON_AddNumberToObject(gen_config, "topP", state->topP);
+    }
+
+    // Add thinking budget as a sub-object within generationConfig.
+    cJSON* thinking_config = cJSON_CreateObject();
+    cJSON_AddNumberToObject(thinking_config, "thinkingBudget", state->thinking_budget);
+    cJSON_AddItemToObject(gen_config, "thinkingConfig", thinking_config);
+
+    // Structured output: the model is constrained to JSON matching the schema.
+    if (state->response_schema) {
+        cJSON_AddStringToObject(gen_config, "responseMimeType", "application/json");
+        cJSON_AddItemToObject(gen_config, "responseSchema", cJSON_Duplicate(state->response_schema, true));
+    }
+
+    cJSON_AddItemToObject(root, "generationConfig", gen_config);
+
+    return root;
+}
+
+/**
+ * @brief Parses a JSON error response from the API and prints a clean message.
+ * @details When an API call fails, the body of the HTTP response often contains
+ *          a JSON object with error details. This function attempts to parse that
+ *          JSON, find the "message" field within the "error" object, and print
+ *          it to stderr for the user. If parsing fails, it prints the raw
+ *          buffer as a fallback.
+ * @param error_buffer The raw response body received from a failed API call.
+ */
+void parse_and_print_error_json(const char* error_buffer) {
+    if (!error_buffer) return;
+
+    // The actual JSON object may be preceded by other text in the error buffer.
+    // Find the opening brace to ensure we parse only the JSON part.
+    const char* json_start = strchr(error_buffer, '{');
+    if (!json_start) {
+        // If no JSON object is found, print the raw error buffer as-is.
+        fprintf(stderr, "API Error: %s\n", error_buffer);
+        return;
+    }
+
+    cJSON* root = cJSON_Parse(json_start);
+    if (!root) {
+        // If parsing fails, we can't extract a specific message.
+        return;
+    }
+
+    cJSON* error = cJSON_GetObjectItem(root, "error");
+    if (error) {
+        cJSON* message = cJSON_GetObjectItem(error, "message");
+        if (cJSON_IsString(message) && message->valuestring) {
+            // Print the clean, user-friendly error message from the API.
+            fprintf(stderr, "API Error Message: %s\n", message->valuestring);
+        }
+    }
+
+    cJSON_Delete(root);
+}
+
+/**
+ * @brief A libcurl write callback for non-streaming API responses.
+ * @details This function is used for API calls that return a complete JSON
+ *          object in a single response (e.g., `countTokens`). It simply
+ *          appends all received data chunks into the MemoryStruct's buffer
+ *          until the request is finished.
+ * @param contents A pointer to the data received.
+ * @param size The size of each data member (always 1 for text).
+ * @param nmemb The number of data members received.
+ * @param userp A user-defined pointer to a MemoryStruct to store the data.
+ * @return The total number of bytes successfully handled.
+ */
+static size_t write_to_memory_struct_callback(void* contents, size_t size, size_t nmemb, void* userp) {
+    size_t realsize = size * nmemb;
+    MemoryStruct* mem = (MemoryStruct*)userp;
+
+    // Expand the buffer to accommodate the new data chunk.
+    char* ptr = mem_realloc(MEM_CURL, mem->buffer, mem->size + realsize + 1);
+    if (!ptr) {
+        fprintf(stderr, "Error: realloc failed in token count callback.\n");
+        return 0; // Signal an error to libcurl.
+    }
+    mem->buffer = ptr;
+
+    // Append the new data and update the size.
+    memcpy(&(mem->buffer[mem->size]), contents, realsize);
+    mem->size += realsize;
+    mem->buffer[mem->size] = '\0'; // Ensure the buffer is always null-terminated.
+
+    return realsize;
+}
+
+/**
+ * @brief Calculates the token count for the current conversation history.
+ * @details This function sends the current conversation contents to the Gemini
+ *          API's `countTokens` endpoint. It builds a request similar to a
+ *          standard generation request but omits unnecessary fields like
+ *          `generationConfig`. It then parses the response to extract the integer
+ *          value for the total token count.
+ * @param state The current application state, containing the history to be counted.
+ * @return The integer token count on success, or -1 on failure.
+ */
+int get_token_count(AppState* state) {
+    usage_begin(state, USAGE_OP_COUNT_TOKENS);
+
+    // Build the request JSON, which includes history and system prompt.
+    cJSON* root = build_request_json(state);
+    if (!root) return -1;
+
+    // The countTokens endpoint does not use these fields, so remove them.
+    cJSON_DeleteItemFromObject(root, "generationConfig");
+    cJSON_DeleteItemFromObject(root, "tools");
+    state->usage.tools = 0;
+
+    // Serialize and (if worthwhile) compress the payload.
+    RequestBody body;
+    bool encoded = encode_request_body(state, root, &body);
+    cJSON_Delete(root);
+    if (!encoded) {
+        fprintf(stderr, "Failed to encode payload for token count.\n");
+        return -1;
+    }
+
+    // Prepare a memory buffer for the API response.
+    MemoryStruct chunk = { .buffer = mem_alloc(MEM_CURL, 1), .size = 0 };
+    if (!chunk.buffer) {
+        mem_free(MEM_REQUEST, body.data);
+        return -1;
+    }
+    chunk.buffer[0] = '\0';
+
+    // Perform the API call to the "countTokens" endpoint.
+    long http_code = perform_api_curl_request(
+        state,
+        "countTokens",
+        &body,
+        write_to_memory_struct_callback, // Use the simple, non-streaming callback.
+        &chunk
+    );
+
+    int token_count = -1;
+    if (http_code == 200) {
+        // If successful, parse the JSON response.
+        cJSON* json_resp = cJSON_Parse(chunk.buffer);
+        if (json_resp) {
+            // Extract the "totalTokens" value.
+            cJSON* tokens = cJSON_GetObjectItem(json_resp, "totalTokens");
+            if (cJSON_IsNumber(tokens)) {
+                token_count = tokens->valueint;
+                state->usage.input_tokens = (uint32_t)token_count;
+            }
+            cJSON_Delete(json_resp);
+        }
+    } else {
+        // On failure, print the error.
+        fprintf(stderr, "Token count API call failed (HTTP code: %ld)\n", http_code);
+        if (http_code < 0) fprintf(stderr, "Curl error: %s\n", curl_easy_strerror(-http_code));
+        parse_and_print_error_json(chunk.buffer);
+    }
+
+    // Clean up resources.
+    mem_free(MEM_REQUEST, body.data);
+    mem_free(MEM_CURL, chunk.buffer);
+    usage_finish(state, token_count >= 0);
+    return token_count;
+}
+
+/**
+ * @brief cJSON print sink that writes printed JSON to a FILE stream.
+ */
+static cJSON_bool file_json_sink(const char* data, size_t length, void* context) {
+    return fwrite(data, 1, length, (FILE*)context) == length;
+}
+
+/**
+ * @brief Saves the current conversation state to a JSON file.
+ * @details This function serializes the entire application state, including the
+ *          conversation history, system prompt, and configuration, into a JSON
+ *          object using `build_request_json`. It then saves this JSON to the
+ *          specified file path, allowing a session to be resumed later.
+ * @param state A pointer to the current application state to be saved.
+ * @param filepath The path of the file where the history will be saved.
+ */
+void save_history_to_file(AppState* state, const char* filepath) {
+    FILE* file = fopen(filepath, "w");
+    if (!file) {
+        perror("Failed to open file for writing");
+        return;
+    }
+
+    // Use the existing function to build a complete JSON representation of the state.
+    cJSON* root = build_request_json(state);
+    if (!root) {
+        fclose(file);
+        return;
+    }
+
+    // Write the formatted, human-readable JSON straight to the file.
+    bool written = cJSON_PrintToSink(root, true, file_json_sink, file);
+    cJSON_Delete(root);
+
+    if (fclose(file) != 0 || !written) {
+        fprintf(stderr, "Error: Failed to write conversation history to %s\n", filepath);
+        return;
+    }
+    fprintf(stderr, "Conversation history saved to %s\n", filepath);
+}
+
+/**
+ * @brief Loads a conversation state from a JSON file.
+ * @details This function reads a JSON file from the given path, parses it, and
+ *          repopulates the application's state. It clears any existing history
+ *          before loading the new data. It carefully iterates through the JSON
+ *          structure to reconstruct the `contents` (history), `systemInstruction`,
+ *          and other settings.
+ * @param state A pointer to the AppState struct that will be overwritten with the
+ *              loaded data.
+ * @param filepath The path of the file from which to load the history.
+ */
+void load_history_from_file(AppState* state, const char* filepath) {
+    FILE* file = fopen(filepath, "r");
+    if (!file) {
+        perror("Failed to open file for reading");
+        return;
+    }
+
+    // Read the entire file content into a memory buffer.
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* buffer = malloc(length + 1);
+    if (!buffer) {
+        fclose(file);
+        return;
+    }
+    if (fread(buffer, 1, length, file) != (size_t)length) {
+        fclose(file);
+        free(buffer);
+        fprintf(stderr, "Error reading file content.\n");
+        return;
+    }
+    buffer[length] = '\0';
+    fclose(file);
+
+    // Parse the buffer in place. Sessions can be huge (inline attachments), so
+    // nodes come from an arena and strings are decoded inside `buffer` rather
+    // than being allocated one by one; both stay alive until loading is done.
+    cJSON_Arena* arena = NULL;
+    cJSON* root = cJSON_ParseInSitu(buffer, (size_t)length, &arena);
+    if (!cJSON_IsObject(root)) {
+        fprintf(stderr, "Error: JSON file is not a valid history object.\n");
+        cJSON_DeleteArena(arena);
+        free(buffer);
+        return;
+    }
+
+    // --- Repopulate the AppState ---
+
+    // 1. Clear existing history before loading the new session.
+    free_history(&state->history);
+
+    // 2. Load the conversation history ("contents").
+    cJSON* contents = cJSON_GetObjectItem(root, "contents");
+    if (cJSON_IsArray(contents)) {
+        cJSON* content_item;
+        cJSON_ArrayForEach(content_item, contents) {
+            cJSON* role_json = cJSON_GetObjectItem(content_item, "role");
+            cJSON* parts_array = cJSON_GetObjectItem(content_item, "parts");
+            if (!cJSON_IsString(role_json) || !cJSON_IsArray(parts_array)) continue;
+
+            int num_parts = cJSON_GetArraySize(parts_array);
+            Part* loaded_parts = calloc(num_parts, sizeof(Part)); // Use calloc for zero-initialization
+            if (!loaded_parts) continue;
+
+            cJSON* part_item;
+            int part_idx = 0;
+            cJSON_ArrayForEach(part_item, parts_array) {
+                if (part_idx >= num_parts) break; // Should not happen, but safe
+                cJSON* text_json = cJSON_GetObjectItem(part_item, "text");
+                cJSON* inline_data_json = cJSON_GetObjectItem(part_item, "inlineData");
+                bool is_call = cJSON_GetObjectItem(part_item, "functionCall") != NULL;
+
+                // The parts borrow the decoded strings; add_content_to_history
+                // makes the history's own copy, which is the only one made.
+                // Function parts are re-serialized and freed below.
+                if (is_call || cJSON_GetObjectItem(part_item, "functionResponse")) {
+                    loaded_parts[part_idx].type = is_call ? PART_TYPE_FUNCTION_CALL : PART_TYPE_FUNCTION_RESPONSE;
+                    loaded_parts[part_idx].text = cJSON_PrintUnformatted(part_item);
+                } else if (cJSON_IsString(text_json)) {
+                    loaded_parts[part_idx].type = PART_TYPE_TEXT;
+                    loaded_parts[part_idx].text = text_json->valuestring;
+                } else if (inline_data_json) {
+                    cJSON* mime_json = cJSON_GetObjectItem(inline_data_json, "mimeType");
+                    cJSON* data_json = cJSON_GetObjectItem(inline_data_json, "data");
+                    if (cJSON_IsString(mime_json) && cJSON_IsString(data_json)) {
+                        loaded_parts[part_idx].type = PART_TYPE_FILE;
+                        loaded_parts[part_idx].mime_type = mime_json->valuestring;
+                        loaded_parts[part_idx].base64_data = data_json->valuestring;
+                    }
+                }
+                part_idx++;
+            }
+            add_content_to_history(&state->history, role_json->valuestring, loaded_parts, num_parts);
+
+            // Free the temporary parts array; its other strings belong to `buffer`.
+            for (int i = 0; i < num_parts; i++) {
+                PartType type = loaded_parts[i].type;
+                if (type == PART_TYPE_FUNCTION_CALL || type == PART_TYPE_FUNCTION_RESPONSE) cJSON_free(loaded_parts[i].text);
+            }
+            free(loaded_parts);
+        }
+    }
+
+    // 3. Load the system prompt.
+    cJSON* sys_instruction = cJSON_GetObjectItem(root, "systemInstruction");
+    if (sys_instruction) {
+        cJSON* parts_array = cJSON_GetObjectItem(sys_instruction, "parts");
+        if (cJSON_IsArray(parts_array)) {
+            cJSON* part_item = cJSON_GetArrayItem(parts_array, 0);
+            if (part_item) {
+                cJSON* text_item = cJSON_GetObjectItem(part_item, "text");
+                if (cJSON_IsString(text_item)) {
+                    if (state->system_prompt) free(state->system_prompt);
+                    state->system_prompt = strdup(text_item->valuestring);
+                }
+            }
+        }
+    }
+
+    cJSON_DeleteArena(arena);
+    free(buffer);
+    fprintf(stderr, "Conversation history loaded from %s\n", filepath);
+}
+
+/**
+ * @brief Adds a new content block (a user or model turn) to the conversation history.
+ * @details This function appends a new `Content` struct to the history array.
+ *          It performs a deep copy of the role string and all the `Part` structs
+ *          provided, ensuring that the history owns its own memory.
+ * @param history A pointer to the History struct to be modified.
+ * @param role The role for this turn, either "user" or "model".
+ * @param parts An array of Part structs that make up this turn's content.
+ * @param num_parts The number of parts in the `parts` array.
+ */
+void add_content_to_history(History* history, const char* role, Part* parts, int num_parts) {
+    // Expand the contents array to make room for the new entry.
+    Content* new_contents = mem_realloc(MEM_HISTORY, history->contents, sizeof(Content) * (history->num_contents + 1));
+    if (!new_contents) {
+        fprintf(stderr, "Error: realloc failed when adding to history.\n");
+        return;
+    }
+    history->contents = new_contents;
+
+    // Get a pointer to the new content block at the end of the array.
+    Content* new_content = &history->contents[history->num_contents];
+    new_content->role = mem_strdup(MEM_HISTORY, role);
+    new_content->num_parts = num_parts;
+    new_content->parts = mem_alloc(MEM_HISTORY, sizeof(Part) * num_parts);
+
+    if (!new_content->parts || !new_content->role) {
+        fprintf(stderr, "Error: malloc failed for new history content.\n");
+        // The array keeps its extra slot; it is reused by the next append.
+        mem_free(MEM_HISTORY, new_content->role);
+        mem_free(MEM_HISTORY, new_content->parts);
+        return;
+    }
+
+    // Perform a deep copy of each part from the input array into the history.
+    // A cold source part is copied expanded; it is re-packed once it ages out.
+    for (int i = 0; i < num_parts; i++) {
+        char* scratch = NULL;
+        const char* payload = part_payload(&parts[i], &scratch);
+        new_content->parts[i].type = parts[i].type;
+        new_content->parts[i].cold = NULL;
+        if (parts[i].type != PART_TYPE_FILE) {
+            new_content->parts[i].text = scratch ? scratch : (payload ? strdup(payload) : NULL);
+            new_content->parts[i].mime_type = NULL;
+            new_content->parts[i].base64_data = NULL;
+            new_content->parts[i].filename = NULL;
+        } else { // PART_TYPE_FILE
+            new_content->parts[i].text = NULL;
+            new_content->parts[i].mime_type = parts[i].mime_type ? strdup(parts[i].mime_type) : NULL;
+            new_content->parts[i].base64_data = scratch ? scratch : (payload ? strdup(payload) : NULL);
+            new_content->parts[i].filename = parts[i].filename ? strdup(parts[i].filename) : NULL;
+        }
+        track_part(MEM_HISTORY, &new_content->parts[i]);
+    }
+    history->num_contents++;
+
+    // Turns that have now aged past `cold_after` are compressed in place.
+    for (int i = 0; history->cold_after > 0 && i < history->num_contents - history->cold_after; i++) {
+        for (int j = 0; j < history->contents[i].num_parts; j++) {
+            freeze_part(&history->contents[i].parts[j]);
+        }
+    }
+}
+
+/**
+ * @brief Frees all memory associated with a single Content struct.
+ * @details This is a helper function for cleaning up history. It deallocates the
+ *          memory for the role string and for each individual part within the
+ *          content block, including text, MIME types, Base64 data, and filenames.
+ * @param content A pointer to the Content struct to be freed.
+ */
+void free_content(Content* content) {
+    if (!content) return;
+
+    // Free the role string (e.g., "user", "model").
+    mem_free(MEM_HISTORY, content->role);
+
+    // Free the data within each part of the content.
+    if (content->parts) {
+        for (int i = 0; i < content->num_parts; i++) {
+            release_part(MEM_HISTORY, &content->parts[i]);
+        }
+        // Free the array of parts itself.
+        mem_free(MEM_HISTORY, content->parts);
+    }
+}
+
+/**
+ * @brief Frees all memory used by pending attachments.
+ * @details This function is called to clear the list of attachments that have
+ *          been prepared but not yet sent with a prompt. It iterates through the
+ *          `attached_parts` array and frees all dynamically allocated fields.
+ * @param state A pointer to the AppState containing the attachments to clear.
+ */
+void free_pending_attachments(AppState* state) {
+    for (int i = 0; i < state->num_attached_parts; i++) {
+        // Free all possible dynamically allocated fields for each pending part.
+        release_part(MEM_ATTACHMENTS, &state->attached_parts[i]);
+    }
+    // Reset the counter to zero, effectively clearing the list.
+    state->num_attached_parts = 0;
+}
+
+/**
+ * @brief Frees all memory associated with the entire conversation history.
+ * @details This function iterates through every content block in the history,
+ *          calling `free_content` on each one to perform a deep clean. Finally,
+ *          it frees the top-level `contents` array itself and resets the history.
+ * @param history A pointer to the History struct to be completely freed.
+ */
+void free_history(History* history) {
+    if (!history) return;
+
+    // Free each content block in the history array.
+    for (int i = 0; i < history->num_contents; i++) {
+        free_content(&history->contents[i]);
+    }
+
+    // Free the array of content blocks itself.
+    mem_free(MEM_HISTORY, history->contents);
+
+    // Reset the history to a clean, empty state.
+    history->contents = NULL;
+    history->num_contents = 0;
+}
+
+/**
+ * @brief One independently deflated slice of a GzipStream's input.
+ * @details Blocks are raw deflate segments primed with the tail of the previous
+ *          block as their dictionary and ended with a sync flush (the last one
+ *          with Z_FINISH), so they can be compressed concurrently and simply
+ *          concatenated into a single valid stream, as pigz does.
+ */
+typedef struct {
+    unsigned char* input;            // Uncompressed data; freed once compressed.
+    size_t input_size;
+    unsigned char dict[GZIP_DICT_SIZE]; // Last bytes of the previous block.
+    size_t dict_size;
+    unsigned char* output;           // Raw deflate output.
+    size_t output_size;
+    uLong crc;                       // CRC-32 of `input`.
+    double seconds;                  // Time spent deflating this block.
+    bool last;
+    bool ok;
+} GzipBlock;
+
+/**
+ * @brief Incremental, block-parallel Gzip compressor.
+ * @details Input is cut into GZIP_BLOCK_SIZE blocks. Once a stream has sealed
+ *          its first full block, worker threads start deflating sealed blocks
+ *          while the caller keeps producing input; gzip_stream_finish joins
+ *          in on whatever is left and stitches the results together. Payloads
+ *          smaller than one block are compressed on the calling thread.
+ */
+typedef struct {
+    GzipBlock** blocks;
+    size_t num_blocks, capacity;     // Sealed blocks (and array capacity).
+    GzipBlock* current;              // Block being filled.
+    size_t next_block;               // Next sealed block to hand to a worker.
+    bool finished;                   // No more blocks will be sealed.
+    bool failed;
+    int level;                       // Deflate level, 1-9.
+#ifndef _WIN32
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t threads[GZIP_MAX_THREADS];
+    int num_threads;
+    bool threads_started;
+#endif
+} GzipStream;
+
+/**
+ * @brief Deflates a single block into a raw deflate segment.
+ * @param block The block to compress. Its input is released on return.
+ * @param level The deflate level.
+ */
+static void gzip_compress_block(GzipBlock* block, int level) {
+    z_stream strm = {0};
+    double started = monotonic_seconds();
+    block->ok = false;
+    block->crc = crc32(crc32(0L, Z_NULL, 0), block->input, (uInt)block->input_size);
+
+    // Negative window bits produce raw deflate data without a header.
+    if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        goto done;
+    }
+    if (block->dict_size > 0) {
+        deflateSetDictionary(&strm, block->dict, (uInt)block->dict_size);
+    }
+
+    // Size the output up front; the slack covers the sync flush marker.
+    size_t capacity = deflateBound(&strm, block->input_size) + 16;
+    block->output = mem_alloc(MEM_REQUEST, capacity);
+    if (!block->output) {
+        deflateEnd(&strm);
+        goto done;
+    }
+
+    strm.next_in = block->input;
+    strm.avail_in = (uInt)block->input_size;
+    int flush = block->last ? Z_FINISH : Z_SYNC_FLUSH;
+    int ret = Z_STREAM_ERROR;
+    do {
+        if (block->output_size == capacity) {
+            unsigned char* grown = mem_realloc(MEM_REQUEST, block->output, capacity + GZIP_CHUNK_SIZE);
+            if (!grown) break;
+            block->output = grown;
+            capacity += GZIP_CHUNK_SIZE;
+        }
+        strm.next_out = block->output + block->output_size;
+        strm.avail_out = (uInt)(capacity - block->output_size);
+        ret = deflate(&strm, flush);
+        block->output_size = capacity - strm.avail_out;
+    } while (ret != Z_STREAM_ERROR && strm.avail_out == 0);
+
+    block->ok = block->last ? (ret == Z_STREAM_END) : (ret == Z_OK && strm.avail_in == 0 && strm.avail_out > 0);
+    deflateEnd(&strm);
+
+done:
+    mem_free(MEM_REQUEST, block->input);
+    block->input = NULL;
+    block->seconds = monotonic_seconds() - started;
+}
+
+/**
+ * @brief Returns how many worker threads a multi-block GzipStream starts.
+ */
+static int gzip_worker_count(void) {
+#ifndef _WIN32
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cores > 1 ? (int)(cores - 1) : 0; // The caller works too.
+    return wanted > GZIP_MAX_THREADS ? GZIP_MAX_THREADS : wanted;
+#else
+    return 0;
+#endif
+}
+
+#ifndef _WIN32
+/**
+ * @brief Worker thread body: compresses sealed blocks until the stream is finished.
+ */
+static void* gzip_worker(void* arg) {
+    GzipStream* gz = (GzipStream*)arg;
+    pthread_mutex_lock(&gz->lock);
+    for (;;) {
+        while (gz->next_block >= gz->num_blocks && !gz->finished) {
+            pthread_cond_wait(&gz->cond, &gz->lock);
+        }
+        if (gz->next_block >= gz->num_blocks) break;
+        GzipBlock* block = gz->blocks[gz->next_block++];
+        pthread_mutex_unlock(&gz->lock);
+        gzip_compress_block(block, gz->level);
+        pthread_mutex_lock(&gz->lock);
+    }
+    pthread_mutex_unlock(&gz->lock);
+    return NULL;
+}
+
+/**
+ * @brief Starts the worker threads, one per spare core up to GZIP_MAX_THREADS.
+ * @details Failing to start threads is not an error: gzip_stream_finish
+ *          compresses any block no worker picked up.
+ */
+static void gzip_start_workers(GzipStream* gz) {
+    int wanted = gzip_worker_count();
 
-        cJSON* parts_array = cJSON_CreateArray();
-        cJSON_AddItemToObject(content_item, "parts", parts_array);
+    gz->threads_started = true;
+    for (int i = 0; i < wanted; i++) {
+        if (pthread_create(&gz->threads[gz->num_threads], NULL, gzip_worker, gz) != 0) break;
+        gz->num_threads++;
+    }
+}
+#endif
 
-        for (int j = 0; j < state->history.contents[i].num_parts; j++) {
-            Part* current_part = &state->history.contents[i].parts[j];
-            cJSON* part_item = cJSON_CreateObject();
+/**
+ * @brief Initializes a GzipStream.
+ * @param gz The stream to initialize.
+ * @param level The deflate level, 1-9.
+ * @return true on success, false if allocation failed.
+ */
+static bool gzip_stream_init(GzipStream* gz, int level) {
+    memset(gz, 0, sizeof(*gz));
+    gz->level = level;
+    gz->current = calloc(1, sizeof(GzipBlock));
+    if (!gz->current) return false;
+    gz->current->input = mem_alloc(MEM_REQUEST, GZIP_BLOCK_SIZE);
+    if (!gz->current->input) {
+        free(gz->current);
+        return false;
+    }
+#ifndef _WIN32
+    pthread_mutex_init(&gz->lock, NULL);
+    pthread_cond_init(&gz->cond, NULL);
+#endif
+    return true;
+}
 
-            if (current_part->type == PART_TYPE_TEXT) {
-                if (current_part->text) {
-                    cJSON_AddStringToObject(part_item, "text", current_part->text);
-                }
-            } else { // PART_TYPE_FILE
-                cJSON* inline_data = cJSON_CreateObject();
-                cJSON_AddStringToObject(inline_data, "mimeType", current_part->mime_type);
-                cJSON_AddStringToObject(inline_data, "data", current_part->base64_data);
-                cJSON_AddItemToObject(part_item, "inlineData", inline_data);
-            }
-            cJSON_AddItemToArray(parts_array, part_item);
+/**
+ * @brief Seals the block being filled and queues it for compression.
+ * @param gz The stream.
+ * @param last true for the final block of the stream.
+ * @return true on success, false if a new block could not be allocated.
+ */
+static bool gzip_seal_block(GzipStream* gz, bool last) {
+    GzipBlock* sealed = gz->current;
+    GzipBlock* next = NULL;
+    sealed->last = last;
+
+    if (!last) {
+        // Prime the next block with the tail of this one.
+        next = calloc(1, sizeof(GzipBlock));
+        if (!next || !(next->input = mem_alloc(MEM_REQUEST, GZIP_BLOCK_SIZE))) {
+            free(next);
+            return false;
         }
-        cJSON_AddItemToArray(contents, content_item);
+        next->dict_size = sealed->input_size < GZIP_DICT_SIZE ? sealed->input_size : GZIP_DICT_SIZE;
+        memcpy(next->dict, sealed->input + sealed->input_size - next->dict_size, next->dict_size);
     }
 
-    // --- 3. Add Tools Configuration ---
-    // Only add the "tools" object if at least one tool is enabled.
-    if (state->url_context || state->google_grounding) {
-        cJSON* tools_array = cJSON_CreateArray();
-        if (state->url_context) {
-            cJSON* tool1 = cJSON_CreateObject();
-            cJSON_AddItemToObject(tool1, "urlContext", cJSON_CreateObject());
-            cJSON_AddItemToArray(tools_array, tool1);
+    if (gz->num_blocks == gz->capacity) {
+        size_t capacity = gz->capacity ? gz->capacity * 2 : 16;
+#ifndef _WIN32
+        pthread_mutex_lock(&gz->lock);
+#endif
+        GzipBlock** grown = realloc(gz->blocks, capacity * sizeof(GzipBlock*));
+        if (grown) {
+            gz->blocks = grown;
+            gz->capacity = capacity;
         }
-        if (state->google_grounding) {
-            cJSON* tool2 = cJSON_CreateObject();
-            cJSON_AddItemToObject(tool2, "googleSearch", cJSON_CreateObject());
-            cJSON_AddItemToArray(tools_array, tool2);
+#ifndef _WIN32
+        pthread_mutex_unlock(&gz->lock);
+#endif
+        if (!grown) {
+            if (next) {
+                mem_free(MEM_REQUEST, next->input);
+                free(next);
+            }
+            return false;
         }
-        cJSON_AddItemToObject(root, "tools", tools_array);
     }
 
-    // --- 4. Add Generation Configuration ---
-    cJSON* gen_config = cJSON_CreateObject();
-    cJSON_AddNumberToObject(gen_config, "temperature", state->temperature);
-    cJSON_AddNumberToObject(gen_config, "maxOutputTokens", state->max_output_tokens);
-    cJSON_AddNumberToObject(gen_config, "seed", state->seed);
-    if (state->topK > 0) {
-        cJSON_AddNumberToObject(gen_config, "topK", state->topK);
-    }
-    if (state->topP > 0.0f) {
-        cJSON_AddNumberToObject(gen_config, "topP", state->topP);
+#ifndef _WIN32
+    pthread_mutex_lock(&gz->lock);
+#endif
+    gz->blocks[gz->num_blocks++] = sealed;
+    gz->current = next;
+    if (last) gz->finished = true;
+#ifndef _WIN32
+    pthread_cond_broadcast(&gz->cond);
+    pthread_mutex_unlock(&gz->lock);
+    if (!last && !gz->threads_started) {
+        gzip_start_workers(gz);
     }
+#endif
+    return true;
+}
 
-    // Add thinking budget as a sub-object within generationConfig.
-    cJSON* thinking_config = cJSON_CreateObject();
-    cJSON_AddNumberToObject(thinking_config, "thinkingBudget", state->thinking_budget);
-    cJSON_AddItemToObject(gen_config, "thinkingConfig", thinking_config);
-
-    cJSON_AddItemToObject(root, "generationConfig", gen_config);
-
-    return root;
+/**
+ * @brief Feeds data into a GzipStream.
+ * @param gz The stream to write to.
+ * @param data The uncompressed input.
+ * @param size The size of the input in bytes.
+ * @return true on success. On failure the stream is marked failed and
+ *         gzip_stream_finish will return an empty result.
+ */
+static bool gzip_stream_write(GzipStream* gz, const unsigned char* data, size_t size) {
+    while (size > 0 && !gz->failed) {
+        GzipBlock* block = gz->current;
+        size_t room = GZIP_BLOCK_SIZE - block->input_size;
+        size_t take = size < room ? size : room;
+        memcpy(block->input + block->input_size, data, take);
+        block->input_size += take;
+        data += take;
+        size -= take;
+
+        // Only seal once more input arrives, so the final block is never empty.
+        if (block->input_size == GZIP_BLOCK_SIZE && size > 0 && !gzip_seal_block(gz, false)) {
+            gz->failed = true;
+        }
+    }
+    return !gz->failed;
 }
 
 /**
- * @brief Parses a JSON error response from the API and prints a clean message.
- * @details When an API call fails, the body of the HTTP response often contains
- *          a JSON object with error details. This function attempts to parse that
- *          JSON, find the "message" field within the "error" object, and print
- *          it to stderr for the user. If parsing fails, it prints the raw
- *          buffer as a fallback.
- * @param error_buffer The raw response body received from a failed API call.
+ * @brief Completes a GzipStream and returns the assembled Gzip data.
+ * @details Seals the final block, helps the workers drain the queue, joins
+ *          them, then writes the Gzip header, every block's deflate segment
+ *          and the trailer (combined CRC-32 and length) into one buffer sized
+ *          exactly for the result. All stream resources are released.
+ * @param gz The stream to finish.
+ * @param seconds_out If not NULL, receives the deflate time summed over all blocks.
+ * @return The compressed data, or an empty result if anything failed.
  */
-void parse_and_print_error_json(const char* error_buffer) {
-    if (!error_buffer) return;
+static GzipResult gzip_stream_finish(GzipStream* gz, double* seconds_out) {
+    GzipResult result = { .data = NULL, .size = 0 };
 
-    // The actual JSON object may be preceded by other text in the error buffer.
-    // Find the opening brace to ensure we parse only the JSON part.
-    const char* json_start = strchr(error_buffer, '{');
-    if (!json_start) {
-        // If no JSON object is found, print the raw error buffer as-is.
-        fprintf(stderr, "API Error: %s\n", error_buffer);
-        return;
+    if (!gz->failed && !gzip_seal_block(gz, true)) {
+        gz->failed = true;
     }
 
-    cJSON* root = cJSON_Parse(json_start);
-    if (!root) {
-        // If parsing fails, we can't extract a specific message.
-        return;
+#ifndef _WIN32
+    pthread_mutex_lock(&gz->lock);
+    gz->finished = true;
+    pthread_cond_broadcast(&gz->cond);
+    // Compress whatever the workers have not picked up yet.
+    while (gz->next_block < gz->num_blocks) {
+        GzipBlock* block = gz->blocks[gz->next_block++];
+        pthread_mutex_unlock(&gz->lock);
+        gzip_compress_block(block, gz->level);
+        pthread_mutex_lock(&gz->lock);
+    }
+    pthread_mutex_unlock(&gz->lock);
+    for (int i = 0; i < gz->num_threads; i++) {
+        pthread_join(gz->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&gz->lock);
+    pthread_cond_destroy(&gz->cond);
+#else
+    while (gz->next_block < gz->num_blocks) {
+        gzip_compress_block(gz->blocks[gz->next_block++], gz->level);
     }
+#endif
 
-    cJSON* error = cJSON_GetObjectItem(root, "error");
-    if (error) {
-        cJSON* message = cJSON_GetObjectItem(error, "message");
-        if (cJSON_IsString(message) && message->valuestring) {
-            // Print the clean, user-friendly error message from the API.
-            fprintf(stderr, "API Error Message: %s\n", message->valuestring);
+    // Size the result: 10-byte header, the segments, 8-byte trailer.
+    size_t total = 10 + 8;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    uLong length = 0;
+    for (size_t i = 0; i < gz->num_blocks && !gz->failed; i++) {
+        GzipBlock* block = gz->blocks[i];
+        if (!block->ok) {
+            gz->failed = true;
+            break;
         }
+        total += block->output_size;
+        if (seconds_out) *seconds_out += block->seconds;
+        crc = crc32_combine(crc, block->crc, (z_off_t)block->input_size);
+        length += (uLong)block->input_size;
+    }
+
+    if (!gz->failed && (result.data = malloc(total)) != NULL) {
+        static const unsigned char header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 2, 0xff };
+        unsigned char* out = result.data;
+        memcpy(out, header, sizeof(header));
+        out += sizeof(header);
+        for (size_t i = 0; i < gz->num_blocks; i++) {
+            memcpy(out, gz->blocks[i]->output, gz->blocks[i]->output_size);
+            out += gz->blocks[i]->output_size;
+        }
+        for (int i = 0; i < 4; i++) *out++ = (unsigned char)(crc >> (8 * i));
+        for (int i = 0; i < 4; i++) *out++ = (unsigned char)(length >> (8 * i));
+        result.size = total;
     }
 
-    cJSON_Delete(root);
+    for (size_t i = 0; i < gz->num_blocks; i++) {
+        mem_free(MEM_REQUEST, gz->blocks[i]->input);
+        mem_free(MEM_REQUEST, gz->blocks[i]->output);
+        free(gz->blocks[i]);
+    }
+    free(gz->blocks);
+    if (gz->current) { // Left over only if sealing the final block failed.
+        mem_free(MEM_REQUEST, gz->current->input);
+        free(gz->current);
+    }
+    return result;
 }
 
 /**
- * @brief A libcurl write callback for non-streaming API responses.
- * @details This function is used for API calls that return a complete JSON
- *          object in a single response (e.g., `countTokens`). It simply
- *          appends all received data chunks into the MemoryStruct's buffer
- *          until the request is finished.
- * @param contents A pointer to the data received.
- * @param size The size of each data member (always 1 for text).
- * @param nmemb The number of data members received.
- * @param userp A user-defined pointer to a MemoryStruct to store the data.
- * @return The total number of bytes successfully handled.
+ * @brief Compresses data using the Gzip algorithm.
+ * @details This function takes a buffer of input data and compresses it using
+ *          zlib's deflate functionality with Gzip headers. This is used to
+ *          reduce the size of the JSON payload sent to the Gemini API, which can
+ *          improve network performance for large requests. Inputs larger than
+ *          one block are compressed on several threads.
+ * @param input_data A pointer to the raw data to be compressed.
+ * @param input_size The size of the input data in bytes.
+ * @param level The deflate level, 1-9.
+ * @return A GzipResult struct containing a pointer to the compressed data and
+ *         its size. The `data` field will be NULL on failure. The caller is
+ *         responsible for freeing the `data` buffer.
  */
-static size_t write_to_memory_struct_callback(void* contents, size_t size, size_t nmemb, void* userp) {
-    size_t realsize = size * nmemb;
-    MemoryStruct* mem = (MemoryStruct*)userp;
-
-    // Expand the buffer to accommodate the new data chunk.
-    char* ptr = realloc(mem->buffer, mem->size + realsize + 1);
-    if (!ptr) {
-        fprintf(stderr, "Error: realloc failed in token count callback.\n");
-        return 0; // Signal an error to libcurl.
+GzipResult gzip_compress(const unsigned char* input_data, size_t input_size, int level) {
+    GzipStream gz;
+    if (!gzip_stream_init(&gz, level)) {
+        return (GzipResult){NULL, 0}; // Return empty result on failure.
     }
-    mem->buffer = ptr;
+    gzip_stream_write(&gz, input_data, input_size);
+    return gzip_stream_finish(&gz, NULL);
+}
 
-    // Append the new data and update the size.
-    memcpy(&(mem->buffer[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->buffer[mem->size] = '\0'; // Ensure the buffer is always null-terminated.
+/**
+ * @brief Typical single-core deflate characteristics on JSON request bodies.
+ * @details The adaptive policy scales these by what it has measured on
+ *          earlier requests (CompressionStats), so only the relative cost of
+ *          the levels matters. Level 0 means "send uncompressed".
+ */
+static const struct { int level; double ratio; double bytes_per_second; } compression_profiles[] = {
+    { 0, 1.00, 0.0 },
+    { 1, 0.28, 90e6 },
+    { 6, 0.22, 30e6 },
+    { 9, 0.21, 12e6 },
+};
 
-    return realsize;
+/**
+ * @brief Returns the upload throughput estimate in bytes/s, or 0 if unknown.
+ * @details Uses the median of the recent samples, so that a single upload
+ *          timed too short or too long does not swing the compression policy.
+ */
+static double estimated_upload_bps(const CompressionStats* stats) {
+    double sorted[UPLOAD_SAMPLE_WINDOW];
+    int count = stats->num_upload_samples;
+    if (count <= 0) return 0.0;
+    for (int i = 0; i < count; i++) {
+        double value = stats->upload_samples[i];
+        int j = i;
+        for (; j > 0 && sorted[j - 1] > value; j--) sorted[j] = sorted[j - 1];
+        sorted[j] = value;
+    }
+    return count % 2 ? sorted[count / 2] : 0.5 * (sorted[count / 2 - 1] + sorted[count / 2]);
 }
 
 /**
- * @brief Calculates the token count for the current conversation history.
- * @details This function sends the current conversation contents to the Gemini
- *          API's `countTokens` endpoint. It builds a request similar to a
- *          standard generation request but omits unnecessary fields like
- *          `generationConfig`. It then parses the response to extract the integer
- *          value for the total token count.
- * @param state The current application state, containing the history to be counted.
- * @return The integer token count on success, or -1 on failure.
+ * @brief Chooses the deflate level for a request body.
+ * @details Bodies below `compression_min_bytes` are sent as-is, and a fixed
+ *          `compression_level` is used verbatim. Otherwise the level with the
+ *          lowest estimated cost is chosen: deflate time (spread over the
+ *          compressor threads for multi-block bodies) plus upload time of the
+ *          expected output at the measured link throughput. Until a throughput
+ *          has been measured, zlib's default level is used.
+ * @param state The application state holding the policy and measurements.
+ * @param size The size of the body, or a lower bound for large bodies.
+ * @return 0 to send uncompressed, otherwise the deflate level.
  */
-int get_token_count(AppState* state) {
-    // Build the request JSON, which includes history and system prompt.
-    cJSON* root = build_request_json(state);
-    if (!root) return -1;
+static int choose_compression_level(const AppState* state, size_t size) {
+    if (state->compression_level == 0 || (state->compression_min_bytes > 0 && size < (size_t)state->compression_min_bytes)) {
+        return 0;
+    }
+    if (state->compression_level > 0) {
+        return state->compression_level > 9 ? 9 : state->compression_level;
+    }
 
-    // The countTokens endpoint does not use these fields, so remove them.
-    cJSON_DeleteItemFromObject(root, "generationConfig");
-    cJSON_DeleteItemFromObject(root, "tools");
+    double bps = estimated_upload_bps(&state->compression);
+    if (bps <= 0.0) {
+        return 6;
+    }
 
-    // Serialize and compress the payload.
-    char* json_string = cJSON_PrintUnformatted(root);
-    cJSON_Delete(root);
-    if (!json_string) return -1;
+    int threads = size > GZIP_BLOCK_SIZE ? gzip_worker_count() + 1 : 1;
+    int best_level = 0;
+    double best_cost = 0.0;
+    for (size_t i = 0; i < sizeof(compression_profiles) / sizeof(compression_profiles[0]); i++) {
+        int level = compression_profiles[i].level;
+        double cost;
+        if (level == 0) {
+            cost = (double)size / bps;
+        } else {
+            double ratio = compression_profiles[i].ratio * state->compression.ratio_scale;
+            double speed = compression_profiles[i].bytes_per_second * state->compression.speed_scale * threads;
+            cost = (double)size / speed + (double)size * ratio / bps;
+        }
+        if (i == 0 || cost < best_cost) {
+            best_cost = cost;
+            best_level = level;
+        }
+    }
+    return best_level;
+}
 
-    GzipResult compressed_result = gzip_compress((unsigned char*)json_string, strlen(json_string));
-    free(json_string);
-    if (!compressed_result.data) {
-        fprintf(stderr, "Failed to compress payload for token count.\n");
-        return -1;
+/**
+ * @brief Folds a finished compression into the calibration and statistics.
+ */
+static void record_compression(AppState* state, const RequestBody* body, int level) {
+    CompressionStats* stats = &state->compression;
+    stats->requests++;
+    stats->bytes_in += (double)body->raw_size;
+    stats->bytes_out += (double)body->size;
+    if (!body->gzipped) return;
+
+    stats->compressed_requests++;
+    stats->cpu_seconds += body->deflate_seconds;
+
+    // Calibrate against the profile, ignoring bodies too small to time reliably.
+    for (size_t i = 1; i < sizeof(compression_profiles) / sizeof(compression_profiles[0]); i++) {
+        if (compression_profiles[i].level != level || body->raw_size < GZIP_BLOCK_SIZE || body->deflate_seconds <= 0.0) continue;
+        double ratio = (double)body->size / (double)body->raw_size;
+        double speed = (double)body->raw_size / body->deflate_seconds;
+        stats->ratio_scale = 0.5 * stats->ratio_scale + 0.5 * (ratio / compression_profiles[i].ratio);
+        stats->speed_scale = 0.5 * stats->speed_scale + 0.5 * (speed / compression_profiles[i].bytes_per_second);
     }
+}
 
-    // Prepare a memory buffer for the API response.
-    MemoryStruct chunk = { .buffer = malloc(1), .size = 0 };
-    if (!chunk.buffer) {
-        free(compressed_result.data);
-        return -1;
+/**
+ * @brief Feeds a measured upload into the throughput estimate and the savings.
+ * @details The upload is timed from pretransfer until libcurl had handed the
+ *          last byte of the body to the socket, so the server's time to
+ *          answer is not counted. Up to a send buffer's worth of the body may
+ *          still have been queued in the kernel then, so only the bytes
+ *          beyond it count as sent. Samples with too few such bytes are
+ *          dominated by latency and are ignored.
+ * @param state The application state to update.
+ * @param body The body that was uploaded.
+ * @param seconds Time from pretransfer to the end of the upload.
+ * @param send_buffer The socket's send buffer size, or 0 if unknown.
+ */
+static void record_upload(AppState* state, const RequestBody* body, double seconds, long send_buffer) {
+    CompressionStats* stats = &state->compression;
+    size_t buffered = send_buffer > 0 ? (size_t)send_buffer : 0;
+    size_t sent = body->size > buffered ? body->size - buffered : 0;
+    if (sent >= UPLOAD_SAMPLE_MIN_BYTES && seconds > 0.0) {
+        stats->upload_samples[stats->next_upload_sample] = (double)sent / seconds;
+        stats->next_upload_sample = (stats->next_upload_sample + 1) % UPLOAD_SAMPLE_WINDOW;
+        if (stats->num_upload_samples < UPLOAD_SAMPLE_WINDOW) stats->num_upload_samples++;
     }
-    chunk.buffer[0] = '\0';
 
-    // Perform the API call to the "countTokens" endpoint.
-    long http_code = perform_api_curl_request(
-        state,
-        "countTokens",
-        (const char*)compressed_result.data,
-        compressed_result.size,
-        write_to_memory_struct_callback, // Use the simple, non-streaming callback.
-        &chunk
-    );
+    double bps = estimated_upload_bps(stats);
+    if (body->gzipped && bps > 0.0) {
+        double wall = body->deflate_seconds / (body->threads > 0 ? body->threads : 1);
+        stats->seconds_saved += (double)(body->raw_size - body->size) / bps - wall;
+    }
+}
 
-    int token_count = -1;
-    if (http_code == 200) {
-        // If successful, parse the JSON response.
-        cJSON* json_resp = cJSON_Parse(chunk.buffer);
-        if (json_resp) {
-            // Extract the "totalTokens" value.
-            cJSON* tokens = cJSON_GetObjectItem(json_resp, "totalTokens");
-            if (cJSON_IsNumber(tokens)) {
-                token_count = tokens->valueint;
+/**
+ * @brief Prints the request compression policy and its effect for `/stats`.
+ */
+static void print_compression_stats(const AppState* state) {
+    const CompressionStats* stats = &state->compression;
+    char policy[32];
+    if (state->compression_level == COMPRESSION_LEVEL_AUTO) snprintf(policy, sizeof(policy), "adaptive");
+    else if (state->compression_level == 0) snprintf(policy, sizeof(policy), "off");
+    else snprintf(policy, sizeof(policy), "level %d", state->compression_level);
+
+    fprintf(stderr, "Request compression: %s, bodies under %d bytes sent as-is\n", policy, state->compression_min_bytes);
+    fprintf(stderr, "Request bodies: %ld sent, %ld compressed\n", stats->requests, stats->compressed_requests);
+    if (stats->requests > 0) {
+        fprintf(stderr, "Request bytes: %.0f -> %.0f (%.1f%%), deflate CPU time %.3fs\n",
+                stats->bytes_in, stats->bytes_out,
+                stats->bytes_in > 0 ? 100.0 * stats->bytes_out / stats->bytes_in : 100.0, stats->cpu_seconds);
+    }
+    double bps = estimated_upload_bps(stats);
+    if (bps > 0.0) {
+        fprintf(stderr, "Upload throughput: %.1f KB/s, est. time saved by compression: %.3fs\n", bps / 1024.0, stats->seconds_saved);
+    } else {
+        fprintf(stderr, "Upload throughput: not measured yet\n");
+    }
+}
+
+/**
+ * @brief Print sink that holds back the start of a request body until its
+ *        compression level is known, then streams the rest into a GzipStream.
+ */
+typedef struct {
+    AppState* state;
+    MemoryStruct head;   // Buffered output (the whole body if not compressing).
+    size_t total;        // Bytes printed so far.
+    bool decided;        // Level chosen (only happens early for large bodies).
+    int level;
+    bool streaming;      // Output goes to `gz`.
+    GzipStream gz;
+} BodyEncoder;
+
+static cJSON_bool body_encoder_sink(const char* data, size_t length, void* context) {
+    BodyEncoder* enc = (BodyEncoder*)context;
+    enc->total += length;
+    if (enc->streaming) {
+        return gzip_stream_write(&enc->gz, (const unsigned char*)data, length);
+    }
+
+    if (!enc->decided && enc->head.size + length > COMPRESSION_PROBE_SIZE) {
+        // The body is large; decide now, knowing a lower bound of its size.
+        enc->decided = true;
+        enc->level = choose_compression_level(enc->state, enc->total);
+        if (enc->level > 0) {
+            if (!gzip_stream_init(&enc->gz, enc->level)) return false;
+            enc->streaming = true;
+            bool ok = gzip_stream_write(&enc->gz, (const unsigned char*)enc->head.buffer, enc->head.size);
+            free(enc->head.buffer);
+            enc->head.buffer = NULL;
+            enc->head.size = 0;
+            return ok && gzip_stream_write(&enc->gz, (const unsigned char*)data, length);
+        }
+    }
+    return text_buffer_append(&enc->head, data, length);
+}
+
+/**
+ * @brief Serializes a request and encodes it according to the compression policy.
+ * @details The unformatted JSON is produced by `cJSON_PrintToSink`. Small bodies
+ *          are buffered so their exact size drives the policy; for bodies past
+ *          COMPRESSION_PROBE_SIZE the level is chosen early and the rest is
+ *          streamed through the (multi-threaded) compressor, so the
+ *          uncompressed text is never held in memory as a whole.
+ * @param state The application state with the compression policy; its
+ *              compression statistics are updated.
+ * @param root The JSON tree to serialize.
+ * @param body Receives the encoded body. The caller frees `body->data` with
+ *             `mem_free(MEM_REQUEST, ...)`.
+ * @return true on success.
+ */
+bool encode_request_body(AppState* state, const cJSON* root, RequestBody* body) {
+    BodyEncoder enc = { .state = state };
+    memset(body, 0, sizeof(*body));
+
+    bool ok = cJSON_PrintToSink(root, false, body_encoder_sink, &enc);
+    body->raw_size = enc.total;
+
+    if (!enc.streaming && ok) {
+        enc.level = enc.decided ? enc.level : choose_compression_level(state, enc.total);
+        if (enc.level > 0) {
+            if (gzip_stream_init(&enc.gz, enc.level)) {
+                enc.streaming = true;
+                ok = gzip_stream_write(&enc.gz, (const unsigned char*)enc.head.buffer, enc.head.size);
+            } else {
+                ok = false;
             }
-            cJSON_Delete(json_resp);
         }
+    }
+
+    if (enc.streaming) {
+        if (!ok) enc.gz.failed = true;
+        GzipResult compressed = gzip_stream_finish(&enc.gz, &body->deflate_seconds);
+        body->data = compressed.data;
+        body->size = compressed.size;
+        body->gzipped = true;
+        body->threads = enc.total > GZIP_BLOCK_SIZE ? gzip_worker_count() + 1 : 1;
+        free(enc.head.buffer);
+        ok = ok && body->data != NULL;
+    } else if (ok) {
+        // Sent uncompressed; an empty body still needs a valid pointer.
+        body->data = enc.head.buffer ? (unsigned char*)enc.head.buffer : calloc(1, 1);
+        body->size = enc.head.size;
+        ok = body->data != NULL;
     } else {
-        // On failure, print the error.
-        fprintf(stderr, "Token count API call failed (HTTP code: %ld)\n", http_code);
-        if (http_code < 0) fprintf(stderr, "Curl error: %s\n", curl_easy_strerror(-http_code));
-        parse_and_print_error_json(chunk.buffer);
+        free(enc.head.buffer);
     }
 
-    // Clean up resources.
-    free(compressed_result.data);
-    free(chunk.buffer);
-    return token_count;
+    if (!ok) {
+        free(body->data);
+        memset(body, 0, sizeof(*body));
+        return false;
+    }
+    mem_track(MEM_REQUEST, body->data);
+    record_compression(state, body, enc.level);
+    return true;
 }
 
 /**
- * @brief Saves the current conversation state to a JSON file.
- * @details This function serializes the entire application state, including the
- *          conversation history, system prompt, and configuration, into a JSON
- *          object using `build_request_json`. It then saves this JSON to the
- *          specified file path, allowing a session to be resumed later.
- * @param state A pointer to the current application state to be saved.
- * @param filepath The path of the file where the history will be saved.
+ * @brief Validates a file path to ensure it is safe.
+ * @details This is a security function that checks for common path traversal
+ *          patterns. It rejects any path that contains ".." and also rejects
+ *          absolute paths, ensuring that file operations are restricted to the
+ *          current working directory and its subdirectories.
+ * @param path The file path string to validate.
+ * @return Returns true if the path is deemed safe, and false otherwise.
  */
-void save_history_to_file(AppState* state, const char* filepath) {
-    FILE* file = fopen(filepath, "w");
-    if (!file) {
-        perror("Failed to open file for writing");
-        return;
+bool is_path_safe(const char* path) {
+    if (path == NULL || path[0] == '\0') {
+        return false;
     }
 
-    // Use the existing function to build a complete JSON representation of the state.
-    cJSON* root = build_request_json(state);
-    if (!root) {
-        fclose(file);
-        return;
+    // Reject paths containing ".." to prevent directory traversal attacks.
+    if (strstr(path, "..")) {
+        return false;
     }
 
-    // Convert the cJSON object to a formatted, human-readable string.
-    char* json_string = cJSON_Print(root);
-    cJSON_Delete(root);
-
-    if (json_string) {
-        fputs(json_string, file);
-        free(json_string);
+    // Reject absolute paths.
+#ifdef _WIN32
+    // Rejects "C:\path" or "\path"
+    if (path[0] == '\\' || (isalpha((unsigned char)path[0]) && path[1] == ':')) {
+        return false;
+    }
+#else
+    // Rejects "/path"
+    if (path[0] == '/') {
+        return false;
     }
+#endif
 
-    fclose(file);
-    fprintf(stderr, "Conversation history saved to %s\n", filepath);
+    return true;
 }
 
 /**
- * @brief Loads a conversation state from a JSON file.
- * @details This function reads a JSON file from the given path, parses it, and
- *          repopulates the application's state. It clears any existing history
- *          before loading the new data. It carefully iterates through the JSON
- *          structure to reconstruct the `contents` (history), `systemInstruction`,
- *          and other settings.
- * @param state A pointer to the AppState struct that will be overwritten with the
- *              loaded data.
- * @param filepath The path of the file from which to load the history.
+ * @brief Computes the 64-bit FNV-1a hash of a buffer.
+ * @param data The bytes to hash.
+ * @param len The number of bytes.
+ * @return The hash value.
  */
-void load_history_from_file(AppState* state, const char* filepath) {
-    FILE* file = fopen(filepath, "r");
-    if (!file) {
-        perror("Failed to open file for reading");
-        return;
+static uint64_t fnv1a_hash(const unsigned char* data, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
     }
+    return hash;
+}
 
-    // Read the entire file content into a memory buffer.
-    fseek(file, 0, SEEK_END);
-    long length = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    char* buffer = malloc(length + 1);
-    if (!buffer) {
-        fclose(file);
-        return;
-    }
-    if (fread(buffer, 1, length, file) != (size_t)length) {
-        fclose(file);
-        free(buffer);
-        fprintf(stderr, "Error reading file content.\n");
-        return;
+/**
+ * @brief Replaces every copy of a file's content inside a text part with a short note.
+ * @details Recognises both the free-mode full-file section
+ *          ("--- Attached File: <path> ---" ... "--- End of File ---") and the
+ *          diff section written for re-attachments
+ *          ("--- Updated File: <path> (" ... "--- End of Update ---").
+ * @param text The text to scan.
+ * @param path The file path whose sections should be replaced.
+ * @return A newly allocated string with the sections replaced, or NULL if the
+ *         text contained no section for this path.
+ */
+static char* supersede_file_sections(const char* text, const char* path) {
+    char markers[2][PATH_MAX + 64];
+    const char* end_markers[2] = { "\n--- End of File ---\n", "--- End of Update ---\n" };
+    char note[PATH_MAX + 96];
+    snprintf(markers[0], sizeof(markers[0]), "\n--- Attached File: %s ---\n", path);
+    snprintf(markers[1], sizeof(markers[1]), "\n--- Updated File: %s (", path);
+    int note_len = snprintf(note, sizeof(note), "\n[Earlier version of %s omitted; superseded by a later attachment.]\n", path);
+
+    MemoryStruct out = { .buffer = NULL, .size = 0 };
+    const char* cursor = text;
+    bool replaced = false;
+
+    while (*cursor) {
+        const char* start = NULL;
+        int kind = -1;
+        for (int k = 0; k < 2; k++) {
+            const char* found = strstr(cursor, markers[k]);
+            if (found && (!start || found < start)) { start = found; kind = k; }
+        }
+        const char* end = start ? strstr(start + strlen(markers[kind]), end_markers[kind]) : NULL;
+        if (!end) break;
+        end += strlen(end_markers[kind]);
+
+        if (!text_buffer_append(&out, cursor, (size_t)(start - cursor)) ||
+            !text_buffer_append(&out, note, (size_t)note_len)) {
+            free(out.buffer);
+            return NULL;
+        }
+        cursor = end;
+        replaced = true;
     }
-    buffer[length] = '\0';
-    fclose(file);
 
-    // Parse the buffer into a cJSON object.
-    cJSON* root = cJSON_Parse(buffer);
-    free(buffer);
-    if (!cJSON_IsObject(root)) {
-        fprintf(stderr, "Error: JSON file is not a valid history object.\n");
-        if(root) cJSON_Delete(root);
-        return;
+    if (!replaced || !text_buffer_append(&out, cursor, strlen(cursor))) {
+        free(out.buffer);
+        return NULL;
     }
+    return out.buffer;
+}
 
-    // --- Repopulate the AppState ---
-
-    // 1. Clear existing history before loading the new session.
-    free_history(&state->history);
-
-    // 2. Load the conversation history ("contents").
-    cJSON* contents = cJSON_GetObjectItem(root, "contents");
-    if (cJSON_IsArray(contents)) {
-        cJSON* content_item;
-        cJSON_ArrayForEach(content_item, contents) {
-            cJSON* role_json = cJSON_GetObjectItem(content_item, "role");
-            cJSON* parts_array = cJSON_GetObjectItem(content_item, "parts");
-            if (!cJSON_IsString(role_json) || !cJSON_IsArray(parts_array)) continue;
-
-            int num_parts = cJSON_GetArraySize(parts_array);
-            Part* loaded_parts = calloc(num_parts, sizeof(Part)); // Use calloc for zero-initialization
-            if (!loaded_parts) continue;
+/**
+ * @brief Checks whether a part carries (a version of) the given file.
+ */
+static bool part_carries_file(const Part* part, const char* path) {
+    if (part->type == PART_TYPE_FILE) {
+        return part->filename && strcmp(part->filename, path) == 0;
+    }
+    char* scratch = NULL;
+    const char* text = part_payload(part, &scratch);
+    if (!text) return false;
+
+    char marker[PATH_MAX + 64];
+    snprintf(marker, sizeof(marker), "\n--- Attached File: %s ---\n", path);
+    bool found = strstr(text, marker) != NULL;
+    if (!found) {
+        snprintf(marker, sizeof(marker), "\n--- Updated File: %s (", path);
+        found = strstr(text, marker) != NULL;
+    }
+    free(scratch);
+    return found;
+}
 
-            cJSON* part_item;
-            int part_idx = 0;
-            cJSON_ArrayForEach(part_item, parts_array) {
-                if (part_idx >= num_parts) break; // Should not happen, but safe
-                cJSON* text_json = cJSON_GetObjectItem(part_item, "text");
-                cJSON* inline_data_json = cJSON_GetObjectItem(part_item, "inlineData");
+/**
+ * @brief Replaces a part's copy of a file with a short "superseded" note.
+ * @param category Whose memory the part is (pending attachment or history).
+ * @return true if the part was changed.
+ */
+static bool supersede_part(Part* part, const char* path, MemCategory category) {
+    if (!part_carries_file(part, path)) return false;
+
+    char* replacement;
+    if (part->type == PART_TYPE_FILE) {
+        char note[PATH_MAX + 96];
+        snprintf(note, sizeof(note), "[Earlier version of %s omitted; superseded by a later attachment.]", path);
+        replacement = strdup(note);
+    } else {
+        char* scratch = NULL;
+        replacement = supersede_file_sections(part_payload(part, &scratch), path);
+        free(scratch);
+    }
+    if (!replacement) return false;
 
-                if (cJSON_IsString(text_json)) {
-                    loaded_parts[part_idx].type = PART_TYPE_TEXT;
-                    loaded_parts[part_idx].text = strdup(text_json->valuestring);
-                } else if (inline_data_json) {
-                    cJSON* mime_json = cJSON_GetObjectItem(inline_data_json, "mimeType");
-                    cJSON* data_json = cJSON_GetObjectItem(inline_data_json, "data");
-                    if (cJSON_IsString(mime_json) && cJSON_IsString(data_json)) {
-                        loaded_parts[part_idx].type = PART_TYPE_FILE;
-                        loaded_parts[part_idx].mime_type = strdup(mime_json->valuestring);
-                        loaded_parts[part_idx].base64_data = strdup(data_json->valuestring);
-                    }
-                }
-                part_idx++;
-            }
-            add_content_to_history(&state->history, role_json->valuestring, loaded_parts, num_parts);
+    release_part(category, part);
+    memset(part, 0, sizeof(Part));
+    part->type = PART_TYPE_TEXT;
+    part->text = replacement;
+    mem_track(category, replacement);
+    return true;
+}
 
-            // Free the temporary parts structure.
-            for (int i = 0; i < num_parts; i++) {
-                if (loaded_parts[i].text) free(loaded_parts[i].text);
-                if (loaded_parts[i].mime_type) free(loaded_parts[i].mime_type);
-                if (loaded_parts[i].base64_data) free(loaded_parts[i].base64_data);
-            }
-            free(loaded_parts);
+/**
+ * @brief Looks up the revision record of a previously attached file.
+ * @details A record is only trusted while some version of the file is still
+ *          present in the history or among the pending attachments. If the
+ *          turn that carried it was dropped (failed request, /clear,
+ *          /history attachments remove), the record is stale and NULL is
+ *          returned so that the file is attached in full again.
+ * @param state The application state.
+ * @param path The attachment path.
+ * @return The record, or NULL if the model has no version of this file.
+ */
+static AttachmentRecord* find_attachment_record(AppState* state, const char* path) {
+    AttachmentRecord* record = NULL;
+    for (int i = 0; i < state->num_attachment_records; i++) {
+        if (strcmp(state->attachment_records[i].path, path) == 0) {
+            record = &state->attachment_records[i];
+            break;
         }
     }
+    if (!record) return NULL;
 
-    // 3. Load the system prompt.
-    cJSON* sys_instruction = cJSON_GetObjectItem(root, "systemInstruction");
-    if (sys_instruction) {
-        cJSON* parts_array = cJSON_GetObjectItem(sys_instruction, "parts");
-        if (cJSON_IsArray(parts_array)) {
-            cJSON* part_item = cJSON_GetArrayItem(parts_array, 0);
-            if (part_item) {
-                cJSON* text_item = cJSON_GetObjectItem(part_item, "text");
-                if (cJSON_IsString(text_item)) {
-                    if (state->system_prompt) free(state->system_prompt);
-                    state->system_prompt = strdup(text_item->valuestring);
-                }
-            }
+    for (int i = 0; i < state->num_attached_parts; i++) {
+        if (part_carries_file(&state->attached_parts[i], path)) return record;
+    }
+    // The pending revision was removed before it was sent.
+    free(record->pending);
+    record->pending = NULL;
+    for (int i = 0; i < state->history.num_contents; i++) {
+        const Content* content = &state->history.contents[i];
+        for (int j = 0; j < content->num_parts; j++) {
+            if (part_carries_file(&content->parts[j], path)) return record;
         }
     }
-
-    cJSON_Delete(root);
-    fprintf(stderr, "Conversation history loaded from %s\n", filepath);
+    return NULL;
 }
 
 /**
- * @brief Adds a new content block (a user or model turn) to the conversation history.
- * @details This function appends a new `Content` struct to the history array.
- *          It performs a deep copy of the role string and all the `Part` structs
- *          provided, ensuring that the history owns its own memory.
- * @param history A pointer to the History struct to be modified.
- * @param role The role for this turn, either "user" or "model".
- * @param parts An array of Part structs that make up this turn's content.
- * @param num_parts The number of parts in the `parts` array.
+ * @brief Remembers the content of an attached file for later delta encoding.
+ * @details The content is kept as the pending revision until the turn that
+ *          carries it is answered (see `settle_attachment_revisions`).
+ * @param state The application state.
+ * @param path The attachment path.
+ * @param data The file content (null-terminated text).
+ * @param len The content length.
  */
-void add_content_to_history(History* history, const char* role, Part* parts, int num_parts) {
-    // Expand the contents array to make room for the new entry.
-    Content* new_contents = realloc(history->contents, sizeof(Content) * (history->num_contents + 1));
-    if (!new_contents) {
-        fprintf(stderr, "Error: realloc failed when adding to history.\n");
-        return;
+static void remember_attachment_revision(AppState* state, const char* path, const char* data, size_t len) {
+    AttachmentRecord* record = NULL;
+    for (int i = 0; i < state->num_attachment_records; i++) {
+        if (strcmp(state->attachment_records[i].path, path) == 0) {
+            record = &state->attachment_records[i];
+            break;
+        }
     }
-    history->contents = new_contents;
-
-    // Get a pointer to the new content block at the end of the array.
-    Content* new_content = &history->contents[history->num_contents];
-    new_content->role = strdup(role);
-    new_content->num_parts = num_parts;
-    new_content->parts = malloc(sizeof(Part) * num_parts);
 
-    if (!new_content->parts || !new_content->role) {
-        fprintf(stderr, "Error: malloc failed for new history content.\n");
-        // Attempt to roll back the realloc if allocation fails here.
-        if (new_content->role) free(new_content->role);
-        if (new_content->parts) free(new_content->parts);
-        history->contents = realloc(history->contents, sizeof(Content) * history->num_contents);
-        return;
+    char* content = malloc(len + 1);
+    if (!content) return;
+    memcpy(content, data, len);
+    content[len] = '\0';
+
+    if (!record) {
+        AttachmentRecord* grown = realloc(state->attachment_records, sizeof(AttachmentRecord) * (state->num_attachment_records + 1));
+        if (!grown || !(grown[state->num_attachment_records].path = strdup(path))) {
+            if (grown) state->attachment_records = grown;
+            free(content);
+            return;
+        }
+        state->attachment_records = grown;
+        record = &state->attachment_records[state->num_attachment_records++];
+        record->content = NULL;
+        record->hash = 0;
+    } else {
+        free(record->pending);
     }
+    record->pending = content;
+    record->pending_hash = fnv1a_hash((const unsigned char*)data, len);
+}
 
-    // Perform a deep copy of each part from the input array into the history.
-    for (int i = 0; i < num_parts; i++) {
-        new_content->parts[i].type = parts[i].type;
-        if (parts[i].type == PART_TYPE_TEXT) {
-            new_content->parts[i].text = parts[i].text ? strdup(parts[i].text) : NULL;
-            new_content->parts[i].mime_type = NULL;
-            new_content->parts[i].base64_data = NULL;
-            new_content->parts[i].filename = NULL;
-        } else { // PART_TYPE_FILE
-            new_content->parts[i].text = NULL;
-            new_content->parts[i].mime_type = parts[i].mime_type ? strdup(parts[i].mime_type) : NULL;
-            new_content->parts[i].base64_data = parts[i].base64_data ? strdup(parts[i].base64_data) : NULL;
-            new_content->parts[i].filename = parts[i].filename ? strdup(parts[i].filename) : NULL;
+/**
+ * @brief Settles the revisions attached with the turn just sent.
+ * @details A pending revision becomes the base of later diffs only once the
+ *          model has answered the turn that carried it. If the request failed
+ *          and the turn was dropped, the model never saw it and it is
+ *          discarded. Records left without any version are removed.
+ * @param state The application state.
+ * @param answered Whether the model answered the turn.
+ */
+static void settle_attachment_revisions(AppState* state, bool answered) {
+    int kept = 0;
+    for (int i = 0; i < state->num_attachment_records; i++) {
+        AttachmentRecord* record = &state->attachment_records[i];
+        if (record->pending && answered) {
+            free(record->content);
+            record->content = record->pending;
+            record->hash = record->pending_hash;
+        } else {
+            free(record->pending);
+        }
+        record->pending = NULL;
+        if (!record->content) {
+            free(record->path);
+            continue;
         }
+        state->attachment_records[kept++] = *record;
     }
-    history->num_contents++;
+    state->num_attachment_records = kept;
 }
 
 /**
- * @brief Frees all memory associated with a single Content struct.
- * @details This is a helper function for cleaning up history. It deallocates the
- *          memory for the role string and for each individual part within the
- *          content block, including text, MIME types, Base64 data, and filenames.
- * @param content A pointer to the Content struct to be freed.
+ * @brief Frees all attachment revision records.
+ * @param state The application state.
  */
-void free_content(Content* content) {
-    if (!content) return;
+void free_attachment_records(AppState* state) {
+    for (int i = 0; i < state->num_attachment_records; i++) {
+        free(state->attachment_records[i].path);
+        free(state->attachment_records[i].content);
+        free(state->attachment_records[i].pending);
+    }
+    free(state->attachment_records);
+    state->attachment_records = NULL;
+    state->num_attachment_records = 0;
+}
 
-    // Free the role string (e.g., "user", "model").
-    if (content->role) free(content->role);
+/**
+ * @brief Attaches a new revision of an already attached file as a compact delta.
+ * @details If the content is byte-for-byte identical to the version in context
+ *          (checked by hash first), nothing is attached. Otherwise a unified
+ *          diff against the previous revision is attached as a text part. If
+ *          the diff would be at least as large as the file, the earlier copies
+ *          are replaced by a short note instead, and the caller attaches the
+ *          full file, so the history never carries two full copies.
+ * @param state The application state.
+ * @param path The attachment path.
+ * @param data The new file content (null-terminated text).
+ * @param len The content length.
+ * @return true if the attachment was fully handled here, false if the caller
+ *         should attach the full content.
+ */
+static bool attach_file_revision(AppState* state, const char* path, const char* data, size_t len) {
+    AttachmentRecord* record = find_attachment_record(state, path);
+    if (!record) return false;
+
+    // A revision still waiting to be sent is what the next diff continues from.
+    const char* base = record->pending ? record->pending : record->content;
+    uint64_t base_hash = record->pending ? record->pending_hash : record->hash;
+    if (!base) return false;
+    if (base_hash == fnv1a_hash((const unsigned char*)data, len) && strcmp(base, data) == 0) {
+        fprintf(stderr, "File '%s' is unchanged since it was last attached; not attaching it again.\n", path);
+        return true;
+    }
 
-    // Free the data within each part of the content.
-    if (content->parts) {
-        for (int i = 0; i < content->num_parts; i++) {
-            if (content->parts[i].text) free(content->parts[i].text);
-            if (content->parts[i].mime_type) free(content->parts[i].mime_type);
-            if (content->parts[i].base64_data) free(content->parts[i].base64_data);
-            if (content->parts[i].filename) free(content->parts[i].filename);
+    MemoryStruct diff = { .buffer = NULL, .size = 0 };
+    const char* format = "\n--- Updated File: %s (unified diff against the earlier version) ---\n%s--- End of Update ---\n";
+    bool use_diff = append_unified_diff(&diff, path, base, data) && diff.size < len;
+
+    if (use_diff) {
+        size_t text_len = snprintf(NULL, 0, format, path, diff.buffer);
+        char* text = malloc(text_len + 1);
+        if (text) {
+            sprintf(text, format, path, diff.buffer);
+            Part* part = &state->attached_parts[state->num_attached_parts];
+            memset(part, 0, sizeof(Part));
+            part->type = PART_TYPE_TEXT;
+            part->text = text;
+            mem_track(MEM_ATTACHMENTS, text);
+            state->num_attached_parts++;
+            fprintf(stderr, "Attached changes to %s as a diff (%zu bytes instead of %zu).\n", path, diff.size, len);
+            remember_attachment_revision(state, path, data, len);
+        } else {
+            use_diff = false;
         }
-        // Free the array of parts itself.
-        free(content->parts);
     }
-}
+    free(diff.buffer);
+    if (use_diff) return true;
 
-/**
- * @brief Frees all memory used by pending attachments.
- * @details This function is called to clear the list of attachments that have
- *          been prepared but not yet sent with a prompt. It iterates through the
- *          `attached_parts` array and frees all dynamically allocated fields.
- * @param state A pointer to the AppState containing the attachments to clear.
- */
-void free_pending_attachments(AppState* state) {
+    // The diff saves nothing; drop the old copies so only the new one remains.
+    int superseded = 0;
     for (int i = 0; i < state->num_attached_parts; i++) {
-        // Free all possible dynamically allocated fields for each pending part.
-        if (state->attached_parts[i].text) free(state->attached_parts[i].text);
-        if (state->attached_parts[i].filename) free(state->attached_parts[i].filename);
-        if (state->attached_parts[i].mime_type) free(state->attached_parts[i].mime_type);
-        if (state->attached_parts[i].base64_data) free(state->attached_parts[i].base64_data);
+        superseded += supersede_part(&state->attached_parts[i], path, MEM_ATTACHMENTS);
     }
-    // Reset the counter to zero, effectively clearing the list.
-    state->num_attached_parts = 0;
+    for (int i = 0; i < state->history.num_contents; i++) {
+        Content* content = &state->history.contents[i];
+        for (int j = 0; j < content->num_parts; j++) {
+            superseded += supersede_part(&content->parts[j], path, MEM_HISTORY);
+        }
+    }
+    if (superseded > 0) {
+        fprintf(stderr, "Replaced %d earlier cop%s of %s with the new version.\n", superseded, superseded == 1 ? "y" : "ies", path);
+    }
+    return false;
 }
 
 /**
- * @brief Frees all memory associated with the entire conversation history.
- * @details This function iterates through every content block in the history,
- *          calling `free_content` on each one to perform a deep clean. Finally,
- *          it frees the top-level `contents` array itself and resets the history.
- * @param history A pointer to the History struct to be completely freed.
+ * @brief Decides whether an attachment is a candidate for log compaction.
+ * @details Piped input and files named like logs (`*.log`, rotated `*.log.1`,
+ *          `*.out`, `*.txt` or no extension at all) qualify. Source files are
+ *          excluded even though they are also text/plain: their lines are
+ *          short and alike enough to be mistaken for log templates.
+ * @param filepath The attachment name ("stdin" for piped input).
+ * @param mime_type The MIME type guessed for the attachment.
+ * @return true if the content may be compacted.
  */
-void free_history(History* history) {
-    if (!history) return;
+static bool is_log_source(const char* filepath, const char* mime_type) {
+    if (strcmp(filepath, "stdin") == 0) return true;
+    if (strcmp(mime_type, "text/plain") != 0) return false;
+
+    const char* base = strrchr(filepath, '/');
+    base = base ? base + 1 : filepath;
+    if (strstr(base, ".log.") != NULL) return true;
+    const char* ext = strrchr(base, '.');
+    return ext == NULL || ext == base || STRCASECMP(ext, ".log") == 0 ||
+           STRCASECMP(ext, ".out") == 0 || STRCASECMP(ext, ".txt") == 0;
+}
 
-    // Free each content block in the history array.
-    for (int i = 0; i < history->num_contents; i++) {
-        free_content(&history->contents[i]);
-    }
+// --- Source Views ---
 
-    // Free the array of content blocks itself.
-    if (history->contents) {
-        free(history->contents);
+typedef struct {
+    char* path;
+    SourceViewResult view;
+    size_t size;            // Original size in bytes.
+    bool ok;
+} SourceTreeFile;
+
+typedef struct {
+    SourceTreeFile* files;
+    int num_files;
+    int next_file;
+    SourceViewMode mode;
+#ifndef _WIN32
+    pthread_mutex_t lock;
+#endif
+} SourceTreeJob;
+
+/**
+ * @brief Recursively collects the supported source files below a directory.
+ * @details Hidden entries, `node_modules` and symbolic links are skipped so
+ *          that VCS metadata, vendored packages and link cycles stay out.
+ * @return false if the file limit was reached or memory ran out.
+ */
+static bool collect_source_files(const char* dir, char*** paths, int* count, int* capacity) {
+    bool ok = true;
+#ifdef _WIN32
+    char pattern[PATH_MAX];
+    snprintf(pattern, sizeof(pattern), "%s\\*", dir);
+    WIN32_FIND_DATA fd;
+    HANDLE hFind = FindFirstFile(pattern, &fd);
+    if (hFind == INVALID_HANDLE_VALUE) return true;
+    do {
+        const char* name = fd.cFileName;
+#else
+    DIR* d = opendir(dir);
+    if (!d) return true;
+    struct dirent* entry;
+    while (ok && (entry = readdir(d)) != NULL) {
+        const char* name = entry->d_name;
+#endif
+        if (name[0] == '.' || strcmp(name, "node_modules") == 0) continue;
+        char path[PATH_MAX];
+        if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path)) continue;
+#ifdef _WIN32
+        bool is_dir = (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        bool is_link = (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+#else
+        struct stat st;
+        if (lstat(path, &st) != 0) continue;
+        bool is_dir = S_ISDIR(st.st_mode);
+        bool is_link = S_ISLNK(st.st_mode);
+#endif
+        if (is_link) continue;
+
+        if (is_dir) {
+            ok = collect_source_files(path, paths, count, capacity);
+        } else if (source_view_supported(path)) {
+            if (*count >= SOURCE_TREE_MAX_FILES) {
+                ok = false;
+            } else {
+                if (*count == *capacity) {
+                    int new_capacity = *capacity ? *capacity * 2 : 64;
+                    char** grown = realloc(*paths, new_capacity * sizeof(char*));
+                    if (!grown) {
+                        ok = false;
+                        break;
+                    }
+                    *paths = grown;
+                    *capacity = new_capacity;
+                }
+                (*paths)[*count] = strdup(path);
+                if ((*paths)[*count]) (*count)++;
+            }
+        }
+#ifdef _WIN32
+    } while (ok && FindNextFile(hFind, &fd) != 0);
+    FindClose(hFind);
+#else
     }
+    closedir(d);
+#endif
+    return ok;
+}
 
-    // Reset the history to a clean, empty state.
-    history->contents = NULL;
-    history->num_contents = 0;
+static int compare_paths(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
 }
 
 /**
- * @brief Compresses data using the Gzip algorithm.
- * @details This function takes a buffer of input data and compresses it using
- *          zlib's deflate functionality with Gzip headers. This is used to
- *          reduce the size of the JSON payload sent to the Gemini API, which can
- *          improve network performance for large requests.
- * @param input_data A pointer to the raw data to be compressed.
- * @param input_size The size of the input data in bytes.
- * @return A GzipResult struct containing a pointer to the compressed data and
- *         its size. The `data` field will be NULL on failure. The caller is
- *         responsible for freeing the `data` buffer.
+ * @brief Reads one source file and builds its reduced view.
  */
-GzipResult gzip_compress(const unsigned char* input_data, size_t input_size) {
-    GzipResult result = { .data = NULL, .size = 0 };
-    z_stream strm = {0};
-
-    // Initialize the zlib stream for Gzip compression.
-    // 15 + 16 enables Gzip headers.
-    if (deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
-        return result; // Return empty result on failure.
+static void process_source_file(SourceTreeFile* file, SourceViewMode mode) {
+    FILE* f = fopen(file->path, "rb");
+    if (!f) return;
+    char* data = NULL;
+    size_t capacity = 0;
+    size_t size = 0;
+    size_t n;
+    char chunk[16384];
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        if (size + n + 1 > capacity) {
+            capacity = (size + n + 1) * 2;
+            char* grown = realloc(data, capacity);
+            if (!grown) {
+                free(data);
+                fclose(f);
+                return;
+            }
+            data = grown;
+        }
+        memcpy(data + size, chunk, n);
+        size += n;
     }
+    fclose(f);
+    if (data) {
+        data[size] = '\0';
+        file->size = size;
+        file->ok = source_view(file->path, data, size, mode, &file->view);
+        free(data);
+    }
+}
 
-    strm.avail_in = input_size;
-    strm.next_in = (Bytef*)input_data;
-
-    unsigned char out_chunk[GZIP_CHUNK_SIZE];
-
-    // Compress the data in chunks until all input is processed.
-    do {
-        strm.avail_out = GZIP_CHUNK_SIZE;
-        strm.next_out = out_chunk;
-
-        // Perform the compression. Z_FINISH tells zlib that this is the last chunk.
-        int ret = deflate(&strm, Z_FINISH);
-        if (ret != Z_STREAM_END && ret != Z_OK) {
-            deflateEnd(&strm);
-            if (result.data) free(result.data);
-            return (GzipResult){NULL, 0}; // Return empty result on failure.
-        }
-
-        // Calculate how much compressed data was produced in this chunk.
-        size_t have = GZIP_CHUNK_SIZE - strm.avail_out;
-        if (have > 0) {
-            // Expand the result buffer and append the new compressed data.
-            unsigned char* new_data = realloc(result.data, result.size + have);
-            if (!new_data) {
-                deflateEnd(&strm);
-                if (result.data) free(result.data);
-                return (GzipResult){NULL, 0}; // Return empty result on failure.
-            }
-            result.data = new_data;
-            memcpy(result.data + result.size, out_chunk, have);
-            result.size += have;
-        }
-    } while (strm.avail_out == 0); // Continue if the output chunk was filled completely.
-
-    // Clean up the zlib stream.
-    deflateEnd(&strm);
-    return result;
+#ifndef _WIN32
+/**
+ * @brief Worker thread body: processes files until none are left.
+ */
+static void* source_tree_worker(void* arg) {
+    SourceTreeJob* job = (SourceTreeJob*)arg;
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        int index = job->next_file < job->num_files ? job->next_file++ : -1;
+        pthread_mutex_unlock(&job->lock);
+        if (index < 0) break;
+        process_source_file(&job->files[index], job->mode);
+    }
+    return NULL;
 }
+#endif
 
 /**
- * @brief Validates a file path to ensure it is safe.
- * @details This is a security function that checks for common path traversal
- *          patterns. It rejects any path that contains ".." and also rejects
- *          absolute paths, ensuring that file operations are restricted to the
- *          current working directory and its subdirectories.
- * @param path The file path string to validate.
- * @return Returns true if the path is deemed safe, and false otherwise.
+ * @brief Attaches a reduced view of every source file below a directory.
+ * @details Files are collected recursively and processed in parallel, one
+ *          worker per spare core, with the calling thread working as well.
+ *          The views are joined in path order into a single text part so a
+ *          whole tree uses one attachment slot. The estimated token savings
+ *          are reported for the tree as a whole.
+ * @param state The application state.
+ * @param dir The directory to attach.
+ * @param mode SOURCE_VIEW_OUTLINE or SOURCE_VIEW_MINIFY.
  */
-bool is_path_safe(const char* path) {
-    if (path == NULL || path[0] == '\0') {
-        return false;
+static void attach_source_tree(AppState* state, const char* dir, SourceViewMode mode) {
+    const char* label = mode == SOURCE_VIEW_OUTLINE ? "outline" : "minified";
+    if (state->num_attached_parts >= ATTACHMENT_LIMIT) {
+        fprintf(stderr, "Error: Attachment limit of %d reached.\n", ATTACHMENT_LIMIT);
+        return;
     }
 
-    // Reject paths containing ".." to prevent directory traversal attacks.
-    if (strstr(path, "..")) {
-        return false;
+    char** paths = NULL;
+    int num_paths = 0;
+    int capacity = 0;
+    if (!collect_source_files(dir, &paths, &num_paths, &capacity)) {
+        fprintf(stderr, "Warning: Stopped collecting files in '%s' after %d files.\n", dir, num_paths);
+    }
+    if (num_paths == 0) {
+        fprintf(stderr, "No supported source files found in '%s'.\n", dir);
+        free(paths);
+        return;
     }
+    qsort(paths, num_paths, sizeof(char*), compare_paths);
 
-    // Reject absolute paths.
-#ifdef _WIN32
-    // Rejects "C:\path" or "\path"
-    if (path[0] == '\\' || (isalpha((unsigned char)path[0]) && path[1] == ':')) {
-        return false;
+    SourceTreeJob job = { 0 };
+    job.files = calloc(num_paths, sizeof(SourceTreeFile));
+    job.num_files = num_paths;
+    job.mode = mode;
+    if (!job.files) {
+        fprintf(stderr, "Error: Failed to allocate memory for the source tree.\n");
+        for (int i = 0; i < num_paths; i++) free(paths[i]);
+        free(paths);
+        return;
     }
+    for (int i = 0; i < num_paths; i++) job.files[i].path = paths[i];
+    free(paths);
+
+#ifndef _WIN32
+    pthread_t threads[SOURCE_TREE_MAX_THREADS];
+    int num_threads = 0;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cores > 1 ? (int)(cores - 1) : 0; // The caller works too.
+    if (wanted > SOURCE_TREE_MAX_THREADS) wanted = SOURCE_TREE_MAX_THREADS;
+    if (wanted > num_paths - 1) wanted = num_paths - 1;
+    pthread_mutex_init(&job.lock, NULL);
+    for (int i = 0; i < wanted; i++) {
+        if (pthread_create(&threads[num_threads], NULL, source_tree_worker, &job) != 0) break;
+        num_threads++;
+    }
+    source_tree_worker(&job);
+    for (int i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&job.lock);
 #else
-    // Rejects "/path"
-    if (path[0] == '/') {
-        return false;
-    }
+    for (int i = 0; i < num_paths; i++) process_source_file(&job.files[i], mode);
 #endif
 
-    return true;
+    // --- Join the views into one text part ---
+    MemoryStruct text = { .buffer = NULL, .size = 0 };
+    size_t bytes_in = 0, tokens_in = 0, tokens_out = 0;
+    int included = 0;
+    char line[PATH_MAX + 64];
+    snprintf(line, sizeof(line), "\n--- Source Tree: %s (%s) ---\n", dir, label);
+    bool ok = text_buffer_append(&text, line, strlen(line));
+    for (int i = 0; i < num_paths && ok; i++) {
+        SourceTreeFile* file = &job.files[i];
+        if (!file->ok) continue;
+        snprintf(line, sizeof(line), "--- File: %s ---\n", file->path);
+        ok = text_buffer_append(&text, line, strlen(line)) && text_buffer_append(&text, file->view.text, file->view.size);
+        bytes_in += file->size;
+        tokens_in += file->view.tokens_in;
+        tokens_out += file->view.tokens_out;
+        included++;
+    }
+    ok = ok && text_buffer_append(&text, "--- End of Source Tree ---\n", 27);
+
+    if (ok && included > 0) {
+        Part* part = &state->attached_parts[state->num_attached_parts];
+        memset(part, 0, sizeof(Part));
+        part->type = PART_TYPE_TEXT;
+        part->text = text.buffer;
+        text.buffer = NULL;
+        mem_track(MEM_ATTACHMENTS, part->text);
+        state->num_attached_parts++;
+        fprintf(stderr, "Attached %s %s (%d files, %zu -> %zu bytes, ~%zu -> ~%zu tokens, %.0f%% fewer)\n",
+                label, dir, included, bytes_in, text.size, tokens_in, tokens_out,
+                tokens_in ? 100.0 * (double)(tokens_in - tokens_out) / (double)tokens_in : 0.0);
+    } else if (!ok) {
+        fprintf(stderr, "Error: Failed to allocate memory for the source tree.\n");
+    } else {
+        fprintf(stderr, "No source files in '%s' could be read.\n", dir);
+    }
+
+    free(text.buffer);
+    for (int i = 0; i < num_paths; i++) {
+        free(job.files[i].path);
+        source_view_result_free(&job.files[i].view);
+    }
+    free(job.files);
+}
+
+// --- Table Profiles ---
+
+/**
+ * @brief Attaches a profile of a CSV/TSV stream instead of its raw content.
+ * @details The stream is read once in fixed-size chunks by `table_profile`, so
+ *          memory use does not depend on the file size. The profile (schema,
+ *          column statistics and a stratified row sample) becomes a text part.
+ *          With a `--where` filter the statistics and sample cover only the
+ *          matching rows, which answers many follow-up questions without
+ *          sending the data again.
+ * @param state The application state where the new attachment part will be added.
+ * @param stream The open stream positioned at the start of the file.
+ * @param filepath The file name, used for delimiter detection and in the profile.
+ */
+static void attach_table_profile(AppState* state, FILE* stream, const char* filepath) {
+    TableOptions options = { 0 };
+    options.where = state->table_where;
+    TableProfileResult profile = { 0 };
+    char error[256];
+    if (!table_profile(stream, filepath, &options, &profile, error, sizeof(error))) {
+        fprintf(stderr, "Error: Could not profile '%s': %s\n", filepath, error);
+        return;
+    }
+
+    Part* part = &state->attached_parts[state->num_attached_parts];
+    memset(part, 0, sizeof(Part));
+    part->type = PART_TYPE_TEXT;
+    part->text = profile.text;
+    profile.text = NULL;
+    mem_track(MEM_ATTACHMENTS, part->text);
+    state->num_attached_parts++;
+    if (options.where) {
+        fprintf(stderr, "Attached profile of %s (%zu of %zu rows match, %zu columns, %zu -> %zu bytes)\n",
+                filepath, profile.matched_rows, profile.rows, profile.columns, profile.bytes_read, profile.size);
+    } else {
+        fprintf(stderr, "Attached profile of %s (%zu rows, %zu columns, %zu -> %zu bytes)\n",
+                filepath, profile.rows, profile.columns, profile.bytes_read, profile.size);
+    }
+    table_profile_result_free(&profile);
 }
 
 /**
@@ -3548,7 +7689,9 @@ bool is_path_safe(const char* path) {
  *               open the file specified by `filepath`.
  * @param filepath A descriptive name for the source (e.g., filename or "stdin").
  *                 If `stream` is NULL, this is used as the path to open.
- * @param mime_type The MIME type of the data, used in official API mode.
+ * @param mime_type The MIME type guessed from the name. The content decides in
+ *                  the end: signatures override it, and text becomes text/plain
+ *                  unless this is already a text type.
  * @param state The application state where the new attachment part will be added.
  */
 void handle_attachment_from_stream(FILE* stream, const char* filepath, const char* mime_type, AppState* state) {
@@ -3558,6 +7701,14 @@ void handle_attachment_from_stream(FILE* stream, const char* filepath, const cha
     char* formatted_text = NULL;
     bool opened_here = false;
     size_t total_read = 0;
+    ImageResult image = { 0 };
+    bool optimized = false;
+    LogCompactResult compaction = { 0 };
+    SourceViewResult view = { 0 };
+    PdfTextResult pdf = { 0 };
+    bool reduced = false;
+    ContentScan scan;
+    content_scan_init(&scan);
 
     // --- 1. Pre-flight Checks ---
     if (state->num_attached_parts >= ATTACHMENT_LIMIT) {
@@ -3588,6 +7739,14 @@ void handle_attachment_from_stream(FILE* stream, const char* filepath, const cha
         goto cleanup; // Go to cleanup to close the file if we opened it.
     }
 
+    // CSV/TSV files are profiled while streaming when requested or too large to send.
+    if (table_is_tabular(filepath) &&
+        (state->attach_table || (state->table_profile_min_bytes > 0 && S_ISREG(st.st_mode) &&
+                                 st.st_size >= state->table_profile_min_bytes))) {
+        attach_table_profile(state, input_stream, filepath);
+        goto cleanup;
+    }
+
     // Strategy 1: For regular, seekable files.
     if (S_ISREG(st.st_mode)) {
         fseek(input_stream, 0, SEEK_END);
@@ -3603,7 +7762,15 @@ void handle_attachment_from_stream(FILE* stream, const char* filepath, const cha
             fprintf(stderr, "Error: Failed to allocate memory for file buffer.\n");
             goto cleanup;
         }
-        total_read = fread(buffer, 1, file_size, input_stream);
+        // Read in chunks and validate each one while it is still in cache.
+        while (total_read < (size_t)file_size) {
+            size_t want = (size_t)file_size - total_read;
+            if (want > ATTACHMENT_READ_CHUNK) want = ATTACHMENT_READ_CHUNK;
+            size_t got = fread(buffer + total_read, 1, want, input_stream);
+            if (got == 0) break;
+            content_scan_update(&scan, buffer + total_read, got);
+            total_read += got;
+        }
         if (total_read != (size_t)file_size) {
             fprintf(stderr, "Error reading from file '%s'.\n", filepath);
             goto cleanup;
@@ -3619,6 +7786,7 @@ void handle_attachment_from_stream(FILE* stream, const char* filepath, const cha
         }
         ssize_t bytes_read;
         while ((bytes_read = read(fd, buffer + total_read, 1024)) > 0) {
+            content_scan_update(&scan, buffer + total_read, (size_t)bytes_read);
             total_read += (size_t)bytes_read;
             if (capacity - total_read < 1024) {
                 capacity *= 2;
@@ -3642,6 +7810,112 @@ void handle_attachment_from_stream(FILE* stream, const char* filepath, const cha
     }
     buffer[total_read] = '\0'; // Always null-terminate the buffer content.
 
+    // Decide from the content, not the name, what is being attached: text in any
+    // encoding is sent as UTF-8 text, recognized binaries with their real MIME
+    // type, and anything the API would refuse is rejected here.
+    content_scan_finish(&scan);
+    ContentEncoding encoding = content_classify(&scan, buffer, total_read);
+    const char* sniffed = content_sniff_mime(buffer, total_read, encoding != CONTENT_BINARY);
+    if (sniffed) {
+        if (!content_mime_supported(sniffed)) {
+            fprintf(stderr, "Error: %s is %s, which cannot be attached. Attachment skipped.\n", filepath, sniffed);
+            goto cleanup;
+        }
+        mime_type = sniffed;
+    } else if (encoding == CONTENT_BINARY) {
+        if (scan.nul_bytes > 0) {
+            fprintf(stderr, "Error: %s is binary data of an unsupported type (%zu NUL bytes). Attachment skipped.\n",
+                    filepath, scan.nul_bytes);
+        } else {
+            // Without NUL bytes only a high share of control characters makes content binary.
+            fprintf(stderr, "Error: %s is binary data of an unsupported type (%zu control characters, first at byte %zu). Attachment skipped.\n",
+                    filepath, scan.control_bytes, scan.first_control);
+        }
+        goto cleanup;
+    } else {
+        if (encoding != CONTENT_UTF8) {
+            size_t converted_size = 0;
+            char* converted = content_to_utf8(buffer, total_read, encoding, &converted_size);
+            if (!converted) {
+                fprintf(stderr, "Error: Failed to allocate memory for converting %s to UTF-8.\n", filepath);
+                goto cleanup;
+            }
+            if (encoding == CONTENT_UTF8_REPAIRED) {
+                fprintf(stderr, "Replaced %zu malformed UTF-8 sequence(s) in %s with U+FFFD (first at byte %zu).\n",
+                        scan.invalid_utf8, filepath, scan.first_invalid);
+            } else {
+                fprintf(stderr, "Converted %s from %s to UTF-8.\n", filepath, content_encoding_name(encoding));
+            }
+            free(buffer);
+            buffer = (unsigned char*)converted;
+            total_read = converted_size;
+        }
+        if (!content_mime_is_text(mime_type)) mime_type = "text/plain";
+    }
+
+    // With --pdf-text, a PDF with a usable text layer is sent as that text.
+    // Scanned or unusual documents, and text no smaller than the file, fall back to the PDF.
+    if (state->pdf_text && strcmp(mime_type, "application/pdf") == 0) {
+        if (pdf_extract_text_with_timeout(buffer, total_read, PDF_EXTRACT_TIMEOUT_MS, &pdf) && pdf.size < total_read) {
+            fprintf(stderr, "Extracted text from %s: %d pages, %zu -> %zu bytes (%.1f%% smaller)\n",
+                    filepath, pdf.pages, total_read, pdf.size,
+                    100.0 * (double)(total_read - pdf.size) / (double)total_read);
+            free(buffer);
+            buffer = (unsigned char*)pdf.text;
+            total_read = pdf.size;
+            pdf.text = NULL;
+            mime_type = "text/plain";
+            reduced = true;
+        } else {
+            fprintf(stderr, "Sending %s as a PDF: %s.\n", filepath,
+                    pdf.reason ? pdf.reason : "its text is not smaller than the document");
+            pdf_text_result_free(&pdf);
+        }
+    }
+
+    // With --compact-logs, repeated log lines are collapsed into templates and
+    // the compacted text replaces the content from here on.
+    if (state->compact_logs && is_log_source(filepath, mime_type) &&
+        log_compact((const char*)buffer, total_read, &compaction)) {
+        fprintf(stderr, "Compacted log %s: %zu -> %zu lines, %zu -> %zu bytes (%.1f%% smaller)\n",
+                filepath, compaction.lines_in, compaction.lines_out, total_read, compaction.size,
+                100.0 * (double)(total_read - compaction.size) / (double)total_read);
+        free(buffer);
+        buffer = (unsigned char*)compaction.text;
+        total_read = compaction.size;
+        compaction.text = NULL;
+        reduced = true;
+    }
+
+    // With --outline or --minify, source files are sent as their reduced view.
+    if (!reduced && state->attach_view != SOURCE_VIEW_NONE && source_view_supported(filepath) &&
+        source_view(filepath, (const char*)buffer, total_read, state->attach_view, &view)) {
+        fprintf(stderr, "%s %s: %zu -> %zu bytes, ~%zu -> ~%zu tokens (%.0f%% fewer)\n",
+                state->attach_view == SOURCE_VIEW_OUTLINE ? "Outlined" : "Minified", filepath,
+                total_read, view.size, view.tokens_in, view.tokens_out,
+                view.tokens_in ? 100.0 * (double)(view.tokens_in - view.tokens_out) / (double)view.tokens_in : 0.0);
+        free(buffer);
+        buffer = (unsigned char*)view.text;
+        total_read = view.size;
+        view.text = NULL;
+        reduced = true;
+    }
+
+    // Re-attached text files are sent as a diff against the version already in context.
+    // Reduced content is not: a diff against the raw file would not match what was sent.
+    bool track_revision = !reduced && S_ISREG(st.st_mode) && strcmp(filepath, "stdin") != 0 &&
+                          memchr(buffer, '\0', total_read) == NULL &&
+                          strncmp(mime_type, "image/", 6) != 0 && strcmp(mime_type, "application/pdf") != 0;
+    if (track_revision && attach_file_revision(state, filepath, (const char*)buffer, total_read)) {
+        goto cleanup;
+    }
+
+    // Free mode inlines attachments into the prompt, which only works for text.
+    if (state->free_mode && !content_mime_is_text(mime_type)) {
+        fprintf(stderr, "Error: Free mode can only attach text; %s is %s. Attachment skipped.\n", filepath, mime_type);
+        goto cleanup;
+    }
+
     // --- 4. Create Attachment Part based on API Mode ---
     Part* part = &state->attached_parts[state->num_attached_parts];
     memset(part, 0, sizeof(Part)); // Zero out the struct to prevent stale pointers.
@@ -3668,10 +7942,18 @@ void handle_attachment_from_stream(FILE* stream, const char* filepath, const cha
         part->type = PART_TYPE_TEXT;
         part->text = formatted_text;
     } else { // Official API mode
+        // Downscale and re-encode images before they are Base64-encoded.
+        if (state->image_max_dimension > 0 && strncmp(mime_type, "image/", 6) == 0 &&
+            image_optimize_with_timeout(buffer, total_read, mime_type, state->image_max_dimension,
+                                        IMAGE_OPTIMIZE_TIMEOUT_MS, &image)) {
+            optimized = true;
+            mime_type = image.mime_type;
+        }
+
         part->type = PART_TYPE_FILE;
         part->filename = strdup(filepath);
         part->mime_type = strdup(mime_type);
-        part->base64_data = base64_encode(buffer, total_read);
+        part->base64_data = optimized ? base64_encode(image.data, image.size) : base64_encode(buffer, total_read);
 
         // Check if any allocation failed.
         if (!part->filename || !part->mime_type || !part->base64_data) {
@@ -3686,11 +7968,21 @@ void handle_attachment_from_stream(FILE* stream, const char* filepath, const cha
 
     // --- 5. Finalize Success ---
     // If we reach here, the part is valid and complete.
-    fprintf(stderr, "Attached %s (MIME: %s, Size: %zu bytes)\n",
-            state->free_mode ? "stdin/file" : part->filename,
-            state->free_mode ? "text/plain" : part->mime_type,
-            total_read);
+    if (optimized) {
+        fprintf(stderr, "Attached %s (MIME: %s, Size: %zu -> %zu bytes, %dx%d -> %dx%d)\n",
+                part->filename, part->mime_type, total_read, image.size,
+                image.width, image.height, image.out_width, image.out_height);
+    } else {
+        fprintf(stderr, "Attached %s (MIME: %s, Size: %zu bytes)\n",
+                state->free_mode ? "stdin/file" : part->filename,
+                state->free_mode ? "text/plain" : part->mime_type,
+                total_read);
+    }
+    track_part(MEM_ATTACHMENTS, part);
     (state->num_attached_parts)++;
+    if (track_revision) {
+        remember_attachment_revision(state, filepath, (const char*)buffer, total_read);
+    }
 
 
 // --- 6. Cleanup ---
@@ -3699,6 +7991,7 @@ cleanup:
     if (buffer) {
         free(buffer);
     }
+    image_result_free(&image);
     // Note: formatted_text is now owned by the Part struct, so we don't free it here.
     if (opened_here && input_stream) {
         fclose(input_stream);
@@ -3710,7 +8003,8 @@ cleanup:
  * @details This function performs a simple, case-insensitive check of the file
  *          extension to guess its MIME type. It covers common text, code, image,
  *          and document formats. If the extension is unknown, it defaults to
- *          "text/plain".
+ *          "text/plain". The attachment's content has the final say; see
+ *          handle_attachment_from_stream().
  * @param filename The name of the file.
  * @return A constant string literal representing the guessed MIME type.
  */
@@ -3789,30 +8083,379 @@ char* base64_encode(const unsigned char* data, size_t input_length) {
     return encoded_data;
 }
 
+// --- HTTP Transport ---
+
 /**
- * @brief Performs the low-level cURL request for the official Gemini API.
- * @details This is the core transport function for all POST requests to the
- *          official API. It constructs the full API URL, sets the required
- *          HTTP headers (including content-type, encoding, and API key), and
- *          executes the cURL request with the provided payload and callback.
+ * @brief Returns the multi handle all requests go through, creating it on first use.
+ * @details Every transfer is run on this one handle, so connections stay open
+ *          between requests, and with HTTP/2 concurrent requests to the same
+ *          host share a connection as separate streams. A connection carries at
+ *          most `http2_max_streams` streams; further transfers get a connection
+ *          of their own.
+ * @return The multi handle, or NULL if it could not be created.
+ */
+static CURLM* transport_multi(AppState* state) {
+    HttpTransport* transport = &state->transport;
+    if (!transport->multi) {
+        transport->multi = curl_multi_init();
+        if (!transport->multi) return NULL;
+        curl_multi_setopt(transport->multi, CURLMOPT_PIPELINING, state->http2 ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+#if LIBCURL_VERSION_NUM >= 0x074300
+        long streams = state->http2_max_streams > 0 ? state->http2_max_streams : DEFAULT_HTTP2_MAX_STREAMS;
+        curl_multi_setopt(transport->multi, CURLMOPT_MAX_CONCURRENT_STREAMS, streams);
+#endif
+    }
+    return transport->multi;
+}
+
+/**
+ * @brief Sets the protocol options on an easy handle before it is performed.
+ * @details HTTP/2 is negotiated over TLS; plain HTTP stays on HTTP/1.1. Over
+ *          TLS, a transfer started while a connection to the same host is
+ *          still being set up waits for it, to learn whether it can multiplex,
+ *          rather than opening a second connection alongside it.
+ * @param url The URL the handle was given.
+ */
+static void transport_prepare(AppState* state, CURL* curl, const char* url) {
+    bool tls = strncmp(url, "https://", 8) == 0;
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, state->http2 ? (long)CURL_HTTP_VERSION_2TLS : (long)CURL_HTTP_VERSION_1_1);
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, state->http2 && tls ? 1L : 0L);
+}
+
+/**
+ * @brief Counts a finished transfer as an HTTP/1.x request or an HTTP/2 stream,
+ *        and any connection it had to open, for `/stats`.
+ */
+static void transport_note(HttpTransport* transport, CURL* curl) {
+    long version = 0, connects = 0;
+    curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &version);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    if (version == CURL_HTTP_VERSION_2_0) {
+        transport->h2_streams++;
+        transport->h2_connections += connects;
+    } else if (version == CURL_HTTP_VERSION_1_0 || version == CURL_HTTP_VERSION_1_1) {
+        transport->h1_requests++;
+        transport->h1_connections += connects;
+    }
+}
+
+/**
+ * @brief Notes when the first response header of a transfer arrives.
+ * @details libcurl's own start-transfer time is the first response byte only
+ *          for HTTP/1.x; on a multiplexed HTTP/2 stream it can be taken as
+ *          soon as the request is sent. Interim 1xx responses such as
+ *          `100 Continue` come before the body is sent and are not counted.
+ */
+static size_t transport_header_callback(char* data, size_t size, size_t nmemb, void* userp) {
+    HttpTransfer* transfer = (HttpTransfer*)userp;
+    size_t length = size * nmemb;
+    if (transfer->responded == 0.0 && length > 5 && strncmp(data, "HTTP/", 5) == 0) {
+        const char* space = memchr(data, ' ', length);
+        if (space && space + 1 < data + length && space[1] != '1') transfer->responded = monotonic_seconds();
+    }
+    return length;
+}
+
+/**
+ * @brief Notes when the request body has been sent, then runs the caller's
+ *        progress callback, if any.
+ */
+static int transport_progress_callback(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    HttpTransfer* transfer = (HttpTransfer*)clientp;
+    if (transfer->uploaded == 0.0 && ultotal > 0 && ulnow >= ultotal) {
+        transfer->uploaded = monotonic_seconds();
+        curl_socket_t sock = CURL_SOCKET_BAD;
+        int size = 0;
+#ifdef _WIN32
+        int length = sizeof(size);
+#else
+        socklen_t length = sizeof(size);
+#endif
+        if (curl_easy_getinfo(transfer->curl, CURLINFO_ACTIVESOCKET, &sock) == CURLE_OK && sock != CURL_SOCKET_BAD &&
+            getsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char*)&size, &length) == 0) {
+            transfer->send_buffer = size;
+        }
+    }
+    return transfer->progress ? transfer->progress(transfer->progress_data, dltotal, dlnow, ultotal, ulnow) : 0;
+}
+
+/**
+ * @brief Time from the start of a transfer to its first response header, in
+ *        microseconds (0 if no response arrived).
+ */
+static curl_off_t transfer_response_us(const HttpTransfer* transfer) {
+    if (transfer->responded == 0.0) return 0;
+    return (curl_off_t)((transfer->responded - transfer->started) * 1e6);
+}
+
+/**
+ * @brief Runs several prepared transfers at the same time and returns when
+ *        all of them have finished.
+ * @param state The application state holding the shared transport.
+ * @param transfers The transfers; `curl` is set by the caller, the rest here.
+ *                  The handles are removed from the transport again before
+ *                  returning and remain the caller's to clean up.
+ * @param count Number of transfers.
+ */
+static void transport_perform_all(AppState* state, HttpTransfer* transfers, int count) {
+    HttpTransport* transport = &state->transport;
+    CURLM* multi = transport_multi(state);
+    bool* pending = calloc(count > 0 ? (size_t)count : 1, sizeof(bool));
+    if (!multi || !pending) {
+        for (int i = 0; i < count; i++) transfers[i].result = CURLE_OUT_OF_MEMORY;
+        free(pending);
+        return;
+    }
+
+    int remaining = 0;
+    for (int i = 0; i < count; i++) {
+        HttpTransfer* transfer = &transfers[i];
+        transfer->started = monotonic_seconds();
+        transfer->responded = 0.0;
+        transfer->uploaded = 0.0;
+        transfer->send_buffer = 0;
+        curl_easy_setopt(transfer->curl, CURLOPT_HEADERFUNCTION, transport_header_callback);
+        curl_easy_setopt(transfer->curl, CURLOPT_HEADERDATA, transfer);
+        curl_easy_setopt(transfer->curl, CURLOPT_XFERINFOFUNCTION, transport_progress_callback);
+        curl_easy_setopt(transfer->curl, CURLOPT_XFERINFODATA, transfer);
+        curl_easy_setopt(transfer->curl, CURLOPT_NOPROGRESS, 0L);
+        pending[i] = curl_multi_add_handle(multi, transfer->curl) == CURLM_OK;
+        transfer->result = pending[i] ? CURLE_OK : CURLE_FAILED_INIT;
+        if (pending[i]) remaining++;
+    }
+
+    while (remaining > 0) {
+        int running = 0;
+        CURLMcode mc = curl_multi_perform(multi, &running);
+        if (running > transport->peak_transfers) transport->peak_transfers = running;
+
+        CURLMsg* msg;
+        int queued;
+        while ((msg = curl_multi_info_read(multi, &queued))) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            for (int i = 0; i < count; i++) {
+                if (pending[i] && transfers[i].curl == msg->easy_handle) {
+                    transfers[i].result = msg->data.result;
+                    pending[i] = false;
+                    remaining--;
+                    transport_note(transport, transfers[i].curl);
+                    break;
+                }
+            }
+        }
+        if (mc == CURLM_OK && remaining > 0) mc = curl_multi_poll(multi, NULL, 0, 1000, NULL);
+        if (mc != CURLM_OK) {
+            for (int i = 0; i < count; i++) {
+                if (pending[i]) transfers[i].result = mc == CURLM_OUT_OF_MEMORY ? CURLE_OUT_OF_MEMORY : CURLE_RECV_ERROR;
+            }
+            break;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (transfers[i].result != CURLE_FAILED_INIT) curl_multi_remove_handle(multi, transfers[i].curl);
+    }
+    free(pending);
+}
+
+/**
+ * @brief Runs one prepared transfer on the shared transport, like curl_easy_perform.
+ */
+static CURLcode transport_perform(AppState* state, HttpTransfer* transfer) {
+    transport_perform_all(state, transfer, 1);
+    return transfer->result;
+}
+
+/**
+ * @brief Prints the protocol, connection and stream counts for `/stats`.
+ */
+static void print_transport_stats(const AppState* state) {
+    const HttpTransport* transport = &state->transport;
+    if (state->http2) {
+        fprintf(stderr, "HTTP: HTTP/2 preferred, up to %d streams per connection\n", state->http2_max_streams);
+    } else {
+        fprintf(stderr, "HTTP: HTTP/1.1 only\n");
+    }
+    fprintf(stderr, "HTTP/1.1: %ld requests over %ld connections; HTTP/2: %ld streams over %ld connections; peak %d transfers at once\n",
+            transport->h1_requests, transport->h1_connections, transport->h2_streams, transport->h2_connections,
+            transport->peak_transfers);
+}
+
+// --- API Routes ---
+
+/**
+ * @brief Picks the route for the next attempt of a request to the official API.
+ * @details Without routes in the configuration there is a single one: the
+ *          public endpoint, over the global proxy setting.
+ * @param tried Bit i set: route i already failed for this request.
+ * @return The route, or -1 if none is left to try.
+ */
+static int route_pick(AppState* state, unsigned tried) {
+    if (!state->routes) state->routes = route_table_new();
+    if (!state->routes) return -1;
+    if (route_table_count(state->routes) == 0) route_table_add(state->routes, "default", API_BASE_URL, NULL);
+    return route_table_pick(state->routes, tried);
+}
+
+/**
+ * @brief Points a handle at `path` on the API over the given route.
+ * @details Sets the URL and the route's proxy, or the global proxy setting if
+ *          the route has none of its own.
+ * @param[out] url Receives the full URL.
+ */
+static void route_apply(AppState* state, CURL* curl, int route, const char* path, char* url, size_t url_size) {
+    Route r;
+    route_table_get(state->routes, route, &r);
+    snprintf(url, url_size, "%s%s", r.base_url, path);
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    const char* proxy = r.has_proxy ? r.proxy : state->proxy;
+    if (r.has_proxy || proxy[0] != '\0') {
+        curl_easy_setopt(curl, CURLOPT_PROXY, proxy);
+    }
+}
+
+/**
+ * @brief Records the health of a route from a request sent over it.
+ * @details The route failed if the API gave no answer: no connection, a
+ *          timeout before the response, or a proxy or gateway answering in
+ *          its place. Requests the user or a callback aborted say nothing
+ *          about the route.
+ * @return true if the route failed.
+ */
+static bool route_finish(AppState* state, int route, const HttpTransfer* transfer, long http_code) {
+    if (state->request_cancelled || transfer->result == CURLE_WRITE_ERROR ||
+        transfer->result == CURLE_ABORTED_BY_CALLBACK) {
+        return false;
+    }
+    bool failed = http_code < 0 || route_status_failed(http_code);
+    route_table_report(state->routes, route, !failed);
+    return failed;
+}
+
+static size_t route_write_callback(void* contents, size_t size, size_t nmemb, void* userp) {
+    RouteResponse* response = userp;
+    long http_code = 0;
+    curl_easy_getinfo(response->curl, CURLINFO_RESPONSE_CODE, &http_code);
+    if (route_status_failed(http_code)) {
+        return write_to_memory_struct_callback(contents, size, nmemb, &response->held);
+    }
+    response->delivered = true;
+    return response->callback(contents, size, nmemb, response->callback_data);
+}
+
+/**
+ * @brief Routes the response of `curl` to the caller's write callback,
+ *        except the body of a proxy or gateway error.
+ * @details That body is held back so the request can be sent again over
+ *          another route as if the failed attempt never happened.
+ */
+static void route_response_init(RouteResponse* response, CURL* curl, size_t (*callback)(void*, size_t, size_t, void*),
+                                void* callback_data) {
+    *response = (RouteResponse){ .curl = curl, .callback = callback, .callback_data = callback_data };
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, route_write_callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, response);
+}
+
+/**
+ * @brief Passes a held-back error body on to the caller, unless the request
+ *        is being resent, and frees it.
+ */
+static void route_response_finish(RouteResponse* response, bool resent) {
+    if (response->held.size > 0 && !resent) {
+        response->callback(response->held.buffer, 1, response->held.size, response->callback_data);
+    }
+    mem_free(MEM_CURL, response->held.buffer);
+    response->held.buffer = NULL;
+    response->held.size = 0;
+}
+
+/**
+ * @brief Picks the route to resend a request over after `failed` did not get through.
+ * @return The route, or -1 if every route has been tried.
+ */
+static int route_failover(AppState* state, int failed, unsigned tried) {
+    int next = route_pick(state, tried);
+    if (next >= 0) {
+        Route from, to;
+        route_table_get(state->routes, failed, &from);
+        route_table_get(state->routes, next, &to);
+        fprintf(stderr, "[Route %s failed; trying %s]\n", from.name, to.name);
+    }
+    return next;
+}
+
+/**
+ * @brief Starts measuring the configured routes in the background.
+ * @details Only worth it with more than one route to choose from; the probe
+ *          lists a single model, which is cheap and needs the API key.
+ */
+static void start_route_prober(AppState* state) {
+    if (state->free_mode || !state->routes || route_table_count(state->routes) < 2 || state->route_probe_interval <= 0) {
+        return;
+    }
+    char auth_header[256];
+    snprintf(auth_header, sizeof(auth_header), "x-goog-api-key: %s", state->api_key);
+    route_table_start_prober(state->routes, state->route_probe_interval, API_MODELS_PATH "?pageSize=1",
+                             auth_header, state->proxy);
+}
+
+static void format_route_ms(char* out, size_t size, double seconds) {
+    if (seconds < 0.0) snprintf(out, size, "-");
+    else snprintf(out, size, "%.0f ms", seconds * 1000.0);
+}
+
+/**
+ * @brief Prints the measurements and health of each configured route for `/stats`.
+ */
+static void print_route_stats(AppState* state) {
+    if (!state->routes_configured) return;
+    int count = route_table_count(state->routes);
+    int best = route_table_pick(state->routes, 0);
+    if (route_table_probing(state->routes)) {
+        fprintf(stderr, "Routes: %d, probed every %d s (* = used next)\n", count, state->route_probe_interval);
+    } else {
+        fprintf(stderr, "Routes: %d, not probed (* = used next)\n", count);
+    }
+    double now = route_clock();
+    for (int i = 0; i < count; i++) {
+        Route r;
+        route_table_get(state->routes, i, &r);
+        char connect[32], ttfb[32], health[48];
+        format_route_ms(connect, sizeof(connect), r.connect_ewma);
+        format_route_ms(ttfb, sizeof(ttfb), r.ttfb_ewma);
+        if (r.down_until > now) snprintf(health, sizeof(health), "down for %.0f s", r.down_until - now);
+        else snprintf(health, sizeof(health), "up");
+        const char* proxy = r.has_proxy ? (r.proxy[0] ? r.proxy : "direct") : (state->proxy[0] ? state->proxy : "proxy from environment");
+        fprintf(stderr, "%c %s: %s via %s; connect %s, first byte %s; %s; %ld probes, %ld requests, %ld failed\n",
+                i == best ? '*' : ' ', r.name, r.base_url, proxy, connect, ttfb, health, r.probes, r.requests, r.errors);
+    }
+}
+
+/**
+ * @brief Creates an easy handle for a POST to the official Gemini API.
+ * @details Builds the full API URL from the model name and endpoint and sets
+ *          the required HTTP headers (content type, encoding, API key, origin).
  * @param state The current application state, used for model name, API key, and origin.
+ * @param route The route to send the request over (see `route_pick`).
  * @param endpoint The specific API endpoint to call (e.g., "streamGenerateContent").
- * @param compressed_payload The Gzipped request body.
- * @param payload_size The size of the compressed payload.
+ * @param body The encoded request body; it must outlive the transfer.
  * @param callback The libcurl write callback function to handle the response data.
- * @param callback_data A pointer to the data structure for the callback (e.g., MemoryStruct).
- * @return The HTTP status code of the response. On a transport-level error,
- *         it returns a negative CURLcode.
+ * @param callback_data A pointer to the data structure for the callback.
+ * @param[out] headers_out Receives the header list, which the caller frees after the transfer.
+ * @return The handle, or NULL if it could not be created.
  */
-long perform_api_curl_request(AppState* state, const char* endpoint, const char* compressed_payload, size_t payload_size, size_t (*callback)(void*, size_t, size_t, void*), void* callback_data) {
+static CURL* create_api_curl_handle(AppState* state, int route, const char* endpoint, const RequestBody* body,
+                                    size_t (*callback)(void*, size_t, size_t, void*), void* callback_data,
+                                    struct curl_slist** headers_out) {
+    *headers_out = NULL;
     CURL* curl = curl_easy_init();
     if (!curl) {
-        return -CURLE_FAILED_INIT;
+        return NULL;
     }
 
-    // Construct the full API URL from the model name and endpoint.
-    char full_api_url[256];
-    snprintf(full_api_url, sizeof(full_api_url), API_URL_FORMAT, state->model_name, endpoint);
+    // Construct the API path from the model name and endpoint.
+    char api_path[256];
+    snprintf(api_path, sizeof(api_path), API_MODEL_PATH_FORMAT, state->model_name, endpoint);
 
     // Prepare the authentication and origin headers.
     char auth_header[256];
@@ -3820,7 +8463,9 @@ long perform_api_curl_request(AppState* state, const char* endpoint, const char*
 
     struct curl_slist* headers = NULL;
     headers = curl_slist_append(headers, "Content-Type: application/json");
-    headers = curl_slist_append(headers, "Content-Encoding: gzip");
+    if (body->gzipped) {
+        headers = curl_slist_append(headers, "Content-Encoding: gzip");
+    }
     headers = curl_slist_append(headers, auth_header);
 
     // The 'Origin' header is optional.
@@ -3831,29 +8476,92 @@ long perform_api_curl_request(AppState* state, const char* endpoint, const char*
     }
 
     // Configure the cURL handle for the POST request.
-    curl_easy_setopt(curl, CURLOPT_URL, full_api_url);
-    if (state->proxy[0] != '\0') {
-        curl_easy_setopt(curl, CURLOPT_PROXY, state->proxy);
-    }
+    char full_api_url[512];
+    route_apply(state, curl, route, api_path, full_api_url, sizeof(full_api_url));
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, compressed_payload);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)payload_size);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, (const char*)body->data);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)body->size);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, callback_data);
+    transport_prepare(state, curl, full_api_url);
+    *headers_out = headers;
+    return curl;
+}
 
-    // Execute the request and retrieve the HTTP response code.
+/**
+ * @brief Collects the outcome of a finished POST to the official API.
+ * @details Records the transfer in `usage` and measures the upload for the
+ *          adaptive compression policy.
+ * @param transfer The finished transfer.
+ * @return The HTTP status code of the response. On a transport-level error,
+ *         it returns a negative CURLcode.
+ */
+static long finish_api_curl_request(AppState* state, UsageRecord* usage, const HttpTransfer* transfer, const RequestBody* body) {
     long http_code = 0;
-    CURLcode res = curl_easy_perform(curl);
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+    curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &http_code);
 
     // If the request failed at the transport layer, return the negative cURL error code.
-    if (res != CURLE_OK && http_code == 0) {
-        http_code = -res;
+    if (transfer->result != CURLE_OK && http_code == 0) {
+        http_code = -(long)transfer->result;
     }
+    usage_note_transfer(usage, transfer, http_code);
 
-    // Clean up all allocated resources.
-    curl_easy_cleanup(curl);
-    curl_slist_free_all(headers);
+    // Measure the upload for the adaptive compression policy.
+    curl_off_t pretransfer_us = 0;
+    if (transfer->result == CURLE_OK && transfer->uploaded > 0.0 &&
+        curl_easy_getinfo(transfer->curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer_us) == CURLE_OK) {
+        double upload_us = (transfer->uploaded - transfer->started) * 1e6;
+        record_upload(state, body, (upload_us - (double)pretransfer_us) / 1e6, transfer->send_buffer);
+    }
+    return http_code;
+}
+
+/**
+ * @brief Performs the low-level cURL request for the official Gemini API.
+ * @details This is the core transport function for all POST requests to the
+ *          official API. It creates the request with `create_api_curl_handle`
+ *          and runs it on the shared transport, reusing an open connection
+ *          to the API when there is one. It goes over the fastest healthy
+ *          route, and is sent again over the next one if that route fails
+ *          before any of the response reaches the callback.
+ * @param state The current application state, used for model name, API key, and origin.
+ * @param endpoint The specific API endpoint to call (e.g., "streamGenerateContent").
+ * @param body The encoded request body. Its upload is measured to tune the
+ *             compression policy.
+ * @param callback The libcurl write callback function to handle the response data.
+ * @param callback_data A pointer to the data structure for the callback (e.g., MemoryStruct).
+ * @return The HTTP status code of the response. On a transport-level error,
+ *         it returns a negative CURLcode.
+ */
+long perform_api_curl_request(AppState* state, const char* endpoint, const RequestBody* body, size_t (*callback)(void*, size_t, size_t, void*), void* callback_data) {
+    long http_code = -CURLE_FAILED_INIT;
+    unsigned tried = 0;
+    int route = route_pick(state, tried);
+    while (route >= 0) {
+        struct curl_slist* headers;
+        CURL* curl = create_api_curl_handle(state, route, endpoint, body, callback, callback_data, &headers);
+        if (!curl) {
+            return -CURLE_FAILED_INIT;
+        }
+
+        // Execute the request and retrieve the HTTP response code.
+        RouteResponse response;
+        route_response_init(&response, curl, callback, callback_data);
+        HttpTransfer transfer = { .curl = curl };
+        watch_install_progress(&transfer, state);
+        transport_perform(state, &transfer);
+        http_code = finish_api_curl_request(state, &state->usage, &transfer, body);
+
+        // Clean up all allocated resources.
+        curl_easy_cleanup(curl);
+        curl_slist_free_all(headers);
+
+        // A request the callback has seen nothing of can be sent again as it is.
+        tried |= 1u << route;
+        bool failed = route_finish(state, route, &transfer, http_code);
+        route = failed && !response.delivered ? route_failover(state, route, tried) : -1;
+        route_response_finish(&response, route >= 0);
+    }
     return http_code;
 }
 
@@ -3869,8 +8577,8 @@ long perform_api_curl_request(AppState* state, const char* endpoint, const char*
  * @return Returns 0 on successful execution.
  */
 int main(int argc, char* argv[]) {
-    // Initialize the cURL library globally.
-    curl_global_init(CURL_GLOBAL_ALL);
+    // Initialize the cURL library globally, with memory accounting enabled.
+    mem_accounting_init();
 
     // --- Pre-scan arguments for mode flags ---
     bool execute_flag_found = false;
@@ -0,0 +1,103 @@
+/* Unit tests for internal helpers of gcli.c.
+ *
+ * gcli.c is one translation unit with static helpers, so it is included
+ * here with its main() renamed. Built and run by `make test-gcli`.
+ */
+
+#define main gcli_main
+#include "gcli.c"
+#undef main
+
+static int failures = 0;
+
+#define CHECK(condition, ...) do { \
+    if (!(condition)) { \
+        failures++; \
+        fprintf(stderr, "FAIL (line %d): ", __LINE__); \
+        fprintf(stderr, __VA_ARGS__); \
+        fprintf(stderr, "\n"); \
+    } \
+} while (0)
+
+static void set_samples(CompressionStats* stats, const double* samples, int count) {
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < count; i++) stats->upload_samples[i] = samples[i];
+    stats->num_upload_samples = count;
+    stats->next_upload_sample = count % UPLOAD_SAMPLE_WINDOW;
+}
+
+static void test_upload_estimate(void) {
+    CompressionStats stats;
+
+    set_samples(&stats, NULL, 0);
+    CHECK(estimated_upload_bps(&stats) == 0.0, "no samples should give no estimate");
+
+    // Most uploads ran at about 1 MB/s; two ended in the socket buffer and look 1000x faster.
+    const double skewed_high[] = { 1.0e6, 1.1e6, 0.9e6, 1.2e9, 1.0e6, 4.0e9, 1.05e6 };
+    set_samples(&stats, skewed_high, 7);
+    double bps = estimated_upload_bps(&stats);
+    CHECK(bps >= 0.9e6 && bps <= 1.2e6, "skewed-high samples gave %.0f B/s, expected about 1e6", bps);
+
+    // A stalled upload must not drag the estimate down either.
+    const double skewed_low[] = { 2.0e6, 1.0e3, 2.2e6, 1.8e6, 2.1e6, 5.0e2, 1.9e6, 2.0e6 };
+    set_samples(&stats, skewed_low, 8);
+    bps = estimated_upload_bps(&stats);
+    CHECK(bps >= 1.8e6 && bps <= 2.2e6, "skewed-low samples gave %.0f B/s, expected about 2e6", bps);
+
+    const double pair[] = { 1.0e6, 3.0e6 };
+    set_samples(&stats, pair, 2);
+    CHECK(estimated_upload_bps(&stats) == 2.0e6, "the median of two samples is their mean");
+}
+
+static void test_record_upload(void) {
+    static AppState state;
+    RequestBody body = { .size = 256 * 1024, .raw_size = 256 * 1024 };
+
+    // The whole body fit in the send buffer: the timing says nothing about the link.
+    memset(&state, 0, sizeof(state));
+    record_upload(&state, &body, 0.0001, 1024 * 1024);
+    CHECK(state.compression.num_upload_samples == 0, "a body within the send buffer must not be sampled");
+
+    // Only the bytes beyond the send buffer count as sent.
+    body.size = 1024 * 1024 + 64 * 1024;
+    record_upload(&state, &body, 0.5, 1024 * 1024);
+    CHECK(state.compression.num_upload_samples == 1, "a body beyond the send buffer should be sampled");
+    CHECK(state.compression.upload_samples[0] == 64.0 * 1024 / 0.5, "sample is %.0f B/s, expected %.0f",
+          state.compression.upload_samples[0], 64.0 * 1024 / 0.5);
+
+    // Without a known send buffer the whole body counts.
+    memset(&state, 0, sizeof(state));
+    body.size = 512 * 1024;
+    record_upload(&state, &body, 1.0, 0);
+    CHECK(state.compression.num_upload_samples == 1 && state.compression.upload_samples[0] == 512.0 * 1024,
+          "an unknown send buffer should count the whole body");
+}
+
+static void test_content_scan_control(void) {
+    // Valid ASCII with a run of control characters: binary because of the controls, not UTF-8.
+    unsigned char data[64];
+    memset(data, 'a', sizeof(data));
+    data[40] = 0x01;
+    data[41] = 0x02;
+    ContentScan scan;
+    content_scan_init(&scan);
+    content_scan_update(&scan, data, 32);   // The offset must count across chunks.
+    content_scan_update(&scan, data + 32, 32);
+    content_scan_finish(&scan);
+    CHECK(content_classify(&scan, data, sizeof(data)) == CONTENT_BINARY, "control-heavy content should be binary");
+    CHECK(scan.invalid_utf8 == 0, "ASCII must not count as invalid UTF-8");
+    CHECK(scan.control_bytes == 2 && scan.first_control == 40, "got %zu control bytes, first at %zu; expected 2 at 40",
+          scan.control_bytes, scan.first_control);
+}
+
+int main(void) {
+    test_upload_estimate();
+    test_record_upload();
+    test_content_scan_control();
+    if (failures > 0) {
+        fprintf(stderr, "gcli_unit_test: %d failure(s)\n", failures);
+        return 1;
+    }
+    printf("gcli_unit_test: OK\n");
+    return 0;
+}
@@ -430,6 +430,9 @@ int main(int argc, char* argv[]) {
     int verbose = 0;
     int dry_run = 0;
 
+    // The gcli processes we start record their requests under this tool name.
+    setenv("GCLI_TOOL", "gcmd", 1);
+
     // Parse command line arguments
     int arg_start = 1;
     for (int i = 1; i < argc; i++) {
@@ -9,9 +9,13 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
+#include <time.h>
 
 #define MAX_BUFFER_SIZE 65536
 #define MAX_PROMPT_SIZE 4096
+#define MAX_CANDIDATES 9
 
 // Default prompt for conventional commits
 static const char* DEFAULT_PROMPT =
@@ -44,13 +48,18 @@ static const char* DEFAULT_PROMPT =
     "DO NOT format the message in Markdown code blocks, DO NOT use backticks";
 
 void print_usage(const char* program_name) {
-    printf("Usage: %s [options]\n\n", program_name);
+    printf("Usage: %s [options] [-r [REPO...]]\n\n", program_name);
     printf("Generate conventional commit messages using AI based on staged git changes.\n\n");
     printf("OPTIONS:\n");
     printf("    -m, --model MODEL       Specify the AI model (default: gemini-1.5-pro-latest)\n");
     printf("    -t, --temp TEMP         Set temperature (default: 0.7)\n");
     printf("    -p, --prompt FILE       Use custom prompt file\n");
     printf("    -g, --gcli PATH         Path to gcli binary (default: gcli)\n");
+    printf("    -n, --candidates N      Generate N messages in parallel and pick one to commit (max %d)\n", MAX_CANDIDATES);
+    printf("    -r, --recursive         Generate messages for this repo and all submodules (or REPO...)\n");
+    printf("    -c, --commit            With -r, commit each repository with its generated message\n");
+    printf("    -j, --jobs N            With -r, run at most N gcli processes at once (default: 4)\n");
+    printf("        --rate N            With -r, start at most N requests per minute (default: unlimited)\n");
     printf("    -v, --verbose           Show the diff being sent to AI\n");
     printf("    -h, --help              Show this help message\n\n");
     printf("EXAMPLES:\n");
@@ -58,6 +67,9 @@ void print_usage(const char* program_name) {
     printf("    %s -m gemini-1.5-flash           # Use different model\n", program_name);
     printf("    %s -t 0.3                        # Lower temperature for more focused output\n", program_name);
     printf("    %s -p custom-prompt.txt          # Use custom prompt\n", program_name);
+    printf("    %s -n 3                           # Pick from 3 candidates, then commit\n", program_name);
+    printf("    %s -r -c                          # Commit this repo and its submodules\n", program_name);
+    printf("    %s -r -j 2 --rate 30 api web      # Two repos, 2 at a time, 30 req/min\n", program_name);
     printf("    %s -v                             # Show what's being sent to AI\n", program_name);
     printf("    %s -v                             # Show verbose output\n\n", program_name);
     printf("REQUIREMENTS:\n");
@@ -100,13 +112,17 @@ int check_git_repo() {
     return WEXITSTATUS(status) == 0;
 }
 
-int has_staged_changes() {
-    int status = system("git diff --staged --quiet");
+int has_staged_changes(const char* repo) {
+    char command[PATH_MAX + 64];
+    snprintf(command, sizeof(command), "git -C '%s' diff --staged --quiet", repo);
+    int status = system(command);
     return WEXITSTATUS(status) != 0; // Returns 1 if there are changes
 }
 
-char* get_staged_diff() {
-    FILE* pipe = popen("git diff --staged", "r");
+char* get_staged_diff(const char* repo) {
+    char command[PATH_MAX + 64];
+    snprintf(command, sizeof(command), "git -C '%s' diff --staged", repo);
+    FILE* pipe = popen(command, "r");
     if (!pipe) {
         return NULL;
     }
@@ -135,69 +151,596 @@ char* get_staged_diff() {
     return buffer;
 }
 
+// Write data to a fresh temporary file; `path` must be a mkstemp template
+int write_temp_file(char* path, const char* data) {
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        return 0;
+    }
+    size_t length = strlen(data);
+    ssize_t written = write(fd, data, length);
+    close(fd);
+    if (written != (ssize_t)length) {
+        unlink(path);
+        return 0;
+    }
+    return 1;
+}
+
+// One in-flight gcli invocation; used for message candidates and for
+// generating messages in several repositories at once.
+typedef struct {
+    char* command;
+    const char* label;
+    FILE* pipe;
+    char* output;
+    size_t length;
+    size_t capacity;
+    int started;
+    int done;
+    int status;
+} GcliJob;
+
+typedef void (*job_done_fn)(GcliJob* job, int succeeded, void* ctx);
+
+int build_gcli_command(char* command, size_t size, const char* gcli_path, const char* model,
+                       const char* temp, int seed, const char* diff_file, const char* prompt_file) {
+    char seed_arg[32] = "";
+    if (seed >= 0) {
+        snprintf(seed_arg, sizeof(seed_arg), " -s %d", seed);
+    }
+
+    int cmd_len = snprintf(command, size,
+        "cat '%s' | %s -q -e -m '%s' -t %s%s \"$(cat '%s')\"",
+        diff_file, gcli_path, model, temp, seed_arg, prompt_file);
+
+    return cmd_len < (int)size;
+}
+
+// Trim surrounding whitespace in place and return the start of the message
+char* trim_message(char* message) {
+    while (*message == ' ' || *message == '\t' || *message == '\n' || *message == '\r') message++;
+    size_t len = strlen(message);
+    while (len > 0 && (message[len - 1] == ' ' || message[len - 1] == '\t' ||
+                       message[len - 1] == '\n' || message[len - 1] == '\r')) {
+        message[--len] = '\0';
+    }
+    return message;
+}
+
+int append_job_output(GcliJob* job, const char* data, size_t size) {
+    if (job->length + size + 1 > job->capacity) {
+        size_t new_capacity = job->capacity ? job->capacity * 2 : 1024;
+        while (new_capacity < job->length + size + 1) new_capacity *= 2;
+        char* new_output = realloc(job->output, new_capacity);
+        if (!new_output) {
+            return 0;
+        }
+        job->output = new_output;
+        job->capacity = new_capacity;
+    }
+    memcpy(job->output + job->length, data, size);
+    job->length += size;
+    job->output[job->length] = '\0';
+    return 1;
+}
+
+long long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Run all jobs with at most `max_parallel` gcli processes alive and at most
+// `rate_per_minute` launches per minute (0 = unlimited). Output pipes are
+// polled together and `on_done` fires as soon as each job finishes, with the
+// job output trimmed in place. Returns the number of successful jobs.
+int run_jobs(GcliJob* jobs, int count, int max_parallel, int rate_per_minute,
+             job_done_fn on_done, void* ctx) {
+    struct pollfd* fds = malloc(sizeof(struct pollfd) * (max_parallel > 0 ? max_parallel : 1));
+    int* index_of = malloc(sizeof(int) * (max_parallel > 0 ? max_parallel : 1));
+    long long launch_interval = rate_per_minute > 0 ? 60000 / rate_per_minute : 0;
+    long long last_launch = 0;
+    int next_job = 0;
+    int running = 0;
+    int finished = 0;
+    int succeeded = 0;
+
+    if (!fds || !index_of) {
+        free(fds);
+        free(index_of);
+        return 0;
+    }
+
+    while (finished < count) {
+        // Launch as many pending jobs as the concurrency and rate limits allow.
+        int wait_ms = -1;
+        while (next_job < count && running < max_parallel) {
+            long long now = monotonic_ms();
+            if (launch_interval > 0 && last_launch > 0 && now - last_launch < launch_interval) {
+                wait_ms = (int)(launch_interval - (now - last_launch));
+                break;
+            }
+            GcliJob* job = &jobs[next_job++];
+            job->started = 1;
+            job->pipe = popen(job->command, "r");
+            last_launch = now;
+            if (!job->pipe) {
+                fprintf(stderr, "Error: Failed to launch gcli for %s\n", job->label);
+                job->done = 1;
+                finished++;
+                on_done(job, 0, ctx);
+                continue;
+            }
+            running++;
+        }
+
+        if (running == 0) {
+            if (next_job >= count) break;
+            usleep((useconds_t)(wait_ms > 0 ? wait_ms : 1) * 1000);
+            continue;
+        }
+
+        int nfds = 0;
+        for (int i = 0; i < count; i++) {
+            if (jobs[i].started && !jobs[i].done) {
+                fds[nfds].fd = fileno(jobs[i].pipe);
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                index_of[nfds++] = i;
+            }
+        }
+
+        int ready = poll(fds, nfds, wait_ms);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        for (int k = 0; k < nfds; k++) {
+            if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+            GcliJob* job = &jobs[index_of[k]];
+            char chunk[4096];
+            ssize_t n = read(fds[k].fd, chunk, sizeof(chunk));
+            if (n > 0) {
+                if (!append_job_output(job, chunk, (size_t)n)) {
+                    fprintf(stderr, "Error: Out of memory while reading gcli output\n");
+                }
+                continue;
+            }
+            if (n < 0 && errno == EINTR) continue;
+
+            // EOF (or read error): the job is complete.
+            job->status = pclose(job->pipe);
+            job->pipe = NULL;
+            job->done = 1;
+            running--;
+            finished++;
+
+            char* message = job->output ? trim_message(job->output) : NULL;
+            int ok = WEXITSTATUS(job->status) == 0 && message && *message != '\0';
+            if (ok && message != job->output) {
+                memmove(job->output, message, strlen(message) + 1);
+            }
+            if (ok) succeeded++;
+            on_done(job, ok, ctx);
+        }
+    }
+
+    free(fds);
+    free(index_of);
+    return succeeded;
+}
+
+void free_jobs(GcliJob* jobs, int count) {
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].pipe) pclose(jobs[i].pipe);
+        free(jobs[i].command);
+        free(jobs[i].output);
+    }
+}
+
+// Feed the message to git over a pipe so no temporary file is needed
+int commit_with_message(const char* repo, const char* message) {
+    char command[PATH_MAX + 64];
+    snprintf(command, sizeof(command), "git -C '%s' commit -F -", repo);
+    FILE* git = popen(command, "w");
+    if (!git) {
+        fprintf(stderr, "Error: Failed to run git commit in %s\n", repo);
+        return 1;
+    }
+    fputs(message, git);
+    fputc('\n', git);
+    int status = pclose(git);
+    return WEXITSTATUS(status) == 0 ? 0 : 1;
+}
+
+typedef struct {
+    int order[MAX_CANDIDATES];
+    int count;
+    GcliJob* jobs;
+} CandidateResults;
+
+void print_candidate(GcliJob* job, int succeeded, void* ctx) {
+    CandidateResults* results = ctx;
+    if (!succeeded) {
+        fprintf(stderr, "Warning: A candidate failed to generate\n");
+        return;
+    }
+    results->order[results->count++] = (int)(job - results->jobs);
+    printf("\033[1;36m◆  Candidate %d\033[0m\n", results->count);
+    printf("%s\n\n", job->output);
+    fflush(stdout);
+}
+
+int run_candidates(int count, const char* gcli_path, const char* model, const char* temp,
+                   const char* diff_file, const char* prompt_file, int verbose) {
+    GcliJob jobs[MAX_CANDIDATES];
+    CandidateResults results = { .count = 0, .jobs = jobs };
+    double base_temp = atof(temp);
+
+    memset(jobs, 0, sizeof(jobs));
+
+    // Spread the samples over seeds and slightly increasing temperatures so
+    // the candidates actually differ from one another.
+    for (int i = 0; i < count; i++) {
+        char temp_arg[16];
+        double candidate_temp = base_temp + 0.1 * i;
+        if (candidate_temp > 2.0) candidate_temp = 2.0;
+        snprintf(temp_arg, sizeof(temp_arg), "%.2f", candidate_temp);
+
+        char command[8192];
+        if (!build_gcli_command(command, sizeof(command), gcli_path, model, temp_arg,
+                                42 + i * 7919, diff_file, prompt_file)) {
+            fprintf(stderr, "Error: Command too long\n");
+            return 1;
+        }
+        if (verbose) {
+            printf("Executing: %s\n", command);
+        }
+        jobs[i].command = strdup(command);
+        jobs[i].label = "candidate";
+    }
+    if (verbose) printf("\n");
+
+    int succeeded = run_jobs(jobs, count, count, 0, print_candidate, &results);
+    int result = 1;
+
+    if (succeeded == 0) {
+        fprintf(stderr, "Error: Failed to generate commit message\n");
+    } else if (!isatty(STDIN_FILENO)) {
+        fprintf(stderr, "Not a terminal; candidates printed above, nothing committed.\n");
+        result = 0;
+    } else {
+        printf("Select a message to commit [1-%d] or 'q' to abort: ", succeeded);
+        fflush(stdout);
+
+        char input[16];
+        if (fgets(input, sizeof(input), stdin) != NULL && input[0] != 'q' && input[0] != 'Q') {
+            int choice = atoi(input);
+            if (choice >= 1 && choice <= succeeded) {
+                result = commit_with_message(".", jobs[results.order[choice - 1]].output);
+            } else {
+                fprintf(stderr, "Invalid selection, nothing committed.\n");
+            }
+        } else {
+            printf("Aborted.\n");
+            result = 0;
+        }
+    }
+
+    free_jobs(jobs, count);
+    return result;
+}
+
+// Collect the superproject and every (nested) submodule path
+int discover_repositories(char*** repos_out) {
+    int capacity = 8;
+    int count = 0;
+    char** repos = malloc(sizeof(char*) * capacity);
+    if (!repos) return 0;
+    repos[count++] = strdup(".");
+
+    FILE* pipe = popen("git submodule foreach --quiet --recursive 'echo \"$displaypath\"'", "r");
+    if (pipe) {
+        char line[PATH_MAX];
+        while (fgets(line, sizeof(line), pipe)) {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (line[0] == '\0') continue;
+            if (count == capacity) {
+                capacity *= 2;
+                char** grown = realloc(repos, sizeof(char*) * capacity);
+                if (!grown) break;
+                repos = grown;
+            }
+            repos[count++] = strdup(line);
+        }
+        pclose(pipe);
+    }
+
+    *repos_out = repos;
+    return count;
+}
+
+typedef struct {
+    int do_commit;
+    int committed;
+    int failed;
+} RepoRunContext;
+
+void print_repo_result(GcliJob* job, int succeeded, void* ctx) {
+    RepoRunContext* run = ctx;
+    printf("\033[1;36m◇  %s\033[0m\n", job->label);
+    if (!succeeded) {
+        printf("└  (failed to generate commit message)\n\n");
+        run->failed++;
+        fflush(stdout);
+        return;
+    }
+    printf("%s\n", job->output);
+    fflush(stdout);
+    if (run->do_commit) {
+        if (commit_with_message(job->label, job->output) == 0) {
+            printf("└  committed\n");
+            run->committed++;
+        } else {
+            printf("└  git commit failed\n");
+            run->failed++;
+        }
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+int run_recursive(char** repo_args, int repo_arg_count, const char* gcli_path, const char* model,
+                  const char* temp, const char* prompt_file, int max_parallel, int rate_per_minute,
+                  int do_commit, int verbose) {
+    char** repos = NULL;
+    int repo_count;
+    int owns_repos = 0;
+
+    if (repo_arg_count > 0) {
+        repos = repo_args;
+        repo_count = repo_arg_count;
+    } else {
+        repo_count = discover_repositories(&repos);
+        owns_repos = 1;
+    }
+
+    GcliJob* jobs = calloc(repo_count > 0 ? repo_count : 1, sizeof(GcliJob));
+    char (*diff_files)[32] = calloc(repo_count > 0 ? repo_count : 1, sizeof(*diff_files));
+    int job_count = 0;
+    int result = 1;
+
+    if (!jobs || !diff_files) {
+        fprintf(stderr, "Error: Out of memory\n");
+        goto cleanup;
+    }
+
+    // Only repositories with staged changes get a job.
+    for (int i = 0; i < repo_count; i++) {
+        if (strchr(repos[i], '\'')) {
+            fprintf(stderr, "Warning: Skipping repository with quote in path: %s\n", repos[i]);
+            continue;
+        }
+        if (!has_staged_changes(repos[i])) {
+            if (verbose) printf("No staged changes in %s\n", repos[i]);
+            continue;
+        }
+        char* diff = get_staged_diff(repos[i]);
+        if (!diff) {
+            fprintf(stderr, "Warning: Failed to get staged changes in %s\n", repos[i]);
+            continue;
+        }
+
+        strcpy(diff_files[job_count], "/tmp/gcommit_diff_XXXXXX");
+        int written = write_temp_file(diff_files[job_count], diff);
+        free(diff);
+        if (!written) {
+            fprintf(stderr, "Error: Failed to create temporary diff file\n");
+            diff_files[job_count][0] = '\0';
+            continue;
+        }
+
+        char command[8192];
+        if (!build_gcli_command(command, sizeof(command), gcli_path, model, temp, -1,
+                                diff_files[job_count], prompt_file)) {
+            fprintf(stderr, "Error: Command too long for %s\n", repos[i]);
+            unlink(diff_files[job_count]);
+            diff_files[job_count][0] = '\0';
+            continue;
+        }
+        if (verbose) {
+            printf("Executing in %s: %s\n", repos[i], command);
+        }
+        jobs[job_count].command = strdup(command);
+        jobs[job_count].label = repos[i];
+        job_count++;
+    }
+
+    if (job_count == 0) {
+        fprintf(stderr, "No staged changes found in any repository.\n");
+        goto cleanup;
+    }
+
+    printf("Generating commit messages for %d %s...\n\n", job_count,
+           job_count == 1 ? "repository" : "repositories");
+    fflush(stdout);
+
+    RepoRunContext run = { .do_commit = do_commit, .committed = 0, .failed = 0 };
+    run_jobs(jobs, job_count, max_parallel, rate_per_minute, print_repo_result, &run);
+
+    if (do_commit) {
+        printf("Committed %d of %d repositories.\n", run.committed, job_count);
+    }
+    result = run.failed > 0 ? 1 : 0;
+
+cleanup:
+    for (int i = 0; i < job_count; i++) {
+        if (diff_files[i][0] != '\0') unlink(diff_files[i]);
+    }
+    if (jobs) free_jobs(jobs, job_count);
+    free(jobs);
+    free(diff_files);
+    if (owns_repos) {
+        for (int i = 0; i < repo_count; i++) free(repos[i]);
+        free(repos);
+    }
+    return result;
+}
+
 int main(int argc, char* argv[]) {
     char* model = "gemini-1.5-pro-latest";
     char* temp = "0.7";
     char* prompt_file = NULL;
     char* gcli_path = "gcli";
     int verbose = 0;
+    int candidates = 1;
+    int recursive = 0;
+    int do_commit = 0;
+    int max_parallel = 4;
+    int rate_per_minute = 0;
+    char** repo_args = malloc(sizeof(char*) * (argc > 1 ? argc : 1));
+    int repo_arg_count = 0;
+    int status = 1;
+
+    if (!repo_args) {
+        fprintf(stderr, "Error: Out of memory\n");
+        return 1;
+    }
+
+    // The gcli processes we start record their requests under this tool name.
+    setenv("GCLI_TOOL", "gcommit", 1);
 
     // Parse command line arguments
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
             print_usage(argv[0]);
-            return 0;
+            status = 0;
+            goto done;
         } else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--model") == 0) {
             if (i + 1 < argc) {
                 model = argv[++i];
             } else {
                 fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
-                return 1;
+                goto done;
             }
         } else if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--temp") == 0) {
             if (i + 1 < argc) {
                 temp = argv[++i];
             } else {
                 fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
-                return 1;
+                goto done;
             }
         } else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--prompt") == 0) {
             if (i + 1 < argc) {
                 prompt_file = argv[++i];
             } else {
                 fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
-                return 1;
+                goto done;
             }
         } else if (strcmp(argv[i], "-g") == 0 || strcmp(argv[i], "--gcli") == 0) {
             if (i + 1 < argc) {
                 gcli_path = argv[++i];
             } else {
                 fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
-                return 1;
+                goto done;
+            }
+        } else if (strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--candidates") == 0) {
+            if (i + 1 < argc) {
+                candidates = atoi(argv[++i]);
+                if (candidates < 1 || candidates > MAX_CANDIDATES) {
+                    fprintf(stderr, "Error: Number of candidates must be between 1 and %d\n", MAX_CANDIDATES);
+                    goto done;
+                }
+            } else {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                goto done;
+            }
+        } else if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--jobs") == 0) {
+            if (i + 1 < argc) {
+                max_parallel = atoi(argv[++i]);
+                if (max_parallel < 1) {
+                    fprintf(stderr, "Error: Number of jobs must be at least 1\n");
+                    goto done;
+                }
+            } else {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                goto done;
             }
+        } else if (strcmp(argv[i], "--rate") == 0) {
+            if (i + 1 < argc) {
+                rate_per_minute = atoi(argv[++i]);
+                if (rate_per_minute < 0) {
+                    fprintf(stderr, "Error: Rate must not be negative\n");
+                    goto done;
+                }
+            } else {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                goto done;
+            }
+        } else if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--recursive") == 0) {
+            recursive = 1;
+        } else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--commit") == 0) {
+            do_commit = 1;
         } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
             verbose = 1;
+        } else if (argv[i][0] != '-') {
+            repo_args[repo_arg_count++] = argv[i];
         } else {
             fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
             fprintf(stderr, "Use -h or --help for usage information.\n");
-            return 1;
+            goto done;
         }
     }
 
+    if (repo_arg_count > 0 && !recursive) {
+        fprintf(stderr, "Error: Repository paths require -r/--recursive\n");
+        goto done;
+    }
+    if (recursive && candidates > 1) {
+        fprintf(stderr, "Error: -n cannot be combined with -r\n");
+        goto done;
+    }
+
     // Check if we're in a git repository
-    if (!check_git_repo()) {
+    if (repo_arg_count == 0 && !check_git_repo()) {
         fprintf(stderr, "Error: Not in a git repository\n");
-        return 1;
+        goto done;
+    }
+
+    if (recursive) {
+        char* prompt = prompt_file ? read_file(prompt_file) : strdup(DEFAULT_PROMPT);
+        if (!prompt) {
+            fprintf(stderr, "Error: Failed to read prompt file '%s'\n", prompt_file);
+            goto done;
+        }
+        char temp_prompt_file[] = "/tmp/gcommit_prompt_XXXXXX";
+        int written = write_temp_file(temp_prompt_file, prompt);
+        free(prompt);
+        if (!written) {
+            fprintf(stderr, "Error: Failed to create temporary prompt file\n");
+            goto done;
+        }
+        status = run_recursive(repo_args, repo_arg_count, gcli_path, model, temp,
+                               temp_prompt_file, max_parallel, rate_per_minute,
+                               do_commit, verbose);
+        unlink(temp_prompt_file);
+        goto done;
     }
+    free(repo_args);
+    repo_args = NULL;
 
     // Check if there are staged changes
-    if (!has_staged_changes()) {
+    if (!has_staged_changes(".")) {
         fprintf(stderr, "No staged changes found. Stage some changes first with 'git add'.\n");
         return 1;
     }
 
     // Get the staged diff
-    char* diff = get_staged_diff();
+    char* diff = get_staged_diff(".");
     if (!diff) {
         fprintf(stderr, "Error: Failed to get staged changes\n");
         return 1;
@@ -250,13 +793,22 @@ int main(int argc, char* argv[]) {
     close(diff_fd);
     close(prompt_fd);
 
-    char command[8192];
-    int cmd_len = snprintf(command, sizeof(command),
-        "cat '%s' | %s -q -e -m '%s' -t %s \"$(cat '%s')\"",
-        temp_diff_file, gcli_path, model, temp, temp_prompt_file);
+    if (candidates > 1) {
+        status = run_candidates(candidates, gcli_path, model, temp,
+                                temp_diff_file, temp_prompt_file, verbose);
+        unlink(temp_diff_file);
+        unlink(temp_prompt_file);
+        free(diff);
+        free(prompt);
+        return status;
+    }
 
-    if (cmd_len >= (int)sizeof(command)) {
+    char command[8192];
+    if (!build_gcli_command(command, sizeof(command), gcli_path, model, temp, -1,
+                            temp_diff_file, temp_prompt_file)) {
         fprintf(stderr, "Error: Command too long\n");
+        unlink(temp_diff_file);
+        unlink(temp_prompt_file);
         free(diff);
         free(prompt);
         return 1;
@@ -281,4 +833,9 @@ int main(int argc, char* argv[]) {
     }
 
     return 0;
+
+done:
+    // Exit path for option errors and recursive mode, which still own the path list.
+    free(repo_args);
+    return status;
 }
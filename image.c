@@ -0,0 +1,787 @@
+/**
+ * @file image.c
+ * @brief Attachment image preprocessing: decode, downscale, re-encode.
+ *
+ * Screenshots and photos are usually attached at a resolution far beyond what
+ * the model looks at, which costs upload bandwidth and input tokens. This
+ * module decodes PNG and JPEG attachments, applies the EXIF orientation,
+ * downscales them so the longest side fits a configurable limit, and then
+ * picks the smallest sensible encoding:
+ *   - PNG sources are written as palette PNG when they have at most 256
+ *     colors (typical for UI screenshots), otherwise as RGB/RGBA PNG at
+ *     maximum compression. Opaque, photographic PNGs are turned into JPEG
+ *     only when that at least halves the size, so text stays lossless.
+ *   - JPEG sources are re-encoded only when they had to be resized or
+ *     rotated; otherwise their metadata segments are stripped losslessly.
+ * Ancillary metadata (EXIF, XMP, comments, text chunks) never survives.
+ */
+
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+
+#include "image.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef GCLI_HAVE_IMAGE
+#include <setjmp.h>
+#include <png.h>
+#include <jpeglib.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#define JPEG_QUALITY 85
+#define PNG_TO_JPEG_QUALITY 90
+
+// Decoded image: 8-bit RGBA, rows packed without padding.
+typedef struct {
+    unsigned char* pixels;
+    int width;
+    int height;
+    const int* cancel;      // Non-zero asks the work on this image to stop; may be NULL.
+} Bitmap;
+
+static bool bitmap_cancelled(const Bitmap* bitmap) {
+    if (!bitmap->cancel) return false;
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n(bitmap->cancel, __ATOMIC_RELAXED) != 0;
+#else
+    return *(const volatile int*)bitmap->cancel != 0;
+#endif
+}
+
+// Growable output buffer for the encoders.
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    size_t capacity;
+    bool failed;
+} ByteBuffer;
+
+static void byte_buffer_append(ByteBuffer* buf, const unsigned char* data, size_t len) {
+    if (buf->failed) return;
+    if (buf->size + len > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 65536;
+        while (capacity < buf->size + len) capacity *= 2;
+        unsigned char* grown = realloc(buf->data, capacity);
+        if (!grown) {
+            buf->failed = true;
+            return;
+        }
+        buf->data = grown;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->size, data, len);
+    buf->size += len;
+}
+
+// --- PNG ---
+
+static bool decode_png(const unsigned char* data, size_t size, Bitmap* out) {
+    png_image image;
+    memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+
+    if (!png_image_begin_read_from_memory(&image, data, size)) {
+        return false;
+    }
+    image.format = PNG_FORMAT_RGBA;
+    out->pixels = malloc(PNG_IMAGE_SIZE(image));
+    if (!out->pixels) {
+        png_image_free(&image);
+        return false;
+    }
+    if (!png_image_finish_read(&image, NULL, out->pixels, 0, NULL)) {
+        free(out->pixels);
+        out->pixels = NULL;
+        return false;
+    }
+    out->width = (int)image.width;
+    out->height = (int)image.height;
+    return true;
+}
+
+static void png_write_to_buffer(png_structp png, png_bytep data, png_size_t len) {
+    byte_buffer_append((ByteBuffer*)png_get_io_ptr(png), data, len);
+}
+
+static void png_flush_noop(png_structp png) {
+    (void)png;
+}
+
+/**
+ * @brief Builds a palette for the image if it has at most 256 distinct colors.
+ * @param bitmap The image.
+ * @param palette Receives up to 256 RGBA colors.
+ * @param indices Receives one palette index per pixel.
+ * @return The number of palette entries, or 0 if there are too many colors.
+ */
+static int build_palette(const Bitmap* bitmap, uint32_t palette[256], unsigned char* indices) {
+    // Open-addressing hash from RGBA value to palette slot.
+    enum { SLOTS = 1024 };
+    uint32_t keys[SLOTS];
+    int16_t slots[SLOTS];
+    int count = 0;
+    memset(slots, -1, sizeof(slots));
+
+    size_t pixel_count = (size_t)bitmap->width * bitmap->height;
+    for (size_t i = 0; i < pixel_count; i++) {
+        if ((i & 0xFFFF) == 0 && bitmap_cancelled(bitmap)) return 0;
+        const unsigned char* p = bitmap->pixels + i * 4;
+        uint32_t color = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+        uint32_t h = (color * 2654435761u) >> 22;
+        while (slots[h] >= 0 && keys[h] != color) h = (h + 1) & (SLOTS - 1);
+        if (slots[h] < 0) {
+            if (count == 256) return 0;
+            keys[h] = color;
+            slots[h] = (int16_t)count;
+            palette[count++] = color;
+        }
+        indices[i] = (unsigned char)slots[h];
+    }
+    return count;
+}
+
+static bool bitmap_is_opaque(const Bitmap* bitmap) {
+    size_t pixel_count = (size_t)bitmap->width * bitmap->height;
+    for (size_t i = 0; i < pixel_count; i++) {
+        if (bitmap->pixels[i * 4 + 3] != 255) return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Writes the PNG stream; kept separate so that nothing it owns is
+ *        modified between setjmp and a libpng error.
+ */
+static bool write_png(const Bitmap* bitmap, const uint32_t* palette, int palette_size,
+                      const unsigned char* indices, bool opaque, unsigned char* row, ByteBuffer* out) {
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info = png ? png_create_info_struct(png) : NULL;
+    if (!png || !info) {
+        if (png) png_destroy_write_struct(&png, NULL);
+        return false;
+    }
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        return false;
+    }
+
+    png_set_write_fn(png, out, png_write_to_buffer, png_flush_noop);
+    png_set_compression_level(png, 9);
+    png_set_filter(png, 0, palette_size > 0 ? PNG_FILTER_NONE : PNG_ALL_FILTERS);
+
+    if (palette_size > 0) {
+        png_color colors[256];
+        png_byte alphas[256];
+        int num_alpha = 0;
+        for (int i = 0; i < palette_size; i++) {
+            colors[i].red = (png_byte)(palette[i] >> 24);
+            colors[i].green = (png_byte)(palette[i] >> 16);
+            colors[i].blue = (png_byte)(palette[i] >> 8);
+            alphas[i] = (png_byte)palette[i];
+            if (alphas[i] != 255) num_alpha = i + 1;
+        }
+        int bit_depth = palette_size <= 2 ? 1 : palette_size <= 4 ? 2 : palette_size <= 16 ? 4 : 8;
+        png_set_IHDR(png, info, bitmap->width, bitmap->height, bit_depth, PNG_COLOR_TYPE_PALETTE,
+                     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_set_PLTE(png, info, colors, palette_size);
+        if (num_alpha > 0) png_set_tRNS(png, info, alphas, num_alpha, NULL);
+        png_write_info(png, info);
+        if (bit_depth < 8) png_set_packing(png);
+        for (int y = 0; y < bitmap->height; y++) {
+            if (bitmap_cancelled(bitmap)) png_error(png, "cancelled");
+            png_write_row(png, indices + (size_t)y * bitmap->width);
+        }
+    } else {
+        int channels = opaque ? 3 : 4;
+        png_set_IHDR(png, info, bitmap->width, bitmap->height, 8,
+                     opaque ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGBA,
+                     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_write_info(png, info);
+        for (int y = 0; y < bitmap->height; y++) {
+            if (bitmap_cancelled(bitmap)) png_error(png, "cancelled");
+            const unsigned char* src = bitmap->pixels + (size_t)y * bitmap->width * 4;
+            for (int x = 0; x < bitmap->width; x++) {
+                memcpy(row + (size_t)x * channels, src + (size_t)x * 4, channels);
+            }
+            png_write_row(png, row);
+        }
+    }
+    png_write_end(png, NULL);
+    png_destroy_write_struct(&png, &info);
+    return !out->failed;
+}
+
+/**
+ * @brief Encodes an image as PNG at maximum compression, without metadata.
+ * @details Uses an 8-bit (or narrower) palette when the image has at most 256
+ *          colors and drops the alpha channel when it is fully opaque.
+ */
+static bool encode_png(const Bitmap* bitmap, ByteBuffer* out) {
+    uint32_t palette[256];
+    unsigned char* indices = malloc((size_t)bitmap->width * bitmap->height);
+    unsigned char* row = malloc((size_t)bitmap->width * 4);
+    bool ok = false;
+
+    if (indices && row) {
+        int palette_size = build_palette(bitmap, palette, indices);
+        ok = write_png(bitmap, palette, palette_size, indices, bitmap_is_opaque(bitmap), row, out);
+    }
+    free(indices);
+    free(row);
+    return ok;
+}
+
+// --- JPEG ---
+
+typedef struct {
+    struct jpeg_error_mgr base;
+    jmp_buf jump;
+} JpegError;
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+    longjmp(((JpegError*)cinfo->err)->jump, 1);
+}
+
+static void jpeg_silence(j_common_ptr cinfo, int level) {
+    (void)cinfo; (void)level;
+}
+
+static unsigned read_u16(const unsigned char* p, bool big_endian) {
+    return big_endian ? (unsigned)(p[0] << 8 | p[1]) : (unsigned)(p[1] << 8 | p[0]);
+}
+
+static uint32_t read_u32(const unsigned char* p, bool big_endian) {
+    return big_endian ? (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]
+                      : (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+/**
+ * @brief Extracts the EXIF orientation (1-8) from an APP1 segment.
+ * @return The orientation, or 1 if absent or malformed.
+ */
+static int exif_orientation(const unsigned char* data, size_t len) {
+    if (len < 14 || memcmp(data, "Exif\0\0", 6) != 0) return 1;
+    const unsigned char* tiff = data + 6;
+    size_t tiff_len = len - 6;
+    bool big_endian = tiff[0] == 'M';
+    if (!big_endian && tiff[0] != 'I') return 1;
+
+    uint32_t ifd = read_u32(tiff + 4, big_endian);
+    if (ifd + 2 > tiff_len) return 1;
+    unsigned entries = read_u16(tiff + ifd, big_endian);
+    for (unsigned i = 0; i < entries; i++) {
+        size_t entry = ifd + 2 + (size_t)i * 12;
+        if (entry + 12 > tiff_len) break;
+        if (read_u16(tiff + entry, big_endian) == 0x0112) {
+            unsigned value = read_u16(tiff + entry + 8, big_endian);
+            return value >= 1 && value <= 8 ? (int)value : 1;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Reads the stored dimensions of a JPEG without decoding it.
+ */
+static bool read_jpeg_dimensions(const unsigned char* data, size_t size, int* width, int* height) {
+    struct jpeg_decompress_struct cinfo;
+    JpegError err;
+    cinfo.err = jpeg_std_error(&err.base);
+    err.base.error_exit = jpeg_error_exit;
+    err.base.emit_message = jpeg_silence;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char*)data, (unsigned long)size);
+    jpeg_read_header(&cinfo, TRUE);
+    *width = (int)cinfo.image_width;
+    *height = (int)cinfo.image_height;
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+/**
+ * @brief Decodes a JPEG, letting libjpeg downscale by a power of two on the fly.
+ * @param max_dimension The final size limit; decoding stops at the smallest
+ *                      1/2, 1/4 or 1/8 scale that still exceeds it.
+ * @param orientation Receives the EXIF orientation.
+ */
+static bool decode_jpeg(const unsigned char* data, size_t size, int max_dimension, Bitmap* out, int* orientation) {
+    struct jpeg_decompress_struct cinfo;
+    JpegError err;
+    // Assigned after setjmp and freed by the error path, so it must not live
+    // in a register; out->pixels is in the caller's memory and needs no care.
+    unsigned char* volatile row = NULL;
+    out->pixels = NULL;
+    *orientation = 1;
+
+    cinfo.err = jpeg_std_error(&err.base);
+    err.base.error_exit = jpeg_error_exit;
+    err.base.emit_message = jpeg_silence;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        free(out->pixels);
+        free(row);
+        out->pixels = NULL;
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, (unsigned char*)data, (unsigned long)size);
+    jpeg_save_markers(&cinfo, JPEG_APP0 + 1, 0xFFFF);
+    jpeg_read_header(&cinfo, TRUE);
+
+    for (jpeg_saved_marker_ptr marker = cinfo.marker_list; marker; marker = marker->next) {
+        if (marker->marker == JPEG_APP0 + 1) {
+            *orientation = exif_orientation(marker->data, marker->data_length);
+        }
+    }
+
+    unsigned longest = cinfo.image_width > cinfo.image_height ? cinfo.image_width : cinfo.image_height;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1;
+    while (cinfo.scale_denom < 8 && longest / (cinfo.scale_denom * 2) >= (unsigned)max_dimension) {
+        cinfo.scale_denom *= 2;
+    }
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+
+    out->width = (int)cinfo.output_width;
+    out->height = (int)cinfo.output_height;
+    out->pixels = malloc((size_t)out->width * out->height * 4);
+    row = malloc((size_t)out->width * 3);
+    if (!out->pixels || !row) {
+        longjmp(err.jump, 1);
+    }
+
+    while (cinfo.output_scanline < cinfo.output_height) {
+        if (bitmap_cancelled(out)) longjmp(err.jump, 1);
+        unsigned char* dst = out->pixels + (size_t)cinfo.output_scanline * out->width * 4;
+        unsigned char* src = row;
+        JSAMPROW rows[1] = { src };
+        jpeg_read_scanlines(&cinfo, rows, 1);
+        for (int x = 0; x < out->width; x++) {
+            dst[x * 4 + 0] = src[x * 3 + 0];
+            dst[x * 4 + 1] = src[x * 3 + 1];
+            dst[x * 4 + 2] = src[x * 3 + 2];
+            dst[x * 4 + 3] = 255;
+        }
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    free(row);
+    return true;
+}
+
+static bool encode_jpeg(const Bitmap* bitmap, int quality, ByteBuffer* out) {
+    struct jpeg_compress_struct cinfo;
+    JpegError err;
+    unsigned char* mem = NULL;
+    unsigned long mem_size = 0;
+    unsigned char* row = malloc((size_t)bitmap->width * 3);
+    if (!row) return false;
+
+    cinfo.err = jpeg_std_error(&err.base);
+    err.base.error_exit = jpeg_error_exit;
+    err.base.emit_message = jpeg_silence;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_compress(&cinfo);
+        free(mem);
+        free(row);
+        return false;
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &mem, &mem_size);
+    cinfo.image_width = (JDIMENSION)bitmap->width;
+    cinfo.image_height = (JDIMENSION)bitmap->height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.optimize_coding = TRUE;
+    jpeg_start_compress(&cinfo, TRUE);
+
+    while (cinfo.next_scanline < cinfo.image_height) {
+        if (bitmap_cancelled(bitmap)) longjmp(err.jump, 1);
+        const unsigned char* src = bitmap->pixels + (size_t)cinfo.next_scanline * bitmap->width * 4;
+        for (int x = 0; x < bitmap->width; x++) {
+            row[x * 3 + 0] = src[x * 4 + 0];
+            row[x * 3 + 1] = src[x * 4 + 1];
+            row[x * 3 + 2] = src[x * 4 + 2];
+        }
+        JSAMPROW rows[1] = { row };
+        jpeg_write_scanlines(&cinfo, rows, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    free(row);
+
+    byte_buffer_append(out, mem, mem_size);
+    free(mem);
+    return !out->failed;
+}
+
+/**
+ * @brief Copies a JPEG while dropping metadata segments.
+ * @details Keeps only what affects decoding: APP0 (JFIF), APP2 (ICC color
+ *          profile), APP14 (Adobe color transform) and all non-APP markers.
+ *          EXIF/XMP (APP1), IPTC (APP13), other APPn and COM are removed.
+ *          Entropy-coded data after SOS is copied verbatim.
+ */
+static bool strip_jpeg_metadata(const unsigned char* data, size_t size, ByteBuffer* out) {
+    if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) return false;
+    byte_buffer_append(out, data, 2);
+
+    size_t pos = 2;
+    while (pos + 4 <= size) {
+        if (data[pos] != 0xFF) return false;
+        unsigned char marker = data[pos + 1];
+        if (marker == 0xFF) { pos++; continue; } // Fill byte.
+        size_t len = (size_t)(data[pos + 2] << 8 | data[pos + 3]);
+        if (len < 2 || pos + 2 + len > size) return false;
+
+        if (marker == 0xDA) { // SOS: the rest is image data.
+            byte_buffer_append(out, data + pos, size - pos);
+            return !out->failed;
+        }
+        bool is_app = marker >= 0xE0 && marker <= 0xEF;
+        bool keep = !(is_app || marker == 0xFE) || marker == 0xE0 || marker == 0xE2 || marker == 0xEE;
+        if (keep) byte_buffer_append(out, data + pos, 2 + len);
+        pos += 2 + len;
+    }
+    return false;
+}
+
+// --- Pixel Operations ---
+
+/**
+ * @brief Applies an EXIF orientation so the pixels are upright.
+ * @return true on success (the bitmap may have been replaced and resized).
+ */
+static bool apply_orientation(Bitmap* bitmap, int orientation) {
+    if (orientation <= 1 || orientation > 8) return true;
+
+    int w = bitmap->width, h = bitmap->height;
+    bool transpose = orientation >= 5;
+    int nw = transpose ? h : w, nh = transpose ? w : h;
+    unsigned char* dst = malloc((size_t)w * h * 4);
+    if (!dst) return false;
+
+    for (int y = 0; y < h; y++) {
+        if (bitmap_cancelled(bitmap)) {
+            free(dst);
+            return false;
+        }
+        for (int x = 0; x < w; x++) {
+            int dx, dy;
+            switch (orientation) {
+                case 2: dx = w - 1 - x; dy = y; break;
+                case 3: dx = w - 1 - x; dy = h - 1 - y; break;
+                case 4: dx = x; dy = h - 1 - y; break;
+                case 5: dx = y; dy = x; break;
+                case 6: dx = h - 1 - y; dy = x; break;
+                case 7: dx = h - 1 - y; dy = w - 1 - x; break;
+                default: dx = y; dy = w - 1 - x; break; // 8
+            }
+            memcpy(dst + ((size_t)dy * nw + dx) * 4, bitmap->pixels + ((size_t)y * w + x) * 4, 4);
+        }
+    }
+    free(bitmap->pixels);
+    bitmap->pixels = dst;
+    bitmap->width = nw;
+    bitmap->height = nh;
+    return true;
+}
+
+/**
+ * @brief Downscales an RGBA image by exact area averaging.
+ * @details Two separable passes; every source pixel contributes in proportion
+ *          to the area it covers in the destination pixel. Color is averaged
+ *          premultiplied by alpha so transparent pixels do not bleed into
+ *          visible edges.
+ */
+static bool resize_area(Bitmap* bitmap, int new_width, int new_height) {
+    int w = bitmap->width, h = bitmap->height;
+    float* tmp = malloc(sizeof(float) * 4 * (size_t)new_width * h);
+    unsigned char* dst = malloc((size_t)new_width * new_height * 4);
+    if (!tmp || !dst) {
+        free(tmp);
+        free(dst);
+        return false;
+    }
+
+    double scale_x = (double)w / new_width;
+    for (int y = 0; y < h && !bitmap_cancelled(bitmap); y++) {
+        const unsigned char* src = bitmap->pixels + (size_t)y * w * 4;
+        for (int dx = 0; dx < new_width; dx++) {
+            double x0 = dx * scale_x, x1 = x0 + scale_x;
+            float sum[4] = { 0, 0, 0, 0 };
+            for (int sx = (int)x0; sx < w && sx < x1; sx++) {
+                double left = sx > x0 ? sx : x0, right = sx + 1 < x1 ? sx + 1 : x1;
+                float weight = (float)(right - left);
+                float alpha = src[sx * 4 + 3] * weight;
+                sum[0] += src[sx * 4 + 0] * alpha;
+                sum[1] += src[sx * 4 + 1] * alpha;
+                sum[2] += src[sx * 4 + 2] * alpha;
+                sum[3] += alpha;
+            }
+            float* t = tmp + ((size_t)y * new_width + dx) * 4;
+            for (int c = 0; c < 4; c++) t[c] = sum[c] / (float)scale_x;
+        }
+    }
+
+    double scale_y = (double)h / new_height;
+    for (int dy = 0; dy < new_height && !bitmap_cancelled(bitmap); dy++) {
+        double y0 = dy * scale_y, y1 = y0 + scale_y;
+        for (int dx = 0; dx < new_width; dx++) {
+            float sum[4] = { 0, 0, 0, 0 };
+            for (int sy = (int)y0; sy < h && sy < y1; sy++) {
+                double top = sy > y0 ? sy : y0, bottom = sy + 1 < y1 ? sy + 1 : y1;
+                float weight = (float)(bottom - top);
+                const float* t = tmp + ((size_t)sy * new_width + dx) * 4;
+                for (int c = 0; c < 4; c++) sum[c] += t[c] * weight;
+            }
+            unsigned char* p = dst + ((size_t)dy * new_width + dx) * 4;
+            float alpha = sum[3] / (float)scale_y;
+            for (int c = 0; c < 3; c++) {
+                float value = sum[3] > 0 ? sum[c] / sum[3] : 0;
+                p[c] = (unsigned char)(value > 255.0f ? 255 : value + 0.5f);
+            }
+            p[3] = (unsigned char)(alpha > 255.0f ? 255 : alpha + 0.5f);
+        }
+    }
+
+    free(tmp);
+    if (bitmap_cancelled(bitmap)) {
+        free(dst);
+        return false;
+    }
+    free(bitmap->pixels);
+    bitmap->pixels = dst;
+    bitmap->width = new_width;
+    bitmap->height = new_height;
+    return true;
+}
+
+static void take_buffer(ImageResult* result, ByteBuffer* buf, const char* mime_type) {
+    result->data = buf->data;
+    result->size = buf->size;
+    result->mime_type = mime_type;
+    buf->data = NULL;
+}
+#endif // GCLI_HAVE_IMAGE
+
+/**
+ * @brief image_optimize, stopping early (and failing) once `*cancel` is set.
+ */
+static bool optimize(const unsigned char* data, size_t size, const char* mime_type, int max_dimension,
+                     const int* cancel, ImageResult* result) {
+    memset(result, 0, sizeof(*result));
+#ifdef GCLI_HAVE_IMAGE
+    bool is_png = strcmp(mime_type, "image/png") == 0;
+    bool is_jpeg = strcmp(mime_type, "image/jpeg") == 0;
+    if ((!is_png && !is_jpeg) || max_dimension <= 0) return false;
+
+    Bitmap bitmap = { NULL, 0, 0, cancel };
+    ByteBuffer encoded = { NULL, 0, 0, false };
+    ByteBuffer alternative = { NULL, 0, 0, false };
+    int orientation = 1;
+    bool ok = false;
+
+    if (is_png ? !decode_png(data, size, &bitmap)
+               : !decode_jpeg(data, size, max_dimension, &bitmap, &orientation)) {
+        return false;
+    }
+    if (bitmap_cancelled(&bitmap) || !apply_orientation(&bitmap, orientation)) goto cleanup;
+
+    // libjpeg may already have scaled down while decoding; report the true source size.
+    result->width = bitmap.width;
+    result->height = bitmap.height;
+    if (is_jpeg && read_jpeg_dimensions(data, size, &result->width, &result->height) && orientation >= 5) {
+        int swap = result->width;
+        result->width = result->height;
+        result->height = swap;
+    }
+
+    bool resized = false;
+    int longest = bitmap.width > bitmap.height ? bitmap.width : bitmap.height;
+    if (longest > max_dimension) {
+        double scale = (double)max_dimension / longest;
+        int new_width = (int)(bitmap.width * scale + 0.5);
+        int new_height = (int)(bitmap.height * scale + 0.5);
+        if (!resize_area(&bitmap, new_width > 0 ? new_width : 1, new_height > 0 ? new_height : 1)) goto cleanup;
+        resized = true;
+    }
+    resized = resized || bitmap.width != result->width || bitmap.height != result->height;
+    result->out_width = bitmap.width;
+    result->out_height = bitmap.height;
+
+    if (is_png) {
+        if (!encode_png(&bitmap, &encoded)) goto cleanup;
+        take_buffer(result, &encoded, "image/png");
+        // Lossy only when it clearly wins, i.e. for photographic content.
+        if (bitmap_is_opaque(&bitmap) && encode_jpeg(&bitmap, PNG_TO_JPEG_QUALITY, &alternative) &&
+            alternative.size * 2 < result->size) {
+            free(result->data);
+            take_buffer(result, &alternative, "image/jpeg");
+        }
+    } else if (resized || orientation != 1) {
+        if (!encode_jpeg(&bitmap, JPEG_QUALITY, &encoded)) goto cleanup;
+        take_buffer(result, &encoded, "image/jpeg");
+    } else {
+        if (!strip_jpeg_metadata(data, size, &encoded)) goto cleanup;
+        take_buffer(result, &encoded, "image/jpeg");
+    }
+
+    // A smaller picture is always worth sending (it also costs fewer tokens);
+    // at the same dimensions the re-encode must actually save bytes.
+    ok = resized || result->size < size;
+
+cleanup:
+    free(bitmap.pixels);
+    free(encoded.data);
+    free(alternative.data);
+    if (!ok || bitmap_cancelled(&bitmap)) {
+        image_result_free(result);
+        ok = false;
+    }
+    return ok;
+#else
+    (void)data; (void)size; (void)mime_type; (void)max_dimension; (void)cancel;
+    return false;
+#endif
+}
+
+/**
+ * @brief Downscales and re-encodes a PNG or JPEG attachment.
+ * @param data The original image bytes.
+ * @param size The number of bytes.
+ * @param mime_type The MIME type of the original ("image/png" or "image/jpeg";
+ *                  anything else is left alone).
+ * @param max_dimension The maximum width/height of the result in pixels.
+ * @param result Receives the re-encoded image on success.
+ * @return true if `result` holds a better version of the image; false if the
+ *         original should be sent unchanged.
+ */
+bool image_optimize(const unsigned char* data, size_t size, const char* mime_type, int max_dimension, ImageResult* result) {
+    return optimize(data, size, mime_type, max_dimension, NULL, result);
+}
+
+/**
+ * @brief Frees the data held by an ImageResult.
+ * @param result The result to release; safe to call on a zeroed result.
+ */
+void image_result_free(ImageResult* result) {
+    free(result->data);
+    result->data = NULL;
+    result->size = 0;
+}
+
+#if defined(GCLI_HAVE_IMAGE) && !defined(_WIN32)
+// Lives on the caller's stack; the caller joins the worker before returning.
+typedef struct {
+    const unsigned char* data;
+    size_t size;
+    const char* mime_type;
+    int max_dimension;
+    int cancel;
+    ImageResult result;
+    bool ok;
+    bool done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} OptimizeJob;
+
+static void* optimize_worker(void* arg) {
+    OptimizeJob* job = arg;
+    ImageResult result;
+    bool ok = optimize(job->data, job->size, job->mime_type, job->max_dimension, &job->cancel, &result);
+
+    pthread_mutex_lock(&job->lock);
+    job->result = result;
+    job->ok = ok;
+    job->done = true;
+    pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+#endif
+
+/**
+ * @brief Runs image_optimize on a worker thread with a time limit.
+ * @details Decoding and re-encoding a very large image can take a while; the
+ *          work runs on its own thread so that a pathological input never
+ *          blocks the session for longer than `timeout_ms`. On timeout the
+ *          worker is told to stop and joined, and the original image is used.
+ *          The worker checks between scanlines, so the wait after the deadline
+ *          is at most one row (PNG decoding is a single libpng call and is
+ *          only checked once it returns). Without pthreads this simply calls
+ *          image_optimize.
+ * @return true if `result` holds an optimized image.
+ */
+bool image_optimize_with_timeout(const unsigned char* data, size_t size, const char* mime_type, int max_dimension, int timeout_ms, ImageResult* result) {
+#if defined(GCLI_HAVE_IMAGE) && !defined(_WIN32)
+    memset(result, 0, sizeof(*result));
+    OptimizeJob job = { .data = data, .size = size, .mime_type = mime_type, .max_dimension = max_dimension };
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, optimize_worker, &job) != 0) {
+        pthread_mutex_destroy(&job.lock);
+        pthread_cond_destroy(&job.cond);
+        return image_optimize(data, size, mime_type, max_dimension, result);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&job.lock);
+    while (!job.done) {
+        if (pthread_cond_timedwait(&job.cond, &job.lock, &deadline) == ETIMEDOUT) break;
+    }
+    bool timed_out = !job.done;
+    pthread_mutex_unlock(&job.lock);
+    if (timed_out) {
+#if defined(__GNUC__) || defined(__clang__)
+        __atomic_store_n(&job.cancel, 1, __ATOMIC_RELAXED);
+#else
+        *(volatile int*)&job.cancel = 1;
+#endif
+    }
+    pthread_join(thread, NULL);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.cond);
+
+    if (timed_out) {
+        image_result_free(&job.result);
+        fprintf(stderr, "Warning: Image optimization timed out; sending the original.\n");
+        return false;
+    }
+    *result = job.result;
+    return job.ok;
+#else
+    (void)timeout_ms;
+    return image_optimize(data, size, mime_type, max_dimension, result);
+#endif
+}
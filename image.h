@@ -0,0 +1,30 @@
+/**
+ * @file image.h
+ * @brief Attachment image preprocessing for gcli.
+ *
+ * Downscales oversized PNG and JPEG attachments, re-encodes them in the most
+ * compact suitable format and strips metadata before they are Base64-encoded
+ * into a request. Built on the system libpng and libjpeg; when gcli is built
+ * without them (GCLI_HAVE_IMAGE undefined) every call reports "not optimized"
+ * and attachments are sent unchanged.
+ */
+
+#ifndef GCLI_IMAGE_H
+#define GCLI_IMAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    unsigned char* data;    // Re-encoded image, owned by the result.
+    size_t size;            // Size of `data` in bytes.
+    const char* mime_type;  // MIME type of `data` (static string).
+    int width, height;      // Dimensions of the source image.
+    int out_width, out_height; // Dimensions of the re-encoded image.
+} ImageResult;
+
+bool image_optimize(const unsigned char* data, size_t size, const char* mime_type, int max_dimension, ImageResult* result);
+bool image_optimize_with_timeout(const unsigned char* data, size_t size, const char* mime_type, int max_dimension, int timeout_ms, ImageResult* result);
+void image_result_free(ImageResult* result);
+
+#endif // GCLI_IMAGE_H
@@ -0,0 +1,621 @@
+/**
+ * @file jsonschema.c
+ * @brief Incremental JSON parsing and schema validation for structured output.
+ *
+ * With a response schema the model is asked for a JSON document, and scripts
+ * consume the answer directly. A broken answer used to be noticed only after
+ * the whole generation had been paid for and handed downstream. This module
+ * validates the document byte by byte as it streams:
+ *   - a push parser keeps a stack of open objects and arrays and the state of
+ *     the token in progress (string with escapes, number, literal), so any
+ *     split of the input into chunks gives the same result;
+ *   - every value is checked against its schema node when its first byte
+ *     arrives (type, nullable), string values with an `enum` are checked
+ *     against the allowed prefixes after every character, object keys are
+ *     checked when they close (`additionalProperties: false`), and counts,
+ *     `required` members and number ranges when the value ends.
+ * Supported keywords are the ones of the API's response schema: `type`
+ * (upper or lower case, or a list of types), `nullable`, `enum`,
+ * `properties`, `required`, `additionalProperties` (false only), `items`,
+ * `minItems`, `maxItems`, `minimum` and `maximum`. `anyOf` and unknown
+ * keywords are not checked; the values they govern are only parsed.
+ */
+
+#include "jsonschema.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define JSON_MAX_DEPTH 128
+#define JSON_MAX_NUMBER 64      // Longer numbers are not range-checked.
+
+enum { TYPE_STRING = 1, TYPE_NUMBER = 2, TYPE_INTEGER = 4, TYPE_BOOLEAN = 8, TYPE_ARRAY = 16, TYPE_OBJECT = 32, TYPE_NULL = 64 };
+
+typedef enum { TOKEN_NONE, TOKEN_STRING, TOKEN_NUMBER, TOKEN_LITERAL } TokenKind;
+
+// What the innermost container expects next.
+typedef enum { EXPECT_FIRST, EXPECT_KEY, EXPECT_COLON, EXPECT_VALUE, EXPECT_COMMA } Expect;
+
+typedef enum { NUM_SIGN, NUM_ZERO, NUM_INT, NUM_DOT, NUM_FRAC, NUM_E, NUM_E_SIGN, NUM_EXP, NUM_END } NumberState;
+
+typedef struct {
+    const cJSON* schema;        // NULL: any value.
+    bool object;                // Object or array.
+    Expect expect;
+    int count;                  // Members or items so far.
+    char* key;                  // Key of the member being read (objects).
+    const cJSON* member_schema; // Schema of that member's value.
+    bool* seen_required;        // Per entry of the schema's `required` array.
+    int num_required;
+} Frame;
+
+struct JsonValidator {
+    const cJSON* root_schema;
+    Frame stack[JSON_MAX_DEPTH];
+    int depth;
+    bool started;
+    bool done;
+    bool failed;
+    size_t offset;              // Bytes consumed.
+    char error[384];
+
+    // Token in progress.
+    TokenKind token;
+    const cJSON* token_schema;
+    bool token_is_key;
+    bool escape;
+    int hex_left;               // Hex digits still expected in a \u escape.
+    uint32_t hex_value;
+    uint32_t high_surrogate;
+    char* text;                 // Decoded string (keys and enum values only).
+    size_t text_len, text_cap;
+    bool keep_text;
+    NumberState number;
+    char number_text[JSON_MAX_NUMBER];
+    size_t number_len;
+    const char* literal;        // "true", "false" or "null".
+    size_t literal_pos;
+};
+
+// --- Schema Access ---
+
+static const cJSON* schema_item(const cJSON* schema, const char* key) {
+    return schema ? cJSON_GetObjectItemCaseSensitive(schema, key) : NULL;
+}
+
+static int type_bit(const char* name) {
+    static const struct { const char* name; int bit; } TYPES[] = {
+        { "string", TYPE_STRING }, { "number", TYPE_NUMBER }, { "integer", TYPE_INTEGER }, { "boolean", TYPE_BOOLEAN },
+        { "array", TYPE_ARRAY }, { "object", TYPE_OBJECT }, { "null", TYPE_NULL },
+    };
+    for (size_t i = 0; i < sizeof(TYPES) / sizeof(TYPES[0]); i++) {
+        const char* a = TYPES[i].name;
+        const char* b = name;
+        while (*a && (*b == *a || *b == *a - 'a' + 'A')) a++, b++;
+        if (*a == '\0' && *b == '\0') return TYPES[i].bit;
+    }
+    return 0;
+}
+
+// Types a schema node allows, as a bit set; 0 means any.
+static int schema_types(const cJSON* schema) {
+    if (!schema || schema_item(schema, "anyOf")) return 0;
+    const cJSON* type = schema_item(schema, "type");
+    int types = 0;
+    if (cJSON_IsString(type)) {
+        types = type_bit(type->valuestring);
+    } else if (cJSON_IsArray(type)) {
+        const cJSON* item;
+        cJSON_ArrayForEach(item, type) {
+            if (cJSON_IsString(item)) types |= type_bit(item->valuestring);
+        }
+    }
+    if (types == 0) return 0;
+    if (cJSON_IsTrue(schema_item(schema, "nullable"))) types |= TYPE_NULL;
+    if (types & TYPE_NUMBER) types |= TYPE_INTEGER;
+    return types;
+}
+
+static const char* type_name(int bit) {
+    switch (bit) {
+        case TYPE_STRING: return "a string";
+        case TYPE_NUMBER: return "a number";
+        case TYPE_INTEGER: return "an integer";
+        case TYPE_BOOLEAN: return "a boolean";
+        case TYPE_ARRAY: return "an array";
+        case TYPE_OBJECT: return "an object";
+        default: return "null";
+    }
+}
+
+// --- Errors ---
+
+// Appends the JSON path of the value being read, like $.items[2].name.
+static size_t format_path(const JsonValidator* v, char* out, size_t size) {
+    size_t len = (size_t)snprintf(out, size, "$");
+    for (int i = 0; i < v->depth && len < size; i++) {
+        const Frame* f = &v->stack[i];
+        if (f->object && f->key) {
+            len += (size_t)snprintf(out + len, size - len, ".%s", f->key);
+        } else if (!f->object && f->count > 0) {
+            len += (size_t)snprintf(out + len, size - len, "[%d]", f->count - 1);
+        }
+    }
+    return len < size ? len : size - 1;
+}
+
+static bool fail(JsonValidator* v, const char* format, const char* detail) {
+    char path[160];
+    format_path(v, path, sizeof(path));
+    char message[192];
+    snprintf(message, sizeof(message), format, detail ? detail : "");
+    snprintf(v->error, sizeof(v->error), "%s at %s", message, path);
+    v->failed = true;
+    return false;
+}
+
+// --- Values ---
+
+static void text_reset(JsonValidator* v) {
+    v->text_len = 0;
+    if (v->text) v->text[0] = '\0';
+}
+
+static bool text_append(JsonValidator* v, const char* data, size_t len) {
+    if (v->text_len + len + 1 > v->text_cap) {
+        size_t cap = v->text_cap ? v->text_cap : 64;
+        while (cap < v->text_len + len + 1) cap *= 2;
+        char* text = realloc(v->text, cap);
+        if (!text) return false;
+        v->text = text;
+        v->text_cap = cap;
+    }
+    memcpy(v->text + v->text_len, data, len);
+    v->text_len += len;
+    v->text[v->text_len] = '\0';
+    return true;
+}
+
+static bool text_append_code_point(JsonValidator* v, uint32_t u) {
+    char out[4];
+    size_t n;
+    if (u < 0x80) {
+        out[0] = (char)u;
+        n = 1;
+    } else if (u < 0x800) {
+        out[0] = (char)(0xC0 | u >> 6);
+        out[1] = (char)(0x80 | (u & 0x3F));
+        n = 2;
+    } else if (u < 0x10000) {
+        out[0] = (char)(0xE0 | u >> 12);
+        out[1] = (char)(0x80 | (u >> 6 & 0x3F));
+        out[2] = (char)(0x80 | (u & 0x3F));
+        n = 3;
+    } else {
+        out[0] = (char)(0xF0 | u >> 18);
+        out[1] = (char)(0x80 | (u >> 12 & 0x3F));
+        out[2] = (char)(0x80 | (u >> 6 & 0x3F));
+        out[3] = (char)(0x80 | (u & 0x3F));
+        n = 4;
+    }
+    return text_append(v, out, n);
+}
+
+// True if some enum value starts with the string read so far (or equals it, if `whole`).
+static bool enum_allows(const cJSON* values, const char* text, size_t len, bool whole) {
+    const cJSON* item;
+    cJSON_ArrayForEach(item, values) {
+        if (!cJSON_IsString(item)) continue;
+        size_t item_len = strlen(item->valuestring);
+        if (item_len >= len && memcmp(item->valuestring, text, len) == 0 && (!whole || item_len == len)) return true;
+    }
+    return false;
+}
+
+static bool close_value(JsonValidator* v) {
+    if (v->depth == 0) {
+        v->done = true;
+    } else {
+        v->stack[v->depth - 1].expect = EXPECT_COMMA;
+    }
+    return true;
+}
+
+static bool open_container(JsonValidator* v, const cJSON* schema, bool object) {
+    if (v->depth == JSON_MAX_DEPTH) return fail(v, "nesting is too deep", NULL);
+    Frame* f = &v->stack[v->depth];
+    memset(f, 0, sizeof(*f));
+    f->schema = schema;
+    f->object = object;
+    f->expect = EXPECT_FIRST;
+    const cJSON* required = object ? schema_item(schema, "required") : NULL;
+    if (cJSON_IsArray(required) && cJSON_GetArraySize(required) > 0) {
+        f->num_required = cJSON_GetArraySize(required);
+        f->seen_required = calloc((size_t)f->num_required, sizeof(bool));
+        if (!f->seen_required) return fail(v, "out of memory", NULL);
+    }
+    v->depth++;
+    return true;
+}
+
+static bool close_container(JsonValidator* v) {
+    Frame* f = &v->stack[v->depth - 1];
+    bool ok = true;
+    if (f->object) {
+        const cJSON* required = schema_item(f->schema, "required");
+        for (int i = 0; ok && i < f->num_required; i++) {
+            const cJSON* name = cJSON_GetArrayItem(required, i);
+            if (!f->seen_required[i] && cJSON_IsString(name)) {
+                free(f->key);
+                f->key = NULL;
+                ok = fail(v, "required property \"%s\" is missing", name->valuestring);
+            }
+        }
+    } else {
+        const cJSON* min_items = schema_item(f->schema, "minItems");
+        if (cJSON_IsNumber(min_items) && f->count < min_items->valuedouble) {
+            char count[32];
+            snprintf(count, sizeof(count), "%d", f->count);
+            ok = fail(v, "only %s items, fewer than minItems", count);
+        }
+    }
+    if (!ok) return false;
+    free(f->key);
+    free(f->seen_required);
+    v->depth--;
+    return close_value(v);
+}
+
+// Starts the value whose first byte is `c`, checking it against `schema`.
+static bool begin_value(JsonValidator* v, const cJSON* schema, unsigned char c) {
+    int kind;
+    if (c == '{') kind = TYPE_OBJECT;
+    else if (c == '[') kind = TYPE_ARRAY;
+    else if (c == '"') kind = TYPE_STRING;
+    else if (c == '-' || (c >= '0' && c <= '9')) kind = TYPE_NUMBER;
+    else if (c == 't' || c == 'f') kind = TYPE_BOOLEAN;
+    else if (c == 'n') kind = TYPE_NULL;
+    else {
+        char found[2] = { (char)c, '\0' };
+        return fail(v, "unexpected '%s' where a value should start", found);
+    }
+
+    int types = schema_types(schema);
+    if (types && !(types & (kind == TYPE_NUMBER ? TYPE_NUMBER | TYPE_INTEGER : kind))) {
+        for (int bit = 1; bit <= TYPE_NULL; bit <<= 1) {
+            if (types & bit) return fail(v, "expected %s", type_name(bit));
+        }
+    }
+
+    switch (kind) {
+        case TYPE_OBJECT:
+            return open_container(v, schema, true);
+        case TYPE_ARRAY:
+            return open_container(v, schema, false);
+        case TYPE_STRING: {
+            const cJSON* values = schema_item(schema, "enum");
+            v->token = TOKEN_STRING;
+            v->token_schema = schema;
+            v->token_is_key = false;
+            v->keep_text = cJSON_IsArray(values);
+            text_reset(v);
+            return true;
+        }
+        case TYPE_NUMBER:
+            v->token = TOKEN_NUMBER;
+            v->token_schema = schema;
+            v->number = c == '-' ? NUM_SIGN : (c == '0' ? NUM_ZERO : NUM_INT);
+            v->number_text[0] = (char)c;
+            v->number_len = 1;
+            return true;
+        default:
+            v->token = TOKEN_LITERAL;
+            v->literal = c == 't' ? "true" : (c == 'f' ? "false" : "null");
+            v->literal_pos = 1;
+            return true;
+    }
+}
+
+static bool end_number(JsonValidator* v) {
+    v->token = TOKEN_NONE;
+    if (v->number != NUM_ZERO && v->number != NUM_INT && v->number != NUM_FRAC && v->number != NUM_EXP) {
+        return fail(v, "malformed number", NULL);
+    }
+    if (v->number_len < JSON_MAX_NUMBER) {
+        v->number_text[v->number_len] = '\0';
+        double value = strtod(v->number_text, NULL);
+        const cJSON* minimum = schema_item(v->token_schema, "minimum");
+        const cJSON* maximum = schema_item(v->token_schema, "maximum");
+        if (cJSON_IsNumber(minimum) && value < minimum->valuedouble) return fail(v, "%s is below the minimum", v->number_text);
+        if (cJSON_IsNumber(maximum) && value > maximum->valuedouble) return fail(v, "%s is above the maximum", v->number_text);
+    }
+    return close_value(v);
+}
+
+static bool end_string(JsonValidator* v) {
+    v->token = TOKEN_NONE;
+    if (!v->token_is_key) {
+        const cJSON* values = schema_item(v->token_schema, "enum");
+        if (cJSON_IsArray(values) && !enum_allows(values, v->text, v->text_len, true)) {
+            return fail(v, "\"%s\" is not one of the allowed values", v->text);
+        }
+        return close_value(v);
+    }
+
+    // An object key: find the member's schema and mark required members.
+    Frame* f = &v->stack[v->depth - 1];
+    free(f->key);
+    f->key = malloc(v->text_len + 1);
+    if (!f->key) return fail(v, "out of memory", NULL);
+    memcpy(f->key, v->text, v->text_len + 1);
+    f->member_schema = NULL;
+    f->expect = EXPECT_COLON;
+
+    const cJSON* properties = schema_item(f->schema, "properties");
+    const cJSON* member = cJSON_IsObject(properties) ? cJSON_GetObjectItemCaseSensitive(properties, f->key) : NULL;
+    if (member) {
+        f->member_schema = member;
+    } else if (cJSON_IsFalse(schema_item(f->schema, "additionalProperties"))) {
+        return fail(v, "property \"%s\" is not allowed", f->key);
+    } else if (cJSON_IsObject(schema_item(f->schema, "additionalProperties"))) {
+        f->member_schema = schema_item(f->schema, "additionalProperties");
+    }
+    const cJSON* required = schema_item(f->schema, "required");
+    for (int i = 0; i < f->num_required; i++) {
+        const cJSON* name = cJSON_GetArrayItem(required, i);
+        if (cJSON_IsString(name) && strcmp(name->valuestring, f->key) == 0) f->seen_required[i] = true;
+    }
+    return true;
+}
+
+static bool is_hex(unsigned char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+// Decoded text of a \u escape; surrogate pairs are combined.
+static bool string_escape_done(JsonValidator* v) {
+    uint32_t u = v->hex_value;
+    if (u >= 0xD800 && u <= 0xDBFF) {
+        v->high_surrogate = u;
+        return true;
+    }
+    if (u >= 0xDC00 && u <= 0xDFFF && v->high_surrogate) {
+        u = 0x10000 + ((v->high_surrogate - 0xD800) << 10) + (u - 0xDC00);
+    }
+    v->high_surrogate = 0;
+    return !v->keep_text || text_append_code_point(v, u);
+}
+
+static bool string_char(JsonValidator* v, unsigned char c) {
+    if (v->hex_left > 0) {
+        if (!is_hex(c)) return fail(v, "malformed \\u escape", NULL);
+        v->hex_value = v->hex_value << 4 | (uint32_t)(c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+        if (--v->hex_left == 0 && !string_escape_done(v)) return fail(v, "out of memory", NULL);
+        return true;
+    }
+    char decoded;
+    if (v->escape) {
+        v->escape = false;
+        switch (c) {
+            case '"': case '\\': case '/': decoded = (char)c; break;
+            case 'b': decoded = '\b'; break;
+            case 'f': decoded = '\f'; break;
+            case 'n': decoded = '\n'; break;
+            case 'r': decoded = '\r'; break;
+            case 't': decoded = '\t'; break;
+            case 'u':
+                v->hex_left = 4;
+                v->hex_value = 0;
+                return true;
+            default: {
+                char found[2] = { (char)c, '\0' };
+                return fail(v, "invalid escape \\%s in a string", found);
+            }
+        }
+    } else if (c == '\\') {
+        v->escape = true;
+        return true;
+    } else if (c == '"') {
+        return end_string(v);
+    } else if (c < 0x20) {
+        return fail(v, "control character in a string", NULL);
+    } else {
+        decoded = (char)c;
+    }
+
+    if (!v->keep_text) return true;
+    if (!text_append(v, &decoded, 1)) return fail(v, "out of memory", NULL);
+    // Fail as soon as the value can no longer become one of the allowed ones.
+    const cJSON* values = v->token_is_key ? NULL : schema_item(v->token_schema, "enum");
+    if (values && !enum_allows(values, v->text, v->text_len, false)) {
+        return fail(v, "\"%s...\" cannot become one of the allowed values", v->text);
+    }
+    return true;
+}
+
+// Returns 1 if `c` extends the number, 0 if it ends it, -1 on a violation.
+static int number_char(JsonValidator* v, unsigned char c) {
+    bool digit = c >= '0' && c <= '9';
+    int types = schema_types(v->token_schema);
+    bool integer_only = (types & TYPE_INTEGER) && !(types & TYPE_NUMBER);
+    NumberState next;
+    switch (v->number) {
+        case NUM_SIGN: next = c == '0' ? NUM_ZERO : (digit ? NUM_INT : NUM_END); break;
+        case NUM_ZERO: next = c == '.' ? NUM_DOT : ((c == 'e' || c == 'E') ? NUM_E : NUM_END); break;
+        case NUM_INT: next = digit ? NUM_INT : (c == '.' ? NUM_DOT : ((c == 'e' || c == 'E') ? NUM_E : NUM_END)); break;
+        case NUM_DOT: next = digit ? NUM_FRAC : NUM_END; break;
+        case NUM_FRAC: next = digit ? NUM_FRAC : ((c == 'e' || c == 'E') ? NUM_E : NUM_END); break;
+        case NUM_E: next = (c == '+' || c == '-') ? NUM_E_SIGN : (digit ? NUM_EXP : NUM_END); break;
+        case NUM_E_SIGN: next = digit ? NUM_EXP : NUM_END; break;
+        default: next = digit ? NUM_EXP : NUM_END; break;
+    }
+    if (next == NUM_END) {
+        // Digits were required here; anything else that is not a delimiter is malformed.
+        if (v->number == NUM_SIGN || v->number == NUM_DOT || v->number == NUM_E || v->number == NUM_E_SIGN ||
+            (v->number == NUM_ZERO && digit)) {
+            fail(v, "malformed number", NULL);
+            return -1;
+        }
+        return 0;
+    }
+    if (integer_only && (next == NUM_DOT || next == NUM_E)) {
+        fail(v, "expected an integer", NULL);
+        return -1;
+    }
+    v->number = next;
+    if (v->number_len < JSON_MAX_NUMBER) v->number_text[v->number_len++] = (char)c;
+    return 1;
+}
+
+static bool is_space(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool feed_char(JsonValidator* v, unsigned char c) {
+    switch (v->token) {
+        case TOKEN_STRING:
+            return string_char(v, c);
+        case TOKEN_LITERAL:
+            if (c != (unsigned char)v->literal[v->literal_pos]) return fail(v, "malformed literal (expected %s)", v->literal);
+            if (v->literal[++v->literal_pos] == '\0') {
+                v->token = TOKEN_NONE;
+                return close_value(v);
+            }
+            return true;
+        case TOKEN_NUMBER: {
+            int r = number_char(v, c);
+            if (r != 0) return r > 0;
+            if (!end_number(v)) return false;
+            break; // `c` ends the number and is handled below.
+        }
+        default:
+            break;
+    }
+
+    if (is_space(c)) return true;
+    if (v->done) return fail(v, "unexpected data after the end of the document", NULL);
+    if (v->depth == 0) {
+        v->started = true;
+        return begin_value(v, v->root_schema, c);
+    }
+
+    Frame* f = &v->stack[v->depth - 1];
+    char found[2] = { (char)c, '\0' };
+    if (f->object) {
+        switch (f->expect) {
+            case EXPECT_FIRST:
+            case EXPECT_KEY:
+                if (c == '}' && f->expect == EXPECT_FIRST) return close_container(v);
+                if (c != '"') return fail(v, "unexpected '%s' where a property name should start", found);
+                v->token = TOKEN_STRING;
+                v->token_is_key = true;
+                v->token_schema = NULL;
+                v->keep_text = true;
+                text_reset(v);
+                return true;
+            case EXPECT_COLON:
+                if (c != ':') return fail(v, "unexpected '%s' after a property name", found);
+                f->expect = EXPECT_VALUE;
+                return true;
+            case EXPECT_VALUE:
+                f->count++;
+                return begin_value(v, f->member_schema, c);
+            default:
+                if (c == '}') return close_container(v);
+                if (c != ',') return fail(v, "unexpected '%s' after a property value", found);
+                free(f->key);
+                f->key = NULL;
+                f->expect = EXPECT_KEY;
+                return true;
+        }
+    }
+
+    // Arrays.
+    if (f->expect == EXPECT_COMMA) {
+        if (c == ']') return close_container(v);
+        if (c != ',') return fail(v, "unexpected '%s' after an array item", found);
+        f->expect = EXPECT_VALUE;
+        return true;
+    }
+    if (c == ']' && f->expect == EXPECT_FIRST) return close_container(v);
+    f->count++;
+    const cJSON* max_items = schema_item(f->schema, "maxItems");
+    if (cJSON_IsNumber(max_items) && f->count > max_items->valuedouble) {
+        return fail(v, "more items than maxItems", NULL);
+    }
+    return begin_value(v, schema_item(f->schema, "items"), c);
+}
+
+// --- Public Interface ---
+
+/**
+ * Creates a validator for documents matching `schema`, which must outlive
+ * it. Returns NULL on allocation failure.
+ */
+JsonValidator* json_validator_new(const cJSON* schema) {
+    JsonValidator* v = calloc(1, sizeof(*v));
+    if (!v) return NULL;
+    v->root_schema = schema;
+    return v;
+}
+
+// Prepares the validator for a new document.
+void json_validator_reset(JsonValidator* v) {
+    for (int i = 0; i < v->depth; i++) {
+        free(v->stack[i].key);
+        free(v->stack[i].seen_required);
+    }
+    const cJSON* schema = v->root_schema;
+    char* text = v->text;
+    size_t text_cap = v->text_cap;
+    memset(v, 0, sizeof(*v));
+    v->root_schema = schema;
+    v->text = text;
+    v->text_cap = text_cap;
+    text_reset(v);
+}
+
+void json_validator_free(JsonValidator* v) {
+    if (!v) return;
+    json_validator_reset(v);
+    free(v->text);
+    free(v);
+}
+
+/**
+ * Validates the next piece of the document. Returns false once the document
+ * can no longer match the schema; json_validator_error() says why.
+ */
+bool json_validator_feed(JsonValidator* v, const char* data, size_t size) {
+    for (size_t i = 0; i < size && !v->failed; i++) {
+        if (!feed_char(v, (unsigned char)data[i])) break;
+        v->offset++;
+    }
+    return !v->failed;
+}
+
+// Ends the input. Returns true if it was exactly one complete, valid document.
+bool json_validator_finish(JsonValidator* v) {
+    if (v->failed) return false;
+    if (v->token == TOKEN_NUMBER && !end_number(v)) return false;
+    if (!v->done) {
+        fail(v, v->started ? "the document is incomplete" : "the response is empty", NULL);
+        return false;
+    }
+    return true;
+}
+
+bool json_validator_failed(const JsonValidator* v) {
+    return v->failed;
+}
+
+const char* json_validator_error(const JsonValidator* v) {
+    return v->failed ? v->error : NULL;
+}
+
+// Offset of the byte at which validation failed.
+size_t json_validator_offset(const JsonValidator* v) {
+    return v->offset;
+}
@@ -0,0 +1,31 @@
+/**
+ * @file jsonschema.h
+ * @brief Incremental validation of streamed JSON against a response schema.
+ *
+ * Structured output is checked while it streams instead of after the whole
+ * answer has arrived. The validator is a push parser: each delta of the
+ * response is fed as it comes, and the first byte that cannot lead to a
+ * document matching the schema (a wrong type, an unknown enum value, a
+ * property the schema forbids, a syntax error) fails the validation at
+ * once, so the caller can abort the transfer and ask again.
+ */
+
+#ifndef GCLI_JSONSCHEMA_H
+#define GCLI_JSONSCHEMA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "cJSON.h"
+
+typedef struct JsonValidator JsonValidator;
+
+JsonValidator* json_validator_new(const cJSON* schema);
+void json_validator_free(JsonValidator* validator);
+void json_validator_reset(JsonValidator* validator);
+bool json_validator_feed(JsonValidator* validator, const char* data, size_t size);
+bool json_validator_finish(JsonValidator* validator);
+bool json_validator_failed(const JsonValidator* validator);
+const char* json_validator_error(const JsonValidator* validator);
+size_t json_validator_offset(const JsonValidator* validator);
+
+#endif // GCLI_JSONSCHEMA_H
@@ -0,0 +1,501 @@
+/**
+ * @file logcompact.c
+ * @brief Log template mining and compaction for text attachments.
+ *
+ * Piped build and service logs are dominated by a handful of line templates
+ * ("request <id> served in <n>ms") repeated thousands of times. Sending them
+ * verbatim costs upload time and input tokens without telling the model
+ * anything the template and its value ranges would not. This module mines
+ * templates in a single pass with the Drain scheme:
+ *   - each line is split into whitespace-separated tokens and routed through
+ *     a fixed-depth tree keyed by the token count and then its first tokens
+ *     (tokens containing digits are routed as a wildcard);
+ *   - the leaf holds candidate clusters; the line joins the most similar one
+ *     if at least half of its tokens agree with the cluster's template,
+ *     otherwise it starts a new cluster;
+ *   - template positions that disagree become wildcards, which remember the
+ *     numeric range or the first and last value seen.
+ * Child fan-out and the clusters compared per line are capped, so the work
+ * per line is bounded and the whole pass is linear in the input.
+ *
+ * The output keeps every line in first-occurrence order. Lines that match
+ * an error keyword, lines too long to tokenize and templates seen fewer than
+ * LOG_MIN_REPEAT times are copied verbatim; other templates are written
+ * once, at their first occurrence, with their count and field ranges.
+ */
+
+#include "logcompact.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_MAX_TOKENS 64           // Lines with more tokens are kept verbatim.
+#define LOG_MAX_LINE 4096           // Longer lines are kept verbatim.
+#define LOG_TREE_DEPTH 2            // Leading tokens used to route a line.
+#define LOG_MAX_CHILDREN 100        // Further distinct tokens share the wildcard child.
+#define LOG_MAX_CANDIDATES 64       // Clusters compared per line (most recent first).
+#define LOG_SIMILARITY 0.5          // Fraction of tokens that must agree to join a cluster.
+#define LOG_MIN_REPEAT 3            // Templates seen less often are not collapsed.
+#define LOG_MIN_SAVINGS_PERCENT 10  // Keep the original unless it shrinks at least this much.
+#define NO_CLUSTER UINT32_MAX
+
+static const char WILDCARD[] = "<*>";
+
+static const char* const ERROR_KEYWORDS[] = {
+    "error", "fatal", "panic", "exception", "fail", "critical",
+    "traceback", "abort", "denied", "segfault", "assert",
+};
+
+typedef struct {
+    const char* ptr;    // Points into the input; NULL marks a wildcard.
+    uint32_t len;
+} Token;
+
+// Summary of the values seen at a wildcard position.
+typedef struct {
+    bool numeric;           // Every value so far parsed as a number.
+    bool varied;            // Some value differed from both the first and the last one.
+    double min, max;
+    Token first, last;
+} VarStat;
+
+typedef struct {
+    uint32_t num_tokens;
+    uint32_t token_offset;  // Template and VarStat entries in the token pool.
+    uint32_t next_in_leaf;  // Next (older) cluster in the same leaf.
+    size_t count;
+    size_t first_line, last_line;
+} Cluster;
+
+typedef struct {
+    uint32_t num_children;
+    uint32_t first_cluster; // Most recent cluster routed to this node.
+} TreeNode;
+
+// Tree edge: (parent node, token) -> child node, in an open-addressing table.
+typedef struct {
+    uint32_t parent;
+    uint32_t child;         // 0 marks an empty slot; node 0 is the root.
+    Token key;
+} Edge;
+
+typedef struct {
+    size_t offset;
+    uint32_t length;
+    uint32_t cluster;       // NO_CLUSTER for lines kept verbatim.
+} Line;
+
+typedef struct {
+    TreeNode* nodes;
+    size_t num_nodes, cap_nodes;
+    uint32_t length_nodes[LOG_MAX_TOKENS + 1];
+    Edge* edges;
+    size_t num_edges, cap_edges;
+    Cluster* clusters;
+    size_t num_clusters, cap_clusters;
+    Token* templates;       // Pool of cluster templates, num_tokens entries each.
+    VarStat* stats;         // Parallel to `templates`.
+    size_t num_pool, cap_pool;
+    Line* lines;
+    size_t num_lines, cap_lines;
+    bool failed;
+} Miner;
+
+typedef struct {
+    char* data;
+    size_t size;
+    size_t capacity;
+    bool failed;
+} TextBuffer;
+
+static bool grow(void** array, size_t* capacity, size_t needed, size_t element_size) {
+    if (needed <= *capacity) return true;
+    size_t new_capacity = *capacity ? *capacity : 64;
+    while (new_capacity < needed) new_capacity *= 2;
+    void* grown = realloc(*array, new_capacity * element_size);
+    if (!grown) return false;
+    *array = grown;
+    *capacity = new_capacity;
+    return true;
+}
+
+static void text_append(TextBuffer* buf, const char* data, size_t len) {
+    if (buf->failed) return;
+    if (!grow((void**)&buf->data, &buf->capacity, buf->size + len + 1, 1)) {
+        buf->failed = true;
+        return;
+    }
+    memcpy(buf->data + buf->size, data, len);
+    buf->size += len;
+    buf->data[buf->size] = '\0';
+}
+
+static void text_append_str(TextBuffer* buf, const char* str) {
+    text_append(buf, str, strlen(str));
+}
+
+static bool token_equal(Token a, Token b) {
+    return a.len == b.len && memcmp(a.ptr, b.ptr, a.len) == 0;
+}
+
+static bool token_has_digit(Token token) {
+    for (uint32_t i = 0; i < token.len; i++) {
+        if (isdigit((unsigned char)token.ptr[i])) return true;
+    }
+    return false;
+}
+
+static bool token_number(Token token, double* value) {
+    char text[64];
+    if (token.len == 0 || token.len >= sizeof(text)) return false;
+    memcpy(text, token.ptr, token.len);
+    text[token.len] = '\0';
+    char* end;
+    *value = strtod(text, &end);
+    return end == text + token.len && isfinite(*value);
+}
+
+static bool prefix_equal_nocase(const char* text, const char* lower, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (tolower((unsigned char)text[i]) != lower[i]) return false;
+    }
+    return true;
+}
+
+static bool line_is_error(const char* line, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        char c = (char)tolower((unsigned char)line[i]);
+        for (size_t k = 0; k < sizeof(ERROR_KEYWORDS) / sizeof(ERROR_KEYWORDS[0]); k++) {
+            const char* keyword = ERROR_KEYWORDS[k];
+            size_t keyword_len = strlen(keyword);
+            if (c == keyword[0] && len - i >= keyword_len &&
+                prefix_equal_nocase(line + i, keyword, keyword_len)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static uint32_t edge_hash(uint32_t parent, Token key) {
+    uint32_t hash = 2166136261u ^ parent;
+    for (uint32_t i = 0; i < key.len; i++) {
+        hash = (hash ^ (unsigned char)key.ptr[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t new_node(Miner* miner) {
+    if (!grow((void**)&miner->nodes, &miner->cap_nodes, miner->num_nodes + 1, sizeof(TreeNode))) {
+        miner->failed = true;
+        return 0;
+    }
+    miner->nodes[miner->num_nodes].num_children = 0;
+    miner->nodes[miner->num_nodes].first_cluster = NO_CLUSTER;
+    return (uint32_t)miner->num_nodes++;
+}
+
+static bool rehash_edges(Miner* miner) {
+    size_t capacity = miner->cap_edges ? miner->cap_edges * 2 : 256;
+    Edge* edges = calloc(capacity, sizeof(Edge));
+    if (!edges) return false;
+    for (size_t i = 0; i < miner->cap_edges; i++) {
+        Edge* edge = &miner->edges[i];
+        if (edge->child == 0) continue;
+        size_t slot = edge_hash(edge->parent, edge->key) & (capacity - 1);
+        while (edges[slot].child != 0) slot = (slot + 1) & (capacity - 1);
+        edges[slot] = *edge;
+    }
+    free(miner->edges);
+    miner->edges = edges;
+    miner->cap_edges = capacity;
+    return true;
+}
+
+// Finds the child of `parent` for `key`, creating it if `create` is set.
+static uint32_t find_child(Miner* miner, uint32_t parent, Token key, bool create) {
+    if (miner->num_edges * 2 >= miner->cap_edges && !rehash_edges(miner)) {
+        miner->failed = true;
+        return 0;
+    }
+    size_t slot = edge_hash(parent, key) & (miner->cap_edges - 1);
+    while (miner->edges[slot].child != 0) {
+        Edge* edge = &miner->edges[slot];
+        if (edge->parent == parent && token_equal(edge->key, key)) return edge->child;
+        slot = (slot + 1) & (miner->cap_edges - 1);
+    }
+    if (!create) return 0;
+    uint32_t child = new_node(miner);
+    if (miner->failed) return 0;
+    miner->edges[slot].parent = parent;
+    miner->edges[slot].child = child;
+    miner->edges[slot].key = key;
+    miner->num_edges++;
+    miner->nodes[parent].num_children++;
+    return child;
+}
+
+// Routes a tokenized line to its leaf, growing the tree as needed.
+static uint32_t find_leaf(Miner* miner, const Token* tokens, uint32_t num_tokens) {
+    uint32_t node = miner->length_nodes[num_tokens];
+    if (node == 0) {
+        node = new_node(miner);
+        if (miner->failed) return 0;
+        miner->length_nodes[num_tokens] = node;
+    }
+    const Token wildcard = { WILDCARD, sizeof(WILDCARD) - 1 };
+    for (uint32_t depth = 0; depth < LOG_TREE_DEPTH && depth < num_tokens; depth++) {
+        Token key = token_has_digit(tokens[depth]) ? wildcard : tokens[depth];
+        uint32_t child = find_child(miner, node, key, false);
+        if (child == 0 && !miner->failed) {
+            bool full = miner->nodes[node].num_children >= LOG_MAX_CHILDREN;
+            child = find_child(miner, node, full ? wildcard : key, true);
+        }
+        if (miner->failed) return 0;
+        node = child;
+    }
+    return node;
+}
+
+static void var_update(VarStat* stat, Token value) {
+    double number;
+    if (stat->numeric && token_number(value, &number)) {
+        if (number < stat->min) stat->min = number;
+        if (number > stat->max) stat->max = number;
+    } else {
+        stat->numeric = false;
+    }
+    if (!token_equal(value, stat->first) && !token_equal(value, stat->last)) stat->varied = true;
+    stat->last = value;
+}
+
+static void var_init(VarStat* stat, Token value) {
+    stat->numeric = token_number(value, &stat->min);
+    stat->max = stat->min;
+    stat->varied = false;
+    stat->first = stat->last = value;
+}
+
+// Fraction of tokens equal to the cluster's non-wildcard template tokens.
+static double similarity(const Miner* miner, const Cluster* cluster, const Token* tokens) {
+    const Token* template = &miner->templates[cluster->token_offset];
+    uint32_t equal = 0;
+    for (uint32_t i = 0; i < cluster->num_tokens; i++) {
+        if (template[i].ptr && token_equal(template[i], tokens[i])) equal++;
+    }
+    return (double)equal / cluster->num_tokens;
+}
+
+static void merge_line(Miner* miner, Cluster* cluster, const Token* tokens, size_t line) {
+    Token* template = &miner->templates[cluster->token_offset];
+    VarStat* stats = &miner->stats[cluster->token_offset];
+    for (uint32_t i = 0; i < cluster->num_tokens; i++) {
+        if (template[i].ptr == NULL) {
+            var_update(&stats[i], tokens[i]);
+        } else if (!token_equal(template[i], tokens[i])) {
+            var_init(&stats[i], template[i]);
+            var_update(&stats[i], tokens[i]);
+            template[i].ptr = NULL;
+        }
+    }
+    cluster->count++;
+    cluster->last_line = line;
+}
+
+static uint32_t add_cluster(Miner* miner, uint32_t leaf, const Token* tokens, uint32_t num_tokens, size_t line) {
+    size_t old_cap_pool = miner->cap_pool;
+    if (!grow((void**)&miner->clusters, &miner->cap_clusters, miner->num_clusters + 1, sizeof(Cluster)) ||
+        !grow((void**)&miner->templates, &miner->cap_pool, miner->num_pool + num_tokens, sizeof(Token))) {
+        miner->failed = true;
+        return NO_CLUSTER;
+    }
+    // `stats` shares the pool's capacity, so it grows along with `templates`.
+    if (miner->cap_pool != old_cap_pool) {
+        VarStat* stats = realloc(miner->stats, miner->cap_pool * sizeof(VarStat));
+        if (!stats) {
+            miner->failed = true;
+            return NO_CLUSTER;
+        }
+        miner->stats = stats;
+    }
+
+    uint32_t id = (uint32_t)miner->num_clusters++;
+    Cluster* cluster = &miner->clusters[id];
+    cluster->num_tokens = num_tokens;
+    cluster->token_offset = (uint32_t)miner->num_pool;
+    cluster->count = 1;
+    cluster->first_line = cluster->last_line = line;
+    cluster->next_in_leaf = miner->nodes[leaf].first_cluster;
+    miner->nodes[leaf].first_cluster = id;
+    memcpy(&miner->templates[miner->num_pool], tokens, num_tokens * sizeof(Token));
+    miner->num_pool += num_tokens;
+    return id;
+}
+
+// Assigns one line to a cluster; returns NO_CLUSTER if it stays verbatim.
+static uint32_t mine_line(Miner* miner, const char* line, size_t len, size_t line_number) {
+    if (len > LOG_MAX_LINE || line_is_error(line, len)) return NO_CLUSTER;
+
+    Token tokens[LOG_MAX_TOKENS];
+    uint32_t num_tokens = 0;
+    size_t i = 0;
+    while (i < len) {
+        while (i < len && isspace((unsigned char)line[i])) i++;
+        if (i == len) break;
+        if (num_tokens == LOG_MAX_TOKENS) return NO_CLUSTER;
+        size_t start = i;
+        while (i < len && !isspace((unsigned char)line[i])) i++;
+        tokens[num_tokens].ptr = line + start;
+        tokens[num_tokens].len = (uint32_t)(i - start);
+        num_tokens++;
+    }
+    if (num_tokens == 0) return NO_CLUSTER;
+
+    uint32_t leaf = find_leaf(miner, tokens, num_tokens);
+    if (miner->failed) return NO_CLUSTER;
+
+    uint32_t best = NO_CLUSTER;
+    double best_similarity = -1.0;
+    uint32_t id = miner->nodes[leaf].first_cluster;
+    for (int compared = 0; id != NO_CLUSTER && compared < LOG_MAX_CANDIDATES; compared++) {
+        double sim = similarity(miner, &miner->clusters[id], tokens);
+        if (sim > best_similarity) {
+            best_similarity = sim;
+            best = id;
+        }
+        id = miner->clusters[id].next_in_leaf;
+    }
+    if (best != NO_CLUSTER && best_similarity >= LOG_SIMILARITY) {
+        merge_line(miner, &miner->clusters[best], tokens, line_number);
+        return best;
+    }
+    return add_cluster(miner, leaf, tokens, num_tokens, line_number);
+}
+
+static void append_number(TextBuffer* out, double value) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.15g", value);
+    text_append_str(out, text);
+}
+
+static void append_cluster(TextBuffer* out, const Miner* miner, const Cluster* cluster) {
+    const Token* template = &miner->templates[cluster->token_offset];
+    const VarStat* stats = &miner->stats[cluster->token_offset];
+    for (uint32_t i = 0; i < cluster->num_tokens; i++) {
+        if (i > 0) text_append(out, " ", 1);
+        if (template[i].ptr) {
+            text_append(out, template[i].ptr, template[i].len);
+            continue;
+        }
+        const VarStat* stat = &stats[i];
+        text_append(out, "<", 1);
+        if (stat->numeric) {
+            append_number(out, stat->min);
+            text_append(out, "..", 2);
+            append_number(out, stat->max);
+        } else {
+            text_append(out, stat->first.ptr, stat->first.len);
+            text_append_str(out, stat->varied ? "|...|" : "|");
+            text_append(out, stat->last.ptr, stat->last.len);
+        }
+        text_append(out, ">", 1);
+    }
+    char note[96];
+    snprintf(note, sizeof(note), "  [x%zu, lines %zu-%zu]\n",
+             cluster->count, cluster->first_line + 1, cluster->last_line + 1);
+    text_append_str(out, note);
+}
+
+static void miner_free(Miner* miner) {
+    free(miner->nodes);
+    free(miner->edges);
+    free(miner->clusters);
+    free(miner->templates);
+    free(miner->stats);
+    free(miner->lines);
+}
+
+bool log_compact(const char* data, size_t size, LogCompactResult* result) {
+    memset(result, 0, sizeof(*result));
+    if (size == 0 || memchr(data, '\0', size) != NULL) return false;
+
+    Miner miner = { 0 };
+    TextBuffer body = { 0 };
+    bool ok = false;
+
+    // Node 0 is the root; edges use child id 0 to mark empty slots.
+    new_node(&miner);
+
+    // --- Pass over the input: route every line and remember its cluster ---
+    size_t pos = 0;
+    while (pos < size && !miner.failed) {
+        const char* newline = memchr(data + pos, '\n', size - pos);
+        size_t end = newline ? (size_t)(newline - data) : size;
+        size_t len = end - pos;
+        if (len > 0 && data[pos + len - 1] == '\r') len--;
+        if (!grow((void**)&miner.lines, &miner.cap_lines, miner.num_lines + 1, sizeof(Line))) {
+            miner.failed = true;
+            break;
+        }
+        Line* line = &miner.lines[miner.num_lines];
+        line->offset = pos;
+        line->length = len > UINT32_MAX ? UINT32_MAX : (uint32_t)len;
+        line->cluster = mine_line(&miner, data + pos, len, miner.num_lines);
+        miner.num_lines++;
+        pos = end + 1;
+    }
+    if (miner.failed) goto cleanup;
+
+    // --- Emit lines in order, collapsing each frequent template into its first occurrence ---
+    size_t lines_out = 0;
+    for (size_t i = 0; i < miner.num_lines; i++) {
+        const Line* line = &miner.lines[i];
+        const Cluster* cluster = line->cluster == NO_CLUSTER ? NULL : &miner.clusters[line->cluster];
+        if (cluster == NULL || cluster->count < LOG_MIN_REPEAT) {
+            text_append(&body, data + line->offset, line->length);
+            text_append(&body, "\n", 1);
+        } else if (cluster->first_line == i) {
+            append_cluster(&body, &miner, cluster);
+            result->templates++;
+        } else {
+            continue;
+        }
+        lines_out++;
+    }
+    if (body.failed || result->templates == 0) goto cleanup;
+
+    char header[256];
+    snprintf(header, sizeof(header),
+             "[Log compacted from %zu to %zu lines. A line ending in [xN, lines A-B] stands for N lines "
+             "matching it; <a..b> is a numeric range, <first|...|last> a varying field.]\n",
+             miner.num_lines, lines_out);
+    if ((strlen(header) + body.size) * 100 > size * (100 - LOG_MIN_SAVINGS_PERCENT)) goto cleanup;
+
+    TextBuffer out = { 0 };
+    text_append_str(&out, header);
+    text_append(&out, body.data, body.size);
+    if (out.failed) {
+        free(out.data);
+        goto cleanup;
+    }
+    result->text = out.data;
+    result->size = out.size;
+    result->lines_in = miner.num_lines;
+    result->lines_out = lines_out + 1;
+    ok = true;
+
+cleanup:
+    if (!ok) result->templates = 0;
+    free(body.data);
+    miner_free(&miner);
+    return ok;
+}
+
+void log_compact_result_free(LogCompactResult* result) {
+    free(result->text);
+    memset(result, 0, sizeof(*result));
+}
@@ -0,0 +1,29 @@
+/**
+ * @file logcompact.h
+ * @brief Log-aware compaction of text attachments for gcli.
+ *
+ * Groups the lines of a log into templates with a Drain-style fixed-depth
+ * parse tree, then replaces each template seen often enough by a single
+ * exemplar annotated with its count, line span and the range of every
+ * varying field. Unique lines and lines that look like errors are kept
+ * verbatim and in place. One pass over the input, bounded work per line.
+ */
+
+#ifndef GCLI_LOGCOMPACT_H
+#define GCLI_LOGCOMPACT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    char* text;             // Compacted text, NUL-terminated, owned by the result.
+    size_t size;            // Length of `text` in bytes.
+    size_t lines_in;        // Lines in the original input.
+    size_t lines_out;       // Lines in `text`, including the explanatory header.
+    size_t templates;       // Templates that were collapsed.
+} LogCompactResult;
+
+bool log_compact(const char* data, size_t size, LogCompactResult* result);
+void log_compact_result_free(LogCompactResult* result);
+
+#endif // GCLI_LOGCOMPACT_H
@@ -0,0 +1,1779 @@
+/**
+ * @file pdftext.c
+ * @brief Text extraction from text-based PDFs.
+ *
+ * A PDF attachment is otherwise sent whole, Base64-encoded, on every turn of
+ * the conversation. For documents that carry a text layer, the text alone is
+ * usually a fraction of that size. This module extracts it without external
+ * dependencies beyond zlib:
+ *   - Objects are located by scanning the file for `N G obj` headers rather
+ *     than trusting the cross-reference table, which also recovers files
+ *     with damaged xref data. Later definitions win, as with incremental
+ *     updates. Objects packed in object streams are read afterwards.
+ *   - Pages are collected from the page tree (falling back to every /Page
+ *     object in file order) with inherited resources.
+ *   - Content streams, including nested form XObjects, are interpreted for
+ *     the text operators only. Glyph advances from /Widths and /W keep track
+ *     of the pen position, so spaces and line breaks are inferred from gaps
+ *     and baseline changes.
+ *   - Glyphs are mapped to Unicode through the font's ToUnicode CMap, then
+ *     the simple-font encodings (WinAnsi, MacRoman, Standard, /Differences
+ *     with glyph names), then UCS-2 encoded CMaps.
+ * Extraction is declined for encrypted files, for documents where most pages
+ * have no text (scans), and when too many glyphs have no Unicode mapping.
+ */
+
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+
+#include "pdftext.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#define PDF_MAX_OBJECTS (1 << 22)
+#define PDF_MAX_NESTING 64              // Arrays/dictionaries, page tree levels.
+#define PDF_MAX_STREAM_SIZE (64 << 20)  // Decoded size limit per stream.
+#define PDF_MAX_PAGES 20000
+#define PDF_MAX_PAGE_TREE_NODES (4 * PDF_MAX_PAGES)
+#define PDF_MAX_FORM_DEPTH 8
+#define PDF_MAX_GSTATE_DEPTH 32
+#define PDF_MAX_OPERANDS 32
+#define PDF_MIN_PAGE_CHARS 16           // Pages with fewer characters count as having no text.
+#define PDF_MIN_TEXT_CHARS 64
+#define PDF_MAX_UNMAPPED_PERCENT 5
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// --- Arena ---
+
+// Parsed objects live until the document is done; they are freed together.
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t size;
+    unsigned char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* head;
+    bool failed;
+} Arena;
+
+static void* arena_alloc(Arena* arena, size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    ArenaBlock* block = arena->head;
+    if (!block || block->used + size > block->size) {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + capacity);
+        if (!block) {
+            arena->failed = true;
+            return NULL;
+        }
+        block->size = capacity;
+        block->used = 0;
+        if (arena->head && size > ARENA_BLOCK_SIZE) {
+            // Oversized allocations go behind the head so it keeps filling.
+            block->next = arena->head->next;
+            arena->head->next = block;
+        } else {
+            block->next = arena->head;
+            arena->head = block;
+        }
+    }
+    void* ptr = block->data + block->used;
+    block->used += size;
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+// Frees everything but the newest block, which is emptied for reuse.
+static void arena_reset(Arena* arena) {
+    ArenaBlock* keep = arena->head;
+    if (!keep) return;
+    ArenaBlock* block = keep->next;
+    while (block) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    keep->next = NULL;
+    keep->used = 0;
+}
+
+static void arena_free(Arena* arena) {
+    arena_reset(arena);
+    free(arena->head);
+    arena->head = NULL;
+}
+
+// --- Objects ---
+
+typedef enum {
+    PDF_NULL, PDF_BOOL, PDF_NUMBER, PDF_STRING, PDF_NAME,
+    PDF_ARRAY, PDF_DICT, PDF_STREAM, PDF_REF, PDF_KEYWORD
+} PdfType;
+
+typedef struct PdfObject PdfObject;
+
+typedef struct {
+    const char* key;
+    PdfObject* value;
+} PdfDictEntry;
+
+struct PdfObject {
+    PdfType type;
+    double number;                  // PDF_NUMBER, PDF_BOOL.
+    int num, gen;                   // PDF_REF.
+    unsigned char* data;            // PDF_STRING, PDF_NAME, PDF_KEYWORD (NUL-terminated).
+    size_t len;
+    PdfObject** items;              // PDF_ARRAY.
+    PdfDictEntry* entries;          // PDF_DICT, PDF_STREAM.
+    int count;
+    const unsigned char* stream;    // PDF_STREAM: raw data within the file.
+    size_t stream_len;
+};
+
+typedef struct Font Font;
+
+typedef struct {
+    const unsigned char* data;
+    size_t size;
+    Arena arena;                    // Objects, fonts.
+    Arena scratch;                  // Content stream operands, reset per operator.
+    PdfObject** objects;            // Indexed by object number.
+    int num_objects;
+    Font* fonts;
+    Font* default_font;
+    size_t glyphs, unmapped;
+    const int* cancel;              // Set by another thread to stop the extraction, or NULL.
+} PdfDoc;
+
+static bool doc_cancelled(const PdfDoc* doc) {
+    if (!doc->cancel) return false;
+#if defined(__GNUC__) || defined(__clang__)
+    return __atomic_load_n(doc->cancel, __ATOMIC_RELAXED) != 0;
+#else
+    return *(const volatile int*)doc->cancel != 0;
+#endif
+}
+
+static PdfObject PDF_NULL_OBJECT = { PDF_NULL, 0, 0, 0, NULL, 0, NULL, NULL, 0, NULL, 0 };
+
+static PdfObject* new_object(Arena* arena, PdfType type) {
+    PdfObject* obj = arena_alloc(arena, sizeof(PdfObject));
+    if (obj) obj->type = type;
+    return obj;
+}
+
+static PdfObject* resolve(PdfDoc* doc, PdfObject* obj) {
+    for (int hops = 0; obj && obj->type == PDF_REF && hops < 8; hops++) {
+        obj = (obj->num >= 0 && obj->num < doc->num_objects) ? doc->objects[obj->num] : NULL;
+    }
+    return obj && obj->type != PDF_REF ? obj : NULL;
+}
+
+static PdfObject* dict_get(PdfDoc* doc, PdfObject* dict, const char* key) {
+    if (!dict || (dict->type != PDF_DICT && dict->type != PDF_STREAM)) return NULL;
+    for (int i = 0; i < dict->count; i++) {
+        if (strcmp(dict->entries[i].key, key) == 0) return resolve(doc, dict->entries[i].value);
+    }
+    return NULL;
+}
+
+static bool dict_has(const PdfObject* dict, const char* key) {
+    for (int i = 0; dict && (dict->type == PDF_DICT || dict->type == PDF_STREAM) && i < dict->count; i++) {
+        if (strcmp(dict->entries[i].key, key) == 0) return true;
+    }
+    return false;
+}
+
+static bool is_name(const PdfObject* obj, const char* name) {
+    return obj && obj->type == PDF_NAME && strcmp((const char*)obj->data, name) == 0;
+}
+
+static double number_or(const PdfObject* obj, double fallback) {
+    return obj && obj->type == PDF_NUMBER ? obj->number : fallback;
+}
+
+// --- Lexer ---
+
+typedef struct {
+    const unsigned char* p;
+    const unsigned char* end;
+    Arena* arena;
+    bool allow_refs;                // `N G R` is a reference (not in content streams).
+} Lexer;
+
+static bool is_space(unsigned char c) {
+    return c == 0 || c == '\t' || c == '\n' || c == '\f' || c == '\r' || c == ' ';
+}
+
+static bool is_delimiter(unsigned char c) {
+    return c == '(' || c == ')' || c == '<' || c == '>' || c == '[' || c == ']' ||
+           c == '{' || c == '}' || c == '/' || c == '%';
+}
+
+static bool is_regular(unsigned char c) {
+    return !is_space(c) && !is_delimiter(c);
+}
+
+static void skip_space(Lexer* lx) {
+    while (lx->p < lx->end) {
+        if (is_space(*lx->p)) {
+            lx->p++;
+        } else if (*lx->p == '%') {
+            while (lx->p < lx->end && *lx->p != '\n' && *lx->p != '\r') lx->p++;
+        } else {
+            break;
+        }
+    }
+}
+
+static int hex_value(unsigned char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool lex_number(Lexer* lx, double* value, bool* integer) {
+    const unsigned char* p = lx->p;
+    bool negative = false;
+    if (p < lx->end && (*p == '+' || *p == '-')) negative = *p++ == '-';
+    double v = 0.0, scale = 1.0;
+    bool digits = false, fraction = false;
+    for (; p < lx->end; p++) {
+        if (*p == '.' && !fraction) {
+            fraction = true;
+        } else if (*p >= '0' && *p <= '9') {
+            digits = true;
+            if (fraction) {
+                scale /= 10.0;
+                v += (*p - '0') * scale;
+            } else {
+                v = v * 10.0 + (*p - '0');
+            }
+        } else {
+            break;
+        }
+    }
+    if (!digits && !fraction) return false;
+    lx->p = p;
+    *value = negative ? -v : v;
+    *integer = !fraction;
+    return true;
+}
+
+static PdfObject* lex_bytes(Lexer* lx, PdfType type, size_t capacity) {
+    PdfObject* obj = new_object(lx->arena, type);
+    if (!obj) return NULL;
+    obj->data = arena_alloc(lx->arena, capacity + 1);
+    if (!obj->data) return NULL;
+    return obj;
+}
+
+static PdfObject* lex_literal_string(Lexer* lx) {
+    const unsigned char* start = lx->p + 1;
+    const unsigned char* q = start;
+    int depth = 1;
+    while (q < lx->end) {
+        if (*q == '\\') {
+            q += 2;
+            continue;
+        }
+        if (*q == '(') depth++;
+        else if (*q == ')' && --depth == 0) break;
+        q++;
+    }
+    if (q > lx->end) q = lx->end;
+    PdfObject* obj = lex_bytes(lx, PDF_STRING, (size_t)(q - start));
+    if (!obj) return NULL;
+    size_t n = 0;
+    for (const unsigned char* p = start; p < q; p++) {
+        if (*p != '\\' || p + 1 >= q) {
+            obj->data[n++] = *p;
+            continue;
+        }
+        p++;
+        switch (*p) {
+            case 'n': obj->data[n++] = '\n'; break;
+            case 'r': obj->data[n++] = '\r'; break;
+            case 't': obj->data[n++] = '\t'; break;
+            case 'b': obj->data[n++] = '\b'; break;
+            case 'f': obj->data[n++] = '\f'; break;
+            case '\r':
+                if (p + 1 < q && p[1] == '\n') p++; // Line continuation.
+                break;
+            case '\n':
+                break;
+            default:
+                if (*p >= '0' && *p <= '7') {
+                    int code = 0;
+                    for (int k = 0; k < 3 && p < q && *p >= '0' && *p <= '7'; k++, p++) code = code * 8 + (*p - '0');
+                    p--;
+                    obj->data[n++] = (unsigned char)code;
+                } else {
+                    obj->data[n++] = *p;
+                }
+        }
+    }
+    obj->len = n;
+    lx->p = q < lx->end ? q + 1 : lx->end;
+    return obj;
+}
+
+static PdfObject* lex_hex_string(Lexer* lx) {
+    const unsigned char* start = lx->p + 1;
+    const unsigned char* q = memchr(start, '>', (size_t)(lx->end - start));
+    if (!q) q = lx->end;
+    PdfObject* obj = lex_bytes(lx, PDF_STRING, (size_t)(q - start) / 2 + 1);
+    if (!obj) return NULL;
+    int high = -1;
+    for (const unsigned char* p = start; p < q; p++) {
+        int v = hex_value(*p);
+        if (v < 0) continue;
+        if (high < 0) {
+            high = v;
+        } else {
+            obj->data[obj->len++] = (unsigned char)(high << 4 | v);
+            high = -1;
+        }
+    }
+    if (high >= 0) obj->data[obj->len++] = (unsigned char)(high << 4);
+    lx->p = q < lx->end ? q + 1 : lx->end;
+    return obj;
+}
+
+static PdfObject* lex_name(Lexer* lx) {
+    const unsigned char* start = ++lx->p;
+    while (lx->p < lx->end && is_regular(*lx->p)) lx->p++;
+    PdfObject* obj = lex_bytes(lx, PDF_NAME, (size_t)(lx->p - start));
+    if (!obj) return NULL;
+    for (const unsigned char* p = start; p < lx->p; p++) {
+        if (*p == '#' && p + 2 < lx->p && hex_value(p[1]) >= 0 && hex_value(p[2]) >= 0) {
+            obj->data[obj->len++] = (unsigned char)(hex_value(p[1]) << 4 | hex_value(p[2]));
+            p += 2;
+        } else {
+            obj->data[obj->len++] = *p;
+        }
+    }
+    return obj;
+}
+
+static PdfObject* parse_object(Lexer* lx, int depth);
+
+// Collects items into a temporary array, then copies it into the arena.
+static bool push_item(void** items, int* count, int* capacity, size_t item_size, const void* item) {
+    if (*count == *capacity) {
+        int grown_capacity = *capacity ? *capacity * 2 : 8;
+        void* grown = realloc(*items, (size_t)grown_capacity * item_size);
+        if (!grown) return false;
+        *items = grown;
+        *capacity = grown_capacity;
+    }
+    memcpy((char*)*items + (size_t)*count * item_size, item, item_size);
+    (*count)++;
+    return true;
+}
+
+static PdfObject* parse_array(Lexer* lx, int depth) {
+    lx->p++;
+    PdfObject** items = NULL;
+    int count = 0, capacity = 0;
+    for (;;) {
+        skip_space(lx);
+        if (lx->p >= lx->end) break;
+        if (*lx->p == ']') {
+            lx->p++;
+            break;
+        }
+        PdfObject* item = parse_object(lx, depth + 1);
+        if (!item || !push_item((void**)&items, &count, &capacity, sizeof(PdfObject*), &item)) break;
+    }
+    PdfObject* obj = new_object(lx->arena, PDF_ARRAY);
+    if (obj && count > 0) {
+        obj->items = arena_alloc(lx->arena, (size_t)count * sizeof(PdfObject*));
+        if (obj->items) {
+            memcpy(obj->items, items, (size_t)count * sizeof(PdfObject*));
+            obj->count = count;
+        }
+    }
+    free(items);
+    return obj;
+}
+
+static PdfObject* parse_dict(Lexer* lx, int depth) {
+    lx->p += 2;
+    PdfDictEntry* entries = NULL;
+    int count = 0, capacity = 0;
+    for (;;) {
+        skip_space(lx);
+        if (lx->p >= lx->end) break;
+        if (*lx->p == '>') {
+            lx->p += (lx->p + 1 < lx->end && lx->p[1] == '>') ? 2 : 1;
+            break;
+        }
+        PdfObject* key = parse_object(lx, depth + 1);
+        if (!key) break;
+        if (key->type != PDF_NAME) continue; // Skip junk until the next key.
+        skip_space(lx);
+        PdfObject* value = (lx->p < lx->end && *lx->p != '>') ? parse_object(lx, depth + 1) : &PDF_NULL_OBJECT;
+        if (!value) break;
+        PdfDictEntry entry = { (const char*)key->data, value };
+        if (!push_item((void**)&entries, &count, &capacity, sizeof(PdfDictEntry), &entry)) break;
+    }
+    PdfObject* obj = new_object(lx->arena, PDF_DICT);
+    if (obj && count > 0) {
+        obj->entries = arena_alloc(lx->arena, (size_t)count * sizeof(PdfDictEntry));
+        if (obj->entries) {
+            memcpy(obj->entries, entries, (size_t)count * sizeof(PdfDictEntry));
+            obj->count = count;
+        }
+    }
+    free(entries);
+    return obj;
+}
+
+// Parses one value; bare words come back as PDF_KEYWORD (operators in content streams).
+static PdfObject* parse_object(Lexer* lx, int depth) {
+    skip_space(lx);
+    if (lx->p >= lx->end || depth > PDF_MAX_NESTING) {
+        lx->p = lx->end;
+        return NULL;
+    }
+    unsigned char c = *lx->p;
+    if (c == '/') return lex_name(lx);
+    if (c == '(') return lex_literal_string(lx);
+    if (c == '[') return parse_array(lx, depth);
+    if (c == '<') {
+        if (lx->p + 1 < lx->end && lx->p[1] == '<') return parse_dict(lx, depth);
+        return lex_hex_string(lx);
+    }
+
+    double number;
+    bool integer;
+    if ((c == '+' || c == '-' || c == '.' || (c >= '0' && c <= '9')) && lex_number(lx, &number, &integer)) {
+        if (lx->allow_refs && integer && number >= 0) {
+            // `num gen R` is a reference; otherwise only the first number is consumed.
+            Lexer ahead = *lx;
+            double gen;
+            bool gen_integer;
+            skip_space(&ahead);
+            if (ahead.p < ahead.end && isdigit(*ahead.p) && lex_number(&ahead, &gen, &gen_integer) && gen_integer) {
+                skip_space(&ahead);
+                if (ahead.p < ahead.end && *ahead.p == 'R' && (ahead.p + 1 == ahead.end || !is_regular(ahead.p[1]))) {
+                    lx->p = ahead.p + 1;
+                    PdfObject* ref = new_object(lx->arena, PDF_REF);
+                    if (ref) {
+                        ref->num = number < PDF_MAX_OBJECTS ? (int)number : -1;
+                        ref->gen = (int)gen;
+                    }
+                    return ref;
+                }
+            }
+        }
+        PdfObject* obj = new_object(lx->arena, PDF_NUMBER);
+        if (obj) obj->number = number;
+        return obj;
+    }
+
+    const unsigned char* start = lx->p;
+    while (lx->p < lx->end && is_regular(*lx->p)) lx->p++;
+    if (lx->p == start) lx->p++; // Stray delimiter such as ')' or '{'.
+    size_t len = (size_t)(lx->p - start);
+    if (len == 4 && memcmp(start, "true", 4) == 0) {
+        PdfObject* obj = new_object(lx->arena, PDF_BOOL);
+        if (obj) obj->number = 1;
+        return obj;
+    }
+    if (len == 5 && memcmp(start, "false", 5) == 0) return new_object(lx->arena, PDF_BOOL);
+    if (len == 4 && memcmp(start, "null", 4) == 0) return new_object(lx->arena, PDF_NULL);
+    PdfObject* obj = lex_bytes(lx, PDF_KEYWORD, len);
+    if (obj) {
+        memcpy(obj->data, start, len);
+        obj->len = len;
+    }
+    return obj;
+}
+
+// --- Streams ---
+
+static const unsigned char* find_bytes(const unsigned char* p, const unsigned char* end, const char* needle) {
+    size_t n = strlen(needle);
+    while ((size_t)(end - p) >= n) {
+        const unsigned char* hit = memchr(p, needle[0], (size_t)(end - p) - n + 1);
+        if (!hit) return NULL;
+        if (memcmp(hit, needle, n) == 0) return hit;
+        p = hit + 1;
+    }
+    return NULL;
+}
+
+static unsigned char* inflate_data(const unsigned char* in, size_t in_len, size_t* out_len) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK) return NULL;
+    size_t capacity = in_len * 4 + 1024;
+    if (capacity > PDF_MAX_STREAM_SIZE) capacity = PDF_MAX_STREAM_SIZE;
+    unsigned char* out = malloc(capacity);
+    size_t len = 0;
+    zs.next_in = (Bytef*)in;
+    zs.avail_in = in_len > UINT32_MAX ? UINT32_MAX : (uInt)in_len;
+    while (out) {
+        if (len == capacity) {
+            if (capacity >= PDF_MAX_STREAM_SIZE) break;
+            capacity = capacity * 2 > PDF_MAX_STREAM_SIZE ? PDF_MAX_STREAM_SIZE : capacity * 2;
+            unsigned char* grown = realloc(out, capacity);
+            if (!grown) {
+                free(out);
+                out = NULL;
+                break;
+            }
+            out = grown;
+        }
+        zs.next_out = out + len;
+        zs.avail_out = (uInt)(capacity - len);
+        int ret = inflate(&zs, Z_NO_FLUSH);
+        len = capacity - zs.avail_out;
+        if (ret == Z_STREAM_END) break;
+        if (ret == Z_OK || (ret == Z_BUF_ERROR && zs.avail_out == 0)) continue;
+        // Truncated or damaged data: keep what was decoded, as viewers do.
+        if (len == 0) {
+            free(out);
+            out = NULL;
+        }
+        break;
+    }
+    inflateEnd(&zs);
+    *out_len = len;
+    return out;
+}
+
+static unsigned char* ascii_hex_decode(const unsigned char* in, size_t in_len, size_t* out_len) {
+    unsigned char* out = malloc(in_len / 2 + 1);
+    if (!out) return NULL;
+    size_t len = 0;
+    int high = -1;
+    for (size_t i = 0; i < in_len && in[i] != '>'; i++) {
+        int v = hex_value(in[i]);
+        if (v < 0) continue;
+        if (high < 0) {
+            high = v;
+        } else {
+            out[len++] = (unsigned char)(high << 4 | v);
+            high = -1;
+        }
+    }
+    if (high >= 0) out[len++] = (unsigned char)(high << 4);
+    *out_len = len;
+    return out;
+}
+
+static unsigned char* ascii85_decode(const unsigned char* in, size_t in_len, size_t* out_len) {
+    // No input byte yields more than four output bytes ('z' is four zeros).
+    if (in_len > (SIZE_MAX - 4) / 4) return NULL;
+    unsigned char* out = malloc(in_len * 4 + 4);
+    if (!out) return NULL;
+    size_t len = 0;
+    uint32_t tuple = 0;
+    int count = 0;
+    for (size_t i = 0; i < in_len; i++) {
+        unsigned char c = in[i];
+        if (c == '~') break;
+        if (is_space(c)) continue;
+        if (c == 'z' && count == 0) {
+            memset(out + len, 0, 4);
+            len += 4;
+            continue;
+        }
+        if (c < '!' || c > 'u') continue;
+        tuple = tuple * 85 + (uint32_t)(c - '!');
+        if (++count == 5) {
+            for (int k = 3; k >= 0; k--) out[len++] = (unsigned char)(tuple >> (8 * k));
+            tuple = 0;
+            count = 0;
+        }
+    }
+    if (count > 1) {
+        for (int k = count; k < 5; k++) tuple = tuple * 85 + 84;
+        for (int k = 0; k < count - 1; k++) out[len++] = (unsigned char)(tuple >> (8 * (3 - k)));
+    }
+    *out_len = len;
+    return out;
+}
+
+/**
+ * Decodes a stream through its filter chain. Returns a malloc'd buffer, or
+ * NULL when a filter is not supported (images codecs, LZW, predictors).
+ */
+static unsigned char* decode_stream(PdfDoc* doc, PdfObject* stream, size_t* out_len) {
+    if (!stream || stream->type != PDF_STREAM) return NULL;
+    PdfObject* filter = dict_get(doc, stream, "Filter");
+    PdfObject* params = dict_get(doc, stream, "DecodeParms");
+    PdfObject* filters[8];
+    int num_filters = 0;
+    if (filter && filter->type == PDF_NAME) {
+        filters[num_filters++] = filter;
+    } else if (filter && filter->type == PDF_ARRAY) {
+        for (int i = 0; i < filter->count && num_filters < 8; i++) {
+            PdfObject* f = resolve(doc, filter->items[i]);
+            if (f) filters[num_filters++] = f;
+        }
+    }
+    if (params && params->type == PDF_ARRAY) params = params->count > 0 ? resolve(doc, params->items[0]) : NULL;
+    if (number_or(dict_get(doc, params, "Predictor"), 1) > 1) return NULL;
+
+    unsigned char* data = malloc(stream->stream_len + 1);
+    if (!data) return NULL;
+    memcpy(data, stream->stream, stream->stream_len);
+    size_t len = stream->stream_len;
+    for (int i = 0; i < num_filters && data; i++) {
+        unsigned char* decoded = NULL;
+        size_t decoded_len = 0;
+        if (is_name(filters[i], "FlateDecode") || is_name(filters[i], "Fl")) {
+            decoded = inflate_data(data, len, &decoded_len);
+        } else if (is_name(filters[i], "ASCIIHexDecode") || is_name(filters[i], "AHx")) {
+            decoded = ascii_hex_decode(data, len, &decoded_len);
+        } else if (is_name(filters[i], "ASCII85Decode") || is_name(filters[i], "A85")) {
+            decoded = ascii85_decode(data, len, &decoded_len);
+        }
+        free(data);
+        data = decoded;
+        len = decoded_len;
+    }
+    *out_len = len;
+    return data;
+}
+
+// --- Document structure ---
+
+static bool set_object(PdfDoc* doc, int num, PdfObject* obj) {
+    if (num < 0 || num >= PDF_MAX_OBJECTS) return false;
+    if (num >= doc->num_objects) {
+        int capacity = doc->num_objects ? doc->num_objects : 256;
+        while (capacity <= num) capacity *= 2;
+        if (capacity > PDF_MAX_OBJECTS) capacity = PDF_MAX_OBJECTS;
+        PdfObject** grown = realloc(doc->objects, (size_t)capacity * sizeof(PdfObject*));
+        if (!grown) return false;
+        memset(grown + doc->num_objects, 0, (size_t)(capacity - doc->num_objects) * sizeof(PdfObject*));
+        doc->objects = grown;
+        doc->num_objects = capacity;
+    }
+    doc->objects[num] = obj;
+    return true;
+}
+
+// Reads the integer that ends just before `p` (exclusive), scanning backwards.
+static bool read_int_backwards(const unsigned char* start, const unsigned char** p, long* value) {
+    const unsigned char* q = *p;
+    while (q > start && is_space(q[-1])) q--;
+    const unsigned char* digits_end = q;
+    while (q > start && isdigit(q[-1])) q--;
+    if (q == digits_end || digits_end - q > 9) return false;
+    *value = strtol((const char*)q, NULL, 10);
+    *p = q;
+    return true;
+}
+
+// Attaches the stream data following a dictionary that ends at `p`.
+static const unsigned char* read_stream_data(PdfDoc* doc, PdfObject* dict, const unsigned char* p) {
+    const unsigned char* end = doc->data + doc->size;
+    if (p < end && *p == '\r') p++;
+    if (p < end && *p == '\n') p++;
+    const unsigned char* data = p;
+    PdfObject* length = NULL;
+    for (int i = 0; i < dict->count; i++) {
+        if (strcmp(dict->entries[i].key, "Length") == 0) length = dict->entries[i].value;
+    }
+    // Trust a direct /Length when `endstream` follows it; otherwise search for it.
+    const unsigned char* data_end = NULL;
+    if (length && length->type == PDF_NUMBER && length->number >= 0 && length->number <= (double)(end - data)) {
+        const unsigned char* q = data + (size_t)length->number;
+        const unsigned char* after = q;
+        while (after < end && is_space(*after)) after++;
+        if ((size_t)(end - after) >= 9 && memcmp(after, "endstream", 9) == 0) data_end = q;
+    }
+    const unsigned char* keyword = data_end ? NULL : find_bytes(data, end, "endstream");
+    if (keyword) {
+        data_end = keyword;
+        if (data_end > data && data_end[-1] == '\n') data_end--;
+        if (data_end > data && data_end[-1] == '\r') data_end--;
+    }
+    if (!data_end) data_end = end;
+    dict->type = PDF_STREAM;
+    dict->stream = data;
+    dict->stream_len = (size_t)(data_end - data);
+    return data_end;
+}
+
+// Finds every `N G obj` in the file and parses the object that follows it.
+static void scan_objects(PdfDoc* doc) {
+    const unsigned char* start = doc->data;
+    const unsigned char* end = doc->data + doc->size;
+    const unsigned char* p = start;
+    const unsigned char* hit;
+    while ((hit = find_bytes(p, end, "obj")) != NULL && !doc_cancelled(doc)) {
+        p = hit + 3;
+        if (p < end && is_regular(*p)) continue;
+        const unsigned char* q = hit;
+        long gen, num;
+        if (q == start || !is_space(q[-1])) continue;
+        if (!read_int_backwards(start, &q, &gen) || q == start || !is_space(q[-1])) continue;
+        if (!read_int_backwards(start, &q, &num)) continue;
+        if (q > start && is_regular(q[-1])) continue;
+
+        Lexer lx = { p, end, &doc->arena, true };
+        PdfObject* obj = parse_object(&lx, 0);
+        if (!obj) continue;
+        if (obj->type == PDF_DICT) {
+            Lexer ahead = lx;
+            skip_space(&ahead);
+            if ((size_t)(end - ahead.p) >= 6 && memcmp(ahead.p, "stream", 6) == 0) {
+                lx.p = read_stream_data(doc, obj, ahead.p + 6);
+            }
+        }
+        set_object(doc, (int)num, obj);
+        p = lx.p > p ? lx.p : p;
+    }
+}
+
+// Adds the objects packed in object streams, unless defined directly.
+static void load_object_streams(PdfDoc* doc) {
+    int count = doc->num_objects;
+    for (int i = 0; i < count && !doc_cancelled(doc); i++) {
+        PdfObject* stream = doc->objects[i];
+        if (!stream || stream->type != PDF_STREAM || !is_name(dict_get(doc, stream, "Type"), "ObjStm")) continue;
+        int n = (int)number_or(dict_get(doc, stream, "N"), 0);
+        double first = number_or(dict_get(doc, stream, "First"), -1);
+        size_t len;
+        unsigned char* data = decode_stream(doc, stream, &len);
+        if (!data) continue;
+        if (first >= 0 && first <= (double)len) {
+            Lexer header = { data, data + (size_t)first, &doc->arena, false };
+            for (int k = 0; k < n; k++) {
+                double num, offset;
+                bool integer;
+                skip_space(&header);
+                if (!lex_number(&header, &num, &integer)) break;
+                skip_space(&header);
+                if (!lex_number(&header, &offset, &integer)) break;
+                if (num < 0 || num >= PDF_MAX_OBJECTS || offset < 0 || (size_t)first + (size_t)offset >= len) continue;
+                if ((int)num < doc->num_objects && doc->objects[(int)num]) continue;
+                Lexer lx = { data + (size_t)first + (size_t)offset, data + len, &doc->arena, true };
+                PdfObject* obj = parse_object(&lx, 0);
+                if (obj) set_object(doc, (int)num, obj);
+            }
+        }
+        free(data);
+    }
+}
+
+// Finds the document catalog and whether the file is encrypted.
+static PdfObject* find_catalog(PdfDoc* doc, bool* encrypted) {
+    PdfObject* root = NULL;
+    const unsigned char* end = doc->data + doc->size;
+    const unsigned char* p = doc->data;
+    const unsigned char* hit;
+    while ((hit = find_bytes(p, end, "trailer")) != NULL) {
+        Lexer lx = { hit + 7, end, &doc->arena, true };
+        PdfObject* trailer = parse_object(&lx, 0);
+        if (trailer && trailer->type == PDF_DICT) {
+            if (dict_has(trailer, "Encrypt")) *encrypted = true;
+            PdfObject* candidate = dict_get(doc, trailer, "Root");
+            if (candidate) root = candidate;
+        }
+        p = hit + 7;
+    }
+    for (int i = 0; i < doc->num_objects; i++) {
+        PdfObject* obj = doc->objects[i];
+        if (!obj || obj->type != PDF_STREAM || !is_name(dict_get(doc, obj, "Type"), "XRef")) continue;
+        if (dict_has(obj, "Encrypt")) *encrypted = true;
+        if (!root) root = dict_get(doc, obj, "Root");
+    }
+    for (int i = 0; i < doc->num_objects && !root; i++) {
+        if (doc->objects[i] && is_name(dict_get(doc, doc->objects[i], "Type"), "Catalog")) root = doc->objects[i];
+    }
+    return root;
+}
+
+typedef struct {
+    PdfObject* page;
+    PdfObject* resources;           // Possibly inherited from an ancestor.
+} PageRef;
+
+typedef struct {
+    PageRef* pages;
+    int count, capacity;
+    PdfObject** parents;            // Intermediate nodes walked so far, so each is walked once.
+    int num_parents, parents_capacity;
+    int nodes;                      // Nodes visited, against PDF_MAX_PAGE_TREE_NODES.
+} PageList;
+
+static void collect_pages(PdfDoc* doc, PdfObject* node, PdfObject* resources, int depth, PageList* list) {
+    if (!node || depth > PDF_MAX_NESTING || list->count >= PDF_MAX_PAGES ||
+        ++list->nodes > PDF_MAX_PAGE_TREE_NODES || doc_cancelled(doc)) {
+        return;
+    }
+    PdfObject* own = dict_get(doc, node, "Resources");
+    if (own) resources = own;
+    PdfObject* kids = dict_get(doc, node, "Kids");
+    if (kids && kids->type == PDF_ARRAY) {
+        // A node reached again is a cycle or a shared subtree; either way its pages are already listed.
+        for (int i = 0; i < list->num_parents; i++) {
+            if (list->parents[i] == node) return;
+        }
+        if (!push_item((void**)&list->parents, &list->num_parents, &list->parents_capacity, sizeof(PdfObject*), &node)) {
+            return;
+        }
+        for (int i = 0; i < kids->count; i++) {
+            PdfObject* kid = resolve(doc, kids->items[i]);
+            if (kid) collect_pages(doc, kid, resources, depth + 1, list);
+        }
+        return;
+    }
+    if (!is_name(dict_get(doc, node, "Type"), "Page") && !dict_get(doc, node, "Contents")) return;
+    for (int i = 0; i < list->count; i++) {
+        if (list->pages[i].page == node) return; // Shared or cyclic kids.
+    }
+    PageRef ref = { node, resources };
+    push_item((void**)&list->pages, &list->count, &list->capacity, sizeof(PageRef), &ref);
+}
+
+// --- Fonts ---
+
+typedef struct {
+    uint32_t lo, hi;
+    uint8_t bytes;                  // Code length in bytes.
+    uint8_t dst_len;
+    uint16_t dst[6];                // UTF-16; the last unit is offset by (code - lo).
+} CMapEntry;
+
+typedef struct {
+    uint32_t lo, hi;
+    double width;
+} WidthRange;
+
+struct Font {
+    PdfObject* dict;
+    Font* next;
+    int code_bytes;                 // 1 for simple fonts, usually 2 for Type0.
+    bool codes_are_ucs2;            // Type0 with a UCS-2 encoding CMap.
+    uint32_t simple[256];           // Unicode per byte code, 0 if unknown.
+    double widths[256];             // Simple fonts, in 1/1000 text space units.
+    CMapEntry* cmap;
+    int cmap_count;
+    WidthRange* cid_widths;
+    int num_cid_widths;
+    double default_width;
+};
+
+static const uint16_t WIN_ANSI_80[32] = {
+    0x20AC, 0, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021, 0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0, 0x017D, 0,
+    0, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014, 0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0, 0x017E, 0x0178,
+};
+
+static const uint16_t MAC_ROMAN_80[128] = {
+    0xC4, 0xC5, 0xC7, 0xC9, 0xD1, 0xD6, 0xDC, 0xE1, 0xE0, 0xE2, 0xE4, 0xE3, 0xE5, 0xE7, 0xE9, 0xE8,
+    0xEA, 0xEB, 0xED, 0xEC, 0xEE, 0xEF, 0xF1, 0xF3, 0xF2, 0xF4, 0xF6, 0xF5, 0xFA, 0xF9, 0xFB, 0xFC,
+    0x2020, 0xB0, 0xA2, 0xA3, 0xA7, 0x2022, 0xB6, 0xDF, 0xAE, 0xA9, 0x2122, 0xB4, 0xA8, 0x2260, 0xC6, 0xD8,
+    0x221E, 0xB1, 0x2264, 0x2265, 0xA5, 0xB5, 0x2202, 0x2211, 0x220F, 0x3C0, 0x222B, 0xAA, 0xBA, 0x3A9, 0xE6, 0xF8,
+    0xBF, 0xA1, 0xAC, 0x221A, 0x192, 0x2248, 0x2206, 0xAB, 0xBB, 0x2026, 0xA0, 0xC0, 0xC3, 0xD5, 0x152, 0x153,
+    0x2013, 0x2014, 0x201C, 0x201D, 0x2018, 0x2019, 0xF7, 0x25CA, 0xFF, 0x178, 0x2044, 0x20AC, 0x2039, 0x203A, 0xFB01, 0xFB02,
+    0x2021, 0xB7, 0x201A, 0x201E, 0x2030, 0xC2, 0xCA, 0xC1, 0xCB, 0xC8, 0xCD, 0xCE, 0xCF, 0xCC, 0xD3, 0xD4,
+    0xF8FF, 0xD2, 0xDA, 0xDB, 0xD9, 0x131, 0x2C6, 0x2DC, 0xAF, 0x2D8, 0x2D9, 0x2DA, 0xB8, 0x2DD, 0x2DB, 0x2C7,
+};
+
+// StandardEncoding differs from ASCII in two quotes and an irregular upper half.
+static const uint16_t STANDARD_UPPER[][2] = {
+    { 0xA1, 0xA1 }, { 0xA2, 0xA2 }, { 0xA3, 0xA3 }, { 0xA4, 0x2044 }, { 0xA5, 0xA5 }, { 0xA6, 0x192 },
+    { 0xA7, 0xA7 }, { 0xA8, 0xA4 }, { 0xA9, 0x27 }, { 0xAA, 0x201C }, { 0xAB, 0xAB }, { 0xAC, 0x2039 },
+    { 0xAD, 0x203A }, { 0xAE, 0xFB01 }, { 0xAF, 0xFB02 }, { 0xB1, 0x2013 }, { 0xB2, 0x2020 }, { 0xB3, 0x2021 },
+    { 0xB4, 0xB7 }, { 0xB6, 0xB6 }, { 0xB7, 0x2022 }, { 0xB8, 0x201A }, { 0xB9, 0x201E }, { 0xBA, 0x201D },
+    { 0xBB, 0xBB }, { 0xBC, 0x2026 }, { 0xBD, 0x2030 }, { 0xBF, 0xBF }, { 0xC1, 0x60 }, { 0xC2, 0xB4 },
+    { 0xC3, 0x2C6 }, { 0xC4, 0x2DC }, { 0xC5, 0xAF }, { 0xC6, 0x2D8 }, { 0xC7, 0x2D9 }, { 0xC8, 0xA8 },
+    { 0xCA, 0x2DA }, { 0xCB, 0xB8 }, { 0xCD, 0x2DD }, { 0xCE, 0x2DB }, { 0xCF, 0x2C7 }, { 0xD0, 0x2014 },
+    { 0xE1, 0xC6 }, { 0xE3, 0xAA }, { 0xE8, 0x141 }, { 0xE9, 0xD8 }, { 0xEA, 0x152 }, { 0xEB, 0xBA },
+    { 0xF1, 0xE6 }, { 0xF5, 0x131 }, { 0xF8, 0x142 }, { 0xF9, 0xF8 }, { 0xFA, 0x153 }, { 0xFB, 0xDF },
+};
+
+// Glyph names of the printable ASCII range, starting at 0x20.
+static const char* const ASCII_GLYPHS[95] = {
+    "space", "exclam", "quotedbl", "numbersign", "dollar", "percent", "ampersand", "quotesingle",
+    "parenleft", "parenright", "asterisk", "plus", "comma", "hyphen", "period", "slash",
+    "zero", "one", "two", "three", "four", "five", "six", "seven", "eight", "nine",
+    "colon", "semicolon", "less", "equal", "greater", "question", "at",
+    "A", "B", "C", "D", "E", "F", "G", "H", "I", "J", "K", "L", "M", "N", "O", "P", "Q", "R", "S", "T",
+    "U", "V", "W", "X", "Y", "Z", "bracketleft", "backslash", "bracketright", "asciicircum", "underscore", "grave",
+    "a", "b", "c", "d", "e", "f", "g", "h", "i", "j", "k", "l", "m", "n", "o", "p", "q", "r", "s", "t",
+    "u", "v", "w", "x", "y", "z", "braceleft", "bar", "braceright", "asciitilde",
+};
+
+// Glyph names of the Latin-1 range, starting at 0xA1.
+static const char* const LATIN1_GLYPHS[95] = {
+    "exclamdown", "cent", "sterling", "currency", "yen", "brokenbar", "section", "dieresis", "copyright",
+    "ordfeminine", "guillemotleft", "logicalnot", "sfthyphen", "registered", "macron", "degree", "plusminus",
+    "twosuperior", "threesuperior", "acute", "mu", "paragraph", "periodcentered", "cedilla", "onesuperior",
+    "ordmasculine", "guillemotright", "onequarter", "onehalf", "threequarters", "questiondown",
+    "Agrave", "Aacute", "Acircumflex", "Atilde", "Adieresis", "Aring", "AE", "Ccedilla", "Egrave", "Eacute",
+    "Ecircumflex", "Edieresis", "Igrave", "Iacute", "Icircumflex", "Idieresis", "Eth", "Ntilde", "Ograve",
+    "Oacute", "Ocircumflex", "Otilde", "Odieresis", "multiply", "Oslash", "Ugrave", "Uacute", "Ucircumflex",
+    "Udieresis", "Yacute", "Thorn", "germandbls", "agrave", "aacute", "acircumflex", "atilde", "adieresis",
+    "aring", "ae", "ccedilla", "egrave", "eacute", "ecircumflex", "edieresis", "igrave", "iacute",
+    "icircumflex", "idieresis", "eth", "ntilde", "ograve", "oacute", "ocircumflex", "otilde", "odieresis",
+    "divide", "oslash", "ugrave", "uacute", "ucircumflex", "udieresis", "yacute", "thorn", "ydieresis",
+};
+
+static const struct { const char* name; uint16_t code; } OTHER_GLYPHS[] = {
+    { "quoteleft", 0x2018 }, { "quoteright", 0x2019 }, { "quotedblleft", 0x201C }, { "quotedblright", 0x201D },
+    { "quotesinglbase", 0x201A }, { "quotedblbase", 0x201E }, { "guilsinglleft", 0x2039 }, { "guilsinglright", 0x203A },
+    { "endash", 0x2013 }, { "emdash", 0x2014 }, { "bullet", 0x2022 }, { "ellipsis", 0x2026 },
+    { "dagger", 0x2020 }, { "daggerdbl", 0x2021 }, { "perthousand", 0x2030 }, { "trademark", 0x2122 },
+    { "minus", 0x2212 }, { "fraction", 0x2044 }, { "Euro", 0x20AC }, { "florin", 0x192 },
+    { "ff", 0xFB00 }, { "fi", 0xFB01 }, { "fl", 0xFB02 }, { "ffi", 0xFB03 }, { "ffl", 0xFB04 },
+    { "OE", 0x152 }, { "oe", 0x153 }, { "Scaron", 0x160 }, { "scaron", 0x161 }, { "Zcaron", 0x17D },
+    { "zcaron", 0x17E }, { "Ydieresis", 0x178 }, { "Lslash", 0x141 }, { "lslash", 0x142 }, { "dotlessi", 0x131 },
+    { "circumflex", 0x2C6 }, { "tilde", 0x2DC }, { "nbspace", 0xA0 }, { "nonbreakingspace", 0xA0 },
+    { "hyphenminus", 0x2D }, { "middot", 0xB7 }, { "quotereversed", 0x201B }, { "arrowright", 0x2192 },
+    { "arrowleft", 0x2190 }, { "lessequal", 0x2264 }, { "greaterequal", 0x2265 }, { "notequal", 0x2260 },
+    { "infinity", 0x221E }, { "approxequal", 0x2248 }, { "summation", 0x2211 }, { "product", 0x220F },
+    { "radical", 0x221A }, { "partialdiff", 0x2202 }, { "integral", 0x222B }, { "Omega", 0x3A9 }, { "pi", 0x3C0 },
+};
+
+static uint32_t glyph_to_unicode(const char* name) {
+    char base[64];
+    size_t len = strcspn(name, "."); // Variants such as "a.sc" or "one.oldstyle".
+    if (len == 0 || len >= sizeof(base)) return 0;
+    memcpy(base, name, len);
+    base[len] = '\0';
+    for (int i = 0; i < 95; i++) {
+        if (strcmp(base, ASCII_GLYPHS[i]) == 0) return (uint32_t)(0x20 + i);
+        if (strcmp(base, LATIN1_GLYPHS[i]) == 0) return (uint32_t)(0xA1 + i);
+    }
+    for (size_t i = 0; i < sizeof(OTHER_GLYPHS) / sizeof(OTHER_GLYPHS[0]); i++) {
+        if (strcmp(base, OTHER_GLYPHS[i].name) == 0) return OTHER_GLYPHS[i].code;
+    }
+    // uniXXXX and uXXXX[XX] name Unicode values directly.
+    const char* hex = NULL;
+    size_t digits = 0;
+    if (strncmp(base, "uni", 3) == 0 && len >= 7) {
+        hex = base + 3;
+        digits = 4;
+    } else if (base[0] == 'u' && len >= 5 && len <= 7) {
+        hex = base + 1;
+        digits = len - 1;
+    }
+    uint32_t value = 0;
+    for (size_t i = 0; hex && i < digits; i++) {
+        int v = hex_value((unsigned char)hex[i]);
+        if (v < 0) return 0;
+        value = value << 4 | (uint32_t)v;
+    }
+    return value;
+}
+
+static void set_base_encoding(Font* font, const PdfObject* name) {
+    for (int c = 0x20; c < 0x7F; c++) font->simple[c] = (uint32_t)c;
+    if (is_name(name, "MacRomanEncoding")) {
+        for (int c = 0x80; c < 0x100; c++) font->simple[c] = MAC_ROMAN_80[c - 0x80];
+    } else if (is_name(name, "StandardEncoding")) {
+        font->simple['\''] = 0x2019;
+        font->simple['`'] = 0x2018;
+        for (size_t i = 0; i < sizeof(STANDARD_UPPER) / sizeof(STANDARD_UPPER[0]); i++) {
+            font->simple[STANDARD_UPPER[i][0]] = STANDARD_UPPER[i][1];
+        }
+    } else {
+        for (int c = 0x80; c < 0xA0; c++) font->simple[c] = WIN_ANSI_80[c - 0x80];
+        for (int c = 0xA0; c < 0x100; c++) font->simple[c] = (uint32_t)c;
+    }
+}
+
+static int compare_cmap(const void* a, const void* b) {
+    const CMapEntry* x = a;
+    const CMapEntry* y = b;
+    if (x->bytes != y->bytes) return x->bytes < y->bytes ? -1 : 1;
+    return x->lo < y->lo ? -1 : x->lo > y->lo ? 1 : 0;
+}
+
+static uint32_t code_value(const PdfObject* str) {
+    uint32_t value = 0;
+    for (size_t i = 0; i < str->len && i < 4; i++) value = value << 8 | str->data[i];
+    return value;
+}
+
+static bool add_cmap_entry(CMapEntry** entries, int* count, int* capacity, const PdfObject* lo, uint32_t hi,
+                           const PdfObject* dst) {
+    if (!lo || lo->type != PDF_STRING || lo->len == 0 || lo->len > 4) return true;
+    CMapEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.lo = code_value(lo);
+    entry.hi = hi < entry.lo ? entry.lo : hi;
+    entry.bytes = (uint8_t)lo->len;
+    if (dst->type == PDF_STRING) {
+        for (size_t i = 0; i + 1 < dst->len && entry.dst_len < 6; i += 2) {
+            entry.dst[entry.dst_len++] = (uint16_t)(dst->data[i] << 8 | dst->data[i + 1]);
+        }
+    } else if (dst->type == PDF_NAME) {
+        uint32_t u = glyph_to_unicode((const char*)dst->data);
+        if (u && u < 0x10000) entry.dst[entry.dst_len++] = (uint16_t)u;
+    }
+    if (entry.dst_len == 0) return true;
+    return push_item((void**)entries, count, capacity, sizeof(CMapEntry), &entry);
+}
+
+// Reads codespace ranges, bfchar and bfrange sections of a ToUnicode CMap.
+static void parse_to_unicode(PdfDoc* doc, Font* font, const unsigned char* data, size_t len) {
+    Arena arena = { NULL, false };
+    Lexer lx = { data, data + len, &arena, false };
+    CMapEntry* entries = NULL;
+    int count = 0, capacity = 0;
+    PdfObject* operands[3];
+    int num_operands = 0;
+    enum { NONE, CODESPACE, BFCHAR, BFRANGE } section = NONE;
+    bool ok = true;
+    PdfObject* obj;
+    while (ok && (obj = parse_object(&lx, 0)) != NULL) {
+        if (obj->type == PDF_KEYWORD) {
+            const char* word = (const char*)obj->data;
+            if (strcmp(word, "begincodespacerange") == 0) section = CODESPACE;
+            else if (strcmp(word, "beginbfchar") == 0) section = BFCHAR;
+            else if (strcmp(word, "beginbfrange") == 0) section = BFRANGE;
+            else if (strncmp(word, "end", 3) == 0) section = NONE;
+            num_operands = 0;
+            arena_reset(&arena);
+            continue;
+        }
+        if (section == NONE) {
+            arena_reset(&arena);
+            continue;
+        }
+        operands[num_operands++] = obj;
+        if (section == CODESPACE && num_operands == 2) {
+            if (operands[0]->type == PDF_STRING && operands[0]->len > 0 && operands[0]->len <= 4) {
+                font->code_bytes = (int)operands[0]->len;
+            }
+            num_operands = 0;
+        } else if (section == BFCHAR && num_operands == 2) {
+            ok = add_cmap_entry(&entries, &count, &capacity, operands[0],
+                                operands[0]->type == PDF_STRING ? code_value(operands[0]) : 0, operands[1]);
+            num_operands = 0;
+        } else if (section == BFRANGE && num_operands == 3) {
+            PdfObject* lo = operands[0];
+            PdfObject* hi = operands[1];
+            PdfObject* dst = operands[2];
+            if (lo->type == PDF_STRING && hi->type == PDF_STRING && code_value(hi) >= code_value(lo) &&
+                code_value(hi) - code_value(lo) <= 0xFFFF) {
+                if (dst->type == PDF_ARRAY) {
+                    // One destination per code: expand into single-code entries.
+                    for (int i = 0; ok && i < dst->count && (uint32_t)i <= code_value(hi) - code_value(lo); i++) {
+                        PdfObject single = *lo;
+                        unsigned char bytes[4];
+                        uint32_t code = code_value(lo) + (uint32_t)i;
+                        for (size_t k = 0; k < lo->len; k++) bytes[k] = (unsigned char)(code >> (8 * (lo->len - 1 - k)));
+                        single.data = bytes;
+                        ok = add_cmap_entry(&entries, &count, &capacity, &single, code, dst->items[i]);
+                    }
+                } else {
+                    ok = add_cmap_entry(&entries, &count, &capacity, lo, code_value(hi), dst);
+                }
+            }
+            num_operands = 0;
+        }
+        if (num_operands == 0) arena_reset(&arena);
+    }
+    arena_free(&arena);
+    if (count > 0) {
+        font->cmap = arena_alloc(&doc->arena, (size_t)count * sizeof(CMapEntry));
+        if (font->cmap) {
+            memcpy(font->cmap, entries, (size_t)count * sizeof(CMapEntry));
+            font->cmap_count = count;
+            qsort(font->cmap, (size_t)count, sizeof(CMapEntry), compare_cmap);
+        }
+    }
+    free(entries);
+}
+
+static int compare_widths(const void* a, const void* b) {
+    const WidthRange* x = a;
+    const WidthRange* y = b;
+    return x->lo < y->lo ? -1 : x->lo > y->lo ? 1 : 0;
+}
+
+// Reads a CIDFont /W array: `c [w1 w2 ...]` or `c_first c_last w`.
+static void parse_cid_widths(PdfDoc* doc, Font* font, PdfObject* w) {
+    WidthRange* ranges = NULL;
+    int count = 0, capacity = 0;
+    for (int i = 0; w && i < w->count; ) {
+        PdfObject* first = resolve(doc, w->items[i]);
+        PdfObject* next = i + 1 < w->count ? resolve(doc, w->items[i + 1]) : NULL;
+        if (!first || first->type != PDF_NUMBER || !next) break;
+        if (next->type == PDF_ARRAY) {
+            for (int k = 0; k < next->count; k++) {
+                WidthRange range = { (uint32_t)first->number + (uint32_t)k, (uint32_t)first->number + (uint32_t)k,
+                                     number_or(resolve(doc, next->items[k]), font->default_width) };
+                if (!push_item((void**)&ranges, &count, &capacity, sizeof(WidthRange), &range)) break;
+            }
+            i += 2;
+        } else {
+            PdfObject* width = i + 2 < w->count ? resolve(doc, w->items[i + 2]) : NULL;
+            if (next->type != PDF_NUMBER || !width) break;
+            WidthRange range = { (uint32_t)first->number, (uint32_t)next->number, number_or(width, font->default_width) };
+            if (!push_item((void**)&ranges, &count, &capacity, sizeof(WidthRange), &range)) break;
+            i += 3;
+        }
+    }
+    if (count > 0) {
+        font->cid_widths = arena_alloc(&doc->arena, (size_t)count * sizeof(WidthRange));
+        if (font->cid_widths) {
+            memcpy(font->cid_widths, ranges, (size_t)count * sizeof(WidthRange));
+            font->num_cid_widths = count;
+            qsort(font->cid_widths, (size_t)count, sizeof(WidthRange), compare_widths);
+        }
+    }
+    free(ranges);
+}
+
+static Font* load_font(PdfDoc* doc, PdfObject* dict) {
+    for (Font* font = doc->fonts; font; font = font->next) {
+        if (font->dict == dict) return font;
+    }
+    Font* font = arena_alloc(&doc->arena, sizeof(Font));
+    if (!font) return doc->default_font;
+    font->dict = dict;
+    font->next = doc->fonts;
+    doc->fonts = font;
+    font->code_bytes = 1;
+    font->default_width = 500;
+
+    if (is_name(dict_get(doc, dict, "Subtype"), "Type0")) {
+        font->code_bytes = 2;
+        font->default_width = 1000;
+        PdfObject* encoding = dict_get(doc, dict, "Encoding");
+        if (encoding && encoding->type == PDF_NAME &&
+            (strstr((const char*)encoding->data, "UCS2") || strstr((const char*)encoding->data, "UTF16"))) {
+            font->codes_are_ucs2 = true;
+        }
+        PdfObject* descendants = dict_get(doc, dict, "DescendantFonts");
+        PdfObject* cid_font = descendants && descendants->type == PDF_ARRAY && descendants->count > 0
+                                  ? resolve(doc, descendants->items[0]) : NULL;
+        font->default_width = number_or(dict_get(doc, cid_font, "DW"), 1000);
+        PdfObject* w = dict_get(doc, cid_font, "W");
+        if (w && w->type == PDF_ARRAY) parse_cid_widths(doc, font, w);
+    } else {
+        PdfObject* encoding = dict_get(doc, dict, "Encoding");
+        set_base_encoding(font, encoding && encoding->type == PDF_DICT ? dict_get(doc, encoding, "BaseEncoding") : encoding);
+        PdfObject* differences = encoding && encoding->type == PDF_DICT ? dict_get(doc, encoding, "Differences") : NULL;
+        int code = 0;
+        for (int i = 0; differences && differences->type == PDF_ARRAY && i < differences->count; i++) {
+            PdfObject* item = resolve(doc, differences->items[i]);
+            if (!item) continue;
+            if (item->type == PDF_NUMBER) {
+                code = (int)item->number;
+            } else if (item->type == PDF_NAME && code >= 0 && code < 256) {
+                font->simple[code++] = glyph_to_unicode((const char*)item->data);
+            }
+        }
+        PdfObject* descriptor = dict_get(doc, dict, "FontDescriptor");
+        double missing = number_or(dict_get(doc, descriptor, "MissingWidth"), 0);
+        int first_char = (int)number_or(dict_get(doc, dict, "FirstChar"), 0);
+        PdfObject* widths = dict_get(doc, dict, "Widths");
+        for (int c = 0; c < 256; c++) font->widths[c] = widths ? missing : font->default_width;
+        for (int i = 0; widths && widths->type == PDF_ARRAY && i < widths->count; i++) {
+            if (first_char + i >= 0 && first_char + i < 256) {
+                font->widths[first_char + i] = number_or(resolve(doc, widths->items[i]), missing);
+            }
+        }
+        // Type3 glyph widths are in glyph space; scale them by the font matrix.
+        PdfObject* matrix = dict_get(doc, dict, "FontMatrix");
+        if (matrix && matrix->type == PDF_ARRAY && matrix->count >= 1) {
+            double scale = number_or(resolve(doc, matrix->items[0]), 0.001) * 1000.0;
+            for (int c = 0; c < 256; c++) font->widths[c] *= scale;
+        }
+    }
+
+    PdfObject* to_unicode = dict_get(doc, dict, "ToUnicode");
+    if (to_unicode && to_unicode->type == PDF_STREAM) {
+        size_t len;
+        unsigned char* cmap = decode_stream(doc, to_unicode, &len);
+        if (cmap) {
+            parse_to_unicode(doc, font, cmap, len);
+            free(cmap);
+        }
+    }
+    return font;
+}
+
+static double glyph_width(const Font* font, uint32_t code) {
+    if (font->code_bytes == 1 && code < 256 && !font->num_cid_widths) return font->widths[code];
+    int lo = 0, hi = font->num_cid_widths - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        const WidthRange* range = &font->cid_widths[mid];
+        if (code < range->lo) hi = mid - 1;
+        else if (code > range->hi) lo = mid + 1;
+        else return range->width;
+    }
+    return font->default_width;
+}
+
+// --- Text output ---
+
+typedef struct {
+    char* data;
+    size_t size;
+    size_t capacity;
+    bool failed;
+} TextBuffer;
+
+static void text_append(TextBuffer* buf, const char* data, size_t len) {
+    if (buf->failed) return;
+    if (buf->size + len + 1 > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 16384;
+        while (capacity < buf->size + len + 1) capacity *= 2;
+        char* grown = realloc(buf->data, capacity);
+        if (!grown) {
+            buf->failed = true;
+            return;
+        }
+        buf->data = grown;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->size, data, len);
+    buf->size += len;
+    buf->data[buf->size] = '\0';
+}
+
+static char last_char(const TextBuffer* buf) {
+    return buf->size ? buf->data[buf->size - 1] : '\n';
+}
+
+static void append_newline(TextBuffer* buf, bool paragraph) {
+    while (buf->size && last_char(buf) == ' ') buf->data[--buf->size] = '\0';
+    bool blank = buf->size >= 2 && buf->data[buf->size - 1] == '\n' && buf->data[buf->size - 2] == '\n';
+    if (last_char(buf) != '\n') text_append(buf, "\n", 1);
+    if (paragraph && !blank && buf->size) text_append(buf, "\n", 1);
+}
+
+typedef struct {
+    double a, b, c, d, e, f;
+} Matrix;
+
+static const Matrix IDENTITY = { 1, 0, 0, 1, 0, 0 };
+
+static Matrix matrix_multiply(Matrix m, Matrix n) {
+    Matrix r = {
+        m.a * n.a + m.b * n.c, m.a * n.b + m.b * n.d,
+        m.c * n.a + m.d * n.c, m.c * n.b + m.d * n.d,
+        m.e * n.a + m.f * n.c + n.e, m.e * n.b + m.f * n.d + n.f,
+    };
+    return r;
+}
+
+typedef struct {
+    Matrix ctm;
+    Font* font;
+    double font_size, char_spacing, word_spacing, horizontal_scale, leading, rise;
+} GraphicsState;
+
+typedef struct {
+    PdfDoc* doc;
+    TextBuffer* out;
+    GraphicsState gs;
+    GraphicsState stack[PDF_MAX_GSTATE_DEPTH];
+    int depth;
+    Matrix tm, tlm;
+    bool have_last;                 // Position of the end of the last shown text, in device space.
+    double last_x, last_y, last_size;
+    size_t page_chars;
+} Interpreter;
+
+static void emit_codepoint(Interpreter* in, uint32_t u) {
+    static const char* const LIGATURES[] = { "ff", "fi", "fl", "ffi", "ffl" };
+    char utf8[4];
+    size_t len;
+    if (u >= 0xFB00 && u <= 0xFB04) {
+        text_append(in->out, LIGATURES[u - 0xFB00], strlen(LIGATURES[u - 0xFB00]));
+        in->page_chars += 2;
+        return;
+    }
+    if (u == 0xA0 || u == '\t') u = ' ';
+    if (u < 0x20 || u == 0xFFFD || (u >= 0xD800 && u <= 0xDFFF)) return;
+    if (u == ' ') {
+        if (last_char(in->out) != ' ' && last_char(in->out) != '\n') text_append(in->out, " ", 1);
+        return;
+    }
+    if (u < 0x80) {
+        utf8[0] = (char)u;
+        len = 1;
+    } else if (u < 0x800) {
+        utf8[0] = (char)(0xC0 | u >> 6);
+        utf8[1] = (char)(0x80 | (u & 0x3F));
+        len = 2;
+    } else if (u < 0x10000) {
+        utf8[0] = (char)(0xE0 | u >> 12);
+        utf8[1] = (char)(0x80 | (u >> 6 & 0x3F));
+        utf8[2] = (char)(0x80 | (u & 0x3F));
+        len = 3;
+    } else {
+        utf8[0] = (char)(0xF0 | u >> 18);
+        utf8[1] = (char)(0x80 | (u >> 12 & 0x3F));
+        utf8[2] = (char)(0x80 | (u >> 6 & 0x3F));
+        utf8[3] = (char)(0x80 | (u & 0x3F));
+        len = 4;
+    }
+    text_append(in->out, utf8, len);
+    in->page_chars++;
+}
+
+static void emit_utf16(Interpreter* in, const uint16_t* units, int count) {
+    for (int i = 0; i < count; i++) {
+        uint32_t u = units[i];
+        if (u >= 0xD800 && u <= 0xDBFF && i + 1 < count && units[i + 1] >= 0xDC00 && units[i + 1] <= 0xDFFF) {
+            u = 0x10000 + ((u - 0xD800) << 10) + (units[i + 1] - 0xDC00);
+            i++;
+        }
+        emit_codepoint(in, u);
+    }
+}
+
+// Maps one character code to Unicode and emits it. Returns false if unmapped.
+static bool emit_code(Interpreter* in, const Font* font, uint32_t code, int bytes) {
+    // Find the last entry starting at or before the code, then check that it covers it.
+    int lo = 0, hi = font->cmap_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        const CMapEntry* entry = &font->cmap[mid];
+        if (entry->bytes < bytes || (entry->bytes == bytes && entry->lo <= code)) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo > 0) {
+        const CMapEntry* entry = &font->cmap[lo - 1];
+        if (entry->bytes == bytes && code <= entry->hi) {
+            uint16_t units[6];
+            memcpy(units, entry->dst, sizeof(units));
+            units[entry->dst_len - 1] = (uint16_t)(units[entry->dst_len - 1] + (code - entry->lo));
+            emit_utf16(in, units, entry->dst_len);
+            return true;
+        }
+    }
+    if (font->codes_are_ucs2) {
+        emit_codepoint(in, code);
+        return true;
+    }
+    if (bytes == 1 && font->simple[code]) {
+        emit_codepoint(in, font->simple[code]);
+        return true;
+    }
+    return code == ' ' && bytes == 1;
+}
+
+// Text rendering matrix position, in device space.
+static void text_position(const Interpreter* in, double* x, double* y, double* size) {
+    Matrix m = matrix_multiply(in->tm, in->gs.ctm);
+    *x = m.e;
+    *y = m.f;
+    *size = fabs(in->gs.font_size) * hypot(m.c, m.d);
+    if (*size < 0.01) *size = fabs(in->gs.font_size) > 0 ? fabs(in->gs.font_size) : 1.0;
+}
+
+// Inserts a line break or space when the pen moved since the last text.
+static void break_if_moved(Interpreter* in) {
+    double x, y, size;
+    text_position(in, &x, &y, &size);
+    if (!in->have_last) return;
+    double reference = size > in->last_size ? size : in->last_size;
+    double dy = fabs(y - in->last_y);
+    if (dy > 0.5 * reference) {
+        append_newline(in->out, dy > 2.0 * reference);
+    } else if (fabs(x - in->last_x) > 0.15 * reference) {
+        if (last_char(in->out) != ' ' && last_char(in->out) != '\n') text_append(in->out, " ", 1);
+    }
+}
+
+static void show_text(Interpreter* in, const PdfObject* str) {
+    if (!str || str->type != PDF_STRING) return;
+    const Font* font = in->gs.font ? in->gs.font : in->doc->default_font;
+    break_if_moved(in);
+    int bytes = font->code_bytes;
+    for (size_t i = 0; i + (size_t)bytes <= str->len; i += (size_t)bytes) {
+        uint32_t code = 0;
+        for (int k = 0; k < bytes; k++) code = code << 8 | str->data[i + (size_t)k];
+        in->doc->glyphs++;
+        if (!emit_code(in, font, code, bytes)) in->doc->unmapped++;
+        double advance = glyph_width(font, code) / 1000.0 * in->gs.font_size + in->gs.char_spacing;
+        if (bytes == 1 && code == ' ') advance += in->gs.word_spacing;
+        advance *= in->gs.horizontal_scale;
+        in->tm.e += advance * in->tm.a;
+        in->tm.f += advance * in->tm.b;
+    }
+    double x, y, size;
+    text_position(in, &x, &y, &size);
+    in->have_last = true;
+    in->last_x = x;
+    in->last_y = y;
+    in->last_size = size;
+}
+
+static void move_line(Interpreter* in, double tx, double ty) {
+    Matrix translate = { 1, 0, 0, 1, tx, ty };
+    in->tlm = matrix_multiply(translate, in->tlm);
+    in->tm = in->tlm;
+}
+
+static PdfObject* resource(PdfDoc* doc, PdfObject* resources, const char* category, const PdfObject* name) {
+    if (!name || name->type != PDF_NAME) return NULL;
+    return dict_get(doc, dict_get(doc, resources, category), (const char*)name->data);
+}
+
+static void run_content(Interpreter* in, const unsigned char* data, size_t len, PdfObject* resources, int form_depth);
+
+static void run_form(Interpreter* in, PdfObject* form, int form_depth) {
+    if (form_depth >= PDF_MAX_FORM_DEPTH || !form || form->type != PDF_STREAM ||
+        !is_name(dict_get(in->doc, form, "Subtype"), "Form")) {
+        return;
+    }
+    size_t len;
+    unsigned char* data = decode_stream(in->doc, form, &len);
+    if (!data) return;
+    GraphicsState saved = in->gs;
+    Matrix saved_tm = in->tm, saved_tlm = in->tlm;
+    PdfObject* matrix = dict_get(in->doc, form, "Matrix");
+    if (matrix && matrix->type == PDF_ARRAY && matrix->count == 6) {
+        Matrix m;
+        double* v[6] = { &m.a, &m.b, &m.c, &m.d, &m.e, &m.f };
+        for (int i = 0; i < 6; i++) *v[i] = number_or(resolve(in->doc, matrix->items[i]), 0);
+        in->gs.ctm = matrix_multiply(m, in->gs.ctm);
+    }
+    int saved_depth = in->depth;
+    run_content(in, data, len, dict_get(in->doc, form, "Resources"), form_depth + 1);
+    in->depth = saved_depth;
+    in->gs = saved;
+    in->tm = saved_tm;
+    in->tlm = saved_tlm;
+    free(data);
+}
+
+// Interprets the text-related operators of a content stream.
+static void run_content(Interpreter* in, const unsigned char* data, size_t len, PdfObject* resources, int form_depth) {
+    PdfDoc* doc = in->doc;
+    Arena* scratch = &doc->scratch;
+    Lexer lx = { data, data + len, scratch, false };
+    PdfObject* ops[PDF_MAX_OPERANDS];
+    int n = 0;
+    PdfObject* obj;
+    while (!doc_cancelled(doc) && (obj = parse_object(&lx, 0)) != NULL) {
+        if (obj->type != PDF_KEYWORD) {
+            if (n < PDF_MAX_OPERANDS) ops[n++] = obj;
+            continue;
+        }
+        const char* op = (const char*)obj->data;
+        double v[6] = { 0 };
+        for (int i = 0; i < n && i < 6; i++) v[i] = number_or(ops[i], 0);
+
+        if (strcmp(op, "BT") == 0) {
+            in->tm = in->tlm = IDENTITY;
+        } else if (strcmp(op, "Tf") == 0 && n >= 2) {
+            PdfObject* font = resource(doc, resources, "Font", ops[0]);
+            in->gs.font = font ? load_font(doc, font) : NULL;
+            in->gs.font_size = v[1];
+        } else if (strcmp(op, "Td") == 0 && n >= 2) {
+            move_line(in, v[0], v[1]);
+        } else if (strcmp(op, "TD") == 0 && n >= 2) {
+            in->gs.leading = -v[1];
+            move_line(in, v[0], v[1]);
+        } else if (strcmp(op, "Tm") == 0 && n >= 6) {
+            Matrix m = { v[0], v[1], v[2], v[3], v[4], v[5] };
+            in->tm = in->tlm = m;
+        } else if (strcmp(op, "T*") == 0) {
+            move_line(in, 0, -in->gs.leading);
+        } else if (strcmp(op, "Tj") == 0 && n >= 1) {
+            show_text(in, ops[n - 1]);
+        } else if (strcmp(op, "'") == 0 && n >= 1) {
+            move_line(in, 0, -in->gs.leading);
+            show_text(in, ops[n - 1]);
+        } else if (strcmp(op, "\"") == 0 && n >= 3) {
+            in->gs.word_spacing = v[0];
+            in->gs.char_spacing = v[1];
+            move_line(in, 0, -in->gs.leading);
+            show_text(in, ops[2]);
+        } else if (strcmp(op, "TJ") == 0 && n >= 1 && ops[n - 1]->type == PDF_ARRAY) {
+            PdfObject* array = ops[n - 1];
+            for (int i = 0; i < array->count; i++) {
+                PdfObject* item = array->items[i];
+                if (item->type == PDF_STRING) {
+                    show_text(in, item);
+                } else if (item->type == PDF_NUMBER) {
+                    double advance = -item->number / 1000.0 * in->gs.font_size * in->gs.horizontal_scale;
+                    in->tm.e += advance * in->tm.a;
+                    in->tm.f += advance * in->tm.b;
+                }
+            }
+        } else if (strcmp(op, "Tc") == 0 && n >= 1) {
+            in->gs.char_spacing = v[0];
+        } else if (strcmp(op, "Tw") == 0 && n >= 1) {
+            in->gs.word_spacing = v[0];
+        } else if (strcmp(op, "Tz") == 0 && n >= 1) {
+            in->gs.horizontal_scale = v[0] / 100.0;
+        } else if (strcmp(op, "TL") == 0 && n >= 1) {
+            in->gs.leading = v[0];
+        } else if (strcmp(op, "Ts") == 0 && n >= 1) {
+            in->gs.rise = v[0];
+        } else if (strcmp(op, "q") == 0) {
+            if (in->depth < PDF_MAX_GSTATE_DEPTH) in->stack[in->depth++] = in->gs;
+        } else if (strcmp(op, "Q") == 0) {
+            if (in->depth > 0) in->gs = in->stack[--in->depth];
+        } else if (strcmp(op, "cm") == 0 && n >= 6) {
+            Matrix m = { v[0], v[1], v[2], v[3], v[4], v[5] };
+            in->gs.ctm = matrix_multiply(m, in->gs.ctm);
+        } else if (strcmp(op, "Do") == 0 && n >= 1) {
+            run_form(in, resource(doc, resources, "XObject", ops[0]), form_depth);
+        } else if (strcmp(op, "ID") == 0) {
+            // Inline image data runs until whitespace, "EI", whitespace.
+            const unsigned char* p = lx.p + 1;
+            const unsigned char* hit;
+            while ((hit = find_bytes(p, lx.end, "EI")) != NULL) {
+                if (is_space(hit[-1]) && (hit + 2 == lx.end || is_space(hit[2]))) break;
+                p = hit + 2;
+            }
+            lx.p = hit ? hit + 2 : lx.end;
+        }
+        n = 0;
+        arena_reset(scratch);
+    }
+    arena_reset(scratch);
+}
+
+static void extract_page(Interpreter* in, PageRef* page) {
+    PdfDoc* doc = in->doc;
+    PdfObject* contents = dict_get(doc, page->page, "Contents");
+    PdfObject* single[1] = { contents };
+    PdfObject** streams = single;
+    int count = contents ? 1 : 0;
+    if (contents && contents->type == PDF_ARRAY) {
+        streams = contents->items;
+        count = contents->count;
+    }
+    // The page's content streams form one continuous stream.
+    TextBuffer joined = { 0 };
+    for (int i = 0; i < count; i++) {
+        size_t len;
+        unsigned char* data = decode_stream(doc, resolve(doc, streams[i]), &len);
+        if (!data) continue;
+        text_append(&joined, (const char*)data, len);
+        text_append(&joined, "\n", 1);
+        free(data);
+    }
+    memset(&in->gs, 0, sizeof(in->gs));
+    in->gs.ctm = IDENTITY;
+    in->gs.horizontal_scale = 1.0;
+    in->depth = 0;
+    in->tm = in->tlm = IDENTITY;
+    in->have_last = false;
+    if (joined.data) run_content(in, (const unsigned char*)joined.data, joined.size, page->resources, 0);
+    free(joined.data);
+}
+
+// Extraction stops early, declining the document, once `*cancel` is set.
+static bool extract_text(const unsigned char* data, size_t size, const int* cancel, PdfTextResult* result) {
+    memset(result, 0, sizeof(*result));
+    if (size < 8 || !find_bytes(data, data + (size < 1024 ? size : 1024), "%PDF-")) {
+        result->reason = "not a PDF file";
+        return false;
+    }
+    PdfDoc* doc = calloc(1, sizeof(PdfDoc));
+    if (!doc) return false;
+    doc->data = data;
+    doc->size = size;
+    doc->cancel = cancel;
+    TextBuffer out = { 0 };
+    PageList pages = { 0 };
+    bool encrypted = false;
+    bool ok = false;
+    Font fallback;
+
+    scan_objects(doc);
+    load_object_streams(doc);
+    PdfObject* catalog = find_catalog(doc, &encrypted);
+    if (encrypted) {
+        result->reason = "the document is encrypted";
+        goto cleanup;
+    }
+    collect_pages(doc, dict_get(doc, catalog, "Pages"), NULL, 0, &pages);
+    if (pages.count == 0) {
+        for (int i = 0; i < doc->num_objects && pages.count < PDF_MAX_PAGES; i++) {
+            if (doc->objects[i] && is_name(dict_get(doc, doc->objects[i], "Type"), "Page")) {
+                PageRef ref = { doc->objects[i], dict_get(doc, doc->objects[i], "Resources") };
+                push_item((void**)&pages.pages, &pages.count, &pages.capacity, sizeof(PageRef), &ref);
+            }
+        }
+    }
+    if (pages.count == 0 || doc->arena.failed) {
+        result->reason = "no pages were found";
+        goto cleanup;
+    }
+
+    // Text shown without a usable font is read as WinAnsi.
+    memset(&fallback, 0, sizeof(fallback));
+    fallback.code_bytes = 1;
+    fallback.default_width = 500;
+    set_base_encoding(&fallback, NULL);
+    for (int c = 0; c < 256; c++) fallback.widths[c] = 500;
+    doc->default_font = &fallback;
+
+    Interpreter in;
+    memset(&in, 0, sizeof(in));
+    in.doc = doc;
+    in.out = &out;
+    size_t total_chars = 0;
+    for (int i = 0; i < pages.count && !doc_cancelled(doc); i++) {
+        char marker[48];
+        snprintf(marker, sizeof(marker), "%s--- Page %d ---\n", out.size ? "\n" : "", i + 1);
+        if (out.size && last_char(&out) != '\n') text_append(&out, "\n", 1);
+        text_append(&out, marker, strlen(marker));
+        in.page_chars = 0;
+        extract_page(&in, &pages.pages[i]);
+        total_chars += in.page_chars;
+        if (in.page_chars >= PDF_MIN_PAGE_CHARS) result->pages_with_text++;
+    }
+    if (out.size && last_char(&out) != '\n') text_append(&out, "\n", 1);
+    result->pages = pages.count;
+
+    if (doc_cancelled(doc)) {
+        result->reason = "text extraction timed out";
+    } else if (out.failed || doc->arena.failed) {
+        result->reason = "out of memory";
+    } else if (total_chars < PDF_MIN_TEXT_CHARS || result->pages_with_text * 2 < pages.count) {
+        result->reason = "most pages have no text layer (scanned?)";
+    } else if (doc->unmapped * 100 > doc->glyphs * PDF_MAX_UNMAPPED_PERCENT) {
+        result->reason = "its fonts have no Unicode mapping";
+    } else {
+        result->text = out.data;
+        result->size = out.size;
+        out.data = NULL;
+        ok = true;
+    }
+
+cleanup:
+    free(out.data);
+    free(pages.pages);
+    free(pages.parents);
+    free(doc->objects);
+    arena_free(&doc->arena);
+    arena_free(&doc->scratch);
+    free(doc);
+    return ok;
+}
+
+bool pdf_extract_text(const unsigned char* data, size_t size, PdfTextResult* result) {
+    return extract_text(data, size, NULL, result);
+}
+
+/**
+ * @brief Frees the text held by a PdfTextResult.
+ * @param result The result to release; safe to call on a zeroed result.
+ */
+void pdf_text_result_free(PdfTextResult* result) {
+    free(result->text);
+    result->text = NULL;
+    result->size = 0;
+}
+
+#ifndef _WIN32
+typedef struct {
+    const unsigned char* data;
+    size_t size;
+    int cancel;                     // Set on timeout; the worker stops at its next check.
+    PdfTextResult result;
+    bool ok;
+    bool done;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} ExtractJob;
+
+static void* extract_worker(void* arg) {
+    ExtractJob* job = arg;
+    PdfTextResult result;
+    bool ok = extract_text(job->data, job->size, &job->cancel, &result);
+
+    pthread_mutex_lock(&job->lock);
+    job->result = result;
+    job->ok = ok;
+    job->done = true;
+    pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+#endif
+
+/**
+ * @brief Runs pdf_extract_text on a worker thread with a time limit.
+ * @details Large or unusual documents can take long to interpret; on timeout
+ *          the worker is told to stop and joined, and the caller falls back
+ *          to sending the PDF. Without pthreads this simply calls
+ *          pdf_extract_text.
+ * @return true if `result` holds the extracted text.
+ */
+bool pdf_extract_text_with_timeout(const unsigned char* data, size_t size, int timeout_ms, PdfTextResult* result) {
+#ifndef _WIN32
+    memset(result, 0, sizeof(*result));
+    ExtractJob job = { .data = data, .size = size };
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, extract_worker, &job) != 0) {
+        pthread_mutex_destroy(&job.lock);
+        pthread_cond_destroy(&job.cond);
+        return pdf_extract_text(data, size, result);
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&job.lock);
+    while (!job.done) {
+        if (pthread_cond_timedwait(&job.cond, &job.lock, &deadline) == ETIMEDOUT) break;
+    }
+    bool timed_out = !job.done;
+    pthread_mutex_unlock(&job.lock);
+    if (timed_out) {
+#if defined(__GNUC__) || defined(__clang__)
+        __atomic_store_n(&job.cancel, 1, __ATOMIC_RELAXED);
+#else
+        *(volatile int*)&job.cancel = 1;
+#endif
+    }
+    pthread_join(thread, NULL);
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.cond);
+
+    if (timed_out) {
+        pdf_text_result_free(&job.result);
+        memset(result, 0, sizeof(*result));
+        result->reason = "text extraction timed out";
+        return false;
+    }
+    *result = job.result;
+    return job.ok;
+#else
+    (void)timeout_ms;
+    return pdf_extract_text(data, size, result);
+#endif
+}
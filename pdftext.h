@@ -0,0 +1,33 @@
+/**
+ * @file pdftext.h
+ * @brief Local text extraction for PDF attachments.
+ *
+ * Text-based PDFs can be sent as their extracted text, with page markers,
+ * instead of the Base64-encoded document. The bundled parser reads the
+ * object structure (including object streams), decodes FlateDecode,
+ * ASCIIHexDecode and ASCII85Decode streams, and maps glyphs to Unicode
+ * through ToUnicode CMaps, the standard simple-font encodings and glyph
+ * names. Documents it cannot read faithfully (encrypted, scanned, or using
+ * fonts without a Unicode mapping) are reported as not extracted so the
+ * caller can fall back to uploading the PDF itself.
+ */
+
+#ifndef GCLI_PDFTEXT_H
+#define GCLI_PDFTEXT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    char* text;             // Extracted UTF-8 text, NUL-terminated, owned by the result.
+    size_t size;            // Length of `text` in bytes.
+    int pages;              // Pages in the document.
+    int pages_with_text;    // Pages that produced any text.
+    const char* reason;     // Why extraction was declined (static string), or NULL.
+} PdfTextResult;
+
+bool pdf_extract_text(const unsigned char* data, size_t size, PdfTextResult* result);
+bool pdf_extract_text_with_timeout(const unsigned char* data, size_t size, int timeout_ms, PdfTextResult* result);
+void pdf_text_result_free(PdfTextResult* result);
+
+#endif // GCLI_PDFTEXT_H
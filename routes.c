@@ -0,0 +1,372 @@
+/**
+ * @file routes.c
+ * @brief Latency-probed selection among alternative routes to the API.
+ *
+ * Which way to the API is fastest (direct, one of several corporate proxies,
+ * a regional gateway) is not fixed, so the choice is measured instead of
+ * configured:
+ *   - a background thread requests a small, cheap resource over every route
+ *     at a fixed interval, each time on a fresh connection, and folds the
+ *     connect time and the time to the first response byte into an
+ *     exponentially weighted moving average (EWMA) per route;
+ *   - a request takes the healthy route with the lowest average time to
+ *     first byte. Since probes open a new connection, that time includes the
+ *     DNS lookup, the TCP and TLS handshakes and the proxy hop. Routes not
+ *     measured yet come after measured ones, in configuration order;
+ *   - a route whose probe or request fails (no connection, a timeout, or a
+ *     proxy or gateway error status) is set aside for a back-off period that
+ *     doubles with every further failure, and probes keep checking it so it
+ *     comes back as soon as it works again. If every route is down, the one
+ *     due back first is used rather than none.
+ * On Windows there is no prober: routes are used in order, with the same
+ * failover and back-off.
+ */
+
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include "routes.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <curl/curl.h>
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#define ROUTE_EWMA_ALPHA 0.3         // Weight of the newest sample.
+#define ROUTE_BACKOFF_SECONDS 10.0   // Time out after the first failure; doubles per further failure.
+#define ROUTE_BACKOFF_MAX_SECONDS 300.0
+#define ROUTE_PROBE_TIMEOUT_MS 10000L
+
+struct RouteTable {
+    Route routes[ROUTE_MAX];
+    int count;
+#ifndef _WIN32
+    pthread_mutex_t lock;           // Guards `routes` once the prober runs, and `stopping`.
+    pthread_cond_t wake;
+    pthread_t prober;
+    bool prober_running;
+    bool stopping;
+    int interval_seconds;
+    char path[256];
+    char auth_header[256];
+    char default_proxy[256];
+#endif
+};
+
+#ifndef _WIN32
+#define ROUTES_LOCK(table) pthread_mutex_lock(&(table)->lock)
+#define ROUTES_UNLOCK(table) pthread_mutex_unlock(&(table)->lock)
+#else
+#define ROUTES_LOCK(table) ((void)0)
+#define ROUTES_UNLOCK(table) ((void)0)
+#endif
+
+/**
+ * @brief Monotonic time in seconds, the clock of `Route.down_until`.
+ */
+double route_clock(void) {
+#ifdef _WIN32
+    return (double)GetTickCount64() / 1000.0;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#endif
+}
+
+RouteTable* route_table_new(void) {
+    RouteTable* table = calloc(1, sizeof(RouteTable));
+    if (!table) return NULL;
+#ifndef _WIN32
+    pthread_mutex_init(&table->lock, NULL);
+    pthread_cond_init(&table->wake, NULL);
+#endif
+    return table;
+}
+
+/**
+ * @brief Stops the prober, waiting for a probe in flight to be aborted, and
+ *        frees the table. NULL is ignored.
+ */
+void route_table_free(RouteTable* table) {
+    if (!table) return;
+#ifndef _WIN32
+    if (table->prober_running) {
+        ROUTES_LOCK(table);
+        table->stopping = true;
+        pthread_cond_signal(&table->wake);
+        ROUTES_UNLOCK(table);
+        pthread_join(table->prober, NULL);
+    }
+    pthread_cond_destroy(&table->wake);
+    pthread_mutex_destroy(&table->lock);
+#endif
+    free(table);
+}
+
+/**
+ * @brief Adds a route; only before the prober is started.
+ * @param name Shown in messages and statistics.
+ * @param base_url An http:// or https:// URL that API paths are appended to.
+ * @param proxy The proxy for this route ("" for none), or NULL to use the
+ *              global proxy setting.
+ * @return false if the table is full or a value is invalid or too long.
+ */
+bool route_table_add(RouteTable* table, const char* name, const char* base_url, const char* proxy) {
+    if (table->count >= ROUTE_MAX) return false;
+    if (strncmp(base_url, "https://", 8) != 0 && strncmp(base_url, "http://", 7) != 0) return false;
+    Route* route = &table->routes[table->count];
+    memset(route, 0, sizeof(*route));
+    size_t length = strlen(base_url);
+    while (length > 0 && base_url[length - 1] == '/') length--;
+    if (strlen(name) >= sizeof(route->name) || length >= sizeof(route->base_url) ||
+        (proxy && strlen(proxy) >= sizeof(route->proxy))) {
+        return false;
+    }
+    snprintf(route->name, sizeof(route->name), "%s", name);
+    memcpy(route->base_url, base_url, length);
+    route->base_url[length] = '\0';
+    if (proxy) {
+        snprintf(route->proxy, sizeof(route->proxy), "%s", proxy);
+        route->has_proxy = true;
+    }
+    route->connect_ewma = route->ttfb_ewma = -1.0;
+    table->count++;
+    return true;
+}
+
+int route_table_count(const RouteTable* table) {
+    return table->count;
+}
+
+/**
+ * @brief Copies a route, measurements included, for use outside the lock.
+ */
+void route_table_get(RouteTable* table, int index, Route* route) {
+    ROUTES_LOCK(table);
+    *route = table->routes[index];
+    ROUTES_UNLOCK(table);
+}
+
+/**
+ * @brief Whether route `a` should be preferred to route `b`.
+ */
+static bool route_better(const Route* a, const Route* b, double now) {
+    bool a_up = a->down_until <= now, b_up = b->down_until <= now;
+    if (a_up != b_up) return a_up;
+    if (!a_up) return a->down_until < b->down_until;
+    bool a_measured = a->ttfb_ewma >= 0.0, b_measured = b->ttfb_ewma >= 0.0;
+    if (a_measured != b_measured) return a_measured;
+    return a_measured && a->ttfb_ewma < b->ttfb_ewma;
+}
+
+/**
+ * @brief Picks the route for the next attempt of a request.
+ * @param tried Bit i set: route i already failed for this request.
+ * @return The index of the best route not yet tried, or -1 if none is left.
+ */
+int route_table_pick(RouteTable* table, unsigned tried) {
+    int best = -1;
+    double now = route_clock();
+    ROUTES_LOCK(table);
+    for (int i = 0; i < table->count; i++) {
+        if (tried & (1u << i)) continue;
+        if (best < 0 || route_better(&table->routes[i], &table->routes[best], now)) best = i;
+    }
+    ROUTES_UNLOCK(table);
+    return best;
+}
+
+// Called with the lock held.
+static void route_note_outcome(Route* route, bool ok) {
+    if (ok) {
+        route->failures = 0;
+        route->down_until = 0.0;
+        return;
+    }
+    route->failures++;
+    double backoff = ROUTE_BACKOFF_SECONDS;
+    for (int i = 1; i < route->failures && backoff < ROUTE_BACKOFF_MAX_SECONDS; i++) backoff *= 2.0;
+    if (backoff > ROUTE_BACKOFF_MAX_SECONDS) backoff = ROUTE_BACKOFF_MAX_SECONDS;
+    route->down_until = route_clock() + backoff;
+}
+
+/**
+ * @brief Tells whether an HTTP status comes from a proxy or gateway that
+ *        could not get through to the API, rather than from the API itself.
+ * @details 503 is left out: the API answers it when the model is overloaded,
+ *          which says nothing about the route.
+ */
+bool route_status_failed(long http_code) {
+    return http_code == 407 || http_code == 502 || http_code == 504;
+}
+
+/**
+ * @brief Records the outcome of a request sent over a route.
+ * @param ok false if the route itself failed (see the file comment); an error
+ *           answered by the API is not the route's fault.
+ */
+void route_table_report(RouteTable* table, int index, bool ok) {
+    ROUTES_LOCK(table);
+    Route* route = &table->routes[index];
+    route->requests++;
+    if (!ok) route->errors++;
+    route_note_outcome(route, ok);
+    ROUTES_UNLOCK(table);
+}
+
+#ifndef _WIN32
+// --- Prober ---
+
+typedef struct {
+    RouteTable* table;
+    double started;
+    double responded;   // First response header, or 0.
+} Probe;
+
+static size_t probe_header(char* data, size_t size, size_t nmemb, void* userp) {
+    (void)data;
+    Probe* probe = userp;
+    if (probe->responded == 0.0) probe->responded = route_clock();
+    return size * nmemb;
+}
+
+static size_t probe_discard(void* data, size_t size, size_t nmemb, void* userp) {
+    (void)data;
+    (void)userp;
+    return size * nmemb;
+}
+
+// Aborts a probe in flight when the table is being freed.
+static int probe_progress(void* userp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+    (void)dltotal;
+    (void)dlnow;
+    (void)ultotal;
+    (void)ulnow;
+    Probe* probe = userp;
+    ROUTES_LOCK(probe->table);
+    bool stopping = probe->table->stopping;
+    ROUTES_UNLOCK(probe->table);
+    return stopping ? 1 : 0;
+}
+
+static void ewma_add(double* average, double sample) {
+    *average = *average < 0.0 ? sample : *average + ROUTE_EWMA_ALPHA * (sample - *average);
+}
+
+/**
+ * @brief Probes one route on a fresh connection and records the result.
+ */
+static void probe_route(RouteTable* table, int index) {
+    Route route;
+    route_table_get(table, index, &route);
+    const char* proxy = route.has_proxy ? route.proxy : table->default_proxy;
+    char url[sizeof(route.base_url) + sizeof(table->path)];
+    snprintf(url, sizeof(url), "%s%s", route.base_url, table->path);
+
+    CURL* curl = curl_easy_init();
+    if (!curl) return;
+    struct curl_slist* headers = table->auth_header[0] ? curl_slist_append(NULL, table->auth_header) : NULL;
+    Probe probe = { .table = table, .started = route_clock() };
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    if (route.has_proxy || proxy[0] != '\0') curl_easy_setopt(curl, CURLOPT_PROXY, proxy);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, ROUTE_PROBE_TIMEOUT_MS);
+    curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
+    curl_easy_setopt(curl, CURLOPT_FORBID_REUSE, 1L);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, probe_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &probe);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, probe_discard);
+    curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, probe_progress);
+    curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &probe);
+    curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+
+    CURLcode res = curl_easy_perform(curl);
+    long status = 0;
+    curl_off_t connect_us = 0, tls_us = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect_us);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls_us);
+    curl_easy_cleanup(curl);
+    curl_slist_free_all(headers);
+    if (res == CURLE_ABORTED_BY_CALLBACK) return;
+
+    // Any answer from the API shows the route works, even one refusing the
+    // request; proxy and gateway failures do not.
+    bool ok = res == CURLE_OK && probe.responded > 0.0 && !route_status_failed(status);
+    ROUTES_LOCK(table);
+    Route* target = &table->routes[index];
+    target->probes++;
+    if (ok) {
+        ewma_add(&target->connect_ewma, (double)(tls_us > 0 ? tls_us : connect_us) / 1e6);
+        ewma_add(&target->ttfb_ewma, probe.responded - probe.started);
+    }
+    route_note_outcome(target, ok);
+    ROUTES_UNLOCK(table);
+}
+
+static void* prober_main(void* arg) {
+    RouteTable* table = arg;
+    ROUTES_LOCK(table);
+    while (!table->stopping) {
+        ROUTES_UNLOCK(table);
+        for (int i = 0; i < table->count; i++) {
+            probe_route(table, i);
+        }
+        ROUTES_LOCK(table);
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += table->interval_seconds;
+        while (!table->stopping && pthread_cond_timedwait(&table->wake, &table->lock, &deadline) == 0) {}
+    }
+    ROUTES_UNLOCK(table);
+    return NULL;
+}
+#endif
+
+/**
+ * @brief Starts probing every route now and then every `interval_seconds`.
+ * @param path Appended to each base URL, e.g. a cheap listing endpoint.
+ * @param auth_header A header to send with probes ("" for none).
+ * @param default_proxy The proxy of routes without one of their own ("" for none).
+ * @return false if the prober could not be started or is not available.
+ */
+bool route_table_start_prober(RouteTable* table, int interval_seconds, const char* path,
+                              const char* auth_header, const char* default_proxy) {
+#ifndef _WIN32
+    if (table->prober_running || interval_seconds <= 0 || table->count == 0) return false;
+    table->interval_seconds = interval_seconds;
+    snprintf(table->path, sizeof(table->path), "%s", path);
+    snprintf(table->auth_header, sizeof(table->auth_header), "%s", auth_header);
+    snprintf(table->default_proxy, sizeof(table->default_proxy), "%s", default_proxy);
+    table->prober_running = pthread_create(&table->prober, NULL, prober_main, table) == 0;
+    return table->prober_running;
+#else
+    (void)table;
+    (void)interval_seconds;
+    (void)path;
+    (void)auth_header;
+    (void)default_proxy;
+    return false;
+#endif
+}
+
+bool route_table_probing(const RouteTable* table) {
+#ifndef _WIN32
+    return table->prober_running;
+#else
+    (void)table;
+    return false;
+#endif
+}
@@ -0,0 +1,49 @@
+/**
+ * @file routes.h
+ * @brief Latency-probed selection among alternative routes to the API.
+ *
+ * The API may be reachable in several ways: directly, through one of a few
+ * proxies, or through a regional gateway, and which is fastest changes over
+ * the day. A route is a base URL plus an optional proxy. A background thread
+ * probes every route at a fixed interval and keeps an exponentially weighted
+ * moving average of its connect time and time to first byte; requests take
+ * the route with the lowest average that is currently healthy, and a route
+ * that fails is set aside for a growing back-off period.
+ */
+
+#ifndef GCLI_ROUTES_H
+#define GCLI_ROUTES_H
+
+#include <stdbool.h>
+
+#define ROUTE_MAX 32
+
+typedef struct {
+    char name[64];
+    char base_url[256];     // Scheme and host (and optional path prefix), without a trailing '/'.
+    char proxy[256];
+    bool has_proxy;         // false: the global proxy setting applies. An empty proxy goes direct.
+    // Measurements.
+    double connect_ewma;    // Seconds to an established (TLS) connection, or -1 before the first probe.
+    double ttfb_ewma;       // Seconds to the first response byte, or -1 before the first probe.
+    int failures;           // Consecutive failed probes and requests.
+    double down_until;      // route_clock() time before which the route is skipped.
+    long probes, requests, errors;
+} Route;
+
+typedef struct RouteTable RouteTable;
+
+RouteTable* route_table_new(void);
+void route_table_free(RouteTable* table);
+bool route_table_add(RouteTable* table, const char* name, const char* base_url, const char* proxy);
+int route_table_count(const RouteTable* table);
+void route_table_get(RouteTable* table, int index, Route* route);
+int route_table_pick(RouteTable* table, unsigned tried);
+void route_table_report(RouteTable* table, int index, bool ok);
+bool route_status_failed(long http_code);
+bool route_table_start_prober(RouteTable* table, int interval_seconds, const char* path,
+                              const char* auth_header, const char* default_proxy);
+bool route_table_probing(const RouteTable* table);
+double route_clock(void);
+
+#endif // GCLI_ROUTES_H
@@ -0,0 +1,613 @@
+/**
+ * @file srcview.c
+ * @brief Outline and minified views of source files for attachments.
+ *
+ * Attaching a source file sends every comment, blank line and function body,
+ * even when the question is only about its structure. This module produces
+ * two reduced views with a single-pass, language-aware lexer:
+ *   - minify: comments, blank lines, indentation (except in Python) and
+ *     runs of whitespace are dropped. String, character, raw-string, template
+ *     and regex literals are copied byte for byte, line breaks are kept (so
+ *     preprocessor lines, Go and JS automatic semicolons keep working) and a
+ *     single space is kept wherever there was whitespace, so tokens are never
+ *     glued together.
+ *   - outline: the minified text with every block that is not a type or
+ *     namespace body replaced by `{ ... }`. Whether a block is a container is
+ *     decided from the declaration that precedes it: a class, struct, union,
+ *     enum, namespace, interface, impl, trait, mod, extern or record keyword
+ *     not followed by `(` or `=`. Python function bodies become `...`.
+ * Supported: C, C++, C#, Java, JavaScript, TypeScript, Go, Rust and Python.
+ */
+
+#include "srcview.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define strcasecmp _stricmp
+#else
+#include <strings.h>
+#endif
+
+typedef enum {
+    LANG_NONE,
+    LANG_C,         // C and C++: preprocessor, raw strings.
+    LANG_CSHARP,    // Preprocessor, verbatim strings.
+    LANG_JAVA,
+    LANG_JS,        // JavaScript and TypeScript: template literals, regex literals.
+    LANG_GO,        // Raw strings in backquotes.
+    LANG_RUST,      // Lifetimes, raw strings.
+    LANG_PYTHON
+} Language;
+
+static const struct {
+    const char* extension;
+    Language language;
+} LANGUAGES[] = {
+    { ".c", LANG_C }, { ".h", LANG_C }, { ".cpp", LANG_C }, { ".hpp", LANG_C },
+    { ".cc", LANG_C }, { ".cxx", LANG_C }, { ".hh", LANG_C }, { ".cs", LANG_CSHARP },
+    { ".java", LANG_JAVA }, { ".js", LANG_JS }, { ".mjs", LANG_JS }, { ".jsx", LANG_JS },
+    { ".ts", LANG_JS }, { ".tsx", LANG_JS }, { ".go", LANG_GO }, { ".rs", LANG_RUST },
+    { ".py", LANG_PYTHON },
+};
+
+static const char* const CONTAINER_KEYWORDS[] = {
+    "class", "struct", "union", "enum", "namespace", "interface",
+    "impl", "trait", "mod", "extern", "record", "module", "import",
+};
+
+// JS keywords after which a `/` starts a regex literal rather than a division.
+static const char* const REGEX_KEYWORDS[] = {
+    "return", "typeof", "instanceof", "in", "of", "new", "delete", "void",
+    "throw", "case", "do", "else", "yield", "await",
+};
+
+typedef struct {
+    char* data;
+    size_t size;
+    size_t capacity;
+    bool failed;
+} TextBuffer;
+
+typedef struct {
+    const char* src;
+    size_t size;
+    size_t pos;
+    Language lang;
+    SourceViewMode mode;
+    TextBuffer out;
+    bool pending_space;     // Whitespace was skipped since the last emitted token.
+    bool pending_newline;   // A line break was skipped since the last emitted token.
+    int skip_depth;         // Brace depth inside an elided body (0 = emitting).
+    size_t header_start;    // Output offset where the current declaration began.
+    char last_significant;  // Last non-space source character, for regex detection.
+    const char* last_word;  // Last identifier or keyword in the source.
+    size_t last_word_len;
+} Lexer;
+
+static void text_append(TextBuffer* buf, const char* data, size_t len) {
+    if (buf->failed) return;
+    if (buf->size + len + 1 > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 4096;
+        while (capacity < buf->size + len + 1) capacity *= 2;
+        char* grown = realloc(buf->data, capacity);
+        if (!grown) {
+            buf->failed = true;
+            return;
+        }
+        buf->data = grown;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->size, data, len);
+    buf->size += len;
+    buf->data[buf->size] = '\0';
+}
+
+static char last_output(const Lexer* lx) {
+    return lx->out.size ? lx->out.data[lx->out.size - 1] : '\n';
+}
+
+// Writes source text, preceded by the separator the skipped whitespace calls for.
+static void emit(Lexer* lx, const char* text, size_t len) {
+    if (lx->skip_depth > 0) {
+        lx->pending_space = lx->pending_newline = false;
+        return;
+    }
+    char last = last_output(lx);
+    if (lx->pending_newline && last != '\n') {
+        text_append(&lx->out, "\n", 1);
+    } else if (lx->pending_space && last != '\n' && last != ' ') {
+        text_append(&lx->out, " ", 1);
+    }
+    lx->pending_space = lx->pending_newline = false;
+    text_append(&lx->out, text, len);
+}
+
+static bool is_ident_char(char c) {
+    return isalnum((unsigned char)c) || c == '_' || (unsigned char)c >= 0x80;
+}
+
+static Language language_of(const char* path) {
+    const char* dot = strrchr(path, '.');
+    const char* slash = strrchr(path, '/');
+    if (!dot || dot == path || (slash && dot < slash)) return LANG_NONE;
+    for (size_t i = 0; i < sizeof(LANGUAGES) / sizeof(LANGUAGES[0]); i++) {
+        if (strcasecmp(dot, LANGUAGES[i].extension) == 0) return LANGUAGES[i].language;
+    }
+    return LANG_NONE;
+}
+
+// Returns the offset just past a quoted literal starting at `start`.
+static size_t scan_quoted(const char* src, size_t size, size_t start, char quote, bool escapes, bool multiline) {
+    size_t i = start + 1;
+    while (i < size) {
+        char c = src[i];
+        if (escapes && c == '\\' && i + 1 < size) {
+            i += 2;
+            continue;
+        }
+        if (c == quote) return i + 1;
+        if (c == '\n' && !multiline) return i; // Unterminated: stop at the line end.
+        i++;
+    }
+    return size;
+}
+
+// Returns the offset just past a JS template literal, including nested `${...}` expressions.
+static size_t scan_template(const char* src, size_t size, size_t start) {
+    size_t i = start + 1;
+    while (i < size) {
+        char c = src[i];
+        if (c == '\\') {
+            i += 2;
+        } else if (c == '`') {
+            return i + 1;
+        } else if (c == '$' && i + 1 < size && src[i + 1] == '{') {
+            int depth = 0;
+            for (i += 2; i < size; ) {
+                char e = src[i];
+                if (e == '"' || e == '\'') {
+                    i = scan_quoted(src, size, i, e, true, false);
+                } else if (e == '`') {
+                    i = scan_template(src, size, i);
+                } else {
+                    i++;
+                    if (e == '{') depth++;
+                    if (e == '}' && depth-- == 0) break;
+                }
+            }
+        } else {
+            i++;
+        }
+    }
+    return size;
+}
+
+// Returns the end of a raw string (C++ R"d(...)d", Rust r#"..."#) at `start`, or 0.
+static size_t scan_raw_string(const Lexer* lx, size_t start) {
+    const char* src = lx->src;
+    size_t size = lx->size;
+    if (start > 0 && is_ident_char(src[start - 1])) return 0;
+
+    if (lx->lang == LANG_C && src[start] == 'R' && start + 1 < size && src[start + 1] == '"') {
+        size_t open = start + 2;
+        while (open < size && open - start < 20 && src[open] != '(' && src[open] != '"' && src[open] != '\n') open++;
+        if (open >= size || src[open] != '(') return 0;
+        const char* delim = src + start + 2;
+        size_t delim_len = open - (start + 2);
+        for (size_t i = open + 1; i + delim_len + 1 < size; i++) {
+            if (src[i] == ')' && memcmp(src + i + 1, delim, delim_len) == 0 && src[i + 1 + delim_len] == '"') {
+                return i + delim_len + 2;
+            }
+        }
+        return size;
+    }
+    if (lx->lang == LANG_RUST && (src[start] == 'r' || (src[start] == 'b' && start + 1 < size && src[start + 1] == 'r'))) {
+        size_t i = start + (src[start] == 'b' ? 2 : 1);
+        size_t hashes = 0;
+        while (i < size && src[i] == '#') {
+            hashes++;
+            i++;
+        }
+        if (i >= size || src[i] != '"') return 0;
+        for (i++; i < size; i++) {
+            if (src[i] != '"') continue;
+            size_t n = 0;
+            while (n < hashes && i + 1 + n < size && src[i + 1 + n] == '#') n++;
+            if (n == hashes) return i + 1 + hashes;
+        }
+        return size;
+    }
+    return 0;
+}
+
+// A `/` starts a regex literal in JS when it cannot be a division.
+static bool regex_allowed(const Lexer* lx) {
+    char previous = lx->last_significant;
+    if (previous == '\0') return true;
+    if (!is_ident_char(previous)) return strchr("(,=:[!&|?{};+-*%<>~^", previous) != NULL;
+    for (size_t k = 0; k < sizeof(REGEX_KEYWORDS) / sizeof(REGEX_KEYWORDS[0]); k++) {
+        if (strlen(REGEX_KEYWORDS[k]) == lx->last_word_len &&
+            memcmp(lx->last_word, REGEX_KEYWORDS[k], lx->last_word_len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static size_t scan_regex(const char* src, size_t size, size_t start) {
+    bool in_class = false;
+    for (size_t i = start + 1; i < size; i++) {
+        char c = src[i];
+        if (c == '\n') return 0;
+        if (c == '\\') {
+            i++;
+        } else if (c == '[') {
+            in_class = true;
+        } else if (c == ']') {
+            in_class = false;
+        } else if (c == '/' && !in_class) {
+            i++;
+            while (i < size && isalpha((unsigned char)src[i])) i++;
+            return i;
+        }
+    }
+    return 0;
+}
+
+// Rust `'a` is a lifetime unless it closes like a character literal.
+static bool rust_char_literal(const char* src, size_t size, size_t start) {
+    if (start + 1 >= size) return false;
+    if (src[start + 1] == '\\') return true;
+    size_t i = start + 2;
+    while (i < size && ((unsigned char)src[i] & 0xC0) == 0x80) i++; // Skip UTF-8 continuation bytes.
+    return i < size && src[i] == '\'';
+}
+
+// Decides whether the block opened after `header` is a type or namespace body.
+static bool is_container(const char* header, size_t len) {
+    size_t keyword_end = 0;
+    bool found = false;
+    for (size_t i = 0; i < len;) {
+        char c = header[i];
+        if (c == '"' || c == '\'') {
+            i = scan_quoted(header, len, i, c, true, true);
+            continue;
+        }
+        if (!is_ident_char(c)) {
+            i++;
+            continue;
+        }
+        size_t start = i;
+        while (i < len && is_ident_char(header[i])) i++;
+        for (size_t k = 0; k < sizeof(CONTAINER_KEYWORDS) / sizeof(CONTAINER_KEYWORDS[0]); k++) {
+            if (strlen(CONTAINER_KEYWORDS[k]) == i - start && memcmp(header + start, CONTAINER_KEYWORDS[k], i - start) == 0) {
+                found = true;
+                keyword_end = i;
+            }
+        }
+    }
+    if (!found) return false;
+    for (size_t i = keyword_end; i < len; i++) {
+        if (header[i] == '(' || header[i] == '=') return false;
+    }
+    return true;
+}
+
+static void open_brace(Lexer* lx) {
+    if (lx->skip_depth > 0) {
+        lx->skip_depth++;
+        return;
+    }
+    bool elide = lx->mode == SOURCE_VIEW_OUTLINE &&
+                 !is_container(lx->out.data ? lx->out.data + lx->header_start : "", lx->out.size - lx->header_start);
+    emit(lx, "{", 1);
+    if (elide) lx->skip_depth = 1;
+    lx->header_start = lx->out.size;
+}
+
+static void close_brace(Lexer* lx) {
+    if (lx->skip_depth > 0) {
+        if (--lx->skip_depth > 0) return;
+        text_append(&lx->out, " ... }", 6);
+    } else {
+        emit(lx, "}", 1);
+    }
+    lx->header_start = lx->out.size;
+}
+
+static void view_c_family(Lexer* lx) {
+    const char* src = lx->src;
+    size_t size = lx->size;
+    bool at_line_start = true;
+    bool in_directive = false;
+    bool has_preprocessor = lx->lang == LANG_C || lx->lang == LANG_CSHARP;
+
+    while (lx->pos < size) {
+        size_t pos = lx->pos;
+        char c = src[pos];
+        char next = pos + 1 < size ? src[pos + 1] : '\0';
+
+        if (c == '\n') {
+            if (in_directive) {
+                size_t back = pos;
+                while (back > 0 && src[back - 1] == '\r') back--;
+                bool continued = back > 0 && src[back - 1] == '\\';
+                // Directive lines are kept as they are, including empty continuation lines.
+                if (lx->skip_depth == 0) text_append(&lx->out, "\n", 1);
+                lx->pending_space = lx->pending_newline = false;
+                if (!continued) {
+                    in_directive = false;
+                    lx->header_start = lx->out.size;
+                }
+            } else {
+                lx->pending_newline = true;
+            }
+            at_line_start = true;
+            lx->pos++;
+            continue;
+        }
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v') {
+            lx->pending_space = true;
+            lx->pos++;
+            continue;
+        }
+        if (c == '/' && next == '/') {
+            while (lx->pos < size && src[lx->pos] != '\n') lx->pos++;
+            lx->pending_space = true;
+            continue;
+        }
+        if (c == '/' && next == '*') {
+            const char* end = NULL;
+            for (size_t i = pos + 2; i + 1 < size; i++) {
+                if (src[i] == '*' && src[i + 1] == '/') {
+                    end = src + i + 2;
+                    break;
+                }
+            }
+            size_t stop = end ? (size_t)(end - src) : size;
+            // A comment spanning lines still separates lines (Go and JS insert semicolons there).
+            if (!in_directive && memchr(src + pos, '\n', stop - pos) != NULL) {
+                lx->pending_newline = true;
+            } else {
+                lx->pending_space = true;
+            }
+            lx->pos = stop;
+            continue;
+        }
+
+        bool line_start = at_line_start;
+        at_line_start = false;
+
+        if (line_start && has_preprocessor && c == '#') {
+            in_directive = true;
+            if (lx->skip_depth == 0 && lx->out.size > 0) lx->pending_newline = true;
+        }
+
+        size_t end = 0;
+        if (c == '"' || (c == '\'' && (lx->lang != LANG_RUST || rust_char_literal(src, size, pos)))) {
+            end = scan_quoted(src, size, pos, c, true, false);
+        } else if (c == '`' && lx->lang == LANG_JS) {
+            end = scan_template(src, size, pos);
+        } else if (c == '`' && lx->lang == LANG_GO) {
+            end = scan_quoted(src, size, pos, c, false, true);
+        } else if (c == '@' && next == '"' && lx->lang == LANG_CSHARP) {
+            end = pos + 1;
+            do {
+                end = scan_quoted(src, size, end, '"', false, true);
+            } while (end < size && src[end] == '"'); // "" is an escaped quote.
+        } else if ((c == 'R' || c == 'r' || c == 'b') && !in_directive) {
+            end = scan_raw_string(lx, pos);
+        } else if (c == '/' && lx->lang == LANG_JS && regex_allowed(lx)) {
+            end = scan_regex(src, size, pos);
+        }
+        if (end > pos) {
+            emit(lx, src + pos, end - pos);
+            lx->last_significant = '"';
+            lx->pos = end;
+            continue;
+        }
+
+        lx->last_significant = c;
+        lx->pos++;
+        if (!in_directive && c == '{') {
+            open_brace(lx);
+        } else if (!in_directive && c == '}') {
+            close_brace(lx);
+        } else {
+            size_t len = 1;
+            if (is_ident_char(c)) {
+                while (pos + len < size && is_ident_char(src[pos + len])) len++;
+                lx->pos = pos + len;
+                lx->last_significant = src[pos + len - 1];
+                lx->last_word = src + pos;
+                lx->last_word_len = len;
+            }
+            emit(lx, src + pos, len);
+            if (!in_directive && c == ';' && lx->skip_depth == 0) lx->header_start = lx->out.size;
+        }
+    }
+}
+
+// Length of a Python string literal starting at a quote, including triple quotes.
+static size_t scan_python_string(const char* src, size_t size, size_t start) {
+    char quote = src[start];
+    if (start + 2 < size && src[start + 1] == quote && src[start + 2] == quote) {
+        for (size_t i = start + 3; i < size; i++) {
+            if (src[i] == '\\') {
+                i++;
+            } else if (src[i] == quote && i + 2 < size && src[i + 1] == quote && src[i + 2] == quote) {
+                return i + 3;
+            }
+        }
+        return size;
+    }
+    return scan_quoted(src, size, start, quote, true, false);
+}
+
+static bool starts_with_word(const char* text, size_t len, const char* word) {
+    size_t n = strlen(word);
+    return len > n && memcmp(text, word, n) == 0 && (text[n] == ' ' || text[n] == '\t');
+}
+
+static void view_python(Lexer* lx) {
+    const char* src = lx->src;
+    size_t size = lx->size;
+    int depth = 0;                  // Open brackets: lines inside them are continuations.
+    bool continued = false;         // The previous line ended in a backslash.
+    bool in_def_header = false;     // Emitting a `def` line that may still span lines.
+    bool skipping = false;          // Inside an elided function body.
+    bool ellipsis_written = false;
+    size_t def_indent = 0;
+
+    while (lx->pos < size) {
+        // --- Start of a physical line ---
+        size_t line = lx->pos;
+        size_t indent_end = line;
+        while (indent_end < size && (src[indent_end] == ' ' || src[indent_end] == '\t')) indent_end++;
+        char first = indent_end < size ? src[indent_end] : '\n';
+        bool logical_start = depth == 0 && !continued;
+
+        if (first == '\n' || first == '\r' || first == '#') {
+            // Blank and comment-only lines are dropped, except a shebang.
+            bool shebang = line == 0 && first == '#' && indent_end + 1 < size && src[indent_end + 1] == '!';
+            size_t end = indent_end;
+            while (end < size && src[end] != '\n') end++;
+            if (shebang) text_append(&lx->out, src, end + (end < size ? 1 : 0));
+            lx->pos = end < size ? end + 1 : size;
+            continue;
+        }
+
+        size_t indent = indent_end - line;
+        if (logical_start) {
+            if (skipping && indent > def_indent) {
+                if (!ellipsis_written) {
+                    text_append(&lx->out, src + line, indent);
+                    text_append(&lx->out, "...\n", 4);
+                    ellipsis_written = true;
+                }
+            } else {
+                skipping = false;
+            }
+            const char* text = src + indent_end;
+            size_t rest = size - indent_end;
+            in_def_header = lx->mode == SOURCE_VIEW_OUTLINE && !skipping &&
+                            (starts_with_word(text, rest, "def") || starts_with_word(text, rest, "async"));
+            if (in_def_header) def_indent = indent;
+        }
+        lx->skip_depth = skipping ? 1 : 0;
+        lx->pending_space = lx->pending_newline = false;
+        if (!skipping) text_append(&lx->out, src + line, indent);
+        lx->pos = indent_end;
+        continued = false;
+
+        // --- Tokens up to the end of the line ---
+        char last = '\0';
+        while (lx->pos < size && src[lx->pos] != '\n') {
+            size_t pos = lx->pos;
+            char c = src[pos];
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\f') {
+                lx->pending_space = true;
+                lx->pos++;
+            } else if (c == '#') {
+                while (lx->pos < size && src[lx->pos] != '\n') lx->pos++;
+            } else if (c == '"' || c == '\'') {
+                size_t end = scan_python_string(src, size, pos);
+                emit(lx, src + pos, end - pos);
+                lx->pos = end;
+                last = c;
+            } else if (c == '\\' && (pos + 1 == size || src[pos + 1] == '\n' ||
+                                     (src[pos + 1] == '\r' && pos + 2 < size && src[pos + 2] == '\n'))) {
+                emit(lx, "\\", 1);
+                continued = true;
+                lx->pos++;
+                while (lx->pos < size && src[lx->pos] == '\r') lx->pos++;
+            } else {
+                if (c == '(' || c == '[' || c == '{') depth++;
+                if ((c == ')' || c == ']' || c == '}') && depth > 0) depth--;
+                emit(lx, src + pos, 1);
+                lx->pos++;
+                last = c;
+            }
+        }
+        if (!skipping) text_append(&lx->out, "\n", 1);
+        if (lx->pos < size) lx->pos++;
+
+        // A complete `def ...:` header with its body on the following lines.
+        if (in_def_header && depth == 0 && !continued) {
+            in_def_header = false;
+            if (last == ':') {
+                skipping = true;
+                ellipsis_written = false;
+            }
+        }
+    }
+    lx->skip_depth = 0;
+}
+
+/**
+ * Rough token count for comparing views: identifier and number runs count
+ * one token per eight characters, other characters and line breaks one
+ * each, and indentation runs one per run.
+ */
+size_t source_estimate_tokens(const char* text, size_t size) {
+    size_t tokens = 0;
+    size_t i = 0;
+    while (i < size) {
+        char c = text[i];
+        if (is_ident_char(c)) {
+            size_t start = i;
+            while (i < size && is_ident_char(text[i])) i++;
+            tokens += 1 + (i - start) / 8;
+        } else if (c == ' ' || c == '\t') {
+            size_t start = i;
+            while (i < size && (text[i] == ' ' || text[i] == '\t')) i++;
+            if (i - start > 1) tokens++;
+        } else {
+            tokens++;
+            i++;
+        }
+    }
+    return tokens;
+}
+
+bool source_view_supported(const char* path) {
+    return language_of(path) != LANG_NONE;
+}
+
+bool source_view(const char* path, const char* data, size_t size, SourceViewMode mode, SourceViewResult* result) {
+    memset(result, 0, sizeof(*result));
+    Language lang = language_of(path);
+    if (lang == LANG_NONE || mode == SOURCE_VIEW_NONE || memchr(data, '\0', size) != NULL) return false;
+
+    Lexer lx = { 0 };
+    lx.src = data;
+    lx.size = size;
+    lx.lang = lang;
+    lx.mode = mode;
+    if (lang == LANG_PYTHON) {
+        view_python(&lx);
+    } else {
+        view_c_family(&lx);
+        if (lx.skip_depth > 0) text_append(&lx.out, " ... }", 6); // Unbalanced braces.
+        if (last_output(&lx) != '\n') text_append(&lx.out, "\n", 1);
+    }
+    if (lx.out.failed || lx.out.data == NULL) {
+        free(lx.out.data);
+        return false;
+    }
+
+    result->text = lx.out.data;
+    result->size = lx.out.size;
+    result->tokens_in = source_estimate_tokens(data, size);
+    result->tokens_out = source_estimate_tokens(result->text, result->size);
+    return true;
+}
+
+void source_view_result_free(SourceViewResult* result) {
+    free(result->text);
+    memset(result, 0, sizeof(*result));
+}
@@ -0,0 +1,37 @@
+/**
+ * @file srcview.h
+ * @brief Reduced views of source files for attachments: outline and minify.
+ *
+ * The outline keeps declarations, signatures and type definitions and
+ * replaces function bodies with `{ ... }` (Python: `...`). Minify drops
+ * comments, blank lines and redundant whitespace but keeps the code
+ * meaning-preserving: string literals are untouched and line structure is
+ * kept wherever the language depends on it. Both use a small lexer per
+ * language family (C/C++/C#/Java/JS/TS/Go/Rust and Python).
+ */
+
+#ifndef GCLI_SRCVIEW_H
+#define GCLI_SRCVIEW_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+    SOURCE_VIEW_NONE = 0,
+    SOURCE_VIEW_OUTLINE,
+    SOURCE_VIEW_MINIFY
+} SourceViewMode;
+
+typedef struct {
+    char* text;             // Reduced source, NUL-terminated, owned by the result.
+    size_t size;            // Length of `text` in bytes.
+    size_t tokens_in;       // Estimated tokens in the original source.
+    size_t tokens_out;      // Estimated tokens in `text`.
+} SourceViewResult;
+
+bool source_view_supported(const char* path);
+bool source_view(const char* path, const char* data, size_t size, SourceViewMode mode, SourceViewResult* result);
+void source_view_result_free(SourceViewResult* result);
+size_t source_estimate_tokens(const char* text, size_t size);
+
+#endif // GCLI_SRCVIEW_H
@@ -0,0 +1,1041 @@
+/**
+ * @file tabular.c
+ * @brief Single-pass profiling of delimited (CSV/TSV) files.
+ *
+ * A large table cannot be attached as text, but the model rarely needs every
+ * row to answer a question about it: the schema, the shape of each column
+ * and a representative sample usually suffice. This module streams the file
+ * once, in TABLE_CHUNK_SIZE chunks, and keeps only bounded state per column:
+ *   - counters for the inferred type (integer, decimal, boolean, date,
+ *     string) and nulls, plus Welford mean/variance and min/max;
+ *   - a HyperLogLog sketch (2^HLL_BITS one-byte registers) for the number
+ *     of distinct values;
+ *   - a Space-Saving summary of the most frequent short values.
+ * Records are split with a word-at-a-time (SWAR) scan for the delimiter and
+ * line feed, which checks eight bytes per step without relying on
+ * platform-specific SIMD; quoted fields follow RFC 4180.
+ *
+ * The row sample is stratified: once TABLE_PROBE_ROWS rows have been seen,
+ * the first column with between 2 and TABLE_MAX_STRATA distinct values
+ * becomes the stratum key and every stratum keeps its own reservoir, so rare
+ * categories are represented. Without such a column the sample is a plain
+ * reservoir sample. A `where` filter restricts statistics and sample to the
+ * rows that match it.
+ */
+
+#include "tabular.h"
+
+#include <ctype.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define strcasecmp _stricmp
+#define strncasecmp _strnicmp
+#else
+#include <strings.h>
+#endif
+
+#define TABLE_CHUNK_SIZE (1 << 20)
+#define TABLE_MAX_RECORD (256 << 20)     // Records larger than this abort the profile.
+#define TABLE_MAX_COLUMNS 512
+#define TABLE_DEFAULT_SAMPLE_ROWS 40
+#define TABLE_MAX_SAMPLE_ROWS 1000
+#define TABLE_PROBE_ROWS 1000
+#define TABLE_MAX_STRATA 12
+#define TABLE_TOP_CAPACITY 16
+#define TABLE_TOP_VALUE_MAX 48
+#define TABLE_TOP_REPORTED 5
+#define TABLE_MAX_CONDITIONS 8
+#define TABLE_SAMPLE_FIELD_MAX 200       // Longer fields are cut in the sample.
+#define HLL_BITS 12
+#define HLL_REGISTERS (1 << HLL_BITS)
+
+typedef struct {
+    char* ptr;
+    size_t len;
+    bool escaped;           // Quoted field containing "" pairs still to be collapsed.
+} Field;
+
+typedef struct {
+    uint64_t hash;
+    size_t count;
+    size_t error;           // Upper bound on how much `count` overestimates.
+    uint8_t len;
+    char value[TABLE_TOP_VALUE_MAX];
+} TopValue;
+
+typedef struct {
+    char* name;
+    size_t values, nulls;
+    size_t integers, decimals, booleans, dates;
+    size_t numbers;         // integers + decimals, for the running statistics.
+    double min, max, mean, m2;
+    size_t min_len, max_len;
+    char first_date[32], last_date[32];
+    uint8_t* hll;
+    TopValue top[TABLE_TOP_CAPACITY];
+    int num_top;
+    size_t top_evictions;
+    size_t top_skipped;     // Values too long to be tracked.
+} Column;
+
+typedef enum { OP_EQ, OP_NE, OP_LT, OP_LE, OP_GT, OP_GE, OP_CONTAINS } CompareOp;
+
+typedef struct {
+    char column[128];
+    int index;
+    CompareOp op;
+    char value[256];
+    size_t value_len;
+    double number;
+    bool numeric;
+} Condition;
+
+typedef struct {
+    char key[TABLE_TOP_VALUE_MAX];
+    size_t key_len;
+    bool other;             // Catches values (and nulls) outside the known keys.
+    char** rows;
+    int count, capacity;
+    size_t seen;
+} Stratum;
+
+typedef struct {
+    char delimiter;
+    int sample_rows;
+    Column* columns;
+    int num_columns;
+    bool header_seen, has_header;
+    size_t rows, matched, malformed;
+    Field fields[TABLE_MAX_COLUMNS];
+    int num_fields;
+    Condition conditions[TABLE_MAX_CONDITIONS];
+    int num_conditions;
+    char** probe;           // Rows seen before the stratum column is chosen.
+    int num_probe;
+    bool strata_decided;
+    int strat_column;
+    Stratum strata[TABLE_MAX_STRATA + 1];
+    int num_strata;
+    uint64_t rng;
+    char* error;
+    size_t error_size;
+    bool failed;
+} Profiler;
+
+typedef struct {
+    char* data;
+    size_t size;
+    size_t capacity;
+    bool failed;
+} TextBuffer;
+
+static void text_append(TextBuffer* buf, const char* data, size_t len) {
+    if (buf->failed) return;
+    if (buf->size + len + 1 > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 4096;
+        while (capacity < buf->size + len + 1) capacity *= 2;
+        char* grown = realloc(buf->data, capacity);
+        if (!grown) {
+            buf->failed = true;
+            return;
+        }
+        buf->data = grown;
+        buf->capacity = capacity;
+    }
+    memcpy(buf->data + buf->size, data, len);
+    buf->size += len;
+    buf->data[buf->size] = '\0';
+}
+
+static void text_puts(TextBuffer* buf, const char* text) {
+    text_append(buf, text, strlen(text));
+}
+
+static void text_printf(TextBuffer* buf, const char* format, ...) {
+    char line[1024];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len < 0) return;
+    text_append(buf, line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+}
+
+// --- Scanning ---
+
+// Returns the first byte equal to `a` or `b`, checking eight bytes per step.
+static char* find_either(char* p, char* end, char a, char b) {
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t highs = 0x8080808080808080ull;
+    const uint64_t pattern_a = ones * (unsigned char)a;
+    const uint64_t pattern_b = ones * (unsigned char)b;
+    while (end - p >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        uint64_t xa = word ^ pattern_a;
+        uint64_t xb = word ^ pattern_b;
+        if ((((xa - ones) & ~xa) | ((xb - ones) & ~xb)) & highs) break; // A match is in this word.
+        p += 8;
+    }
+    for (; p < end; p++) {
+        if (*p == a || *p == b) return p;
+    }
+    return NULL;
+}
+
+static void add_field(Profiler* pr, char* ptr, size_t len, bool escaped) {
+    if (pr->num_fields < TABLE_MAX_COLUMNS) {
+        pr->fields[pr->num_fields].ptr = ptr;
+        pr->fields[pr->num_fields].len = len;
+        pr->fields[pr->num_fields].escaped = escaped;
+    }
+    pr->num_fields++;
+}
+
+/**
+ * Splits the record starting at `p` into pr->fields. Returns false if the
+ * record is not complete within [p, end) and more input may follow; the
+ * buffer is not modified in that case.
+ */
+static bool scan_record(Profiler* pr, char* p, char* end, bool eof, char** next) {
+    char delim = pr->delimiter;
+    pr->num_fields = 0;
+    for (;;) {
+        char* field_end;
+        if (p < end && *p == '"') {
+            char* q = p + 1;
+            bool escaped = false;
+            char* close;
+            for (;;) {
+                close = memchr(q, '"', (size_t)(end - q));
+                if (!close) {
+                    if (!eof) return false;
+                    close = end; // Unterminated quote: the rest of the file is the field.
+                    break;
+                }
+                if (close + 1 == end && !eof) return false; // Could be the first half of "".
+                if (close + 1 < end && close[1] == '"') {
+                    escaped = true;
+                    q = close + 2;
+                    continue;
+                }
+                break;
+            }
+            field_end = close < end ? find_either(close + 1, end, delim, '\n') : NULL;
+            if (!field_end) {
+                if (!eof) return false;
+                field_end = end;
+            }
+            add_field(pr, p + 1, (size_t)(close - (p + 1)), escaped);
+        } else {
+            field_end = find_either(p, end, delim, '\n');
+            if (!field_end) {
+                if (!eof) return false;
+                field_end = end;
+            }
+            size_t len = (size_t)(field_end - p);
+            if (len > 0 && p[len - 1] == '\r' && (field_end == end || *field_end == '\n')) len--;
+            add_field(pr, p, len, false);
+        }
+
+        p = field_end;
+        if (p == end) {
+            *next = end;
+            return true;
+        }
+        if (*p == '\n') {
+            *next = p + 1;
+            return true;
+        }
+        p++; // Delimiter.
+        if (p == end) {
+            if (!eof) return false;
+            add_field(pr, p, 0, false); // Trailing delimiter at the end of the file.
+            *next = end;
+            return true;
+        }
+    }
+}
+
+// Collapses the "" pairs of escaped quoted fields, in place.
+static void unescape_fields(Profiler* pr) {
+    int count = pr->num_fields < TABLE_MAX_COLUMNS ? pr->num_fields : TABLE_MAX_COLUMNS;
+    for (int i = 0; i < count; i++) {
+        Field* field = &pr->fields[i];
+        if (!field->escaped) continue;
+        size_t out = 0;
+        for (size_t in = 0; in < field->len; in++) {
+            field->ptr[out++] = field->ptr[in];
+            if (field->ptr[in] == '"' && in + 1 < field->len && field->ptr[in + 1] == '"') in++;
+        }
+        field->len = out;
+    }
+}
+
+// --- Values ---
+
+static bool is_null(const char* s, size_t len) {
+    static const char* const NULLS[] = { "na", "n/a", "null", "nan", "none", "nil" };
+    if (len == 0) return true;
+    for (size_t i = 0; i < sizeof(NULLS) / sizeof(NULLS[0]); i++) {
+        if (strlen(NULLS[i]) == len && strncasecmp(s, NULLS[i], len) == 0) return true;
+    }
+    return false;
+}
+
+static bool parse_integer(const char* s, size_t len, double* value) {
+    size_t i = (len > 0 && (s[0] == '-' || s[0] == '+')) ? 1 : 0;
+    if (i == len || len - i > 18) return false;
+    long long n = 0;
+    for (size_t j = i; j < len; j++) {
+        if (!isdigit((unsigned char)s[j])) return false;
+        n = n * 10 + (s[j] - '0');
+    }
+    *value = (double)(s[0] == '-' ? -n : n);
+    return true;
+}
+
+static bool parse_number(const char* s, size_t len, double* value) {
+    char text[64];
+    if (len == 0 || len >= sizeof(text)) return false;
+    if (!isdigit((unsigned char)s[0]) && s[0] != '-' && s[0] != '+' && s[0] != '.') return false;
+    memcpy(text, s, len);
+    text[len] = '\0';
+    char* end;
+    *value = strtod(text, &end);
+    return end == text + len && isfinite(*value);
+}
+
+static bool parse_boolean(const char* s, size_t len) {
+    return (len == 4 && strncasecmp(s, "true", 4) == 0) || (len == 5 && strncasecmp(s, "false", 5) == 0);
+}
+
+// ISO 8601 date, optionally followed by a time: YYYY-MM-DD[(T| )HH:MM...].
+static bool parse_date(const char* s, size_t len) {
+    if (len < 10 || len >= 32) return false;
+    for (int i = 0; i < 10; i++) {
+        bool dash = i == 4 || i == 7;
+        if (dash ? s[i] != '-' : !isdigit((unsigned char)s[i])) return false;
+    }
+    if (len == 10) return true;
+    return (s[10] == 'T' || s[10] == ' ') && len >= 16 && isdigit((unsigned char)s[11]) && s[13] == ':';
+}
+
+static uint64_t hash_value(const char* s, size_t len) {
+    uint64_t h = 1469598103934665603ull;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ull;
+    }
+    // Finalizer so that the leading bits used by HyperLogLog are well mixed.
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+static void hll_add(uint8_t* registers, uint64_t hash) {
+    uint32_t index = (uint32_t)(hash >> (64 - HLL_BITS));
+    uint64_t rest = hash << HLL_BITS;
+    uint8_t rank = 1;
+    while (rank <= 64 - HLL_BITS && !(rest & 0x8000000000000000ull)) {
+        rank++;
+        rest <<= 1;
+    }
+    if (registers[index] < rank) registers[index] = rank;
+}
+
+static double hll_estimate(const uint8_t* registers) {
+    const double m = HLL_REGISTERS;
+    double sum = 0.0;
+    int zeros = 0;
+    for (int i = 0; i < HLL_REGISTERS; i++) {
+        sum += ldexp(1.0, -registers[i]);
+        if (registers[i] == 0) zeros++;
+    }
+    double estimate = (0.7213 / (1.0 + 1.079 / m)) * m * m / sum;
+    if (estimate <= 2.5 * m && zeros > 0) estimate = m * log(m / zeros); // Linear counting.
+    return estimate;
+}
+
+// Space-Saving: counts exactly while there is room, then replaces the least frequent value.
+static void top_add(Column* column, const char* s, size_t len, uint64_t hash) {
+    if (len >= TABLE_TOP_VALUE_MAX) {
+        column->top_skipped++;
+        return;
+    }
+    int min_index = 0;
+    for (int i = 0; i < column->num_top; i++) {
+        TopValue* top = &column->top[i];
+        if (top->hash == hash && top->len == len && memcmp(top->value, s, len) == 0) {
+            top->count++;
+            return;
+        }
+        if (top->count < column->top[min_index].count) min_index = i;
+    }
+    TopValue* slot;
+    size_t count = 1;
+    size_t error = 0;
+    if (column->num_top < TABLE_TOP_CAPACITY) {
+        slot = &column->top[column->num_top++];
+    } else {
+        slot = &column->top[min_index];
+        count = slot->count + 1;
+        error = slot->count;
+        column->top_evictions++;
+    }
+    slot->hash = hash;
+    slot->count = count;
+    slot->error = error;
+    slot->len = (uint8_t)len;
+    memcpy(slot->value, s, len);
+    slot->value[len] = '\0';
+}
+
+static void column_add(Column* column, const char* s, size_t len) {
+    column->values++;
+    if (is_null(s, len)) {
+        column->nulls++;
+        return;
+    }
+    if (column->values - column->nulls == 1 || len < column->min_len) column->min_len = len;
+    if (len > column->max_len) column->max_len = len;
+
+    double number;
+    bool numeric = false;
+    if (parse_integer(s, len, &number)) {
+        column->integers++;
+        numeric = true;
+    } else if (parse_number(s, len, &number)) {
+        column->decimals++;
+        numeric = true;
+    } else if (parse_boolean(s, len)) {
+        column->booleans++;
+    } else if (parse_date(s, len)) {
+        if (column->dates == 0 || strncmp(s, column->first_date, len) < 0) {
+            memcpy(column->first_date, s, len);
+            column->first_date[len] = '\0';
+        }
+        if (column->dates == 0 || strncmp(s, column->last_date, len) > 0) {
+            memcpy(column->last_date, s, len);
+            column->last_date[len] = '\0';
+        }
+        column->dates++;
+    }
+    if (numeric) {
+        column->numbers++;
+        if (column->numbers == 1 || number < column->min) column->min = number;
+        if (column->numbers == 1 || number > column->max) column->max = number;
+        double delta = number - column->mean;
+        column->mean += delta / (double)column->numbers;
+        column->m2 += delta * (number - column->mean);
+    }
+
+    uint64_t hash = hash_value(s, len);
+    if (column->hll) hll_add(column->hll, hash);
+    top_add(column, s, len, hash);
+}
+
+// --- Filter ---
+
+static bool set_error(Profiler* pr, const char* message, const char* detail) {
+    snprintf(pr->error, pr->error_size, "%s%s%s", message, detail ? ": " : "", detail ? detail : "");
+    pr->failed = true;
+    return false;
+}
+
+static bool parse_condition(Profiler* pr, const char* text, size_t len) {
+    if (pr->num_conditions == TABLE_MAX_CONDITIONS) return set_error(pr, "Too many filter conditions", NULL);
+    Condition* cond = &pr->conditions[pr->num_conditions];
+    memset(cond, 0, sizeof(*cond));
+
+    size_t i = 0;
+    while (i < len && isspace((unsigned char)text[i])) i++;
+    size_t name_start = i, name_end;
+    if (i < len && text[i] == '"') {
+        name_start = ++i;
+        while (i < len && text[i] != '"') i++;
+        name_end = i;
+        if (i < len) i++;
+    } else {
+        while (i < len && !isspace((unsigned char)text[i]) && !strchr("=!<>~", text[i])) i++;
+        name_end = i;
+    }
+    while (i < len && isspace((unsigned char)text[i])) i++;
+    if (name_end == name_start || name_end - name_start >= sizeof(cond->column)) {
+        return set_error(pr, "Filter condition needs a column name", NULL);
+    }
+    memcpy(cond->column, text + name_start, name_end - name_start);
+
+    static const struct { const char* token; CompareOp op; } OPS[] = {
+        { "!=", OP_NE }, { "<=", OP_LE }, { ">=", OP_GE }, { "==", OP_EQ }, { "=", OP_EQ },
+        { "<", OP_LT }, { ">", OP_GT }, { "~", OP_CONTAINS }, { "contains", OP_CONTAINS },
+    };
+    size_t op_len = 0;
+    for (size_t k = 0; k < sizeof(OPS) / sizeof(OPS[0]); k++) {
+        size_t n = strlen(OPS[k].token);
+        if (len - i >= n && strncasecmp(text + i, OPS[k].token, n) == 0) {
+            cond->op = OPS[k].op;
+            op_len = n;
+            break;
+        }
+    }
+    if (op_len == 0) return set_error(pr, "Filter condition needs one of = != < <= > >= ~", cond->column);
+    i += op_len;
+
+    while (i < len && isspace((unsigned char)text[i])) i++;
+    size_t value_end = len;
+    while (value_end > i && isspace((unsigned char)text[value_end - 1])) value_end--;
+    if (value_end - i >= 2 && (text[i] == '"' || text[i] == '\'') && text[value_end - 1] == text[i]) {
+        i++;
+        value_end--;
+    }
+    if (value_end - i >= sizeof(cond->value)) return set_error(pr, "Filter value is too long", cond->column);
+    memcpy(cond->value, text + i, value_end - i);
+    cond->value_len = value_end - i;
+    cond->numeric = parse_number(cond->value, cond->value_len, &cond->number);
+    pr->num_conditions++;
+    return true;
+}
+
+// Parses "cond [and cond]...", where `and` may also be written `&&`.
+static bool parse_filter(Profiler* pr, const char* where) {
+    const char* start = where;
+    const char* p = where;
+    while (*p) {
+        size_t sep = 0;
+        if (strncasecmp(p, " and ", 5) == 0) sep = 5;
+        else if (strncmp(p, "&&", 2) == 0) sep = 2;
+        if (sep == 0) {
+            p++;
+            continue;
+        }
+        if (!parse_condition(pr, start, (size_t)(p - start))) return false;
+        p += sep;
+        start = p;
+    }
+    return parse_condition(pr, start, (size_t)(p - start));
+}
+
+static bool resolve_filter(Profiler* pr) {
+    for (int i = 0; i < pr->num_conditions; i++) {
+        Condition* cond = &pr->conditions[i];
+        cond->index = -1;
+        if (cond->column[0] == '#') {
+            int n = atoi(cond->column + 1);
+            if (n >= 1 && n <= pr->num_columns) cond->index = n - 1;
+        }
+        for (int c = 0; c < pr->num_columns && cond->index < 0; c++) {
+            if (strcasecmp(pr->columns[c].name, cond->column) == 0) cond->index = c;
+        }
+        if (cond->index < 0) return set_error(pr, "Unknown column in filter", cond->column);
+    }
+    return true;
+}
+
+static bool row_matches(const Profiler* pr) {
+    for (int i = 0; i < pr->num_conditions; i++) {
+        const Condition* cond = &pr->conditions[i];
+        const char* s = "";
+        size_t len = 0;
+        if (cond->index < pr->num_fields) {
+            s = pr->fields[cond->index].ptr;
+            len = pr->fields[cond->index].len;
+        }
+        bool match;
+        if (cond->op == OP_CONTAINS) {
+            match = false;
+            for (size_t k = 0; !match && k + cond->value_len <= len; k++) {
+                match = strncasecmp(s + k, cond->value, cond->value_len) == 0;
+            }
+        } else {
+            int cmp;
+            double number;
+            if (cond->numeric && parse_number(s, len, &number)) {
+                cmp = number < cond->number ? -1 : number > cond->number ? 1 : 0;
+            } else {
+                size_t n = len < cond->value_len ? len : cond->value_len;
+                cmp = memcmp(s, cond->value, n);
+                if (cmp == 0) cmp = len < cond->value_len ? -1 : len > cond->value_len ? 1 : 0;
+            }
+            switch (cond->op) {
+                case OP_EQ: match = cmp == 0; break;
+                case OP_NE: match = cmp != 0; break;
+                case OP_LT: match = cmp < 0; break;
+                case OP_LE: match = cmp <= 0; break;
+                case OP_GT: match = cmp > 0; break;
+                default: match = cmp >= 0; break;
+            }
+        }
+        if (!match) return false;
+    }
+    return true;
+}
+
+// --- Sampling ---
+
+static uint64_t next_random(Profiler* pr) {
+    pr->rng ^= pr->rng << 13;
+    pr->rng ^= pr->rng >> 7;
+    pr->rng ^= pr->rng << 17;
+    return pr->rng;
+}
+
+// Re-serializes the current row as a delimited line, quoting where needed.
+static char* serialize_row(const Profiler* pr) {
+    TextBuffer line = { 0 };
+    int count = pr->num_fields < pr->num_columns ? pr->num_fields : pr->num_columns;
+    for (int i = 0; i < count; i++) {
+        const Field* field = &pr->fields[i];
+        size_t len = field->len > TABLE_SAMPLE_FIELD_MAX ? TABLE_SAMPLE_FIELD_MAX : field->len;
+        bool quote = memchr(field->ptr, pr->delimiter, len) || memchr(field->ptr, '"', len) ||
+                     memchr(field->ptr, '\n', len);
+        if (i > 0) text_append(&line, &pr->delimiter, 1);
+        if (quote) text_append(&line, "\"", 1);
+        for (size_t k = 0; k < len; k++) {
+            if (field->ptr[k] == '"') text_append(&line, "\"", 1);
+            text_append(&line, field->ptr + k, 1);
+        }
+        if (len < field->len) text_append(&line, "...", 3);
+        if (quote) text_append(&line, "\"", 1);
+    }
+    if (line.failed || !line.data) {
+        free(line.data);
+        return NULL;
+    }
+    return line.data;
+}
+
+static void stratum_offer(Profiler* pr, Stratum* stratum, char* row) {
+    stratum->seen++;
+    if (stratum->count < stratum->capacity) {
+        stratum->rows[stratum->count++] = row;
+        return;
+    }
+    uint64_t j = next_random(pr) % stratum->seen;
+    if (j < (uint64_t)stratum->capacity) {
+        free(stratum->rows[j]);
+        stratum->rows[j] = row;
+    } else {
+        free(row);
+    }
+}
+
+static void sample_row(Profiler* pr, char* row, const char* key, size_t key_len) {
+    Stratum* target = &pr->strata[pr->num_strata - 1]; // The catch-all stratum is last.
+    if (pr->strat_column >= 0 && key) {
+        for (int i = 0; i < pr->num_strata - 1; i++) {
+            if (pr->strata[i].key_len == key_len && memcmp(pr->strata[i].key, key, key_len) == 0) {
+                target = &pr->strata[i];
+                break;
+            }
+        }
+    }
+    stratum_offer(pr, target, row);
+}
+
+// Picks the stratum column from what the first rows showed and replays them.
+static void decide_strata(Profiler* pr) {
+    pr->strata_decided = true;
+    pr->strat_column = -1;
+    for (int c = 0; c < pr->num_columns && pr->strat_column < 0; c++) {
+        const Column* column = &pr->columns[c];
+        bool mostly_present = column->nulls * 2 < column->values;
+        if (mostly_present && column->top_evictions == 0 && column->top_skipped == 0 && column->num_top >= 2 && column->num_top <= TABLE_MAX_STRATA) {
+            pr->strat_column = c;
+        }
+    }
+
+    pr->num_strata = 0;
+    if (pr->strat_column >= 0) {
+        const Column* column = &pr->columns[pr->strat_column];
+        for (int i = 0; i < column->num_top; i++) {
+            Stratum* stratum = &pr->strata[pr->num_strata++];
+            memcpy(stratum->key, column->top[i].value, column->top[i].len);
+            stratum->key_len = column->top[i].len;
+        }
+    }
+    pr->strata[pr->num_strata++].other = true;
+
+    int per_stratum = pr->sample_rows / (pr->num_strata > 1 ? pr->num_strata - 1 : 1);
+    if (per_stratum < 2) per_stratum = 2;
+    for (int i = 0; i < pr->num_strata; i++) {
+        Stratum* stratum = &pr->strata[i];
+        stratum->capacity = stratum->other && pr->num_strata > 1 ? 2 : per_stratum;
+        stratum->rows = calloc((size_t)stratum->capacity, sizeof(char*));
+        if (!stratum->rows) {
+            pr->failed = true;
+            set_error(pr, "Out of memory", NULL);
+        }
+    }
+
+    // Replay the probed rows, re-reading each one's key from its serialized form.
+    for (int i = 0; i < pr->num_probe; i++) {
+        char* row = pr->probe[i];
+        if (pr->failed) {
+            free(row);
+            continue;
+        }
+        const char* key = NULL;
+        size_t key_len = 0;
+        size_t row_len = strlen(row);
+        char* copy = pr->strat_column >= 0 ? malloc(row_len + 1) : NULL;
+        char* next;
+        if (copy) memcpy(copy, row, row_len + 1);
+        if (copy && scan_record(pr, copy, copy + row_len, true, &next)) {
+            unescape_fields(pr);
+            if (pr->strat_column < pr->num_fields) {
+                key = pr->fields[pr->strat_column].ptr;
+                key_len = pr->fields[pr->strat_column].len;
+            }
+        }
+        sample_row(pr, row, key, key_len);
+        free(copy);
+    }
+    free(pr->probe);
+    pr->probe = NULL;
+    pr->num_probe = 0;
+}
+
+// --- Records ---
+
+static bool start_columns(Profiler* pr) {
+    int count = pr->num_fields < TABLE_MAX_COLUMNS ? pr->num_fields : TABLE_MAX_COLUMNS;
+    pr->num_columns = count;
+    pr->columns = calloc((size_t)count, sizeof(Column));
+    if (!pr->columns) return set_error(pr, "Out of memory", NULL);
+
+    // The first row is a header if every field is present and none is a number.
+    pr->has_header = true;
+    for (int i = 0; i < count; i++) {
+        double number;
+        const Field* field = &pr->fields[i];
+        if (field->len == 0 || parse_number(field->ptr, field->len, &number)) pr->has_header = false;
+    }
+    for (int i = 0; i < count; i++) {
+        Column* column = &pr->columns[i];
+        char name[32];
+        snprintf(name, sizeof(name), "column%d", i + 1);
+        size_t len = pr->has_header ? pr->fields[i].len : strlen(name);
+        column->name = malloc(len + 1);
+        column->hll = calloc(HLL_REGISTERS, 1);
+        if (!column->name || !column->hll) return set_error(pr, "Out of memory", NULL);
+        memcpy(column->name, pr->has_header ? pr->fields[i].ptr : name, len);
+        column->name[len] = '\0';
+    }
+    pr->header_seen = true;
+    return resolve_filter(pr);
+}
+
+static void handle_record(Profiler* pr) {
+    if (pr->num_fields == 1 && pr->fields[0].len == 0) return; // Blank line.
+    unescape_fields(pr);
+    if (!pr->header_seen) {
+        if (!start_columns(pr) || pr->has_header) return;
+    }
+
+    pr->rows++;
+    if (pr->num_fields != pr->num_columns) pr->malformed++;
+    if (!row_matches(pr)) return;
+    pr->matched++;
+
+    int count = pr->num_fields < pr->num_columns ? pr->num_fields : pr->num_columns;
+    for (int i = 0; i < count; i++) {
+        column_add(&pr->columns[i], pr->fields[i].ptr, pr->fields[i].len);
+    }
+    for (int i = count; i < pr->num_columns; i++) {
+        column_add(&pr->columns[i], "", 0);
+    }
+
+    char* row = serialize_row(pr);
+    if (!row) return;
+    if (pr->strata_decided) {
+        const Field* key = pr->strat_column >= 0 && pr->strat_column < count ? &pr->fields[pr->strat_column] : NULL;
+        sample_row(pr, row, key ? key->ptr : NULL, key ? key->len : 0);
+        return;
+    }
+    if (!pr->probe) pr->probe = calloc(TABLE_PROBE_ROWS, sizeof(char*));
+    if (!pr->probe) {
+        free(row);
+        return;
+    }
+    pr->probe[pr->num_probe++] = row;
+}
+
+// --- Report ---
+
+static const char* column_type(const Column* column, size_t present) {
+    if (present == 0) return "empty";
+    if (column->integers == present) return "integer";
+    if (column->numbers == present) return "decimal";
+    if (column->booleans == present) return "boolean";
+    if (column->dates == present) return "date";
+    return "string";
+}
+
+// Appends a value for display, with control characters escaped.
+static void append_display(TextBuffer* out, const char* s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '\n') text_puts(out, "\\n");
+        else if (s[i] == '\r') text_puts(out, "\\r");
+        else if (s[i] == '\t') text_puts(out, "\\t");
+        else text_append(out, s + i, 1);
+    }
+}
+
+static int compare_top(const void* a, const void* b) {
+    const TopValue* x = a;
+    const TopValue* y = b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static void describe_column(TextBuffer* out, Column* column, int index) {
+    size_t present = column->values - column->nulls;
+    const char* type = column_type(column, present);
+    double distinct = column->hll ? hll_estimate(column->hll) : 0.0;
+    if (distinct > (double)present) distinct = (double)present;
+
+    text_printf(out, "  %d. %s: %s", index + 1, column->name, type);
+    if (strcmp(type, "string") == 0 && column->numbers * 10 >= present * 9) {
+        text_printf(out, " (%.1f%% numeric)", 100.0 * (double)column->numbers / (double)present);
+    }
+    text_printf(out, " | nulls %.1f%%", column->values ? 100.0 * (double)column->nulls / (double)column->values : 0.0);
+    if (present == 0) {
+        text_puts(out, "\n");
+        return;
+    }
+    if (strcmp(type, "integer") == 0 || strcmp(type, "decimal") == 0) {
+        double sd = column->numbers > 1 ? sqrt(column->m2 / (double)(column->numbers - 1)) : 0.0;
+        text_printf(out, " | min %.6g, max %.6g, mean %.6g, sd %.6g", column->min, column->max, column->mean, sd);
+    } else if (strcmp(type, "date") == 0) {
+        text_printf(out, " | from %s to %s", column->first_date, column->last_date);
+    } else {
+        text_printf(out, " | length %zu-%zu", column->min_len, column->max_len);
+    }
+    text_printf(out, " | ~%.0f distinct", distinct);
+
+    // Frequent values are only informative for categorical-looking columns.
+    bool categorical = strcmp(type, "decimal") != 0 && (distinct <= 20.0 || distinct * 2.0 <= (double)present);
+    if (categorical && column->num_top > 0) {
+        qsort(column->top, (size_t)column->num_top, sizeof(TopValue), compare_top);
+        // Once values were evicted, only those guaranteed to be frequent are reported.
+        bool exact = column->top_evictions == 0;
+        int reported = 0;
+        for (int i = 0; i < column->num_top && reported < TABLE_TOP_REPORTED; i++) {
+            const TopValue* top = &column->top[i];
+            if (!exact && (top->count - top->error) * TABLE_TOP_CAPACITY <= present) continue;
+            text_puts(out, reported++ ? ", " : " | top: ");
+            append_display(out, top->value, top->len);
+            text_printf(out, " (%s%.1f%%)", exact ? "" : "~", 100.0 * (double)top->count / (double)present);
+        }
+    }
+    text_puts(out, "\n");
+}
+
+static void profiler_free(Profiler* pr) {
+    for (int i = 0; i < pr->num_columns; i++) {
+        free(pr->columns[i].name);
+        free(pr->columns[i].hll);
+    }
+    free(pr->columns);
+    for (int i = 0; i < pr->num_probe; i++) free(pr->probe[i]);
+    free(pr->probe);
+    for (int i = 0; i < pr->num_strata; i++) {
+        for (int j = 0; j < pr->strata[i].count; j++) free(pr->strata[i].rows[j]);
+        free(pr->strata[i].rows);
+    }
+}
+
+bool table_is_tabular(const char* path) {
+    const char* dot = strrchr(path, '.');
+    if (!dot) return false;
+    return strcasecmp(dot, ".csv") == 0 || strcasecmp(dot, ".tsv") == 0 ||
+           strcasecmp(dot, ".tab") == 0 || strcasecmp(dot, ".psv") == 0;
+}
+
+// Picks the delimiter from the file name, or the most frequent candidate on the first line.
+static char detect_delimiter(const char* name, const char* data, size_t len) {
+    const char* dot = strrchr(name, '.');
+    if (dot && (strcasecmp(dot, ".tsv") == 0 || strcasecmp(dot, ".tab") == 0)) return '\t';
+    if (dot && strcasecmp(dot, ".psv") == 0) return '|';
+    static const char CANDIDATES[] = { ',', ';', '\t', '|' };
+    size_t counts[sizeof(CANDIDATES)] = { 0 };
+    bool quoted = false;
+    for (size_t i = 0; i < len && (quoted || data[i] != '\n'); i++) {
+        if (data[i] == '"') quoted = !quoted;
+        for (size_t k = 0; !quoted && k < sizeof(CANDIDATES); k++) {
+            if (data[i] == CANDIDATES[k]) counts[k]++;
+        }
+    }
+    size_t best = 0;
+    for (size_t k = 1; k < sizeof(CANDIDATES); k++) {
+        if (counts[k] > counts[best]) best = k;
+    }
+    return CANDIDATES[best];
+}
+
+bool table_profile(FILE* stream, const char* name, const TableOptions* options, TableProfileResult* result,
+                   char* error, size_t error_size) {
+    memset(result, 0, sizeof(*result));
+    Profiler* pr = calloc(1, sizeof(Profiler));
+    if (!pr) {
+        snprintf(error, error_size, "Out of memory");
+        return false;
+    }
+    pr->error = error;
+    pr->error_size = error_size;
+    pr->rng = 0x9E3779B97F4A7C15ull;
+    pr->sample_rows = options && options->sample_rows > 0 ? options->sample_rows : TABLE_DEFAULT_SAMPLE_ROWS;
+    if (pr->sample_rows > TABLE_MAX_SAMPLE_ROWS) pr->sample_rows = TABLE_MAX_SAMPLE_ROWS;
+    const char* where = options ? options->where : NULL;
+    bool ok = false;
+    size_t capacity = TABLE_CHUNK_SIZE;
+    char* buffer = malloc(capacity);
+    size_t len = 0;
+    size_t bytes_read = 0;
+    bool eof = false;
+    bool first_chunk = true;    // The byte order mark and delimiter are checked on the first read.
+
+    if (!buffer) {
+        set_error(pr, "Out of memory", NULL);
+        goto cleanup;
+    }
+    if (where && *where && !parse_filter(pr, where)) goto cleanup;
+
+    // --- Stream the file through the record scanner ---
+    while (!pr->failed) {
+        if (!eof && len < capacity) {
+            size_t n = fread(buffer + len, 1, capacity - len, stream);
+            if (n == 0) {
+                if (ferror(stream)) {
+                    set_error(pr, "Read error", name);
+                    break;
+                }
+                eof = true;
+            }
+            if (first_chunk) {
+                if (n >= 3 && memcmp(buffer, "\xEF\xBB\xBF", 3) == 0) {
+                    memmove(buffer, buffer + 3, n - 3); // UTF-8 byte order mark.
+                    n -= 3;
+                    bytes_read += 3;
+                }
+                if (pr->delimiter == '\0') {
+                    pr->delimiter = options && options->delimiter ? options->delimiter : detect_delimiter(name, buffer, n);
+                }
+                first_chunk = false;
+            }
+            len += n;
+            bytes_read += n;
+            if (!eof && len < capacity) continue;
+        }
+
+        char* p = buffer;
+        char* end = buffer + len;
+        while (p < end && !pr->failed) {
+            char* next;
+            if (!scan_record(pr, p, end, eof, &next)) break;
+            handle_record(pr);
+            if (!pr->strata_decided && pr->num_probe == TABLE_PROBE_ROWS) decide_strata(pr);
+            p = next;
+        }
+        if (eof) break;
+
+        size_t rest = (size_t)(end - p);
+        if (p == buffer && len == capacity) {
+            // A single record fills the buffer: grow it.
+            if (capacity >= TABLE_MAX_RECORD) {
+                set_error(pr, "Record too large", name);
+                break;
+            }
+            char* grown = realloc(buffer, capacity * 2);
+            if (!grown) {
+                set_error(pr, "Out of memory", NULL);
+                break;
+            }
+            buffer = grown;
+            capacity *= 2;
+        } else {
+            memmove(buffer, p, rest);
+            len = rest;
+        }
+    }
+    if (pr->failed) goto cleanup;
+    if (!pr->header_seen) {
+        set_error(pr, "No rows found", name);
+        goto cleanup;
+    }
+    if (!pr->strata_decided) decide_strata(pr);
+    if (pr->failed) goto cleanup;
+
+    // --- Write the profile ---
+    TextBuffer out = { 0 };
+    char delimiter_name[8];
+    if (pr->delimiter == '\t') snprintf(delimiter_name, sizeof(delimiter_name), "tab");
+    else snprintf(delimiter_name, sizeof(delimiter_name), "'%c'", pr->delimiter);
+
+    text_printf(&out, "\n--- Table Profile: %s ---\n", name);
+    text_printf(&out, "%zu data rows%s, %d columns, delimiter %s, %.1f MB read.\n",
+                pr->rows, pr->has_header ? " plus a header row" : " (no header)", pr->num_columns,
+                delimiter_name, (double)bytes_read / (1024.0 * 1024.0));
+    if (pr->num_conditions > 0) {
+        text_printf(&out, "Filter: %s -> %zu matching rows (%.1f%%). Statistics and sample cover matching rows only.\n",
+                    where, pr->matched, pr->rows ? 100.0 * (double)pr->matched / (double)pr->rows : 0.0);
+    }
+    if (pr->malformed > 0) {
+        text_printf(&out, "%zu rows have a field count different from %d.\n", pr->malformed, pr->num_columns);
+    }
+    text_puts(&out, "Columns (type | nulls | range | approximate distinct values | most frequent values):\n");
+    for (int i = 0; i < pr->num_columns; i++) describe_column(&out, &pr->columns[i], i);
+
+    int sampled = 0;
+    for (int i = 0; i < pr->num_strata; i++) sampled += pr->strata[i].count;
+    if (pr->strat_column >= 0) {
+        text_printf(&out, "Sample of %d rows, stratified by %s:\n", sampled, pr->columns[pr->strat_column].name);
+    } else {
+        text_printf(&out, "Random sample of %d rows:\n", sampled);
+    }
+    if (pr->has_header) {
+        for (int i = 0; i < pr->num_columns; i++) {
+            if (i > 0) text_append(&out, &pr->delimiter, 1);
+            text_puts(&out, pr->columns[i].name);
+        }
+        text_puts(&out, "\n");
+    }
+    for (int i = 0; i < pr->num_strata; i++) {
+        for (int j = 0; j < pr->strata[i].count; j++) {
+            text_puts(&out, pr->strata[i].rows[j]);
+            text_puts(&out, "\n");
+        }
+    }
+    text_puts(&out, "--- End of Table Profile ---\n");
+    if (out.failed) {
+        free(out.data);
+        set_error(pr, "Out of memory", NULL);
+        goto cleanup;
+    }
+
+    result->text = out.data;
+    result->size = out.size;
+    result->rows = pr->rows;
+    result->matched_rows = pr->matched;
+    result->columns = (size_t)pr->num_columns;
+    result->bytes_read = bytes_read;
+    ok = true;
+
+cleanup:
+    free(buffer);
+    profiler_free(pr);
+    free(pr);
+    return ok;
+}
+
+void table_profile_result_free(TableProfileResult* result) {
+    free(result->text);
+    memset(result, 0, sizeof(*result));
+}
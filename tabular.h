@@ -0,0 +1,41 @@
+/**
+ * @file tabular.h
+ * @brief Streaming profiles of CSV/TSV attachments for gcli.
+ *
+ * Instead of sending a large delimited file as text, gcli can attach a
+ * compact profile of it: the schema, per-column statistics (inferred type,
+ * null rate, numeric/date range, approximate distinct count, most frequent
+ * values) and a small row sample stratified by a categorical column. The
+ * file is read once, in fixed-size chunks, so its size does not matter.
+ * An optional filter ("region = EU and amount > 100") restricts the profile
+ * to matching rows, which lets follow-up questions be answered locally.
+ */
+
+#ifndef GCLI_TABULAR_H
+#define GCLI_TABULAR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+typedef struct {
+    char delimiter;         // Field delimiter; 0 detects it from the name and first line.
+    int sample_rows;        // Rows in the sample (0 uses the default).
+    const char* where;      // Row filter, or NULL for all rows.
+} TableOptions;
+
+typedef struct {
+    char* text;             // The profile, NUL-terminated, owned by the result.
+    size_t size;            // Length of `text` in bytes.
+    size_t rows;            // Data rows read (excluding the header).
+    size_t matched_rows;    // Rows that passed the filter.
+    size_t columns;
+    size_t bytes_read;
+} TableProfileResult;
+
+bool table_is_tabular(const char* path);
+bool table_profile(FILE* stream, const char* name, const TableOptions* options, TableProfileResult* result,
+                   char* error, size_t error_size);
+void table_profile_result_free(TableProfileResult* result);
+
+#endif // GCLI_TABULAR_H
@@ -0,0 +1,352 @@
+/**
+ * @file toolexec.c
+ * @brief Concurrent execution of local function calls.
+ *
+ * An agentic turn often asks for several things at once (read two files, grep
+ * for a symbol, run the tests). Running those calls one after the other makes
+ * the turn as slow as the sum of its commands; here they run side by side:
+ *   - a pool of worker threads takes jobs from a shared queue, so at most
+ *     `max_workers` commands run at a time and the caller's thread helps;
+ *   - each command runs as `/bin/sh -c <command>` in a process group of its
+ *     own, with stdin from /dev/null and stdout and stderr in one pipe;
+ *   - the call's arguments are passed in the environment, never spliced into
+ *     the command line: GCLI_FUNCTION holds the function name, GCLI_ARGS the
+ *     arguments as JSON, and GCLI_ARG_<NAME> each top-level argument (strings
+ *     as-is, other values as JSON), so commands quote them like any variable;
+ *   - output beyond the cap is read and counted but not kept, and a command
+ *     still running at its deadline, or one that closed its output and kept
+ *     going, is killed together with everything it started;
+ *   - the output kept is made valid UTF-8 so it can be sent back as JSON.
+ * On Windows, calls are answered with an error instead.
+ */
+
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+
+#include "toolexec.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char** environ;
+#endif
+
+#define TOOL_READ_CHUNK 4096
+#define TOOL_REAP_INTERVAL_NS 10000000L // Polling interval while waiting for a command to exit.
+
+#ifndef _WIN32
+// --- Output ---
+
+/**
+ * @brief Replaces NUL bytes and every byte of a malformed UTF-8 sequence with '?'.
+ * @details Also covers a sequence cut in half by the output cap.
+ */
+static void sanitize_utf8(char* text, size_t size) {
+    unsigned char* s = (unsigned char*)text;
+    size_t i = 0;
+    while (i < size) {
+        unsigned char c = s[i];
+        if (c == 0) {
+            s[i++] = '?';
+            continue;
+        }
+        if (c < 0x80) {
+            i++;
+            continue;
+        }
+        size_t length = 0;
+        unsigned char lower = 0x80, upper = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) length = 2;
+        else if (c >= 0xE0 && c <= 0xEF) {
+            length = 3;
+            if (c == 0xE0) lower = 0xA0;
+            if (c == 0xED) upper = 0x9F; // No surrogates.
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            length = 4;
+            if (c == 0xF0) lower = 0x90;
+            if (c == 0xF4) upper = 0x8F;
+        }
+        bool valid = length > 0 && i + length <= size && s[i + 1] >= lower && s[i + 1] <= upper;
+        for (size_t k = 2; valid && k < length; k++) {
+            valid = s[i + k] >= 0x80 && s[i + k] <= 0xBF;
+        }
+        if (valid) {
+            i += length;
+        } else {
+            s[i++] = '?';
+        }
+    }
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+// --- Environment ---
+
+static char* env_entry(const char* name, const char* value) {
+    size_t length = strlen(name) + strlen(value) + 2;
+    char* entry = malloc(length);
+    if (entry) snprintf(entry, length, "%s=%s", name, value);
+    return entry;
+}
+
+/**
+ * @brief Builds the command's environment: the process environment without
+ *        any inherited GCLI_ARG* or GCLI_FUNCTION, plus this call's values.
+ * @param job The call.
+ * @param owned Receives how many leading entries were allocated here.
+ * @return A NULL-terminated array, or NULL if out of memory.
+ */
+static char** build_environment(const ToolJob* job, size_t* owned) {
+    size_t inherited = 0;
+    while (environ[inherited]) inherited++;
+    size_t num_args = cJSON_IsObject(job->args) ? (size_t)cJSON_GetArraySize(job->args) : 0;
+    char** env = calloc(inherited + num_args + 3, sizeof(char*));
+    if (!env) return NULL;
+
+    size_t count = 0;
+    bool ok = (env[count++] = env_entry("GCLI_FUNCTION", job->function)) != NULL;
+    char* json = job->args ? cJSON_PrintUnformatted(job->args) : NULL;
+    ok = ok && (env[count++] = env_entry("GCLI_ARGS", json ? json : "{}")) != NULL;
+    cJSON_free(json);
+
+    for (const cJSON* arg = num_args > 0 ? job->args->child : NULL; arg && ok; arg = arg->next) {
+        if (!arg->string) continue;
+        char name[80];
+        size_t n = snprintf(name, sizeof(name), "GCLI_ARG_");
+        for (const char* p = arg->string; *p && n < sizeof(name) - 1; p++) {
+            name[n++] = isalnum((unsigned char)*p) ? (char)toupper((unsigned char)*p) : '_';
+        }
+        name[n] = '\0';
+        char* value = cJSON_IsString(arg) ? NULL : cJSON_PrintUnformatted(arg);
+        ok = (env[count++] = env_entry(name, value ? value : (arg->valuestring ? arg->valuestring : ""))) != NULL;
+        cJSON_free(value);
+    }
+    *owned = count;
+    if (!ok) {
+        for (size_t i = 0; i < count; i++) free(env[i]);
+        free(env);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < inherited; i++) {
+        if (strncmp(environ[i], "GCLI_ARG", 8) == 0 || strncmp(environ[i], "GCLI_FUNCTION=", 14) == 0) continue;
+        env[count++] = environ[i];
+    }
+    return env;
+}
+
+// --- Running a Command ---
+
+// Both ends close on exec, so a command started by another worker cannot
+// inherit this pipe and hold it open.
+static int make_pipe(int fds[2]) {
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC);
+#else
+    if (pipe(fds) != 0) return -1;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+#endif
+}
+
+/**
+ * @brief Runs one call to completion, its deadline, or failure to start.
+ */
+static void run_job(ToolJob* job, size_t output_limit) {
+    double started = now_seconds();
+    double deadline = started + (job->timeout_ms > 0 ? job->timeout_ms : 1) / 1000.0;
+    size_t owned = 0;
+    char** env = build_environment(job, &owned);
+    job->output = malloc(output_limit + 1);
+    job->output_size = job->output_total = 0;
+    job->exit_code = -1;
+    int fds[2] = { -1, -1 };
+    pid_t pid = -1;
+
+    if (!env || !job->output) {
+        job->error = "out of memory";
+        goto done;
+    }
+    if (make_pipe(fds) != 0) {
+        job->error = "cannot create a pipe";
+        goto done;
+    }
+
+    // Everything the child needs is prepared before fork: between fork and
+    // exec only async-signal-safe calls are allowed in a threaded process.
+    char* argv[] = { "sh", "-c", (char*)job->command, NULL };
+    pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        job->error = "cannot start a process";
+        goto done;
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (null_fd >= 0) dup2(null_fd, STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        execve("/bin/sh", argv, env);
+        _exit(127);
+    }
+    setpgid(pid, pid); // Also here, so the group exists before it can be killed.
+    close(fds[1]);
+
+    char chunk[TOOL_READ_CHUNK];
+    for (;;) {
+        int wait_ms = (int)((deadline - now_seconds()) * 1000.0);
+        if (wait_ms <= 0) {
+            job->timed_out = true;
+            break;
+        }
+        struct pollfd pfd = { .fd = fds[0], .events = POLLIN };
+        int ready = poll(&pfd, 1, wait_ms);
+        if (ready < 0 && errno != EINTR) break;
+        if (ready <= 0) continue;
+        ssize_t n = read(fds[0], chunk, sizeof(chunk));
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (n <= 0) break;
+        size_t room = output_limit - job->output_size;
+        size_t keep = (size_t)n < room ? (size_t)n : room;
+        memcpy(job->output + job->output_size, chunk, keep);
+        job->output_size += keep;
+        job->output_total += (size_t)n;
+    }
+    close(fds[0]);
+
+    // The command may have closed its output and kept running.
+    int status = 0;
+    bool reaped = false;
+    while (!job->timed_out) {
+        pid_t result = waitpid(pid, &status, WNOHANG);
+        if (result == pid) {
+            reaped = true;
+            break;
+        }
+        if (result < 0 && errno != EINTR) break;
+        if (now_seconds() >= deadline) {
+            job->timed_out = true;
+            break;
+        }
+        struct timespec pause = { 0, TOOL_REAP_INTERVAL_NS };
+        nanosleep(&pause, NULL);
+    }
+    if (!reaped) {
+        kill(-pid, SIGKILL);
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+    } else if (WIFEXITED(status)) {
+        job->exit_code = WEXITSTATUS(status);
+    }
+
+done:
+    if (env) {
+        for (size_t i = 0; i < owned; i++) free(env[i]);
+        free(env);
+    }
+    if (job->output) {
+        job->output[job->output_size] = '\0';
+        sanitize_utf8(job->output, job->output_size);
+    }
+    job->seconds = now_seconds() - started;
+}
+
+// --- Worker Pool ---
+
+typedef struct {
+    ToolJob* jobs;
+    int count;
+    int next;
+    size_t output_limit;
+    pthread_mutex_t lock;
+} JobQueue;
+
+static void* tool_worker(void* arg) {
+    JobQueue* queue = arg;
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        int index = queue->next < queue->count ? queue->next++ : -1;
+        pthread_mutex_unlock(&queue->lock);
+        if (index < 0) break;
+        run_job(&queue->jobs[index], queue->output_limit);
+    }
+    return NULL;
+}
+#endif
+
+/**
+ * @brief Runs the given calls, up to `max_workers` at a time, and returns
+ *        when all of them have finished.
+ * @param jobs The calls; their result fields are filled in.
+ * @param count Number of calls.
+ * @param max_workers Commands to run at once (clamped to 1..16).
+ * @param output_limit Bytes of output kept per call.
+ */
+void tool_jobs_run(ToolJob* jobs, int count, int max_workers, size_t output_limit) {
+    if (count <= 0) return;
+    if (output_limit == 0 || output_limit > TOOL_MAX_OUTPUT_LIMIT) {
+        for (int i = 0; i < count; i++) {
+            jobs[i].output = NULL;
+            jobs[i].output_size = jobs[i].output_total = 0;
+            jobs[i].exit_code = -1;
+            jobs[i].error = "invalid output limit";
+        }
+        return;
+    }
+#ifndef _WIN32
+    JobQueue queue = { .jobs = jobs, .count = count, .next = 0, .output_limit = output_limit };
+    pthread_mutex_init(&queue.lock, NULL);
+
+    int workers = max_workers < 1 ? 1 : max_workers > TOOL_MAX_WORKERS ? TOOL_MAX_WORKERS : max_workers;
+    if (workers > count) workers = count;
+    pthread_t threads[TOOL_MAX_WORKERS];
+    int started = 0;
+    while (started < workers - 1 && pthread_create(&threads[started], NULL, tool_worker, &queue) == 0) {
+        started++;
+    }
+    tool_worker(&queue); // The calling thread takes its share.
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&queue.lock);
+#else
+    (void)max_workers;
+    (void)output_limit;
+    for (int i = 0; i < count; i++) {
+        jobs[i].output = NULL;
+        jobs[i].output_size = jobs[i].output_total = 0;
+        jobs[i].exit_code = -1;
+        jobs[i].error = "local functions are not supported on this platform";
+    }
+#endif
+}
+
+/**
+ * @brief Frees the output held by a job; safe to call on a zeroed job.
+ */
+void tool_job_free(ToolJob* job) {
+    free(job->output);
+    job->output = NULL;
+    job->output_size = 0;
+}
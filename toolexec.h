@@ -0,0 +1,41 @@
+/**
+ * @file toolexec.h
+ * @brief Local execution of the functions the model calls.
+ *
+ * Functions declared in the configuration are shell commands. When the model
+ * answers with several function calls in one turn, they are run at the same
+ * time on a small pool of worker threads, each in its own process group with
+ * a time limit and a cap on the output kept, so one slow or chatty command
+ * neither blocks the others nor floods the next request.
+ */
+
+#ifndef GCLI_TOOLEXEC_H
+#define GCLI_TOOLEXEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "cJSON.h"
+
+#define TOOL_MAX_WORKERS 16
+#define TOOL_MAX_OUTPUT_LIMIT (4 * 1024 * 1024) // Largest output kept of one call.
+
+typedef struct {
+    // Set by the caller.
+    const char* function;   // Name the model called; exported as GCLI_FUNCTION.
+    const char* command;    // Run with /bin/sh -c.
+    const cJSON* args;      // Call arguments; exported as GCLI_ARGS and GCLI_ARG_<NAME>.
+    int timeout_ms;
+    // Set by tool_jobs_run.
+    char* output;           // Combined stdout and stderr as UTF-8, NUL-terminated (owned).
+    size_t output_size;     // Bytes kept in `output`.
+    size_t output_total;    // Bytes the command wrote, including those past the cap.
+    int exit_code;          // Exit status, or -1 if the command was killed or not run.
+    bool timed_out;
+    double seconds;         // Wall time.
+    const char* error;      // Why the command could not be run (static string), or NULL.
+} ToolJob;
+
+void tool_jobs_run(ToolJob* jobs, int count, int max_workers, size_t output_limit);
+void tool_job_free(ToolJob* job);
+
+#endif // GCLI_TOOLEXEC_H